@@ -27,7 +27,7 @@ using namespace std;
 vector<string> splitSequenceOfAddressExpressionsAtCommas(const string& mes);
 bool isValidMatchExpression(const std::string& s, bool *has_wildcard);
 bool doesIdMatchExpression(const std::string& id, std::string match_rule);
-bool doesAddressMatchExpressions(Address &address,
+bool doesAddressMatchExpressions(const Address &address,
                                  std::vector<AddressExpression>& address_expressions,
                                  bool *used_wildcard,
                                  bool *filtered_out,
@@ -412,7 +412,7 @@ string AddressExpression::str()
     return s;
 }
 
-string Address::str()
+string Address::str() const
 {
     string s;
 
@@ -433,10 +433,10 @@ string Address::str()
     return s;
 }
 
-string Address::concat(std::vector<Address> &addresses)
+string Address::concat(const std::vector<Address> &addresses)
 {
     string s;
-    for (Address& a: addresses)
+    for (const Address& a: addresses)
     {
         if (s.size() > 0) s.append(",");
         s.append(a.str());
@@ -483,7 +483,7 @@ void Address::decodeIdFirst(const vector<uchar>::iterator &pos)
     type = *(pos+7);
 }
 
-bool doesTelegramMatchExpressions(std::vector<Address> &addresses,
+bool doesTelegramMatchExpressions(const std::vector<Address> &addresses,
                                   std::vector<AddressExpression>& address_expressions,
                                   bool *used_wildcard)
 {
@@ -492,7 +492,7 @@ bool doesTelegramMatchExpressions(std::vector<Address> &addresses,
     bool required_found = false; // An R12345678 field was found.
     bool required_failed = true; // Init to fail, set to true if R is satistifed anywhere.
 
-    for (Address &a : addresses)
+    for (const Address &a : addresses)
     {
         if (doesAddressMatchExpressions(a,
                                         address_expressions,
@@ -513,7 +513,7 @@ bool doesTelegramMatchExpressions(std::vector<Address> &addresses,
     return match;
 }
 
-bool doesAddressMatchExpressions(Address &address,
+bool doesAddressMatchExpressions(const Address &address,
                                  vector<AddressExpression>& address_expressions,
                                  bool *used_wildcard,
                                  bool *filtered_out,
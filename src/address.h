@@ -53,8 +53,8 @@ struct Address
     void decodeMfctFirst(const std::vector<uchar>::iterator &pos);
     void decodeIdFirst(const std::vector<uchar>::iterator &pos);
 
-    std::string str();
-    static std::string concat(std::vector<Address> &addresses);
+    std::string str() const;
+    static std::string concat(const std::vector<Address> &addresses);
 };
 
 struct AddressExpression
@@ -110,7 +110,7 @@ bool isValidSequenceOfAddressExpressions(const std::string& s);
 std::vector<AddressExpression> splitAddressExpressions(const std::string &aes);
 bool flagToManufacturer(const char *s, uint16_t *out_mfct);
 std::string manufacturerFlag(int m_field);
-bool doesTelegramMatchExpressions(std::vector<Address> &addresses,
+bool doesTelegramMatchExpressions(const std::vector<Address> &addresses,
                                   std::vector<AddressExpression>& address_expressions,
                                   bool *used_wildcard);
 
@@ -79,18 +79,6 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 /*****************************************************************************/
 // state - array holding the intermediate results during decryption.
 typedef uint8_t state_t[4][4];
-static state_t* state;
-
-// The array that stores the round keys.
-static uint8_t RoundKey[keyExpSize];
-
-// The Key input to the AES Program
-static const uint8_t* Key;
-
-#if defined(CBC) && CBC
-  // Initial Vector used only for CBC mode
-  static uint8_t* Iv;
-#endif
 
 // The lookup-tables are marked const so they can be placed in read-only storage instead of RAM
 // The numbers below can be computed dynamically trading ROM for RAM -
@@ -182,7 +170,7 @@ static uint8_t getSBoxInvert(uint8_t num)
 }
 
 // This function produces Nb(Nr+1) round keys. The round keys are used in each round to decrypt the states.
-static void KeyExpansion(void)
+static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key)
 {
   uint32_t i, k;
   uint8_t tempa[4]; // Used for the column/row operations
@@ -255,7 +243,7 @@ static void KeyExpansion(void)
 
 // This function adds the round key to state.
 // The round key is added to the state by an XOR function.
-static void AddRoundKey(uint8_t round)
+static void AddRoundKey(uint8_t round, state_t* state, const uint8_t* RoundKey)
 {
   uint8_t i,j;
   for (i=0;i<4;++i)
@@ -269,7 +257,7 @@ static void AddRoundKey(uint8_t round)
 
 // The SubBytes Function Substitutes the values in the
 // state matrix with values in an S-box.
-static void SubBytes(void)
+static void SubBytes(state_t* state)
 {
   uint8_t i, j;
   for (i = 0; i < 4; ++i)
@@ -284,7 +272,7 @@ static void SubBytes(void)
 // The ShiftRows() function shifts the rows in the state to the left.
 // Each row is shifted with different offset.
 // Offset = Row number. So the first row is not shifted.
-static void ShiftRows(void)
+static void ShiftRows(state_t* state)
 {
   uint8_t temp;
 
@@ -318,7 +306,7 @@ static uint8_t xtime(uint8_t x)
 }
 
 // MixColumns function mixes the columns of the state matrix
-static void MixColumns(void)
+static void MixColumns(state_t* state)
 {
   uint8_t i;
   uint8_t Tmp,Tm,t;
@@ -356,7 +344,7 @@ static uint8_t Multiply(uint8_t x, uint8_t y)
 // MixColumns function mixes the columns of the state matrix.
 // The method used to multiply may be difficult to understand for the inexperienced.
 // Please use the references to gain more information.
-static void InvMixColumns(void)
+static void InvMixColumns(state_t* state)
 {
   int i;
   uint8_t a, b, c, d;
@@ -377,7 +365,7 @@ static void InvMixColumns(void)
 
 // The SubBytes Function Substitutes the values in the
 // state matrix with values in an S-box.
-static void InvSubBytes(void)
+static void InvSubBytes(state_t* state)
 {
   uint8_t i,j;
   for (i = 0; i < 4; ++i)
@@ -389,7 +377,7 @@ static void InvSubBytes(void)
   }
 }
 
-static void InvShiftRows(void)
+static void InvShiftRows(state_t* state)
 {
   uint8_t temp;
 
@@ -419,180 +407,264 @@ static void InvShiftRows(void)
 
 
 // Cipher is the main function that encrypts the PlainText.
-static void Cipher(void)
+static void Cipher(state_t* state, const uint8_t* RoundKey)
 {
   uint8_t round = 0;
 
   // Add the First round key to the state before starting the rounds.
-  AddRoundKey(0);
+  AddRoundKey(0, state, RoundKey);
 
   // There will be Nr rounds.
   // The first Nr-1 rounds are identical.
   // These Nr-1 rounds are executed in the loop below.
   for (round = 1; round < Nr; ++round)
   {
-    SubBytes();
-    ShiftRows();
-    MixColumns();
-    AddRoundKey(round);
+    SubBytes(state);
+    ShiftRows(state);
+    MixColumns(state);
+    AddRoundKey(round, state, RoundKey);
   }
 
   // The last round is given below.
   // The MixColumns function is not here in the last round.
-  SubBytes();
-  ShiftRows();
-  AddRoundKey(Nr);
+  SubBytes(state);
+  ShiftRows(state);
+  AddRoundKey(Nr, state, RoundKey);
 }
 
-static void InvCipher(void)
+static void InvCipher(state_t* state, const uint8_t* RoundKey)
 {
   uint8_t round=0;
 
   // Add the First round key to the state before starting the rounds.
-  AddRoundKey(Nr);
+  AddRoundKey(Nr, state, RoundKey);
 
   // There will be Nr rounds.
   // The first Nr-1 rounds are identical.
   // These Nr-1 rounds are executed in the loop below.
   for (round = (Nr - 1); round > 0; --round)
   {
-    InvShiftRows();
-    InvSubBytes();
-    AddRoundKey(round);
-    InvMixColumns();
+    InvShiftRows(state);
+    InvSubBytes(state);
+    AddRoundKey(round, state, RoundKey);
+    InvMixColumns(state);
   }
 
   // The last round is given below.
   // The MixColumns function is not here in the last round.
-  InvShiftRows();
-  InvSubBytes();
-  AddRoundKey(0);
+  InvShiftRows(state);
+  InvSubBytes(state);
+  AddRoundKey(0, state, RoundKey);
 }
 
 
 /*****************************************************************************/
-/* Public functions:                                                         */
+/* AES-NI:                                                                   */
 /*****************************************************************************/
-#if defined(ECB) && (ECB == 1)
+// On x86 the hardware AES instructions are used when the cpu has them.
+// The round keys are stored in the same byte order as for the byte-wise code.
+#if AES_HAVE_AESNI
 
+#include <cpuid.h>
+#include <wmmintrin.h>
 
-void AES_ECB_encrypt(const uint8_t* input, const uint8_t* key, uint8_t* output, const uint32_t length)
+static bool cpuHasAESNI(void)
 {
-  // Copy input to output, and work in-memory on output
-  memcpy(output, input, length);
-  state = (state_t*)output;
-
-  Key = key;
-  KeyExpansion();
-
-  // The next function call encrypts the PlainText with the Key using AES algorithm.
-  Cipher();
+  unsigned int a, b, c, d;
+  if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+  return (c & bit_AES) != 0;
 }
 
-void AES_ECB_decrypt(const uint8_t* input, const uint8_t* key, uint8_t *output, const uint32_t length)
+__attribute__((target("aes,sse2")))
+static void aesniInvKeys(const uint8_t* RoundKey, uint8_t* InvRoundKey)
 {
-  // Copy input to output, and work in-memory on output
-  memcpy(output, input, length);
-  state = (state_t*)output;
+  // The equivalent inverse cipher uses the round keys in reverse order,
+  // with InvMixColumns applied to all but the first and last.
+  _mm_storeu_si128((__m128i*)InvRoundKey, _mm_loadu_si128((const __m128i*)(RoundKey + Nr*16)));
+  for (int round = 1; round < Nr; ++round)
+  {
+    __m128i k = _mm_loadu_si128((const __m128i*)(RoundKey + (Nr-round)*16));
+    _mm_storeu_si128((__m128i*)(InvRoundKey + round*16), _mm_aesimc_si128(k));
+  }
+  _mm_storeu_si128((__m128i*)(InvRoundKey + Nr*16), _mm_loadu_si128((const __m128i*)RoundKey));
+}
 
-  // The KeyExpansion routine must be called before encryption.
-  Key = key;
-  KeyExpansion();
+__attribute__((target("aes,sse2")))
+static void aesniCipher(const uint8_t* RoundKey, const uint8_t* input, uint8_t* output)
+{
+  __m128i m = _mm_loadu_si128((const __m128i*)input);
+  m = _mm_xor_si128(m, _mm_loadu_si128((const __m128i*)RoundKey));
+  for (int round = 1; round < Nr; ++round)
+  {
+    m = _mm_aesenc_si128(m, _mm_loadu_si128((const __m128i*)(RoundKey + round*16)));
+  }
+  m = _mm_aesenclast_si128(m, _mm_loadu_si128((const __m128i*)(RoundKey + Nr*16)));
+  _mm_storeu_si128((__m128i*)output, m);
+}
 
-  InvCipher();
+__attribute__((target("aes,sse2")))
+static void aesniInvCipher(const uint8_t* InvRoundKey, const uint8_t* input, uint8_t* output)
+{
+  __m128i m = _mm_loadu_si128((const __m128i*)input);
+  m = _mm_xor_si128(m, _mm_loadu_si128((const __m128i*)InvRoundKey));
+  for (int round = 1; round < Nr; ++round)
+  {
+    m = _mm_aesdec_si128(m, _mm_loadu_si128((const __m128i*)(InvRoundKey + round*16)));
+  }
+  m = _mm_aesdeclast_si128(m, _mm_loadu_si128((const __m128i*)(InvRoundKey + Nr*16)));
+  _mm_storeu_si128((__m128i*)output, m);
 }
 
+static const bool hw_available_ = cpuHasAESNI();
 
-#endif // #if defined(ECB) && (ECB == 1)
+#else
 
+static const bool hw_available_ = false;
 
+#endif // AES_HAVE_AESNI
 
+static bool use_hw_ = hw_available_;
 
+bool AES_hw_available(void)
+{
+  return hw_available_;
+}
 
-#if defined(CBC) && (CBC == 1)
+bool AES_hw_enabled(void)
+{
+  return use_hw_;
+}
+
+void AES_enable_hw(bool enable)
+{
+  use_hw_ = enable && AES_hw_available();
+}
 
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
 
-static void XorWithIv(uint8_t* buf)
+void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key)
 {
-  uint8_t i;
-  for (i = 0; i < BLOCKLEN; ++i) //WAS for(i = 0; i < KEYLEN; ++i) but the block in AES is always 128bit so 16 bytes!
+  memcpy(ctx->Key, key, KEYLEN);
+  KeyExpansion(ctx->RoundKey, key);
+#if AES_HAVE_AESNI
+  if (hw_available_)
   {
-    buf[i] ^= Iv[i];
+    aesniInvKeys(ctx->RoundKey, ctx->InvRoundKey);
   }
+#endif
 }
 
-void AES_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
+void AES_ctx_encrypt_block(const struct AES_ctx* ctx, const uint8_t* input, uint8_t* output)
 {
-  uintptr_t i;
-//  uint8_t extra = length % BLOCKLEN; /* Remaining bytes in the last non-full block */
-
-  // Skip the key expansion if key is passed as 0
-  if (0 != key)
+#if AES_HAVE_AESNI
+  if (use_hw_)
   {
-    Key = key;
-    KeyExpansion();
+    aesniCipher(ctx->RoundKey, input, output);
+    return;
   }
+#endif
+  if (output != input) memcpy(output, input, BLOCKLEN);
+  Cipher((state_t*)output, ctx->RoundKey);
+}
 
-  if (iv != 0)
+void AES_ctx_decrypt_block(const struct AES_ctx* ctx, const uint8_t* input, uint8_t* output)
+{
+#if AES_HAVE_AESNI
+  if (use_hw_)
   {
-    Iv = (uint8_t*)iv;
+    aesniInvCipher(ctx->InvRoundKey, input, output);
+    return;
   }
+#endif
+  if (output != input) memcpy(output, input, BLOCKLEN);
+  InvCipher((state_t*)output, ctx->RoundKey);
+}
+
+void AES_ctx_CBC_decrypt_buffer(const struct AES_ctx* ctx, uint8_t* output, const uint8_t* input, uint32_t length, const uint8_t* iv)
+{
+  uint8_t prev[BLOCKLEN];
+  uint8_t block[BLOCKLEN];
+  uint32_t i, j;
 
+  memcpy(prev, iv, BLOCKLEN);
   for (i = 0; i < length; i += BLOCKLEN)
   {
-    XorWithIv(input);
-    memcpy(output, input, BLOCKLEN);
-    state = (state_t*)output;
-    Cipher();
-    Iv = output;
-    input += BLOCKLEN;
-    output += BLOCKLEN;
-    //printf("Step %d - %d", i/16, i);
+    // Keep the ciphertext block, output and input may be the same buffer.
+    memcpy(block, input + i, BLOCKLEN);
+    AES_ctx_decrypt_block(ctx, block, output + i);
+    for (j = 0; j < BLOCKLEN; ++j)
+    {
+      output[i + j] ^= prev[j];
+    }
+    memcpy(prev, block, BLOCKLEN);
   }
+}
 
-/*  if (extra)
-  {
-    memcpy(output, input, extra);
-    state = (state_t*)output;
-    Cipher();
-    } */
+#if defined(ECB) && (ECB == 1)
+
+
+void AES_ECB_encrypt(const uint8_t* input, const uint8_t* key, uint8_t* output, const uint32_t length)
+{
+  struct AES_ctx ctx;
+
+  // Copy input to output, and work in-memory on output
+  memcpy(output, input, length);
+
+  AES_init_ctx(&ctx, key);
+  // The next function call encrypts the first block of the PlainText with the Key using AES algorithm.
+  AES_ctx_encrypt_block(&ctx, output, output);
 }
 
-void AES_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
+void AES_ECB_decrypt(const uint8_t* input, const uint8_t* key, uint8_t *output, const uint32_t length)
 {
-  uintptr_t i;
-//  uint8_t extra = length % BLOCKLEN; /* Remaining bytes in the last non-full block */
+  struct AES_ctx ctx;
+
+  // Copy input to output, and work in-memory on output
+  memcpy(output, input, length);
+
+  AES_init_ctx(&ctx, key);
+  AES_ctx_decrypt_block(&ctx, output, output);
+}
+
+
+#endif // #if defined(ECB) && (ECB == 1)
 
-  // Skip the key expansion if key is passed as 0
-  if (0 != key)
-  {
-    Key = key;
-    KeyExpansion();
-  }
 
-  // If iv is passed as 0, we continue to encrypt without re-setting the Iv
-  if (iv != 0)
-  {
-    Iv = (uint8_t*)iv;
-  }
+
+
+
+#if defined(CBC) && (CBC == 1)
+
+
+void AES_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
+{
+  uintptr_t i, j;
+  struct AES_ctx ctx;
+  const uint8_t* Iv = iv;
+
+  AES_init_ctx(&ctx, key);
 
   for (i = 0; i < length; i += BLOCKLEN)
   {
-    memcpy(output, input, BLOCKLEN);
-    state = (state_t*)output;
-    InvCipher();
-    XorWithIv(output);
-    Iv = input;
+    for (j = 0; j < BLOCKLEN; ++j)
+    {
+      input[j] ^= Iv[j];
+    }
+    AES_ctx_encrypt_block(&ctx, input, output);
+    Iv = output;
     input += BLOCKLEN;
     output += BLOCKLEN;
   }
+}
 
-/*  if (extra)
-  {
-    memcpy(output, input, extra);
-    state = (state_t*)output;
-    InvCipher();
-    }*/
+void AES_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
+{
+  struct AES_ctx ctx;
+
+  AES_init_ctx(&ctx, key);
+  AES_ctx_CBC_decrypt_buffer(&ctx, output, input, length, iv);
 }
 
 #endif // #if defined(CBC) && (CBC == 1)
@@ -25,6 +25,39 @@
 //#define AES192 1
 //#define AES256 1
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+  #define AES_HAVE_AESNI 1
+#else
+  #define AES_HAVE_AESNI 0
+#endif
+
+// An expanded key schedule. Expanding the key is more expensive than
+// encrypting a block, so keep the context around while the key is unchanged.
+// The functions using a context are reentrant.
+struct AES_ctx
+{
+  uint8_t Key[16];
+  uint8_t RoundKey[176];
+  // The decryption round keys used by the AES-NI instructions.
+  uint8_t InvRoundKey[176];
+};
+
+void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key);
+// Encrypt/decrypt a single 16 byte block, input and output may be the same.
+void AES_ctx_encrypt_block(const struct AES_ctx* ctx, const uint8_t* input, uint8_t* output);
+void AES_ctx_decrypt_block(const struct AES_ctx* ctx, const uint8_t* input, uint8_t* output);
+// The length must be a multiple of 16, input and output may be the same.
+void AES_ctx_CBC_decrypt_buffer(const struct AES_ctx* ctx, uint8_t* output, const uint8_t* input, uint32_t length, const uint8_t* iv);
+
+// The hardware AES instructions (AES-NI) are used when available.
+// They can be disabled to compare with or test the byte-wise implementation.
+bool AES_hw_available(void);
+bool AES_hw_enabled(void);
+void AES_enable_hw(bool enable);
+
+// The functions below expand the key on every call.
+// Only the first block of the input is encrypted/decrypted by the ECB functions.
+
 #if defined(ECB) && (ECB == 1)
 
 void AES_ECB_encrypt(const uint8_t* input, const uint8_t* key, uint8_t *output, const uint32_t length);
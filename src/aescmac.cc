@@ -26,7 +26,7 @@ uchar vec87[16] = {
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x87
 };
 
-void generateSubkeys(uchar *key, uchar *K1, uchar *K2)
+void generateSubkeys(const AES_ctx *ctx, uchar *K1, uchar *K2)
 {
     uchar L[16];
     uchar Z[16];
@@ -34,7 +34,7 @@ void generateSubkeys(uchar *key, uchar *K1, uchar *K2)
 
     memset(Z, 0, 16);
 
-    AES_ECB_encrypt(Z, key, L, 16);
+    AES_ctx_encrypt_block(ctx, Z, L);
 
     if (!(L[0] & 0x80))
     {
@@ -77,13 +77,20 @@ void pad(uchar *in, uchar *out, int len)
 }
 
 void AES_CMAC(uchar *key, uchar *input, int len, uchar *mac)
+{
+    AES_ctx ctx;
+    AES_init_ctx(&ctx, key);
+    AES_CMAC_ctx(&ctx, input, len, mac);
+}
+
+void AES_CMAC_ctx(const AES_ctx *ctx, uchar *input, int len, uchar *mac)
 {
     bool len_is_multiple_of_block;
     uchar X[16], Y[16];
     uchar K1[16], K2[16];
     uchar M_last[16], padded[16];
 
-    generateSubkeys(key, K1, K2);
+    generateSubkeys(ctx, K1, K2);
 
     int num_blocks = (len+15)/16;
 
@@ -112,11 +119,11 @@ void AES_CMAC(uchar *key, uchar *input, int len, uchar *mac)
     for (int i=0; i<num_blocks-1; i++)
     {
         xorit(X, input+(16*i), Y, 16);
-        AES_ECB_encrypt(Y, key, X, 16);
+        AES_ctx_encrypt_block(ctx, Y, X);
     }
 
     xorit(X,M_last,Y, 16);
-    AES_ECB_encrypt(Y, key, X, 16);
+    AES_ctx_encrypt_block(ctx, Y, X);
 
     memcpy(mac, X, 16);
 }
@@ -0,0 +1,562 @@
+/*
+ Copyright (C) 2024 Fredrik Öhrström (gpl-3.0-or-later)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Benchmark of the telegram decoding pipeline, built and run with "make bench".
+//
+// The corpus is every telegram= line in simulations/*.txt and tests/*. The keys
+// and drivers are picked up from the meter quadruples in the test scripts and from
+// the meter files in the test configs, telegrams without a configured driver use
+// the auto detected driver. Each telegram is driven through the stages below and
+// the result is printed as json per stage and per driver, so that it can be
+// compared between commits.
+
+#include"drivers.h"
+#include"dvparser.h"
+#include"meters.h"
+#include"meters_common_implementation.h"
+#include"metrics.h"
+#include"threads.h"
+#include"util.h"
+#include"wmbus.h"
+
+#include<algorithm>
+#include<atomic>
+#include<chrono>
+#include<inttypes.h>
+#include<map>
+#include<new>
+#include<set>
+#include<stdlib.h>
+#include<string.h>
+
+using namespace std;
+
+// Every heap allocation made by the process is counted, also by threads started by the library code.
+static std::atomic<size_t> num_allocations_ {};
+
+void *operator new(size_t size)
+{
+    num_allocations_++;
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+// header    the parse done once per telegram to select the meters, since it stops only
+//           when it reaches encrypted content, it includes the dv parsing of plain telegrams
+// parse     the full parse with the meter keys
+// decrypt   the decryption is done in the middle of parsing the transport layer, its time is
+//           taken from the telegram and its allocations cannot be counted separately
+// dv        parseDV of the decrypted payload
+// extract   the field extractors and any driver specific processContent
+// calculate the formulas of the calculated fields
+// render    printMeter rendering the json, fields and human readable outputs
+#define LIST_OF_STAGES \
+    X(header)          \
+    X(parse)           \
+    X(decrypt)         \
+    X(dv)              \
+    X(extract)         \
+    X(calculate)       \
+    X(render)
+
+enum class Stage
+{
+#define X(name) name,
+LIST_OF_STAGES
+#undef X
+    NUM_STAGES
+};
+
+static const char *stage_names_[] =
+{
+#define X(name) #name,
+LIST_OF_STAGES
+#undef X
+};
+
+const int NUM_STAGES = (int)Stage::NUM_STAGES;
+
+struct StageResult
+{
+    uint64_t ns {};
+    uint64_t allocations {};
+    uint64_t telegrams {};
+    bool allocations_counted = true;
+
+    void add(uint64_t n, uint64_t a)
+    {
+        ns += n;
+        allocations += a;
+        telegrams++;
+    }
+};
+
+struct MeterSetup
+{
+    string driver;
+    string key;
+};
+
+struct BenchTelegram
+{
+    string hex;
+    string source; // The file the telegram was found in.
+    AboutTelegram about;
+    vector<uchar> frame;
+    MeterKeys keys;
+    shared_ptr<Meter> meter;
+    MeterCommonImplementation *meter_impl {};
+};
+
+// A telegram that was not benchmarked, or that failed to decode.
+struct Rejected
+{
+    string hex;
+    string source;
+    string driver;
+    string reason;
+};
+
+struct DriverResult
+{
+    string driver;
+    int telegrams {};
+    int failed {};
+    StageResult stages[NUM_STAGES];
+};
+
+static uint64_t nowNs()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool isId(const string &s)
+{
+    if (s.length() != 8) return false;
+    for (char c : s) if (c < '0' || c > '9') return false;
+    return true;
+}
+
+static string unquote(string s)
+{
+    if (s.length() >= 2 && (s[0] == '"' || s[0] == '\'') && s.back() == s[0]) return s.substr(1, s.length()-2);
+    return s;
+}
+
+static bool isKey(const string &s)
+{
+    bool invalid = false;
+    return s == "" || s == "NOKEY" || (s.length() == 32 && isHexStringStrict(s, &invalid) && !invalid);
+}
+
+// Collect the meters from command line quadruples: name driver id key
+static void loadQuadruples(vector<string> &lines, map<string,MeterSetup> *setups)
+{
+    for (string &line : lines)
+    {
+        vector<string> tokens = splitString(line, ' ');
+        for (size_t i = 0; i+2 < tokens.size(); ++i)
+        {
+            string driver = tokens[i];
+            string id = tokens[i+1];
+            string key = unquote(tokens[i+2]);
+            if (!isId(id) || !isKey(key)) continue;
+            if (driver != "auto" && lookupDriver(driver) == NULL) continue;
+            MeterSetup &ms = (*setups)[id];
+            if (driver != "auto") ms.driver = driver;
+            if (key != "" && key != "NOKEY") ms.key = key;
+        }
+    }
+}
+
+// Collect the meters from a meter file in a test config: type= id= key=
+static void loadMeterFile(vector<string> &lines, map<string,MeterSetup> *setups)
+{
+    string driver, id, key;
+    for (string &line : lines)
+    {
+        if (line.substr(0,5) == "type=" || line.substr(0,7) == "driver=") driver = line.substr(line.find('=')+1);
+        if (line.substr(0,3) == "id=") id = line.substr(3);
+        if (line.substr(0,4) == "key=") key = line.substr(4);
+    }
+    if (!isId(id)) return;
+    MeterSetup &ms = (*setups)[id];
+    if (driver != "" && driver != "auto" && lookupDriver(driver) != NULL) ms.driver = driver;
+    if (isKey(key) && key != "" && key != "NOKEY") ms.key = key;
+}
+
+static void loadTelegrams(const string &source, vector<string> &lines, set<string> *seen,
+                          vector<BenchTelegram> *telegrams, vector<Rejected> *skipped)
+{
+    for (string &line : lines)
+    {
+        if (line.substr(0,9) != "telegram=") continue;
+        string hex;
+        for (size_t i = 9; i < line.length(); ++i)
+        {
+            if (line[i] == '|' || line[i] == '_') continue;
+            if (line[i] == '+' || line[i] == ' ') break;
+            hex += line[i];
+        }
+        if (seen->count(hex) > 0) continue;
+        seen->insert(hex);
+
+        BenchTelegram bt;
+        bt.hex = hex;
+        bt.source = source;
+        if (!hex2bin(hex, &bt.frame))
+        {
+            skipped->push_back({ hex, source, "", "not hex" });
+            continue;
+        }
+
+        size_t frame_length;
+        int payload_len, payload_offset;
+        bool is_mbus = FullFrame == checkMBusFrame(bt.frame, &frame_length, &payload_len, &payload_offset, true);
+        bool is_wmbus = FullFrame == checkWMBusFrame(bt.frame, &frame_length, &payload_len, &payload_offset, true);
+
+        // Prepare the frames the same way as the simulator does.
+        if (is_wmbus)
+        {
+            bt.about = AboutTelegram("", 0, FrameType::WMBUS);
+            removeAnyDLLCRCs(bt.frame);
+        }
+        else if (is_mbus)
+        {
+            bt.about = AboutTelegram("", 0, FrameType::MBUS);
+            while (((size_t)payload_len) < bt.frame.size()) bt.frame.pop_back();
+        }
+        else
+        {
+            skipped->push_back({ hex, source, "", "not a full wmbus or mbus frame" });
+            continue;
+        }
+        telegrams->push_back(bt);
+    }
+}
+
+static void loadCorpus(vector<BenchTelegram> *telegrams, map<string,MeterSetup> *setups, vector<Rejected> *skipped)
+{
+    set<string> seen;
+    vector<string> files;
+
+    listFiles("simulations", &files);
+    sort(files.begin(), files.end());
+    for (string &f : files)
+    {
+        if (f.length() < 4 || f.substr(f.length()-4) != ".txt") continue;
+        vector<string> lines;
+        loadFile("simulations/"+f, &lines);
+        loadTelegrams("simulations/"+f, lines, &seen, telegrams, skipped);
+    }
+
+    files.clear();
+    listFiles("tests", &files);
+    sort(files.begin(), files.end());
+    for (string &f : files)
+    {
+        string path = "tests/"+f;
+        if (checkIfDirExists(path.c_str()))
+        {
+            vector<string> meters;
+            string dir = path+"/etc/wmbusmeters.d";
+            listFiles(dir, &meters);
+            sort(meters.begin(), meters.end());
+            for (string &m : meters)
+            {
+                vector<string> lines;
+                loadFile(dir+"/"+m, &lines);
+                loadMeterFile(lines, setups);
+            }
+            continue;
+        }
+        vector<string> lines;
+        loadFile(path, &lines);
+        loadQuadruples(lines, setups);
+        loadTelegrams(path, lines, &seen, telegrams, skipped);
+    }
+}
+
+// Pick the driver and key for the telegram and create a meter for it.
+// Returns the name of the driver or the empty string, with the reason, if no driver was found.
+static string setupMeter(BenchTelegram *bt, map<string,MeterSetup> &setups, map<string,shared_ptr<Meter>> *meters,
+                         string *reason)
+{
+    Telegram header;
+    header.about = bt->about;
+    header.disableExplanations();
+    if (!header.parseHeader(bt->frame) || header.addresses.size() == 0)
+    {
+        *reason = "the header could not be parsed";
+        return "";
+    }
+
+    Address &address = header.addresses.back();
+    MeterSetup setup;
+    if (setups.count(address.id) > 0) setup = setups[address.id];
+    if (setup.driver == "")
+    {
+        DriverInfo *di = pickMeterDriver(&header);
+        if (di == NULL)
+        {
+            *reason = "no driver configured or detected";
+            return "";
+        }
+        setup.driver = di->name().str();
+    }
+
+    string meter_key = setup.driver+" "+address.id+" "+setup.key;
+    if (meters->count(meter_key) == 0)
+    {
+        MeterInfo mi;
+        mi.name = "bench";
+        mi.driver_name = DriverName(setup.driver);
+        mi.key = setup.key;
+        mi.address_expressions.push_back(AddressExpression(address));
+        mi.poll_interval = 1000*1000*1000;  // Fake a high value to silence warning about poll inteval.
+        (*meters)[meter_key] = createMeter(&mi);
+    }
+    bt->meter = (*meters)[meter_key];
+    bt->meter_impl = dynamic_cast<MeterCommonImplementation*>(bt->meter.get());
+    if (bt->meter_impl == NULL)
+    {
+        *reason = "the meter has no common implementation";
+        return "";
+    }
+    if (setup.key != "") hex2bin(setup.key, &bt->keys.confidentiality_key);
+
+    return setup.driver;
+}
+
+// Drive the telegram through all stages once. Returns false, with the reason, if it could not be parsed or decrypted.
+static bool runStages(BenchTelegram &bt, DriverResult *dr, string *reason)
+{
+    uint64_t ns[NUM_STAGES] = {};
+    uint64_t allocs[NUM_STAGES] = {};
+    uint64_t start, start_allocs;
+
+#define BEGIN() { start_allocs = num_allocations_; start = nowNs(); }
+#define END(stage) { ns[(int)Stage::stage] = nowNs()-start; allocs[(int)Stage::stage] = num_allocations_-start_allocs; }
+
+    BEGIN();
+    Telegram header;
+    header.about = bt.about;
+    header.disableExplanations();
+    header.parseHeader(bt.frame);
+    END(header);
+
+    BEGIN();
+    Telegram t;
+    t.about = bt.about;
+    t.meter = bt.meter.get();
+    t.disableExplanations();
+    bool ok = t.parse(bt.frame, &bt.keys, false);
+    END(parse);
+
+    if (t.decryption_failed)
+    {
+        *reason = bt.keys.hasConfidentialityKey() ? "decryption failed, wrong key" : "encrypted and no key";
+        return false;
+    }
+    if (!ok)
+    {
+        *reason = "the telegram could not be parsed";
+        return false;
+    }
+
+    BEGIN();
+    Telegram dvt;
+    dvt.disableExplanations();
+    map<string,pair<int,DVEntry>> dv_entries;
+    vector<uchar> format_bytes;
+    if (t.format_signature != 0) loadFormatBytesFromSignature(t.format_signature, &format_bytes);
+    vector<uchar>::iterator format = format_bytes.begin();
+    vector<uchar>::iterator pos = t.frame.begin()+t.header_size;
+    size_t len = t.frame.size()-t.header_size-t.suffix_size;
+    parseDV(&dvt, t.frame, pos, len, &dv_entries, format_bytes.size() > 0 ? &format : NULL, format_bytes.size());
+    END(dv);
+
+    BEGIN();
+    bt.meter_impl->extractFields(&t);
+    END(extract);
+
+    BEGIN();
+    bt.meter_impl->processFieldCalculators();
+    END(calculate);
+
+    BEGIN();
+    string hr, fields, json;
+    vector<string> envs, more_json, selected_fields;
+    bt.meter->printMeter(&t, &hr, &fields, '\t', &json, &envs, &more_json, &selected_fields, false);
+    END(render);
+
+#undef BEGIN
+#undef END
+
+    for (int s = 0; s < NUM_STAGES; ++s)
+    {
+        if ((Stage)s == Stage::decrypt)
+        {
+            if (t.decrypt_ns == 0) continue;
+            dr->stages[s].add(t.decrypt_ns, 0);
+            dr->stages[s].allocations_counted = false;
+            continue;
+        }
+        dr->stages[s].add(ns[s], allocs[s]);
+    }
+    return true;
+}
+
+static void printStages(StageResult *stages, const char *indent)
+{
+    bool first = true;
+    for (int s = 0; s < NUM_STAGES; ++s)
+    {
+        StageResult &sr = stages[s];
+        if (sr.telegrams == 0) continue;
+        double ns_per_telegram = (double)sr.ns/sr.telegrams;
+        double telegrams_per_s = sr.ns > 0 ? 1e9*sr.telegrams/sr.ns : 0;
+        string allocations_per_telegram = "null";
+        if (sr.allocations_counted) allocations_per_telegram = tostrprintf("%.2f", (double)sr.allocations/sr.telegrams);
+        printf("%s\n%s\"%s\":{\"telegrams\":%" PRIu64 ",\"telegrams_per_s\":%.0f,\"ns_per_telegram\":%.1f,\"allocations_per_telegram\":%s}",
+               first ? "" : ",", indent, stage_names_[s], sr.telegrams, telegrams_per_s, ns_per_telegram,
+               allocations_per_telegram.c_str());
+        first = false;
+    }
+}
+
+static void printRejected(const char *name, vector<Rejected> &rejected)
+{
+    printf("  \"%s\":[", name);
+    for (size_t i = 0; i < rejected.size(); ++i)
+    {
+        Rejected &r = rejected[i];
+        // A telegram that is not hex could contain anything, keep the json valid.
+        string telegram = r.hex;
+        for (char &c : telegram) if (c == '"' || c == '\\' || c < ' ') c = '?';
+        printf("%s\n    {\"source\":\"%s\",", i == 0 ? "" : ",", r.source.c_str());
+        if (r.driver != "") printf("\"driver\":\"%s\",", r.driver.c_str());
+        printf("\"reason\":\"%s\",\"telegram\":\"%s\"}", r.reason.c_str(), telegram.c_str());
+    }
+    printf("%s]", rejected.size() > 0 ? "\n  " : "");
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = 1000;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strncmp(argv[i], "--rounds=", 9))
+        {
+            rounds = atoi(argv[i]+9);
+            continue;
+        }
+        error("Usage: bench [--rounds=<n>]\n"
+              "Run from the source root, prints the benchmark results as json on stdout.\n");
+    }
+    if (rounds <= 0) error("The number of rounds must be positive.\n");
+
+    // Drivers and the parser print warnings for the broken telegrams in the corpus.
+    silentLogging(true);
+    // The decryption is only timed when the metrics are enabled.
+    enableMetrics(true);
+    loadAllBuiltinDrivers();
+
+    vector<BenchTelegram> telegrams;
+    map<string,MeterSetup> setups;
+    vector<Rejected> skipped, failed;
+    loadCorpus(&telegrams, &setups, &skipped);
+    size_t num_not_frames = skipped.size();
+    if (telegrams.size() == 0) error("No telegrams found in simulations/*.txt or tests/*\n");
+
+    map<string,shared_ptr<Meter>> meters;
+    map<string,vector<BenchTelegram*>> by_driver;
+    for (BenchTelegram &bt : telegrams)
+    {
+        string reason;
+        string driver = setupMeter(&bt, setups, &meters, &reason);
+        if (driver == "")
+        {
+            skipped.push_back({ bt.hex, bt.source, "", reason });
+            continue;
+        }
+        by_driver[driver].push_back(&bt);
+    }
+
+    vector<DriverResult> results;
+    for (auto &p : by_driver)
+    {
+        DriverResult dr;
+        dr.driver = p.first;
+        dr.telegrams = p.second.size();
+        for (BenchTelegram *bt : p.second)
+        {
+            for (int r = 0; r < rounds; ++r)
+            {
+                string reason;
+                if (!runStages(*bt, &dr, &reason))
+                {
+                    dr.failed++;
+                    failed.push_back({ bt->hex, bt->source, dr.driver, reason });
+                    break;
+                }
+            }
+        }
+        results.push_back(dr);
+    }
+
+    StageResult total[NUM_STAGES];
+    int total_failed = 0;
+    for (DriverResult &dr : results)
+    {
+        total_failed += dr.failed;
+        for (int s = 0; s < NUM_STAGES; ++s)
+        {
+            total[s].ns += dr.stages[s].ns;
+            total[s].allocations += dr.stages[s].allocations;
+            total[s].telegrams += dr.stages[s].telegrams;
+            total[s].allocations_counted = total[s].allocations_counted && dr.stages[s].allocations_counted;
+        }
+    }
+
+    // The peak rss is only meaningful for the whole run, the drivers share the heap.
+    printf("{\n  \"rounds\":%d,\n  \"telegrams\":%zu,\n  \"skipped\":%zu,\n  \"failed\":%d,\n  \"peak_rss\":%zu,\n  \"stages\":{",
+           rounds, telegrams.size()+num_not_frames, skipped.size(), total_failed, getPeakRSS());
+    printStages(total, "    ");
+    printf("\n  },\n  \"drivers\":[");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        DriverResult &dr = results[i];
+        printf("%s\n    {\"driver\":\"%s\",\"telegrams\":%d,\"failed\":%d,\"stages\":{",
+               i == 0 ? "" : ",", dr.driver.c_str(), dr.telegrams, dr.failed);
+        printStages(dr.stages, "      ");
+        printf("}}");
+    }
+    printf("\n  ],\n");
+    printRejected("skipped_telegrams", skipped);
+    printf(",\n");
+    printRejected("failed_telegrams", failed);
+    printf("\n}\n");
+
+    return 0;
+}
@@ -186,6 +186,7 @@ static shared_ptr<Configuration> parseNormalCommandLine(Configuration *c, int ar
             c->analyze_driver = "";
             c->analyze_key = "";
             c->analyze_verbose = false;
+            c->analyze_batch = false;
             i++;
             continue;
         }
@@ -202,6 +203,7 @@ static shared_ptr<Configuration> parseNormalCommandLine(Configuration *c, int ar
             c->analyze_driver = "";
             c->analyze_key = "";
             c->analyze_verbose = false;
+            c->analyze_batch = false;
             string arg = string(argv[i]+10);
             vector<string> args = splitString(arg, ':');
 
@@ -221,6 +223,7 @@ static shared_ptr<Configuration> parseNormalCommandLine(Configuration *c, int ar
                 else if (s == "json") c->analyze_format = OutputFormat::JSON;
                 else if (s == "html") c->analyze_format = OutputFormat::HTML;
                 else if (s == "verbose") c->analyze_verbose = true;
+                else if (s == "batch") c->analyze_batch = true;
                 else
                 {
                     MeterInfo mi;
@@ -503,6 +506,35 @@ static shared_ptr<Configuration> parseNormalCommandLine(Configuration *c, int ar
             i++;
             continue;
         }
+        if (!strncmp(argv[i], "--duplicatecapacity=", 20)) {
+            c->duplicate_capacity = atoi(argv[i]+20);
+            if (c->duplicate_capacity <= 0 || !isNumber(argv[i]+20)) {
+                error("Not a valid duplicate capacity. \"%s\"\n", argv[i]+20);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--duplicatewindow=", 18) && strlen(argv[i]) > 18) {
+            c->duplicate_window = parseTime(argv[i]+18);
+            if (c->duplicate_window <= 0) {
+                error("Not a valid time to ignore duplicates within. \"%s\"\n", argv[i]+18);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--metrics=", 10) && strlen(argv[i]) > 10) {
+            c->metrics = string(argv[i]+10);
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--metricsinterval=", 18) && strlen(argv[i]) > 18) {
+            c->metrics_interval = parseTime(argv[i]+18);
+            if (c->metrics_interval <= 0) {
+                error("Not a valid time between writing the metrics. \"%s\"\n", argv[i]+18);
+            }
+            i++;
+            continue;
+        }
         if (!strncmp(argv[i], "--usestdoutforlogging", 13)) {
             c->use_stderr_for_log = false;
             i++;
@@ -522,6 +554,15 @@ static shared_ptr<Configuration> parseNormalCommandLine(Configuration *c, int ar
             i++;
             continue;
         }
+        if (!strncmp(argv[i], "--streamshell=", 14)) {
+            string cmd = string(argv[i]+14);
+            if (cmd == "") {
+                error("The stream shell command cannot be empty.\n");
+            }
+            c->stream_shells.push_back(cmd);
+            i++;
+            continue;
+        }
         if (!strncmp(argv[i], "--metershell=", 13)) {
             string cmd = string(argv[i]+13);
             if (cmd == "") {
@@ -649,6 +690,46 @@ static shared_ptr<Configuration> parseNormalCommandLine(Configuration *c, int ar
             i++;
             continue;
         }
+        if (!strncmp(argv[i], "--decoderthreads=", 17)) {
+            c->decoder_threads = atoi(argv[i]+17);
+            if (c->decoder_threads < 0 || !isNumber(argv[i]+17)) {
+                error("Not a valid number of decoder threads. \"%s\"\n", argv[i]+17);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--shellworkers=", 15)) {
+            c->shell_workers = atoi(argv[i]+15);
+            if (c->shell_workers < 0 || !isNumber(argv[i]+15)) {
+                error("Not a valid number of shell workers. \"%s\"\n", argv[i]+15);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--shellqueue=", 13)) {
+            c->shell_queue = atoi(argv[i]+13);
+            if (c->shell_queue <= 0 || !isNumber(argv[i]+13)) {
+                error("Not a valid shell queue size. \"%s\"\n", argv[i]+13);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--shellcoalesce", 15)) {
+            if (argv[i][15] == 0 || !strcmp(argv[i]+15, "=true"))
+            {
+                c->shell_coalesce = true;
+            }
+            else if (!strcmp(argv[i]+15, "=false"))
+            {
+                c->shell_coalesce = false;
+            }
+            else
+            {
+                error("You must specify true or false after --shellcoalesce=\n");
+            }
+            i++;
+            continue;
+        }
         if (!strncmp(argv[i], "--alarmtimeout=", 15)) {
             c->alarm_timeout = parseTime(argv[i]+15);
             if (c->alarm_timeout <= 0) {
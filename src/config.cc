@@ -293,6 +293,49 @@ void handleIgnoreDuplicateTelegrams(Configuration *c, string value)
     }
 }
 
+void handleDuplicateCapacity(Configuration *c, string s)
+{
+    if (isNumber(s) && atoi(s.c_str()) > 0)
+    {
+        c->duplicate_capacity = atoi(s.c_str());
+    }
+    else
+    {
+        warning("duplicatecapacity must be a positive number, not \"%s\"\n", s.c_str());
+    }
+}
+
+void handleDuplicateWindow(Configuration *c, string s)
+{
+    int window = parseTime(s);
+    if (window > 0)
+    {
+        c->duplicate_window = window;
+    }
+    else
+    {
+        warning("duplicatewindow must be a time, eg 30s, not \"%s\"\n", s.c_str());
+    }
+}
+
+void handleMetrics(Configuration *c, string s)
+{
+    c->metrics = s;
+}
+
+void handleMetricsInterval(Configuration *c, string s)
+{
+    int interval = parseTime(s);
+    if (interval > 0)
+    {
+        c->metrics_interval = interval;
+    }
+    else
+    {
+        warning("metricsinterval must be a time, eg 15s, not \"%s\"\n", s.c_str());
+    }
+}
+
 void handleDetailedFirst(Configuration *c, string value)
 {
     if (value == "true")
@@ -324,6 +367,57 @@ void handleResetAfter(Configuration *c, string s)
     }
 }
 
+void handleDecoderThreads(Configuration *c, string s)
+{
+    if (isNumber(s))
+    {
+        c->decoder_threads = atoi(s.c_str());
+    }
+    else
+    {
+        warning("decoderthreads must be a number, not \"%s\"\n", s.c_str());
+    }
+}
+
+void handleShellWorkers(Configuration *c, string s)
+{
+    if (isNumber(s))
+    {
+        c->shell_workers = atoi(s.c_str());
+    }
+    else
+    {
+        warning("shellworkers must be a number, not \"%s\"\n", s.c_str());
+    }
+}
+
+void handleShellQueue(Configuration *c, string s)
+{
+    if (isNumber(s) && atoi(s.c_str()) > 0)
+    {
+        c->shell_queue = atoi(s.c_str());
+    }
+    else
+    {
+        warning("shellqueue must be a positive number, not \"%s\"\n", s.c_str());
+    }
+}
+
+void handleShellCoalesce(Configuration *c, string value)
+{
+    if (value == "true")
+    {
+        c->shell_coalesce = true;
+    }
+    else if (value == "false")
+    {
+        c->shell_coalesce = false;
+    }
+    else {
+        warning("shellcoalesce should be either true or false, not \"%s\"\n", value.c_str());
+    }
+}
+
 bool handleDeviceOrHex(Configuration *c, string devicefilehex)
 {
     bool invalid_hex = false;
@@ -663,6 +757,11 @@ void handleShell(Configuration *c, string cmdline)
     c->telegram_shells.push_back(cmdline);
 }
 
+void handleStreamShell(Configuration *c, string cmdline)
+{
+    c->stream_shells.push_back(cmdline);
+}
+
 void handleMeterShell(Configuration *c, string cmdline)
 {
     c->new_meter_shells.push_back(cmdline);
@@ -728,6 +827,10 @@ shared_ptr<Configuration> loadConfiguration(string root, ConfigOverrides overrid
         if (p.first == "loglevel") handleLoglevel(c, p.second);
         else if (p.first == "internaltesting") handleInternalTesting(c, p.second);
         else if (p.first == "ignoreduplicates") handleIgnoreDuplicateTelegrams(c, p.second);
+        else if (p.first == "duplicatecapacity") handleDuplicateCapacity(c, p.second);
+        else if (p.first == "duplicatewindow") handleDuplicateWindow(c, p.second);
+        else if (p.first == "metrics") handleMetrics(c, p.second);
+        else if (p.first == "metricsinterval") handleMetricsInterval(c, p.second);
         else if (p.first == "detailedfirst") handleDetailedFirst(c, p.second);
         else if (p.first == "device") handleDeviceOrHex(c, p.second);
         else if (p.first == "donotprobe") handleDoNotProbe(c, p.second);
@@ -749,6 +852,11 @@ shared_ptr<Configuration> loadConfiguration(string root, ConfigOverrides overrid
         else if (p.first == "selectfields") handleSelectedFields(c, p.second);
         else if (p.first == "shell") handleShell(c, p.second);
         else if (p.first == "resetafter") handleResetAfter(c, p.second);
+        else if (p.first == "decoderthreads") handleDecoderThreads(c, p.second);
+        else if (p.first == "shellworkers") handleShellWorkers(c, p.second);
+        else if (p.first == "shellqueue") handleShellQueue(c, p.second);
+        else if (p.first == "shellcoalesce") handleShellCoalesce(c, p.second);
+        else if (p.first == "streamshell") handleStreamShell(c, p.second);
         else if (p.first == "metershell") handleMeterShell(c, p.second);
         else if (p.first == "alarmshell") handleAlarmShell(c, p.second);
         else if (startsWith(p.first, "json_") ||
@@ -81,6 +81,7 @@ struct Configuration
     string analyze_driver {};
     string analyze_key {};
     bool analyze_verbose {};
+    bool analyze_batch {}; // Print a single line report with the best driver for each analyzed telegram.
     int analyze_profile {}; // If greater than 0, then run the handleTelegram call this number of times when analyzing.
     bool debug {};
     bool trace {};
@@ -97,6 +98,10 @@ struct Configuration
     bool use_logfile {};
     bool use_stderr_for_log = true; // Default is to use stderr for logging.
     bool ignore_duplicate_telegrams = true; // Default is to ignore duplicates.
+    int duplicate_capacity = 10; // Remember this many telegrams when ignoring duplicates.
+    int duplicate_window {}; // Only ignore duplicates seen within this many seconds, 0 means no limit.
+    std::string metrics; // Write the metrics in Prometheus text format to this file or unix socket.
+    int metrics_interval = 15; // Seconds between writing the metrics.
     bool detailed_first = false; // Print additional lines in telegram mapping back to driver field.
     std::string logfile;
     bool json {};
@@ -107,7 +112,12 @@ struct Configuration
     char separator { ';' };
     std::vector<std::string> telegram_shells;
     std::vector<std::string> new_meter_shells;
+    std::vector<std::string> stream_shells; // Started once, receives one json line per update on stdin.
     std::vector<std::string> alarm_shells;
+    int decoder_threads {}; // Decode the telegrams in this many threads, 0 means in the event loop thread.
+    int shell_workers {}; // Invoke the shells from this many worker threads, 0 means synchronously.
+    int shell_queue = 100; // Maximum number of queued shell invocations.
+    bool shell_coalesce {}; // Only invoke the latest queued shell for a meter.
     int alarm_timeout {}; // Maximum number of seconds between dongle receiving two telegrams.
     std::string alarm_expected_activity; // Only warn when within these time periods.
     bool exit_instead_of_alarm_ {};
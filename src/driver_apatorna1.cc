@@ -58,14 +58,16 @@ namespace
         vector<uchar>::iterator pos = frame.begin();
 
         // TODO: read specified key from input
-        vector<uchar> aes_key(16, 0);
+        uchar aes_key_bytes[16] = {};
+        AES_ctx aes_key;
+        AES_init_ctx(&aes_key, aes_key_bytes);
 
         int num_encrypted_bytes = 0;
         int num_not_encrypted_at_end = 0;
 
         t->tpl_acc = content[0]; //0xBB;
 
-        decrypt_TPL_AES_CBC_IV(t, frame, pos, aes_key, &num_encrypted_bytes, &num_not_encrypted_at_end);
+        decrypt_TPL_AES_CBC_IV(t, frame, pos, &aes_key, &num_encrypted_bytes, &num_not_encrypted_at_end);
 
         const int multiplier = pow(10, (frame.at(1) & 0b00110000) >> 4);
 
@@ -134,23 +134,120 @@ bool DriverDynamic::load(DriverInfo *di, const string &file_name, const char *co
 DriverDynamic::DriverDynamic(MeterInfo &mi, DriverInfo &di) :
     MeterCommonImplementation(mi, di), file_name_(di.getDynamicFileName())
 {
+    verbose("(driver) constructing driver %s from already loaded file %s\n",
+            di.name().str().c_str(),
+            fileName().c_str());
+
+    if (di.getDynamicFields())
+    {
+        addDynamicFields(*di.getDynamicFields());
+        return;
+    }
+
     XMQDoc *doc = NULL;
+    DynamicDriverFields *dfs = new DynamicDriverFields();
     try
     {
         doc = di.getDynamicDriver();
         assert(doc);
 
-        verbose("(driver) constructing driver %s from already loaded file %s\n",
-                di.name().str().c_str(),
-                fileName().c_str());
-
+        tmp_fields_ = dfs;
         xmqForeach(doc, "/driver/library/use", (XMQNodeCallback)add_use, this);
         xmqForeach(doc, "/driver/fields/field", (XMQNodeCallback)add_field, this);
+        // Only a driver without errors is stored, a broken driver reports its errors for every meter.
+        di.setDynamicFields(shared_ptr<const DynamicDriverFields>(dfs));
     }
     catch(...)
     {
         xmqFreeDoc(doc);
     }
+    addDynamicFields(*dfs);
+    if (!di.getDynamicFields()) delete dfs;
+}
+
+void DriverDynamic::addDynamicFields(const DynamicDriverFields &dfs)
+{
+    for (auto &name : dfs.library_uses)
+    {
+        bool ok = addOptionalLibraryFields(name);
+        if (!ok)
+        {
+            warning("(driver) error in %s, unknown library field: %s \n",
+                    fileName().c_str(),
+                    name.c_str());
+        }
+    }
+
+    for (auto &f : dfs.fields)
+    {
+        bool is_numeric = f.quantity != Quantity::Text;
+
+        if (is_numeric)
+        {
+            if (f.calculate == "")
+            {
+                addNumericFieldWithExtractor(
+                    f.name,
+                    f.info,
+                    f.properties,
+                    f.quantity,
+                    f.vif_scaling,
+                    f.dif_signedness,
+                    f.match,
+                    f.display_unit,
+                    f.force_scale
+                    );
+            }
+            else
+            {
+                if (!f.match.active)
+                {
+                    addNumericFieldWithCalculator(
+                        f.name,
+                        f.info,
+                        f.properties,
+                        f.quantity,
+                        f.calculate,
+                        f.display_unit
+                        );
+                }
+                else
+                {
+                    addNumericFieldWithCalculatorAndMatcher(
+                        f.name,
+                        f.info,
+                        f.properties,
+                        f.quantity,
+                        f.calculate,
+                        f.match,
+                        f.display_unit
+                        );
+                }
+            }
+        }
+        else
+        {
+            if (f.has_lookup)
+            {
+                addStringFieldWithExtractorAndLookup(
+                    f.name,
+                    f.info,
+                    f.properties,
+                    f.match,
+                    f.lookup
+                    );
+            }
+            else
+            {
+                addStringFieldWithExtractor(
+                    f.name,
+                    f.info,
+                    f.properties,
+                    f.match
+                    );
+            }
+        }
+    }
 }
 
 DriverDynamic::~DriverDynamic()
@@ -260,128 +357,59 @@ XMQProceed DriverDynamic::add_detect(XMQDoc *doc, XMQNode *detect, DriverInfo *d
 XMQProceed DriverDynamic::add_use(XMQDoc *doc, XMQNode *field, DriverDynamic *dd)
 {
     string name = xmqGetStringRel(doc, ".", field);
-    bool ok = dd->addOptionalLibraryFields(name);
-    if (!ok)
-    {
-        warning("(driver) error in %s, unknown library field: %s \n",
-                dd->fileName().c_str(),
-                name.c_str());
-    }
+    dd->tmp_fields_->library_uses.push_back(name);
 
     return XMQ_CONTINUE;
 }
 
 XMQProceed DriverDynamic::add_field(XMQDoc *doc, XMQNode *field, DriverDynamic *dd)
 {
+    DynamicField f;
+
     // The field name must be supplied without a unit ie total (not total_m3) since units are managed by wmbusmeters.
-    string name = check_field_name(xmqGetStringRel(doc, "name", field), dd);
+    f.name = check_field_name(xmqGetStringRel(doc, "name", field), dd);
 
     // The quantity ie Volume, gives the default unit (m3) for the field. The unit can be overriden with display_unit.
-    Quantity quantity = check_field_quantity(xmqGetStringRel(doc, "quantity", field), dd);
-
     // Text fields are either version strings or lookups from status bits.
     // All other fields are numeric, ie they have a unit. This also includes date and datetime.
-    bool is_numeric = quantity != Quantity::Text;
+    f.quantity = check_field_quantity(xmqGetStringRel(doc, "quantity", field), dd);
 
     // The vif scaling is by default Auto but can be overriden for pesky fields.
-    VifScaling vif_scaling = check_vif_scaling(xmqGetStringRel(doc, "vif_scaling", field), dd);
+    f.vif_scaling = check_vif_scaling(xmqGetStringRel(doc, "vif_scaling", field), dd);
 
     // The dif signedness is by default Signed but can be overriden for pesky fields.
-    DifSignedness dif_signedness = check_dif_signedness(xmqGetStringRel(doc, "dif_signedness", field), dd);
+    f.dif_signedness = check_dif_signedness(xmqGetStringRel(doc, "dif_signedness", field), dd);
 
     // The properties are by default empty but can be specified for specific fields.
-    PrintProperties properties = check_print_properties(xmqGetStringRel(doc, "attributes", field), dd);
+    f.properties = check_print_properties(xmqGetStringRel(doc, "attributes", field), dd);
 
     // The info fields explains what the value is for. Ie. is storage 1 the previous day or month value etc.
-    string info = check_field_info(xmqGetStringRel(doc, "info", field), dd);
+    f.info = check_field_info(xmqGetStringRel(doc, "info", field), dd);
 
     // The calculate formula is optional.
-    string calculate = check_calculate(xmqGetStringRel(doc, "calculate", field), dd);
+    f.calculate = check_calculate(xmqGetStringRel(doc, "calculate", field), dd);
 
     // The display unit is usually based on the quantity. But you can override it.
-    Unit display_unit = check_display_unit(xmqGetStringRel(doc, "display_unit", field), dd);
+    f.display_unit = check_display_unit(xmqGetStringRel(doc, "display_unit", field), dd);
 
     // A field can force a scale factor. Defaults to 1.0 but you can override
     // with 1.123 or 1/32 or 0.33333 or 3.14/2.5
-    double force_scale = check_force_scale(xmqGetStringRel(doc, "force_scale", field), dd);
+    f.force_scale = check_force_scale(xmqGetStringRel(doc, "force_scale", field), dd);
 
     // Now find all matchers.
-    FieldMatcher match = FieldMatcher::build();
-    dd->tmp_matcher_ = &match;
+    f.match = FieldMatcher::build();
+    dd->tmp_matcher_ = &f.match;
     int num_matches = xmqForeachRel(doc, "match", (XMQNodeCallback)add_match, dd, field);
     // Check if there were any matches at all, if not, then disable the matcher.
-    match.active = num_matches > 0;
+    f.match.active = num_matches > 0;
 
     // Now find all matchers.
-    Translate::Lookup lookup = Translate::Lookup();
-    dd->tmp_lookup_ = &lookup;
+    dd->tmp_lookup_ = &f.lookup;
     int num_lookups = xmqForeachRel(doc, "lookup", (XMQNodeCallback)add_lookup, dd, field);
+    f.has_lookup = num_lookups > 0;
+
+    dd->tmp_fields_->fields.push_back(f);
 
-    if (is_numeric)
-    {
-        if (calculate == "")
-        {
-            dd->addNumericFieldWithExtractor(
-                name,
-                info,
-                properties,
-                quantity,
-                vif_scaling,
-                dif_signedness,
-                match,
-                display_unit,
-                force_scale
-                );
-        }
-        else
-        {
-            if (!match.active)
-            {
-                dd->addNumericFieldWithCalculator(
-                    name,
-                    info,
-                    properties,
-                    quantity,
-                    calculate,
-                    display_unit
-                    );
-            }
-            else
-            {
-                dd->addNumericFieldWithCalculatorAndMatcher(
-                    name,
-                    info,
-                    properties,
-                    quantity,
-                    calculate,
-                    match,
-                    display_unit
-                    );
-            }
-        }
-    }
-    else
-    {
-        if (num_lookups > 0)
-        {
-            dd->addStringFieldWithExtractorAndLookup(
-                name,
-                info,
-                properties,
-                match,
-                lookup
-                );
-        }
-        else
-        {
-            dd->addStringFieldWithExtractor(
-                name,
-                info,
-                properties,
-                match
-                );
-        }
-    }
     return XMQ_CONTINUE;
 }
 
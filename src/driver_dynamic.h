@@ -20,6 +20,31 @@
 
 #include "meters_common_implementation.h"
 
+// A field of a dynamic driver, checked and parsed from the xmq.
+struct DynamicField
+{
+    string name;
+    string info;
+    PrintProperties properties { 0 };
+    Quantity quantity {};
+    VifScaling vif_scaling {};
+    DifSignedness dif_signedness {};
+    string calculate;
+    Unit display_unit {};
+    double force_scale { 1.0 };
+    FieldMatcher match;
+    Translate::Lookup lookup;
+    bool has_lookup {};
+};
+
+// The fields of a dynamic driver are compiled from the xmq when the first meter
+// is created and are then stored in the DriverInfo and shared by all meters.
+struct DynamicDriverFields
+{
+    vector<string> library_uses;
+    vector<DynamicField> fields;
+};
+
 struct DriverDynamic : public virtual MeterCommonImplementation
 {
     DriverDynamic(MeterInfo &mi, DriverInfo &di);
@@ -38,7 +63,10 @@ struct DriverDynamic : public virtual MeterCommonImplementation
 
 private:
 
+    void addDynamicFields(const DynamicDriverFields &dfs);
+
     string file_name_;
+    DynamicDriverFields *tmp_fields_;
     FieldMatcher *tmp_matcher_;
     Translate::Lookup *tmp_lookup_;
     Translate::Rule *tmp_rule_;
@@ -160,30 +160,31 @@ namespace
         if (it != t->dv_entries.end()) {
             vector<uchar> v;
             auto entry = it->second.second;
-            hex2bin(entry.value.substr(0, 8), &v);
+            std::string value = entry.hexValue();
+            hex2bin(value.substr(0, 8), &v);
             // FIXME PROBLEM
             Address a;
             a.id = tostrprintf("%02x%02x%02x%02x", v[3], v[2], v[1], v[0]);
             t->addresses.push_back(a);
-            std::string info = "*** " + entry.value.substr(0, 8) + " tpl-id (" + t->addresses.back().id + ")";
+            std::string info = "*** " + value.substr(0, 8) + " tpl-id (" + t->addresses.back().id + ")";
             t->addSpecialExplanation(entry.offset, 4, KindOfData::CONTENT, Understanding::FULL, info.c_str());
 
             v.clear();
-            hex2bin(entry.value.substr(8, 4), &v);
+            hex2bin(value.substr(8, 4), &v);
             uint16_t tpl_mfct = *(uint16_t *) (&v[0]);
-            info = "*** " + entry.value.substr(8, 4) + " tpl-mfct (" + manufacturerFlag(tpl_mfct) + ")";
+            info = "*** " + value.substr(8, 4) + " tpl-mfct (" + manufacturerFlag(tpl_mfct) + ")";
             t->addSpecialExplanation(entry.offset + 4, 2, KindOfData::PROTOCOL, Understanding::FULL, info.c_str());
 
             v.clear();
-            hex2bin(entry.value.substr(12, 2), &v);
+            hex2bin(value.substr(12, 2), &v);
             uint8_t tpl_version = v[0];
-            info = "*** " + entry.value.substr(12, 2) + " tpl-version";
+            info = "*** " + value.substr(12, 2) + " tpl-version";
             t->addSpecialExplanation(entry.offset + 6, 1, KindOfData::PROTOCOL, Understanding::FULL, info.c_str());
 
             v.clear();
-            hex2bin(entry.value.substr(14, 2), &v);
+            hex2bin(value.substr(14, 2), &v);
             uint8_t tpl_type = v[0];
-            info = "*** " + entry.value.substr(14, 2) + " tpl-type (" + mediaType(v[0], tpl_mfct) + ")";
+            info = "*** " + value.substr(14, 2) + " tpl-type (" + mediaType(v[0], tpl_mfct) + ")";
             t->addSpecialExplanation(entry.offset + 7, 1, KindOfData::PROTOCOL, Understanding::FULL, info.c_str());
 
             t->tpl_id_found = true;
@@ -195,7 +196,7 @@ namespace
         it = t->dv_entries.find("0DFF5F");
         if (it != t->dv_entries.end()) {
             DVEntry entry = it->second.second;
-            if (entry.value.length() == 53 * 2) {
+            if (entry.value_bytes.size() == 53) {
                 qdsExtractWalkByField(t, this, entry, 24, 8, "0C05", "total_energy_consumption", Quantity::Energy);
                 qdsExtractWalkByField(t, this, entry, 32, 4, "426C", "last_year_date", Quantity::Text);
                 qdsExtractWalkByField(t, this, entry, 36, 8, "4C05", "last_year_energy_consumption", Quantity::Energy);
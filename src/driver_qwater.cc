@@ -148,7 +148,7 @@ void Driver::processContent(Telegram *t) {
         return;
     }
     DVEntry entry = it->second.second;
-    if (entry.value.length() != 53 * 2) {
+    if (entry.value_bytes.size() != 53) {
         return;
     }
     qdsExtractWalkByField(t, this, entry, 24, 8, "0C13", "total", Quantity::Volume);
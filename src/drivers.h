@@ -18,6 +18,8 @@
 #ifndef DRIVERS_H_
 #define DRIVERS_H_
 
+#include"util.h"
+
 #include<string>
 
 void prepareBuiltinDrivers();
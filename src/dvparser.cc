@@ -23,6 +23,7 @@
 #include<cmath>
 #include<math.h>
 #include<memory.h>
+#include<pthread.h>
 #include<limits>
 
 // The parser should not crash on invalid data, but yeah, when I
@@ -152,15 +153,21 @@ LIST_OF_VIF_RANGES
 }
 
 map<uint16_t,string> hash_to_format_;
+// Telegrams can be parsed by several decoder threads at the same time.
+static pthread_mutex_t hash_to_format_lock_ = PTHREAD_MUTEX_INITIALIZER;
 
 bool loadFormatBytesFromSignature(uint16_t format_signature, vector<uchar> *format_bytes)
 {
-    if (hash_to_format_.count(format_signature) > 0) {
+    pthread_mutex_lock(&hash_to_format_lock_);
+    auto i = hash_to_format_.find(format_signature);
+    if (i != hash_to_format_.end()) {
         debug("(dvparser) found remembered format for hash %x\n", format_signature);
         // Return the proper hash!
-        hex2bin(hash_to_format_[format_signature], format_bytes);
+        hex2bin(i->second, format_bytes);
+        pthread_mutex_unlock(&hash_to_format_lock_);
         return true;
     }
+    pthread_mutex_unlock(&hash_to_format_lock_);
     // Unknown format signature.
     return false;
 }
@@ -533,7 +540,7 @@ bool parseDV(Telegram *t,
             datalen = remaining-1;
         }
 
-        string value = bin2hex(data, data_end, datalen);
+        vector<uchar> value(data, data+std::max(0, std::min(datalen, (int)std::distance(data, data_end))));
         int offset = start_parse_here+data-data_start;
 
         (*dv_entries)[key] = { offset, DVEntry(offset,
@@ -556,10 +563,12 @@ bool parseDV(Telegram *t,
 
         assert(key == dve->dif_vif_key.str());
 
-        if (value.length() > 0) {
+        if (value.size() > 0) {
+            // Only render the hex when someone is going to look at it.
+            string hex = t->explanationsEnabled() ? dve->hexValue() : "";
             // This call increments data with datalen.
-            t->addExplanationAndIncrementPos(data, datalen, KindOfData::CONTENT, Understanding::NONE, "%s", value.c_str());
-            DEBUG_PARSER("(dvparser debug) data \"%s\"\n\n", value.c_str());
+            t->addExplanationAndIncrementPos(data, datalen, KindOfData::CONTENT, Understanding::NONE, "%s", hex.c_str());
+            DEBUG_PARSER("(dvparser debug) data \"%s\"\n\n", hex.c_str());
         }
         if (remaining == datalen || data == databytes.end()) {
             // We are done here!
@@ -571,10 +580,12 @@ bool parseDV(Telegram *t,
     uint16_t hash = crc16_EN13757(safeButUnsafeVectorPtr(format_bytes), format_bytes.size());
 
     if (data_has_difvifs) {
+        pthread_mutex_lock(&hash_to_format_lock_);
         if (hash_to_format_.count(hash) == 0) {
             hash_to_format_[hash] = format_string;
             debug("(dvparser) found new format \"%s\" with hash %x, remembering!\n", format_string.c_str(), hash);
         }
+        pthread_mutex_unlock(&hash_to_format_lock_);
     }
 
     return true;
@@ -693,8 +704,7 @@ bool extractDVuint8(map<string,pair<int,DVEntry>> *dv_entries,
 
     pair<int,DVEntry>&  p = (*dv_entries)[key];
     *offset = p.first;
-    vector<uchar> v;
-    hex2bin(p.second.value, &v);
+    vector<uchar> &v = p.second.value_bytes;
 
     *value = v[0];
     return true;
@@ -714,8 +724,7 @@ bool extractDVuint16(map<string,pair<int,DVEntry>> *dv_entries,
 
     pair<int,DVEntry>&  p = (*dv_entries)[key];
     *offset = p.first;
-    vector<uchar> v;
-    hex2bin(p.second.value, &v);
+    vector<uchar> &v = p.second.value_bytes;
 
     *value = v[1]<<8 | v[0];
     return true;
@@ -735,8 +744,7 @@ bool extractDVuint24(map<string,pair<int,DVEntry>> *dv_entries,
 
     pair<int,DVEntry>&  p = (*dv_entries)[key];
     *offset = p.first;
-    vector<uchar> v;
-    hex2bin(p.second.value, &v);
+    vector<uchar> &v = p.second.value_bytes;
 
     *value = v[2] << 16 | v[1]<<8 | v[0];
     return true;
@@ -756,8 +764,7 @@ bool extractDVuint32(map<string,pair<int,DVEntry>> *dv_entries,
 
     pair<int,DVEntry>&  p = (*dv_entries)[key];
     *offset = p.first;
-    vector<uchar> v;
-    hex2bin(p.second.value, &v);
+    vector<uchar> &v = p.second.value_bytes;
 
     *value = (uint32_t(v[3]) << 24) |  (uint32_t(v[2]) << 16) | (uint32_t(v[1])<<8) | uint32_t(v[0]);
     return true;
@@ -779,7 +786,7 @@ bool extractDVdouble(map<string,pair<int,DVEntry>> *dv_entries,
     pair<int,DVEntry>&  p = (*dv_entries)[key];
     *offset = p.first;
 
-    if (p.second.value.length() == 0) {
+    if (p.second.value_bytes.size() == 0) {
         verbose("(dvparser) warning: key found but no data  \"%s\"\n", key.c_str());
         *offset = 0;
         *value = 0;
@@ -789,24 +796,57 @@ bool extractDVdouble(map<string,pair<int,DVEntry>> *dv_entries,
     return p.second.extractDouble(value, auto_scale, force_unsigned);
 }
 
-bool checkSizeHex(size_t expected_len, DifVifKey &dvk, string &v)
+bool checkSize(size_t expected_len, DifVifKey &dvk, vector<uchar> &v)
 {
-    if (v.length() == expected_len) return true;
+    if (v.size() == expected_len) return true;
 
     warning("(dvparser) bad decode since difvif %s expected %d hex chars but got \"%s\"\n",
-            dvk.str().c_str(), expected_len, v.c_str());
+            dvk.str().c_str(), (int)expected_len*2, bin2hex(v).c_str());
     return false;
 }
 
-bool is_all_F(string &v)
+bool is_all_FF(vector<uchar> &v)
 {
-    for (size_t i = 0; i < v.length(); ++i)
+    for (size_t i = 0; i < v.size(); ++i)
     {
-        if (v[i] != 'F') return false;
+        if (v[i] != 0xff) return false;
     }
     return true;
 }
 
+// Little endian binary integer, v.size() bytes long.
+uint64_t decodeBinary(vector<uchar> &v)
+{
+    uint64_t raw = 0;
+    for (size_t i = v.size(); i > 0; --i)
+    {
+        raw = (raw << 8) | v[i-1];
+    }
+    return raw;
+}
+
+// A non-decimal nibble decodes to what its hex char minus '0' used to give, ie A=17.
+static int bcdDigit(int nibble)
+{
+    return nibble <= 9 ? nibble : nibble + 7;
+}
+
+// Little endian bcd, 74140000 -> 00001474. The most significant nibble
+// is F for negative values and then counts as a zero.
+uint64_t decodeBCD(vector<uchar> &v, bool *negate)
+{
+    uint64_t raw = 0;
+    *negate = false;
+    for (size_t i = v.size(); i > 0; --i)
+    {
+        int hi = v[i-1] >> 4;
+        int lo = v[i-1] & 0xf;
+        if (i == v.size() && hi == 0xf) { *negate = true; hi = 0; }
+        raw = raw*100 + bcdDigit(hi)*10 + bcdDigit(lo);
+    }
+    return raw;
+}
+
 bool DVEntry::extractDouble(double *out, bool auto_scale, bool force_unsigned)
 {
     int t = dif_vif_key.dif() & 0xf;
@@ -827,56 +867,16 @@ bool DVEntry::extractDouble(double *out, bool auto_scale, bool force_unsigned)
         t == 0x6 || // 48 Bit Integer/Binary
         t == 0x7)   // 64 Bit Integer/Binary
     {
-        vector<uchar> v;
-        hex2bin(value, &v);
-        uint64_t raw = 0;
+        int len = difLenBytes(t);
+        if (!checkSize(len, dif_vif_key, value_bytes)) return false;
+        uint64_t raw = decodeBinary(value_bytes);
         bool negate = false;
         uint64_t negate_mask = 0;
-        if (t == 0x1) {
-            if (!checkSizeHex(2, dif_vif_key, value)) return false;
-            assert(v.size() == 1);
-            raw = v[0];
-            if (!force_unsigned && (raw & (uint64_t)0x80UL) != 0) { negate = true; negate_mask = ~((uint64_t)0)<<8; }
-        } else if (t == 0x2) {
-            if (!checkSizeHex(4, dif_vif_key, value)) return false;
-            assert(v.size() == 2);
-            raw = v[1]*256 + v[0];
-            if (!force_unsigned && (raw & (uint64_t)0x8000UL) != 0) { negate = true; negate_mask = ~((uint64_t)0)<<16; }
-        } else if (t == 0x3) {
-            if (!checkSizeHex(6, dif_vif_key, value)) return false;
-            assert(v.size() == 3);
-            raw = v[2]*256*256 + v[1]*256 + v[0];
-            if (!force_unsigned && (raw & (uint64_t)0x800000UL) != 0) { negate = true; negate_mask = ~((uint64_t)0)<<24; }
-        } else if (t == 0x4) {
-            if (!checkSizeHex(8, dif_vif_key, value)) return false;
-            assert(v.size() == 4);
-            raw = ((unsigned int)v[3])*256*256*256
-                + ((unsigned int)v[2])*256*256
-                + ((unsigned int)v[1])*256
-                + ((unsigned int)v[0]);
-            if (!force_unsigned && (raw & (uint64_t)0x80000000UL) != 0) { negate = true; negate_mask = ~((uint64_t)0)<<32; }
-        } else if (t == 0x6) {
-            if (!checkSizeHex(12, dif_vif_key, value)) return false;
-            assert(v.size() == 6);
-            raw = ((uint64_t)v[5])*256*256*256*256*256
-                + ((uint64_t)v[4])*256*256*256*256
-                + ((uint64_t)v[3])*256*256*256
-                + ((uint64_t)v[2])*256*256
-                + ((uint64_t)v[1])*256
-                + ((uint64_t)v[0]);
-            if (!force_unsigned && (raw & (uint64_t)0x800000000000UL) != 0) { negate = true; negate_mask = ~((uint64_t)0)<<48; }
-        } else if (t == 0x7) {
-            if (!checkSizeHex(16, dif_vif_key, value)) return false;
-            assert(v.size() == 8);
-            raw = ((uint64_t)v[7])*256*256*256*256*256*256*256
-                + ((uint64_t)v[6])*256*256*256*256*256*256
-                + ((uint64_t)v[5])*256*256*256*256*256
-                + ((uint64_t)v[4])*256*256*256*256
-                + ((uint64_t)v[3])*256*256*256
-                + ((uint64_t)v[2])*256*256
-                + ((uint64_t)v[1])*256
-                + ((uint64_t)v[0]);
-            if (!force_unsigned && (raw & (uint64_t)0x8000000000000000UL) != 0) { negate = true; negate_mask = 0; }
+        uint64_t sign_bit = ((uint64_t)1) << (len*8-1);
+        if (!force_unsigned && (raw & sign_bit) != 0)
+        {
+            negate = true;
+            negate_mask = len < 8 ? ~((uint64_t)0) << (len*8) : 0;
         }
         double scale = 1.0;
         double draw = (double)raw;
@@ -896,48 +896,14 @@ bool DVEntry::extractDouble(double *out, bool auto_scale, bool force_unsigned)
     {
         // Negative BCD values are always visible in bcd. I.e. they are always signed.
         // Ignore assumption on signedness.
-        // 74140000 -> 00001474
-        string& v = value;
-        uint64_t raw = 0;
-        bool negate = false;
-
-        if (is_all_F(v))
+        if (is_all_FF(value_bytes))
         {
             *out = std::nan("");
             return false;
         }
-        if (t == 0x9) {
-            if (!checkSizeHex(2, dif_vif_key, v)) return false;
-            if (v[0] == 'F') { negate = true; v[0] = '0'; }
-            raw = (v[0]-'0')*10 + (v[1]-'0');
-        } else if (t ==  0xA) {
-            if (!checkSizeHex(4, dif_vif_key, v)) return false;
-            if (v[2] == 'F') { negate = true; v[2] = '0'; }
-            raw = (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
-                + (v[0]-'0')*10 + (v[1]-'0');
-        } else if (t ==  0xB) {
-            if (!checkSizeHex(6, dif_vif_key, v)) return false;
-            if (v[4] == 'F') { negate = true; v[4] = '0'; }
-            raw = (v[4]-'0')*10*10*10*10*10 + (v[5]-'0')*10*10*10*10
-                + (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
-                + (v[0]-'0')*10 + (v[1]-'0');
-        } else if (t ==  0xC) {
-            if (!checkSizeHex(8, dif_vif_key, v)) return false;
-            if (v[6] == 'F') { negate = true; v[6] = '0'; }
-            raw = (v[6]-'0')*10*10*10*10*10*10*10 + (v[7]-'0')*10*10*10*10*10*10
-                + (v[4]-'0')*10*10*10*10*10 + (v[5]-'0')*10*10*10*10
-                + (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
-                + (v[0]-'0')*10 + (v[1]-'0');
-        } else if (t ==  0xE) {
-            if (!checkSizeHex(12, dif_vif_key, v)) return false;
-            if (v[10] == 'F') { negate = true; v[10] = '0'; }
-            raw =(v[10]-'0')*10*10*10*10*10*10*10*10*10*10*10 + (v[11]-'0')*10*10*10*10*10*10*10*10*10*10
-                + (v[8]-'0')*10*10*10*10*10*10*10*10*10 + (v[9]-'0')*10*10*10*10*10*10*10*10
-                + (v[6]-'0')*10*10*10*10*10*10*10 + (v[7]-'0')*10*10*10*10*10*10
-                + (v[4]-'0')*10*10*10*10*10 + (v[5]-'0')*10*10*10*10
-                + (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
-                + (v[0]-'0')*10 + (v[1]-'0');
-        }
+        if (!checkSize(difLenBytes(t), dif_vif_key, value_bytes)) return false;
+        bool negate = false;
+        uint64_t raw = decodeBCD(value_bytes, &negate);
         double scale = 1.0;
         double draw = (double)raw;
         if (negate)
@@ -950,10 +916,8 @@ bool DVEntry::extractDouble(double *out, bool auto_scale, bool force_unsigned)
     else
     if (t == 0x5) // 32 Bit Real
     {
-        vector<uchar> v;
-        hex2bin(value, &v);
-        if (!checkSizeHex(8, dif_vif_key, value)) return false;
-        assert(v.size() == 4);
+        vector<uchar> &v = value_bytes;
+        if (!checkSize(4, dif_vif_key, v)) return false;
         RealConversion rc;
         rc.i = v[3]<<24 | v[2]<<16 | v[1]<<8 | v[0];
 
@@ -990,7 +954,7 @@ bool extractDVlong(map<string,pair<int,DVEntry>> *dv_entries,
     pair<int,DVEntry>&  p = (*dv_entries)[key];
     *offset = p.first;
 
-    if (p.second.value.length() == 0) {
+    if (p.second.value_bytes.size() == 0) {
         verbose("(dvparser) warning: key found but no data  \"%s\"\n", key.c_str());
         *offset = 0;
         *out = 0;
@@ -1010,50 +974,8 @@ bool DVEntry::extractLong(uint64_t *out)
         t == 0x6 || // 48 Bit Integer/Binary
         t == 0x7)   // 64 Bit Integer/Binary
     {
-        vector<uchar> v;
-        hex2bin(value, &v);
-        uint64_t raw = 0;
-        if (t == 0x1) {
-            if (!checkSizeHex(2, dif_vif_key, value)) return false;
-            assert(v.size() == 1);
-            raw = v[0];
-        } else if (t == 0x2) {
-            if (!checkSizeHex(4, dif_vif_key, value)) return false;
-            assert(v.size() == 2);
-            raw = v[1]*256 + v[0];
-        } else if (t == 0x3) {
-            if (!checkSizeHex(6, dif_vif_key, value)) return false;
-            assert(v.size() == 3);
-            raw = v[2]*256*256 + v[1]*256 + v[0];
-        } else if (t == 0x4) {
-            if (!checkSizeHex(8, dif_vif_key, value)) return false;
-            assert(v.size() == 4);
-            raw = ((unsigned int)v[3])*256*256*256
-                + ((unsigned int)v[2])*256*256
-                + ((unsigned int)v[1])*256
-                + ((unsigned int)v[0]);
-        } else if (t == 0x6) {
-            if (!checkSizeHex(12, dif_vif_key, value)) return false;
-            assert(v.size() == 6);
-            raw = ((uint64_t)v[5])*256*256*256*256*256
-                + ((uint64_t)v[4])*256*256*256*256
-                + ((uint64_t)v[3])*256*256*256
-                + ((uint64_t)v[2])*256*256
-                + ((uint64_t)v[1])*256
-                + ((uint64_t)v[0]);
-        } else if (t == 0x7) {
-            if (!checkSizeHex(16, dif_vif_key, value)) return false;
-            assert(v.size() == 8);
-            raw = ((uint64_t)v[7])*256*256*256*256*256*256*256
-                + ((uint64_t)v[6])*256*256*256*256*256*256
-                + ((uint64_t)v[5])*256*256*256*256*256
-                + ((uint64_t)v[4])*256*256*256*256
-                + ((uint64_t)v[3])*256*256*256
-                + ((uint64_t)v[2])*256*256
-                + ((uint64_t)v[1])*256
-                + ((uint64_t)v[0]);
-        }
-        *out = raw;
+        if (!checkSize(difLenBytes(t), dif_vif_key, value_bytes)) return false;
+        *out = decodeBinary(value_bytes);
     }
     else
     if (t == 0x9 || // 2 digit BCD
@@ -1062,51 +984,13 @@ bool DVEntry::extractLong(uint64_t *out)
         t == 0xC || // 8 digit BCD
         t == 0xE)   // 12 digit BCD
     {
-        // 74140000 -> 00001474
-        string& v = value;
-        if (is_all_F(v))
+        if (is_all_FF(value_bytes))
         {
             return false;
         }
-        uint64_t raw = 0;
+        if (!checkSize(difLenBytes(t), dif_vif_key, value_bytes)) return false;
         bool negate = false;
-        if (t == 0x9) {
-            if (!checkSizeHex(2, dif_vif_key, value)) return false;
-            if (v[0] == 'F') { negate = true; v[0] = '0'; }
-            assert(v.size() == 2);
-            raw = (v[0]-'0')*10 + (v[1]-'0');
-        } else if (t ==  0xA) {
-            if (!checkSizeHex(4, dif_vif_key, value)) return false;
-            if (v[2] == 'F') { negate = true; v[2] = '0'; }
-            assert(v.size() == 4);
-            raw = (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
-                + (v[0]-'0')*10 + (v[1]-'0');
-        } else if (t ==  0xB) {
-            if (!checkSizeHex(6, dif_vif_key, value)) return false;
-            if (v[4] == 'F') { negate = true; v[4] = '0'; }
-            assert(v.size() == 6);
-            raw = (v[4]-'0')*10*10*10*10*10 + (v[5]-'0')*10*10*10*10
-                + (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
-                + (v[0]-'0')*10 + (v[1]-'0');
-        } else if (t ==  0xC) {
-            if (!checkSizeHex(8, dif_vif_key, value)) return false;
-            if (v[6] == 'F') { negate = true; v[6] = '0'; }
-            assert(v.size() == 8);
-            raw = (v[6]-'0')*10*10*10*10*10*10*10 + (v[7]-'0')*10*10*10*10*10*10
-                + (v[4]-'0')*10*10*10*10*10 + (v[5]-'0')*10*10*10*10
-                + (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
-                + (v[0]-'0')*10 + (v[1]-'0');
-        } else if (t ==  0xE) {
-            if (!checkSizeHex(12, dif_vif_key, value)) return false;
-            if (v[10] == 'F') { negate = true; v[10] = '0'; }
-            assert(v.size() == 12);
-            raw =(v[10]-'0')*10*10*10*10*10*10*10*10*10*10*10 + (v[11]-'0')*10*10*10*10*10*10*10*10*10*10
-                + (v[8]-'0')*10*10*10*10*10*10*10*10*10 + (v[9]-'0')*10*10*10*10*10*10*10*10
-                + (v[6]-'0')*10*10*10*10*10*10*10 + (v[7]-'0')*10*10*10*10*10*10
-                + (v[4]-'0')*10*10*10*10*10 + (v[5]-'0')*10*10*10*10
-                + (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
-                + (v[0]-'0')*10 + (v[1]-'0');
-        }
+        uint64_t raw = decodeBCD(value_bytes, &negate);
 
         if (negate)
         {
@@ -1135,7 +1019,7 @@ bool extractDVHexString(map<string,pair<int,DVEntry>> *dv_entries,
     }
     pair<int,DVEntry>&  p = (*dv_entries)[key];
     *offset = p.first;
-    *value = p.second.value;
+    *value = p.second.hexValue();
 
     return true;
 }
@@ -1161,7 +1045,7 @@ bool DVEntry::extractReadableString(string *out)
 {
     int t = dif_vif_key.dif() & 0xf;
 
-    string v = value;
+    string v = hexValue();
 
     if (t == 0x1 || // 8 Bit Integer/Binary
         t == 0x2 || // 16 Bit Integer/Binary
@@ -1286,8 +1170,7 @@ bool DVEntry::extractDate(struct tm *out)
     memset(out, 0, sizeof(*out));
     out->tm_isdst = -1; // Figure out the dst automatically!
 
-    vector<uchar> v;
-    hex2bin(value, &v);
+    vector<uchar> &v = value_bytes;
 
     bool ok = true;
     if (v.size() == 2) {
@@ -1312,7 +1195,7 @@ bool DVEntry::extractDate(struct tm *out)
     return ok;
 }
 
-bool FieldMatcher::matches(DVEntry &dv_entry)
+bool FieldMatcher::matches(DVEntry &dv_entry) const
 {
     if (!active) return false;
 
@@ -1429,7 +1312,7 @@ MeasurementType toMeasurementType(const char *s)
     return MeasurementType::Unknown;
 }
 
-string FieldMatcher::str()
+string FieldMatcher::str() const
 {
     string s = "";
 
@@ -1494,6 +1377,31 @@ string FieldMatcher::str()
     return s;
 }
 
+bool FieldMatcher::operator==(const FieldMatcher &fm) const
+{
+    return active == fm.active &&
+        match_dif_vif_key == fm.match_dif_vif_key &&
+        dif_vif_key == fm.dif_vif_key &&
+        match_measurement_type == fm.match_measurement_type &&
+        measurement_type == fm.measurement_type &&
+        match_vif_range == fm.match_vif_range &&
+        vif_range == fm.vif_range &&
+        match_vif_raw == fm.match_vif_raw &&
+        vif_raw == fm.vif_raw &&
+        vif_combinables == fm.vif_combinables &&
+        vif_combinables_raw == fm.vif_combinables_raw &&
+        match_storage_nr == fm.match_storage_nr &&
+        storage_nr_from == fm.storage_nr_from &&
+        storage_nr_to == fm.storage_nr_to &&
+        match_tariff_nr == fm.match_tariff_nr &&
+        tariff_nr_from == fm.tariff_nr_from &&
+        tariff_nr_to == fm.tariff_nr_to &&
+        match_subunit_nr == fm.match_subunit_nr &&
+        subunit_nr_from == fm.subunit_nr_from &&
+        subunit_nr_to == fm.subunit_nr_to &&
+        index_nr == fm.index_nr;
+}
+
 DVEntryCounterType toDVEntryCounterType(const std::string &s)
 {
     if (s == "storage_counter") return DVEntryCounterType::STORAGE_COUNTER;
@@ -235,12 +235,12 @@ struct DifVifKey
     DifVifKey(std::string key) : key_(key) {
         extractDV(key, &dif_, &vif_, &has_difes_, &has_vifes_);
     }
-    std::string str() { return key_; }
-    bool operator==(DifVifKey &dvk) { return key_ == dvk.key_; }
-    uchar dif() { return dif_; }
-    int vif() { return vif_; }
-    bool hasDifes() { return has_difes_; }
-    bool hasVifes() { return has_vifes_; }
+    std::string str() const { return key_; }
+    bool operator==(const DifVifKey &dvk) const { return key_ == dvk.key_; }
+    uchar dif() const { return dif_; }
+    int vif() const { return vif_; }
+    bool hasDifes() const { return has_difes_; }
+    bool hasVifes() const { return has_vifes_; }
 
 private:
 
@@ -258,8 +258,8 @@ static DifVifKey NoDifVifKey = DifVifKey("");
 struct Vif
 {
     Vif(int n) : nr_(n) {}
-    int intValue() { return nr_; }
-    bool operator==(Vif s) { return nr_ == s.nr_; }
+    int intValue() const { return nr_; }
+    bool operator==(Vif s) const { return nr_ == s.nr_; }
 
 private:
     int nr_;
@@ -281,11 +281,11 @@ const char *toString(DVEntryCounterType ct);
 struct StorageNr
 {
     StorageNr(int n) : nr_(n) {}
-    int intValue() { return nr_; }
-    bool operator==(StorageNr s) { return nr_ == s.nr_; }
-    bool operator!=(StorageNr s) { return nr_ != s.nr_; }
-    bool operator>=(StorageNr s) { return nr_ >= s.nr_; }
-    bool operator<=(StorageNr s) { return nr_ <= s.nr_; }
+    int intValue() const { return nr_; }
+    bool operator==(StorageNr s) const { return nr_ == s.nr_; }
+    bool operator!=(StorageNr s) const { return nr_ != s.nr_; }
+    bool operator>=(StorageNr s) const { return nr_ >= s.nr_; }
+    bool operator<=(StorageNr s) const { return nr_ <= s.nr_; }
 
 private:
     int nr_;
@@ -296,11 +296,11 @@ static StorageNr AnyStorageNr = StorageNr(-1);
 struct TariffNr
 {
     TariffNr(int n) : nr_(n) {}
-    int intValue() { return nr_; }
-    bool operator==(TariffNr s) { return nr_ == s.nr_; }
-    bool operator!=(TariffNr s) { return nr_ != s.nr_; }
-    bool operator>=(TariffNr s) { return nr_ >= s.nr_; }
-    bool operator<=(TariffNr s) { return nr_ <= s.nr_; }
+    int intValue() const { return nr_; }
+    bool operator==(TariffNr s) const { return nr_ == s.nr_; }
+    bool operator!=(TariffNr s) const { return nr_ != s.nr_; }
+    bool operator>=(TariffNr s) const { return nr_ >= s.nr_; }
+    bool operator<=(TariffNr s) const { return nr_ <= s.nr_; }
 
 private:
     int nr_;
@@ -311,11 +311,11 @@ static TariffNr AnyTariffNr = TariffNr(-1);
 struct SubUnitNr
 {
     SubUnitNr(int n) : nr_(n) {}
-    int intValue() { return nr_; }
-    bool operator==(SubUnitNr s) { return nr_ == s.nr_; }
-    bool operator!=(SubUnitNr s) { return nr_ != s.nr_; }
-    bool operator>=(SubUnitNr s) { return nr_ >= s.nr_; }
-    bool operator<=(SubUnitNr s) { return nr_ <= s.nr_; }
+    int intValue() const { return nr_; }
+    bool operator==(SubUnitNr s) const { return nr_ == s.nr_; }
+    bool operator!=(SubUnitNr s) const { return nr_ != s.nr_; }
+    bool operator>=(SubUnitNr s) const { return nr_ >= s.nr_; }
+    bool operator<=(SubUnitNr s) const { return nr_ <= s.nr_; }
 
 private:
     int nr_;
@@ -324,9 +324,9 @@ private:
 struct IndexNr
 {
     IndexNr(int n) : nr_(n) {}
-    int intValue() { return nr_; }
-    bool operator==(IndexNr s) { return nr_ == s.nr_; }
-    bool operator!=(IndexNr s) { return nr_ != s.nr_; }
+    int intValue() const { return nr_; }
+    bool operator==(IndexNr s) const { return nr_ == s.nr_; }
+    bool operator!=(IndexNr s) const { return nr_ != s.nr_; }
 
 private:
     int nr_;
@@ -347,7 +347,7 @@ struct DVEntry
     StorageNr storage_nr;
     TariffNr tariff_nr;
     SubUnitNr subunit_nr;
-    std::string value;
+    std::vector<uchar> value_bytes; // The raw data bytes, use hexValue() to get them as a hex string.
 
     DVEntry(int off,
             DifVifKey dvk,
@@ -358,7 +358,7 @@ struct DVEntry
             StorageNr st,
             TariffNr ta,
             SubUnitNr su,
-            std::string &val) :
+            const std::vector<uchar> &val) :
         offset(off),
         dif_vif_key(dvk),
         measurement_type(mt),
@@ -368,10 +368,34 @@ struct DVEntry
         storage_nr(st),
         tariff_nr(ta),
         subunit_nr(su),
-        value(val)
+        value_bytes(val)
     {
     }
 
+    // Used by drivers that construct entries from manufacturer specific data as hex.
+    DVEntry(int off,
+            DifVifKey dvk,
+            MeasurementType mt,
+            Vif vi,
+            std::set<VIFCombinable> vc,
+            std::set<uint16_t> vc_raw,
+            StorageNr st,
+            TariffNr ta,
+            SubUnitNr su,
+            const std::string &hex) :
+        offset(off),
+        dif_vif_key(dvk),
+        measurement_type(mt),
+        vif(vi),
+        combinable_vifs(vc),
+        combinable_vifs_raw(vc_raw),
+        storage_nr(st),
+        tariff_nr(ta),
+        subunit_nr(su)
+    {
+        hex2bin(hex, &value_bytes);
+    }
+
     DVEntry() :
         offset(999999),
         dif_vif_key("????"),
@@ -379,8 +403,7 @@ struct DVEntry
         vif(0),
         storage_nr(0),
         tariff_nr(0),
-        subunit_nr(0),
-        value("x")
+        subunit_nr(0)
     {
     }
 
@@ -388,6 +411,7 @@ struct DVEntry
     bool extractLong(uint64_t *out);
     bool extractDate(struct tm *out);
     bool extractReadableString(std::string *out);
+    std::string hexValue() { return bin2hex(value_bytes); }
     void addFieldInfo(FieldInfo *fi) { field_infos_.insert(fi); }
     bool hasFieldInfo(FieldInfo *fi) { return field_infos_.count(fi) > 0; }
     std::string str();
@@ -497,18 +521,20 @@ struct FieldMatcher
 
     FieldMatcher &set(IndexNr i) { index_nr = i; return *this; }
 
-    bool matches(DVEntry &dv_entry);
+    bool matches(DVEntry &dv_entry) const;
 
     // Returns true of there is any range for storage, tariff, subunit nrs.
     // I.e. this matcher is expected to match against multiple dv entries!
-    bool expectedToMatchAgainstMultipleEntries()
+    bool expectedToMatchAgainstMultipleEntries() const
     {
         return (match_storage_nr && storage_nr_from != storage_nr_to)
             || (match_tariff_nr && tariff_nr_from != tariff_nr_to)
             || (match_subunit_nr && subunit_nr_from != subunit_nr_to);
     }
 
-    std::string str();
+    std::string str() const;
+    // True if all the match rules are the same, unlike str() this includes the raw combinables.
+    bool operator==(const FieldMatcher &fm) const;
 };
 
 bool loadFormatBytesFromSignature(uint16_t format_signature, std::vector<uchar> *format_bytes);
@@ -190,6 +190,162 @@ double NumericFormulaSquareRoot::calculate(SIUnit to_siunit)
     return v;
 }
 
+void NumericFormulaConstant::compile(SIUnit to)
+{
+    formula()->emitConstant(calculate(to));
+}
+
+void NumericFormulaMeterField::compile(SIUnit to_si_unit)
+{
+    if (formula()->meter() == NULL)
+    {
+        formula()->emitConstant(std::numeric_limits<double>::quiet_NaN());
+        return;
+    }
+
+    // The field is looked up once here instead of for every calculation.
+    FieldInfo *fi = formula()->meter()->findFieldInfo(vname_, quantity_);
+
+    formula()->emitMeterField(fi);
+    formula()->emitConversion(toSIUnit(fi->displayUnit()), to_si_unit);
+}
+
+void NumericFormulaDVEntryField::compile(SIUnit to_si_unit)
+{
+    formula()->emitDVEntryField(counter_);
+    formula()->emitConversion(toSIUnit(Unit::COUNTER), to_si_unit);
+}
+
+void NumericFormulaPair::compileMathOp(MathOp op, SIUnit to_siunit)
+{
+    FormulaImplementation *f = formula();
+    const SIUnit &left_siunit = left_->siunit();
+    const SIUnit &right_siunit = right_->siunit();
+    const SIExp &ut = SI_UnixTimestamp.exp();
+    const SIExp &s = SI_Second.exp();
+    const SIExp &month = SI_Month.exp();
+
+    SIUnit v_siunit(Unit::COUNTER);
+    SIConversion c;
+
+    if (op == MathOp::ADD && left_siunit.exp() == ut && right_siunit.exp() == ut)
+    {
+        // Two unix timestamps cannot be added together.
+        f->emitConstant(std::numeric_limits<double>::quiet_NaN());
+    }
+    else if (left_siunit.conversionTo(right_siunit, &c))
+    {
+        // Same units or temperatures, the left value is converted into the right unit.
+        f->compileNode(left_.get(), left_siunit);
+        f->emitConversion(left_siunit, right_siunit);
+        f->compileNode(right_.get(), right_siunit);
+        f->emitOp(op == MathOp::ADD ? FormulaOp::ADD : FormulaOp::SUB);
+        v_siunit = right_siunit;
+    }
+    else if (left_siunit.exp() == ut && right_siunit.exp() == s)
+    {
+        f->compileNode(left_.get(), left_siunit);
+        f->compileNode(right_.get(), right_siunit);
+        f->emitConversion(right_siunit, SI_Second);
+        f->emitOp(op == MathOp::ADD ? FormulaOp::ADD : FormulaOp::SUB);
+        v_siunit = SI_UnixTimestamp;
+    }
+    else if (left_siunit.exp() == ut && right_siunit.exp() == month)
+    {
+        f->compileNode(left_.get(), left_siunit);
+        f->compileNode(right_.get(), right_siunit);
+        if (op == MathOp::SUB) f->emitOp(FormulaOp::NEGATE);
+        f->emitOp(FormulaOp::ADD_MONTHS);
+        v_siunit = SI_UnixTimestamp;
+    }
+    else if (left_siunit.exp() == s && right_siunit.exp() == ut)
+    {
+        // mathOpTo flips the arguments when the timestamp is to the right.
+        f->compileNode(left_.get(), left_siunit);
+        f->emitConversion(left_siunit, SI_Second);
+        f->compileNode(right_.get(), right_siunit);
+        f->emitOp(op == MathOp::ADD ? FormulaOp::ADD : FormulaOp::SUB_REVERSED);
+        v_siunit = SI_UnixTimestamp;
+    }
+    else if (left_siunit.exp() == month && right_siunit.exp() == ut)
+    {
+        f->compileNode(left_.get(), left_siunit);
+        if (op == MathOp::SUB) f->emitOp(FormulaOp::NEGATE);
+        f->compileNode(right_.get(), right_siunit);
+        f->emitOp(FormulaOp::ADD_MONTHS_REVERSED);
+        v_siunit = SI_UnixTimestamp;
+    }
+    else
+    {
+        // mathOpTo refuses, which leaves a zero counter.
+        f->emitConstant(0);
+    }
+
+    f->emitConversion(v_siunit, to_siunit);
+}
+
+void NumericFormulaAddition::compile(SIUnit to_siunit)
+{
+    compileMathOp(MathOp::ADD, to_siunit);
+}
+
+void NumericFormulaSubtraction::compile(SIUnit to_siunit)
+{
+    compileMathOp(MathOp::SUB, to_siunit);
+}
+
+void NumericFormulaMultiplication::compile(SIUnit to_siunit)
+{
+    formula()->compileNode(left_.get(), left_->siunit());
+    formula()->compileNode(right_.get(), right_->siunit());
+    formula()->emitOp(FormulaOp::MUL);
+    formula()->emitConversion(siunit(), to_siunit);
+}
+
+void NumericFormulaDivision::compile(SIUnit to_siunit)
+{
+    formula()->compileNode(left_.get(), left_->siunit());
+    formula()->compileNode(right_.get(), right_->siunit());
+    formula()->emitOp(FormulaOp::DIV);
+    formula()->emitConversion(siunit(), to_siunit);
+}
+
+void NumericFormulaExponentiation::compile(SIUnit to_siunit)
+{
+    formula()->compileNode(left_.get(), to_siunit);
+    formula()->compileNode(right_.get(), to_siunit);
+    formula()->emitOp(FormulaOp::POW);
+    formula()->emitConversion(siunit(), to_siunit);
+}
+
+void NumericFormulaSquareRoot::compile(SIUnit to_siunit)
+{
+    formula()->compileNode(inner_.get(), inner_->siunit());
+    formula()->emitOp(FormulaOp::SQRT);
+    formula()->emitConversion(siunit(), to_siunit);
+}
+
+const char *toString(FormulaOp op)
+{
+    switch (op) {
+    case FormulaOp::CONSTANT: return "CONSTANT";
+    case FormulaOp::METER_FIELD: return "METER_FIELD";
+    case FormulaOp::DVENTRY_FIELD: return "DVENTRY_FIELD";
+    case FormulaOp::CONVERT: return "CONVERT";
+    case FormulaOp::NEGATE: return "NEGATE";
+    case FormulaOp::ADD: return "ADD";
+    case FormulaOp::SUB: return "SUB";
+    case FormulaOp::SUB_REVERSED: return "SUB_REVERSED";
+    case FormulaOp::MUL: return "MUL";
+    case FormulaOp::DIV: return "DIV";
+    case FormulaOp::POW: return "POW";
+    case FormulaOp::SQRT: return "SQRT";
+    case FormulaOp::ADD_MONTHS: return "ADD_MONTHS";
+    case FormulaOp::ADD_MONTHS_REVERSED: return "ADD_MONTHS_REVERSED";
+    }
+    return "?";
+}
+
 const char *toString(TokenType tt)
 {
     switch (tt) {
@@ -266,6 +422,8 @@ void FormulaImplementation::clear()
     formula_ = "";
     dventry_ = NULL;
     meter_ = NULL;
+    field_positions_.clear();
+    program_.clear();
 }
 
 bool is_letter(char c)
@@ -949,7 +1107,182 @@ double FormulaImplementation::calculate(Unit to, DVEntry *dve, Meter *m)
         return std::nan("");
     }
 
-    return topOp()->calculate(toSIUnit(to));
+    if (program_.size() == 0 || program_unit_ != to || program_meter_ != meter_)
+    {
+        compile(to);
+    }
+
+    return runProgram();
+}
+
+void FormulaImplementation::compile(Unit to)
+{
+    program_.clear();
+    program_depth_ = 0;
+    program_stack_.clear();
+    program_unit_ = to;
+    program_meter_ = meter_;
+
+    if (!valid_ || op_stack_.size() != 1) return;
+
+    compileNode(topOp(), toSIUnit(to));
+
+    if (isDebugEnabled())
+    {
+        debug("(formula) program %s\n", program().c_str());
+    }
+}
+
+void FormulaImplementation::compileNode(NumericFormula *nf, SIUnit to)
+{
+    if (nf->constant())
+    {
+        emitConstant(nf->calculate(to));
+        return;
+    }
+    nf->compile(to);
+}
+
+void FormulaImplementation::emitConstant(double c)
+{
+    FormulaInstruction i(FormulaOp::CONSTANT);
+    i.value = c;
+    emit(i);
+}
+
+void FormulaImplementation::emitMeterField(FieldInfo *fi)
+{
+    FormulaInstruction i(FormulaOp::METER_FIELD);
+    // The position is stable even if more fields are added to the meter later.
+    i.slot = fi - &meter_->fieldInfos().front();
+    emit(i);
+}
+
+void FormulaImplementation::emitDVEntryField(DVEntryCounterType ct)
+{
+    FormulaInstruction i(FormulaOp::DVENTRY_FIELD);
+    i.counter = ct;
+    emit(i);
+}
+
+void FormulaImplementation::emitConversion(const SIUnit &from, const SIUnit &to)
+{
+    FormulaInstruction i(FormulaOp::CONVERT);
+    from.conversionTo(to, &i.conversion);
+    if (i.conversion.identity()) return;
+    emit(i);
+}
+
+void FormulaImplementation::emitOp(FormulaOp op)
+{
+    emit(FormulaInstruction(op));
+}
+
+void FormulaImplementation::emit(const FormulaInstruction &i)
+{
+    switch (i.op)
+    {
+    case FormulaOp::CONSTANT:
+    case FormulaOp::METER_FIELD:
+    case FormulaOp::DVENTRY_FIELD:
+        program_depth_++;
+        if (program_depth_ > program_stack_.size()) program_stack_.resize(program_depth_);
+        break;
+    case FormulaOp::CONVERT:
+    case FormulaOp::NEGATE:
+    case FormulaOp::SQRT:
+        break;
+    default:
+        program_depth_--;
+    }
+    program_.push_back(i);
+}
+
+double FormulaImplementation::runProgram()
+{
+    if (program_.size() == 0) return std::nan("");
+
+    double *stack = &program_stack_[0];
+    size_t sp = 0;
+
+    for (FormulaInstruction &i : program_)
+    {
+        switch (i.op)
+        {
+        case FormulaOp::CONSTANT:
+            stack[sp++] = i.value;
+            break;
+        case FormulaOp::METER_FIELD:
+        {
+            FieldInfo *fi = &meter_->fieldInfos()[i.slot];
+            stack[sp++] = meter_->getNumericValue(fi, fi->displayUnit());
+            break;
+        }
+        case FormulaOp::DVENTRY_FIELD:
+            if (dventry_ == NULL) stack[sp++] = std::numeric_limits<double>::quiet_NaN();
+            else stack[sp++] = dventry_->getCounter(i.counter);
+            break;
+        case FormulaOp::CONVERT:
+            stack[sp-1] = i.conversion.apply(stack[sp-1]);
+            break;
+        case FormulaOp::NEGATE:
+            stack[sp-1] = -stack[sp-1];
+            break;
+        case FormulaOp::ADD:
+            sp--;
+            stack[sp-1] = stack[sp-1]+stack[sp];
+            break;
+        case FormulaOp::SUB:
+            sp--;
+            stack[sp-1] = stack[sp-1]-stack[sp];
+            break;
+        case FormulaOp::SUB_REVERSED:
+            sp--;
+            stack[sp-1] = stack[sp]-stack[sp-1];
+            break;
+        case FormulaOp::MUL:
+            sp--;
+            stack[sp-1] = stack[sp-1]*stack[sp];
+            break;
+        case FormulaOp::DIV:
+            sp--;
+            stack[sp-1] = stack[sp-1]/stack[sp];
+            break;
+        case FormulaOp::POW:
+            sp--;
+            stack[sp-1] = pow(stack[sp-1], stack[sp]);
+            break;
+        case FormulaOp::SQRT:
+            stack[sp-1] = sqrt(stack[sp-1]);
+            break;
+        case FormulaOp::ADD_MONTHS:
+            sp--;
+            stack[sp-1] = addMonths(stack[sp-1], stack[sp]);
+            break;
+        case FormulaOp::ADD_MONTHS_REVERSED:
+            sp--;
+            stack[sp-1] = addMonths(stack[sp], stack[sp-1]);
+            break;
+        }
+    }
+
+    assert(sp == 1);
+    return stack[0];
+}
+
+string FormulaImplementation::program()
+{
+    string s;
+
+    for (FormulaInstruction &i : program_)
+    {
+        if (s.length() > 0) s += " ";
+        s += toString(i.op);
+        if (i.op == FormulaOp::CONSTANT) s += tostrprintf("(%.17g)", i.value);
+        if (i.op == FormulaOp::METER_FIELD) s += tostrprintf("(%d)", i.slot);
+        if (i.op == FormulaOp::DVENTRY_FIELD) s += string("(")+toString(i.counter)+")";
+    }
+    return s;
 }
 
 void FormulaImplementation::doConstant(Unit u, double c)
@@ -1058,6 +1391,8 @@ void FormulaImplementation::doMeterField(Unit u, FieldInfo *fi)
     SIUnit to_si_unit = toSIUnit(u);
     assert(from_si_unit.convertTo(0, to_si_unit, NULL));
 
+    if (meter_ != NULL) field_positions_.push_back(fi - &meter_->fieldInfos().front());
+
     pushOp(new NumericFormulaMeterField(this, u, fi->vname(), fi->xuantity()));
 }
 
@@ -1097,6 +1432,11 @@ string FormulaImplementation::tree()
     return s;
 }
 
+vector<size_t> FormulaImplementation::fieldPositions()
+{
+    return field_positions_;
+}
+
 void FormulaImplementation::setMeter(Meter *m)
 {
     meter_ = m;
@@ -1174,12 +1514,14 @@ string NumericFormulaDVEntryField::tree()
 
 void FormulaImplementation::pushOp(NumericFormula *nf)
 {
+    program_.clear();
     op_stack_.push_back(unique_ptr<NumericFormula>(nf));
 }
 
 unique_ptr<NumericFormula> FormulaImplementation::popOp()
 {
     assert(op_stack_.size() > 0);
+    program_.clear();
     unique_ptr<NumericFormula> nf = std::move(op_stack_.back());
     op_stack_.pop_back();
     return nf;
@@ -1266,6 +1608,15 @@ bool StringInterpolatorImplementation::parse(Meter *m, const std::string &f)
     return true;
 }
 
+bool StringInterpolatorImplementation::onlyCounters()
+{
+    for (auto &f : formulas_)
+    {
+        if (f->fieldPositions().size() > 0) return false;
+    }
+    return true;
+}
+
 string StringInterpolatorImplementation::apply(Meter *m, DVEntry *dve)
 {
     string result;
@@ -39,12 +39,17 @@ struct Formula
     // If a dventry is supplied, then the values storage_counter, tariff_counter, subunit_counter are available.
     // If a meter is supplied it overrides the meter supplied when parsing.
     virtual double calculate(Unit to, DVEntry *dve = NULL, Meter *m = NULL) = 0;
+    // Compile the formula into a flat program that calculates the value in the given unit.
+    // Calculate compiles on demand, calling this beforehand moves the work to setup time.
+    virtual void compile(Unit to) = 0;
     // Clear the formula, ie drop any parsed tree.
     virtual void clear() = 0;
     // Return a regenerated formula string.
     virtual std::string str() = 0;
     // Return the formula in a format where the tree structure is explicit.
     virtual std::string tree() = 0;
+    // Return the positions in the meter's field infos of the fields read by the formula.
+    virtual std::vector<size_t> fieldPositions() = 0;
     // Return the final type of the formula calculation.
     virtual SIUnit &siUnit() = 0;
     // Specify which meter to read the meter fields from.
@@ -73,6 +78,11 @@ struct StringInterpolator
 
     */
     virtual std::string apply(Meter *m, DVEntry *dve) = 0;
+    /**
+       onlyCounters: Returns true if apply only depends on the storage, tariff and subunit counters of the dve,
+       ie the formulas do not read any meter fields.
+    */
+    virtual bool onlyCounters() = 0;
 
     virtual ~StringInterpolator() = 0;
 };
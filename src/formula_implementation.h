@@ -31,6 +31,10 @@ struct NumericFormula
     SIUnit &siunit() { return siunit_; }
     // Calculate the formula and return the value in the given "to" unit.
     virtual double calculate(SIUnit to) = 0;
+    // Append the instructions that calculate the value in the given "to" unit to the formula program.
+    virtual void compile(SIUnit to) = 0;
+    // Returns true if the value does not depend on any meter or dventry field.
+    virtual bool constant() = 0;
     virtual string str() = 0;
     virtual string tree() = 0;
     virtual ~NumericFormula() = 0;
@@ -47,6 +51,8 @@ struct NumericFormulaConstant : public NumericFormula
 {
     NumericFormulaConstant(FormulaImplementation *f, Unit u, double c) : NumericFormula(f, u), constant_(c) {}
     double calculate(SIUnit to);
+    void compile(SIUnit to);
+    bool constant() { return true; }
     string str();
     string tree();
     ~NumericFormulaConstant();
@@ -62,6 +68,8 @@ struct NumericFormulaMeterField : public NumericFormula
         : NumericFormula(f, u), vname_(v), quantity_(q) {}
 
     double calculate(SIUnit to);
+    void compile(SIUnit to);
+    bool constant() { return false; }
     string str();
     string tree();
     ~NumericFormulaMeterField();
@@ -77,6 +85,8 @@ struct NumericFormulaDVEntryField : public NumericFormula
     NumericFormulaDVEntryField(FormulaImplementation *f, Unit u, DVEntryCounterType ct) : NumericFormula(f, u), counter_(ct) {}
 
     double calculate(SIUnit to);
+    void compile(SIUnit to);
+    bool constant() { return false; }
     string str();
     string tree();
     ~NumericFormulaDVEntryField();
@@ -101,10 +111,14 @@ struct NumericFormulaPair : public NumericFormula
 
     string str();
     string tree();
+    bool constant() { return left_->constant() && right_->constant(); }
     ~NumericFormulaPair();
 
 protected:
 
+    // Compile an addition or subtraction the same way as SIUnit::mathOpTo calculates it.
+    void compileMathOp(MathOp op, SIUnit to);
+
     std::unique_ptr<NumericFormula> left_;
     std::unique_ptr<NumericFormula> right_;
     std::string name_;
@@ -119,6 +133,7 @@ struct NumericFormulaAddition : public NumericFormulaPair
         : NumericFormulaPair(f, siu, a, b, "ADD", "+") {}
 
     double calculate(SIUnit to);
+    void compile(SIUnit to);
 
     ~NumericFormulaAddition();
 };
@@ -131,6 +146,7 @@ struct NumericFormulaSubtraction : public NumericFormulaPair
         : NumericFormulaPair(f, siu, a, b, "SUB", "-") {}
 
     double calculate(SIUnit to);
+    void compile(SIUnit to);
 
     ~NumericFormulaSubtraction();
 };
@@ -143,6 +159,7 @@ struct NumericFormulaMultiplication : public NumericFormulaPair
         : NumericFormulaPair(f, siu, a, b, "TIMES", "×") {}
 
     double calculate(SIUnit to);
+    void compile(SIUnit to);
 
     ~NumericFormulaMultiplication();
 };
@@ -155,6 +172,7 @@ struct NumericFormulaDivision : public NumericFormulaPair
         : NumericFormulaPair(f, siu, a, b, "DIV", "÷") {}
 
     double calculate(SIUnit to);
+    void compile(SIUnit to);
 
     ~NumericFormulaDivision();
 };
@@ -167,6 +185,7 @@ struct NumericFormulaExponentiation : public NumericFormulaPair
         : NumericFormulaPair(f, siu, a, b, "EXP", "^") {}
 
     double calculate(SIUnit to);
+    void compile(SIUnit to);
 
     ~NumericFormulaExponentiation();
 };
@@ -178,6 +197,8 @@ struct NumericFormulaSquareRoot : public NumericFormula
         : NumericFormula(f, siu), inner_(std::move(inner)) {}
 
     double calculate(SIUnit to);
+    void compile(SIUnit to);
+    bool constant() { return inner_->constant(); }
     string str();
     string tree();
 
@@ -188,6 +209,37 @@ private:
     std::unique_ptr<NumericFormula> inner_;
 };
 
+enum class FormulaOp
+{
+    CONSTANT,            // Push the value.
+    METER_FIELD,         // Push the meter field at position slot in the field infos, in its display unit.
+    DVENTRY_FIELD,       // Push the counter from the dventry.
+    CONVERT,             // Convert the top value with the prepared conversion.
+    NEGATE,              // Negate the top value.
+    ADD,                 // Pop right and left, push left+right.
+    SUB,                 // Pop right and left, push left-right.
+    SUB_REVERSED,        // Pop right and left, push right-left.
+    MUL,                 // Pop right and left, push left*right.
+    DIV,                 // Pop right and left, push left/right.
+    POW,                 // Pop right and left, push left^right.
+    SQRT,                // Replace the top value with its square root.
+    ADD_MONTHS,          // Pop right (months) and left (timestamp), push the timestamp moved the months.
+    ADD_MONTHS_REVERSED  // Pop right (timestamp) and left (months), push the timestamp moved the months.
+};
+
+const char *toString(FormulaOp op);
+
+struct FormulaInstruction
+{
+    FormulaInstruction(FormulaOp o) : op(o) {}
+
+    FormulaOp op;
+    double value {};
+    int slot {};
+    DVEntryCounterType counter {};
+    SIConversion conversion;
+};
+
 enum class TokenType
 {
     SPACE,
@@ -230,9 +282,11 @@ struct FormulaImplementation : public Formula
     bool valid();
     string errors();
     double calculate(Unit to, DVEntry *dve = NULL, Meter *m = NULL);
+    void compile(Unit to);
     void clear();
     string str();
     string tree();
+    std::vector<size_t> fieldPositions();
     SIUnit &siUnit();
     void setMeter(Meter *m);
     void setDVEntry(DVEntry *dve);
@@ -262,6 +316,25 @@ struct FormulaImplementation : public Formula
     // The target unit will be SIUnit square rooted.
     void doSquareRoot();
 
+    // Append a node to the program, a node that does not depend on any field is calculated now.
+    void compileNode(NumericFormula *nf, SIUnit to);
+    // Append a push of a constant to the program.
+    void emitConstant(double c);
+    // Append a push of the meter field to the program.
+    void emitMeterField(FieldInfo *fi);
+    // Append a push of the dventry counter to the program.
+    void emitDVEntryField(DVEntryCounterType ct);
+    // Append a conversion of the top value to the program, nothing is appended if the value is unchanged.
+    void emitConversion(const SIUnit &from, const SIUnit &to);
+    // Append an operation on the top value(s) to the program.
+    void emitOp(FormulaOp op);
+    // Append an instruction to the program and track the depth of the evaluation stack.
+    void emit(const FormulaInstruction &i);
+    // Run the compiled program.
+    double runProgram();
+    // Return the compiled program as a string, for debugging.
+    string program();
+
     ~FormulaImplementation();
 
     bool tokenize();
@@ -310,8 +383,19 @@ private:
     std::vector<std::unique_ptr<NumericFormula>> op_stack_;
     std::vector<Token> tokens_;
     std::string formula_; // To be parsed.
-    Meter *meter_; // To be referenced when parsing and calculating.
-    DVEntry *dventry_; // To be referenced when calculating.
+    Meter *meter_ = NULL; // To be referenced when parsing and calculating.
+    DVEntry *dventry_ = NULL; // To be referenced when calculating.
+    // The positions in the meter's field infos of the fields pushed by doMeterField.
+    std::vector<size_t> field_positions_;
+
+    // The tree on the op stack is compiled into this program, for the unit and meter below.
+    // It is dropped whenever the op stack changes.
+    std::vector<FormulaInstruction> program_;
+    Unit program_unit_ = Unit::Unknown;
+    Meter *program_meter_ = NULL;
+    // The evaluation stack, sized to the deepest point of the program.
+    std::vector<double> program_stack_;
+    size_t program_depth_ = 0;
 
     // Any errors during parsing are store here.
     std::vector<std::string> errors_;
@@ -323,6 +407,7 @@ struct StringInterpolatorImplementation : public StringInterpolator
     // Which for a dventry with storage 13 will "generate historic_1_value"
     bool parse(Meter *m, const std::string &f);
     std::string apply(Meter *m, DVEntry *dve);
+    bool onlyCounters();
     ~StringInterpolatorImplementation();
 
     // The strings store "historic_" "_value"
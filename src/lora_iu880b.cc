@@ -144,7 +144,7 @@ struct LoRaIU880B : public virtual BusDeviceCommonImplementation
     ~LoRaIU880B() {
     }
 
-    static FrameStatus checkIU880BFrame(vector<uchar> &data,
+    static FrameStatus checkIU880BFrame(FrameView data,
                                         vector<uchar> &out,
                                         size_t *frame_length,
                                         int *endpoint_id_out,
@@ -154,7 +154,7 @@ struct LoRaIU880B : public virtual BusDeviceCommonImplementation
 
 private:
 
-    vector<uchar> read_buffer_;
+    ReceiveBuffer read_buffer_;
     vector<uchar> request_;
     vector<uchar> response_;
 
@@ -297,7 +297,7 @@ bool LoRaIU880B::deviceSetLinkModes(LinkModeSet lms)
     return true;
 }
 
-FrameStatus LoRaIU880B::checkIU880BFrame(vector<uchar> &data,
+FrameStatus LoRaIU880B::checkIU880BFrame(FrameView data,
                                          vector<uchar> &out,
                                          size_t *frame_length_out,
                                          int *endpoint_id_out,
@@ -309,7 +309,12 @@ FrameStatus LoRaIU880B::checkIU880BFrame(vector<uchar> &data,
 
     removeSlipFraming(data, frame_length_out, msg);
 
-    if (msg.size() < 5) return PartialFrame;
+    if (*frame_length_out == 0) return PartialFrame;
+    if (msg.size() < 5)
+    {
+        debug("(iu880b) too short frame\n");
+        return ErrorInFrame;
+    }
 
     *endpoint_id_out = msg[0];
     *msg_id_out = msg[1];
@@ -342,7 +347,7 @@ void LoRaIU880B::processSerialData()
     // Receive and accumulated serial data until a full frame has been received.
     serial()->receive(&data);
 
-    read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    read_buffer_.append(data);
 
     size_t frame_length;
     int endpoint_id;
@@ -354,7 +359,8 @@ void LoRaIU880B::processSerialData()
 
     for (;;)
     {
-        FrameStatus status = checkIU880BFrame(read_buffer_,
+        FrameView frame = read_buffer_.view();
+        FrameStatus status = checkIU880BFrame(frame,
                                               payload,
                                               &frame_length,
                                               &endpoint_id,
@@ -364,21 +370,22 @@ void LoRaIU880B::processSerialData()
 
         if (status == PartialFrame)
         {
-            if (read_buffer_.size() > 0)
+            if (frame.size() > 0)
             {
-                debugPayload("(iu880b) partial frame, expecting more.", read_buffer_);
+                debugPayload("(iu880b) partial frame, expecting more.", frame);
             }
             break;
         }
         if (status == ErrorInFrame)
         {
-            debugPayload("(iu880b) bad frame, clearing.", read_buffer_);
-            read_buffer_.clear();
-            break;
+            // The slip framing found the end of the bad frame, skip just that frame.
+            debugPayload("(iu880b) bad frame, skipping.", frame);
+            read_buffer_.consume(frame_length);
+            continue;
         }
         if (status == FullFrame)
         {
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
 
             // We now have a proper message in payload. Let us trigger actions based on it.
             // It can be wmbus receiver-dongle messages or wmbus remote meter messages received over the radio.
@@ -20,6 +20,7 @@
 #include"config.h"
 #include"drivers.h"
 #include"meters.h"
+#include"metrics.h"
 #include"printer.h"
 #include"rtlsdr.h"
 #include"serial.h"
@@ -196,6 +197,7 @@ shared_ptr<Printer> create_printer(Configuration *config)
                                            config->use_logfile, config->logfile,
                                            config->new_meter_shells,
                                            config->telegram_shells,
+                                           config->stream_shells,
                                            config->meterfiles_action == MeterFileType::Overwrite,
                                            config->meterfiles_naming,
                                            config->meterfiles_timestamp));
@@ -603,7 +605,9 @@ bool start(Configuration *config)
     stderrEnabled(config->use_stderr_for_log);
     setAlarmShells(config->alarm_shells);
     setIgnoreDuplicateTelegrams(config->ignore_duplicate_telegrams);
+    setDuplicateTelegramsWindow(config->duplicate_capacity, config->duplicate_window);
     setDetailedFirst(config->detailed_first);
+    enableMetrics(config->metrics != "");
     if (config->new_meter_shells.size() > 0)
     {
         // We have metershells, force detailed first telegram.
@@ -621,6 +625,7 @@ bool start(Configuration *config)
     // telegrams into json, fields that are written into log files
     // or sent to shell invocations.
     printer_ = create_printer(config);
+    startShellPool(config->shell_workers, config->shell_queue, config->shell_coalesce);
 
     // The meter manager knows about specified device templates
     // and creates meters on demand when the telegram arrives
@@ -631,7 +636,10 @@ bool start(Configuration *config)
                                    config->analyze_driver,
                                    config->analyze_key,
                                    config->analyze_verbose,
+                                   config->analyze_batch,
                                    config->analyze_profile);
+    // With decoder threads, the telegrams are decoded and printed outside of the serial manager thread.
+    meter_manager_->startDecoders(config->decoder_threads);
 
     // The bus manager detects new/lost wmbus devices and
     // configures the devices according to the specification.
@@ -683,6 +691,15 @@ bool start(Configuration *config)
                                       regular_checkup(config);
                                   });
 
+    if (config->metrics != "")
+    {
+        serial_manager_->startRegularCallback("METRICS",
+                                              config->metrics_interval,
+                                              [&](){
+                                                  writeMetrics(config->metrics);
+                                              });
+    }
+
     if (config->daemon)
     {
         notice("(wmbusmeters) waiting for telegrams\n");
@@ -699,7 +716,7 @@ bool start(Configuration *config)
         {
             if (!config->logsummary) notice("No meters configured. Printing id:s of all telegrams heard!\n");
 
-            meter_manager_->onTelegram([](AboutTelegram &about, vector<uchar> frame) {
+            meter_manager_->onTelegram([](AboutTelegram &about, const vector<uchar> &frame) {
                     Telegram t;
                     t.about = about;
                     MeterKeys mk;
@@ -741,8 +758,35 @@ bool start(Configuration *config)
         notice("(wmbusmeters) shutting down\n");
     }
 
+    // The poll threads use the bus devices.
+    meter_manager_->stopPolling();
     bus_manager_->removeAllBusDevices();
+    // Let the queued telegrams be decoded before the meters are removed.
+    meter_manager_->stopDecoders();
+    // The calculation counters are kept by the meters.
+    string calculation_metrics = isVerboseEnabled() ? meter_manager_->calculationMetrics() : "";
     meter_manager_->removeAllMeters();
+    // Let the queued shell invocations finish before exiting.
+    stopShellPool();
+    if (config->metrics != "")
+    {
+        // Write the final metrics, a short run might never have reached the first interval.
+        writeMetrics(config->metrics);
+    }
+    if (config->ignore_duplicate_telegrams)
+    {
+        size_t hits, misses;
+        duplicateTelegramsCounters(&hits, &misses);
+        verbose("(wmbusmeters) ignored %zu duplicate telegrams of %zu\n", hits, hits+misses);
+    }
+    if (isVerboseEnabled())
+    {
+        string poll_metrics = meter_manager_->pollMetrics();
+        if (poll_metrics != "") verbose("(wmbusmeters) poll metrics\n%s", poll_metrics.c_str());
+        if (calculation_metrics != "") verbose("(wmbusmeters) calculation metrics\n%s", calculation_metrics.c_str());
+        string event_loop_metrics = serial_manager_->eventLoopMetrics();
+        if (event_loop_metrics != "") verbose("(wmbusmeters) event loop metrics\n%s", event_loop_metrics.c_str());
+    }
     printer_.reset();
     serial_manager_.reset();
 
@@ -350,7 +350,7 @@ const char *toString(DiehlAddressTransformMethod m)
 }
 
 void qdsExtractWalkByField(Telegram *t, Meter *driver, DVEntry &mfctEntry, int pos, int n, const string &key_s, const string &fieldName, Quantity quantity) {
-    string bytes = mfctEntry.value.substr(pos, n);
+    string bytes = mfctEntry.hexValue().substr(pos, n);
 
     DifVifKey key(key_s);
     DVEntry fieldEntry(0,
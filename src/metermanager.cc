@@ -20,6 +20,7 @@
 #include"drivers.h"
 #include"meters.h"
 #include"meters_common_implementation.h"
+#include"metrics.h"
 #include"units.h"
 #include"wmbus.h"
 #include"wmbus_utils.h"
@@ -27,12 +28,117 @@
 #include<algorithm>
 #include<chrono>
 #include<cmath>
+#include<deque>
 #include<limits>
 #include<memory.h>
 #include<numeric>
+#include<set>
 #include<stdexcept>
 #include<time.h>
+#include<unistd.h>
 
+// A telegram for a meter, waiting to be decoded by a decoder thread.
+struct DecoderJob
+{
+    Meter *meter {};
+    shared_ptr<const Telegram> header;
+    shared_ptr<const vector<uchar>> frame;
+    bool simulated {};
+    bool new_meter {};
+};
+
+struct Decoder
+{
+    pthread_t thread {};
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    // Signalled when a job is queued or the decoder should stop.
+    pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+    // Signalled when a job is taken from the queue.
+    pthread_cond_t space = PTHREAD_COND_INITIALIZER;
+    deque<DecoderJob> queue;
+    bool stopping {};
+};
+
+// Maximum number of telegrams queued for a decoder thread
+// before the event loop has to wait for it.
+#define MAX_QUEUED_PER_DECODER 100
+
+// A bus can only have one outstanding request, thus the meters on a bus are polled
+// one at a time by the poll thread of the bus. Different buses are polled in parallel.
+struct PollBus
+{
+    string alias;
+    pthread_t thread {};
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    // Signalled when meters are queued or the poll thread should stop.
+    pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+    deque<shared_ptr<Meter>> queue;
+    // A meter is queued only once, until its poll has finished.
+    set<Meter*> queued;
+    shared_ptr<BusManager> bus_manager;
+    bool stopping {};
+
+    // Metrics, a poll cycle lasts from when the queue is no longer empty until it is empty again.
+    size_t cycles {};
+    double last_cycle_s {};
+    double max_cycle_s {};
+    size_t polls {};
+    size_t timeouts {};
+    double sum_latency_ms {};
+    int max_latency_ms {};
+    // The latest response latency for each meter name.
+    map<string,int> latency_ms;
+    // The exported metrics, NULL when the metrics are disabled.
+    BusMetrics *metrics {};
+};
+
+// A driver tested against a telegram when analyzing.
+struct AnalyzeCandidate
+{
+    string driver_name;
+    shared_ptr<Meter> meter;
+    bool match {};
+    bool handled {};
+    int length {};
+    int understood {};
+};
+
+// The candidates are shared by the analyze threads, each takes the next untested candidate.
+struct AnalyzeWork
+{
+    vector<AnalyzeCandidate> *candidates {};
+    AboutTelegram *about {};
+    const vector<uchar> *frame {};
+    bool simulated {};
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    size_t next {};
+};
+
+static void testCandidate(AnalyzeCandidate *c, AboutTelegram &about, const vector<uchar> &input_frame, bool simulated)
+{
+    // Each candidate is analyzed into its own telegram, the input frame is only read.
+    Telegram t;
+    vector<Address> addresses;
+    c->handled = c->meter->handleTelegram(about, input_frame, simulated, &addresses, &c->match, &t);
+    if (c->match && c->handled)
+    {
+        t.analyzeParse(OutputFormat::NONE, &c->length, &c->understood);
+    }
+}
+
+static void *analyzeEntryPoint(void *arg)
+{
+    AnalyzeWork *w = (AnalyzeWork*)arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&w->lock);
+        size_t i = w->next++;
+        pthread_mutex_unlock(&w->lock);
+        if (i >= w->candidates->size()) break;
+        testCandidate(&(*w->candidates)[i], *w->about, *w->frame, w->simulated);
+    }
+    return NULL;
+}
 
 struct MeterManagerImplementation : public virtual MeterManager
 {
@@ -44,10 +150,28 @@ private:
     string analyze_driver_;
     string analyze_key_;
     bool analyze_verbose_;
+    bool analyze_batch_ {};
     vector<MeterInfo> meter_templates_;
     vector<shared_ptr<Meter>> meters_;
-    vector<function<bool(AboutTelegram&,vector<uchar>)>> telegram_listeners_;
+    // Meters whose address expressions require an exact id are indexed on that id.
+    // A telegram is then only offered to the meters found through its addresses
+    // and to the meters that use wildcards, which always have to be tried.
+    map<string,vector<Meter*>> meters_by_id_;
+    vector<Meter*> wildcard_meters_;
+    vector<function<bool(AboutTelegram&,const vector<uchar>&)>> telegram_listeners_;
     function<void(Telegram*t,Meter*)> on_meter_updated_;
+    // The telegrams for a meter are always decoded by the same decoder thread,
+    // thus the updates of a meter are kept in order.
+    vector<unique_ptr<Decoder>> decoders_;
+    // The poll threads, started on demand for each bus that has meters to poll.
+    map<string,unique_ptr<PollBus>> poll_buses_;
+    RecursiveMutex poll_buses_mutex_ = { "poll_buses_mutex" };
+#define LOCK_POLL_BUSES(where) WITH(poll_buses_mutex_, poll_buses_mutex, where)
+
+    // Protects meters_, meters_by_id_ and wildcard_meters_ since the meters
+    // are created by the event loop thread, but also used by the decoder threads.
+    RecursiveMutex meters_mutex_ = { "meters_mutex" };
+#define LOCK_METERS(where) WITH(meters_mutex_, meters_mutex, where)
 
 public:
     void addMeterTemplate(MeterInfo &mi)
@@ -57,25 +181,102 @@ public:
 
     void addMeter(shared_ptr<Meter> meter)
     {
+        LOCK_METERS(addMeter);
+
         meters_.push_back(meter);
         meter->setIndex(meters_.size());
         meter->onUpdate(on_meter_updated_);
         meter->setMeterManager(this);
+        indexMeter(meter.get());
+    }
+
+    void indexMeter(Meter *meter)
+    {
+        vector<string> ids;
+        bool exact = true;
+
+        // A meter instantiated from a template has a required identity expression
+        // appended. No telegram can match the meter unless it contains this id.
+        for (AddressExpression &ae : meter->addressExpressions())
+        {
+            if (ae.required && !ae.filter_out && !ae.has_wildcard) ids.push_back(ae.id);
+        }
+
+        if (ids.size() == 0)
+        {
+            // Otherwise all positive expressions must be exact ids.
+            for (AddressExpression &ae : meter->addressExpressions())
+            {
+                if (ae.filter_out) continue;
+                if (ae.has_wildcard) exact = false;
+                ids.push_back(ae.id);
+            }
+        }
+
+        if (!exact || ids.size() == 0)
+        {
+            wildcard_meters_.push_back(meter);
+            return;
+        }
+
+        for (string &id : ids)
+        {
+            vector<Meter*> &ms = meters_by_id_[id];
+            if (std::find(ms.begin(), ms.end(), meter) == ms.end()) ms.push_back(meter);
+        }
+    }
+
+    // Find the meters that could possibly match a telegram with these addresses.
+    // The meters are returned in the order they were added.
+    void findCandidateMeters(vector<Address> &addresses, vector<Meter*> *candidates)
+    {
+        LOCK_METERS(findCandidateMeters);
+
+        *candidates = wildcard_meters_;
+        for (Address &a : addresses)
+        {
+            auto i = meters_by_id_.find(a.id);
+            if (i == meters_by_id_.end()) continue;
+            for (Meter *m : i->second)
+            {
+                if (std::find(candidates->begin(), candidates->end(), m) == candidates->end())
+                {
+                    candidates->push_back(m);
+                }
+            }
+        }
+        sort(candidates->begin(), candidates->end(),
+             [](Meter *a, Meter *b) -> bool { return a->index() < b->index(); });
     }
 
     Meter *lastAddedMeter()
     {
+        LOCK_METERS(lastAddedMeter);
+
         return meters_.back().get();
     }
 
     void removeAllMeters()
     {
+        // Any queued telegrams and polls refer to the meters.
+        stopPolling();
+        stopDecoders();
+
+        LOCK_METERS(removeAllMeters);
+
         meters_.clear();
+        meters_by_id_.clear();
+        wildcard_meters_.clear();
     }
 
     void forEachMeter(std::function<void(Meter*)> cb)
     {
-        for (auto &meter : meters_)
+        vector<shared_ptr<Meter>> meters;
+        {
+            LOCK_METERS(forEachMeter);
+            meters = meters_;
+        }
+        for (auto &meter : meters)
         {
             cb(meter.get());
         }
@@ -83,6 +284,8 @@ public:
 
     bool hasAllMetersReceivedATelegram()
     {
+        LOCK_METERS(hasAllMetersReceivedATelegram);
+
         if (meters_.size() < meter_templates_.size()) return false;
 
         for (auto &meter : meters_)
@@ -95,6 +298,8 @@ public:
 
     bool hasMeters()
     {
+        LOCK_METERS(hasMeters);
+
         return meters_.size() != 0 || meter_templates_.size() != 0;
     }
 
@@ -128,7 +333,7 @@ public:
         warning("(meter) to add support for this unknown mfct,media,version combination\n");
     }
 
-    bool handleTelegram(AboutTelegram &about, vector<uchar> input_frame, bool simulated)
+    bool handleTelegram(AboutTelegram &about, const vector<uchar> &input_frame, bool simulated)
     {
         if (should_analyze_)
         {
@@ -137,14 +342,43 @@ public:
         }
 
         bool handled = false;
+        bool queued = false;
         bool exact_id_match = false;
+        bool template_match = false;
         string verbose_info;
 
-        vector<Address> addresses;
-        for (auto &m : meters_)
+        // Parse the header once to find the addresses used to select the meters.
+        // The header is shared with the decoder threads, if any.
+        shared_ptr<Telegram> header = make_shared<Telegram>();
+        Telegram &t = *header;
+        t.about = about;
+        t.disableExplanations();
+        bool ok = t.parseHeader(input_frame);
+        if (simulated) t.markAsSimulated();
+
+        // When using decoder threads, the frame is copied once and shared by the queued jobs.
+        shared_ptr<const vector<uchar>> frame;
+
+        if (ok)
         {
-            bool h = m->handleTelegram(about, input_frame, simulated, &addresses, &exact_id_match);
-            if (h) handled = true;
+            vector<Meter*> candidates;
+            findCandidateMeters(t.addresses, &candidates);
+            for (Meter *m : candidates)
+            {
+                if (decoders_.size() > 0)
+                {
+                    // Only the address match decides if the templates should be tried,
+                    // so it is enough to check it here and leave the decoding to the thread.
+                    // Whether the meter could decode the telegram is not known here.
+                    if (!MeterCommonImplementation::isTelegramForMeter(&t, m, NULL)) continue;
+                    exact_id_match = true;
+                    queued = true;
+                    queueDecode(m, header, input_frame, simulated, false, &frame);
+                    continue;
+                }
+                bool h = m->handleTelegramWithHeader(&t, input_frame, simulated, &exact_id_match);
+                if (h) handled = true;
+            }
         }
 
         // If not properly handled, and there was no exact id match.
@@ -153,22 +387,18 @@ public:
         {
             if (isDebugEnabled())
             {
-                string idsc = Address::concat(addresses);
+                string idsc = Address::concat(t.addresses);
                 debug("(meter) no meter handled %s checking %d templates.\n",
                       idsc.c_str(), meter_templates_.size());
             }
             // Not handled, maybe we have a template to create a new meter instance for this telegram?
-            Telegram t;
-            t.about = about;
-            bool ok = t.parseHeader(input_frame);
-            if (simulated) t.markAsSimulated();
-
             if (ok)
             {
                 for (auto &mi : meter_templates_)
                 {
                     if (MeterCommonImplementation::isTelegramForMeter(&t, NULL, &mi))
                     {
+                        template_match = true;
                         // We found a match, make a copy of the meter info.
                         MeterInfo meter_info = mi;
                         // Append the identity to the address expressions.
@@ -197,8 +427,8 @@ public:
                         if (meter_info.driverName().str() == "auto")
                         {
                             // Look up the proper meter driver!
-                            DriverInfo di = pickMeterDriver(&t);
-                            if (di.name().str() == "")
+                            DriverInfo *di = pickMeterDriver(&t);
+                            if (di == NULL)
                             {
                                 if (should_analyze_ == false)
                                 {
@@ -208,7 +438,7 @@ public:
                             }
                             else
                             {
-                                meter_info.driver_name = di.name();
+                                meter_info.driver_name = di->name();
                             }
                         }
                         // Now build a meter object with for this exact id.
@@ -248,27 +478,12 @@ public:
                                     identity_expression.str().c_str());
                         }
 
-                        bool match = false;
-                        bool h = meter->handleTelegram(about, input_frame, simulated, &addresses, &match);
-                        if (!match)
-                        {
-                            string aesc = AddressExpression::concat(meter->addressExpressions());
-                            // Oups, we added a new meter object tailored for this telegram
-                            // but it still did not match! This is probably an error in wmbusmeters!
-                            warning("(meter) newly created meter (%s %s %s) did not match telegram! ",
-                                    "Please open an issue at https://github.com/wmbusmeters/wmbusmeters/\n",
-                                    meter->name().c_str(), aesc.c_str(), meter->driverName().str().c_str());
-                        }
-                        else if (!h)
+                        if (decoders_.size() > 0)
                         {
-                            string aesc = AddressExpression::concat(meter->addressExpressions());
-                            // Oups, we added a new meter object tailored for this telegram
-                            // but it still did not handle it! This can happen if the wrong
-                            // decryption key was used.
-                            warning("(meter) newly created meter (%s %s %s) did not handle telegram!\n",
-                                    meter->name().c_str(), aesc.c_str(), meter->driverName().str().c_str());
+                            queueDecode(meter.get(), header, input_frame, simulated, true, &frame);
+                            queued = true;
                         }
-                        else
+                        else if (handleTelegramForNewMeter(meter.get(), &t, input_frame, simulated))
                         {
                             handled = true;
                         }
@@ -276,18 +491,156 @@ public:
                 }
             }
         }
-        for (auto f : telegram_listeners_)
+        for (auto &f : telegram_listeners_)
         {
             f(about, input_frame);
         }
-        if (isVerboseEnabled() && !handled)
+        if (isVerboseEnabled() && !handled && !queued)
         {
             verbose("(wmbus) telegram from %s ignored by all configured meters!\n", "TODO");
         }
-        return handled;
+        if (!handled && !exact_id_match && !template_match)
+        {
+            if (about.bus_metrics) countMetrics(about.bus_metrics->unknown_meter);
+        }
+        return handled || queued;
+    }
+
+    bool handleTelegramForNewMeter(Meter *meter, const Telegram *t, const vector<uchar> &input_frame, bool simulated)
+    {
+        bool match = false;
+        bool h = meter->handleTelegramWithHeader(t, input_frame, simulated, &match);
+        if (!match)
+        {
+            string aesc = AddressExpression::concat(meter->addressExpressions());
+            // Oups, we added a new meter object tailored for this telegram
+            // but it still did not match! This is probably an error in wmbusmeters!
+            warning("(meter) newly created meter (%s %s %s) did not match telegram! ",
+                    "Please open an issue at https://github.com/wmbusmeters/wmbusmeters/\n",
+                    meter->name().c_str(), aesc.c_str(), meter->driverName().str().c_str());
+        }
+        else if (!h)
+        {
+            string aesc = AddressExpression::concat(meter->addressExpressions());
+            // Oups, we added a new meter object tailored for this telegram
+            // but it still did not handle it! This can happen if the wrong
+            // decryption key was used.
+            warning("(meter) newly created meter (%s %s %s) did not handle telegram!\n",
+                    meter->name().c_str(), aesc.c_str(), meter->driverName().str().c_str());
+        }
+        return match && h;
     }
 
-    void onTelegram(function<bool(AboutTelegram &about, vector<uchar>)> cb)
+    void queueDecode(Meter *meter, shared_ptr<const Telegram> header, const vector<uchar> &input_frame, bool simulated,
+                     bool new_meter, shared_ptr<const vector<uchar>> *frame)
+    {
+        if (!*frame)
+        {
+            *frame = make_shared<vector<uchar>>(input_frame);
+        }
+
+        Decoder *d = decoders_[meter->index() % decoders_.size()].get();
+
+        pthread_mutex_lock(&d->lock);
+        while (d->queue.size() >= MAX_QUEUED_PER_DECODER)
+        {
+            pthread_cond_wait(&d->space, &d->lock);
+        }
+        DecoderJob job;
+        job.meter = meter;
+        job.header = header;
+        job.frame = *frame;
+        job.simulated = simulated;
+        job.new_meter = new_meter;
+        d->queue.push_back(job);
+        pthread_cond_signal(&d->work);
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    void runDecoder(Decoder *d)
+    {
+        pthread_mutex_lock(&d->lock);
+        for (;;)
+        {
+            if (d->queue.empty())
+            {
+                if (d->stopping) break;
+                pthread_cond_wait(&d->work, &d->lock);
+                continue;
+            }
+            DecoderJob job = d->queue.front();
+            d->queue.pop_front();
+            pthread_cond_signal(&d->space);
+            pthread_mutex_unlock(&d->lock);
+
+            // The frame and the header are shared by the jobs and only read.
+            const vector<uchar> &frame = *job.frame;
+            if (job.new_meter)
+            {
+                handleTelegramForNewMeter(job.meter, job.header.get(), frame, job.simulated);
+            }
+            else
+            {
+                bool match = false;
+                bool h = job.meter->handleTelegramWithHeader(job.header.get(), frame, job.simulated, &match);
+                if (!h && isVerboseEnabled())
+                {
+                    verbose("(meter) %s(%d) %s could not decode the queued telegram\n",
+                            job.meter->name().c_str(),
+                            job.meter->index(),
+                            job.meter->driverName().str().c_str());
+                }
+            }
+
+            pthread_mutex_lock(&d->lock);
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    static void *decoderEntryPoint(void *arg)
+    {
+        pair<MeterManagerImplementation*,Decoder*> *p = (pair<MeterManagerImplementation*,Decoder*>*)arg;
+        MeterManagerImplementation *mm = p->first;
+        Decoder *d = p->second;
+        delete p;
+        mm->runDecoder(d);
+        return NULL;
+    }
+
+    void startDecoders(int n)
+    {
+        assert(decoders_.size() == 0);
+        for (int i = 0; i < n; ++i)
+        {
+            decoders_.push_back(unique_ptr<Decoder>(new Decoder()));
+            Decoder *d = decoders_.back().get();
+            auto *arg = new pair<MeterManagerImplementation*,Decoder*>(this, d);
+            if (pthread_create(&d->thread, NULL, decoderEntryPoint, arg))
+            {
+                error("(meter) could not start decoder thread!\n");
+            }
+        }
+        if (n > 0) verbose("(meter) started %d decoder threads\n", n);
+    }
+
+    void stopDecoders()
+    {
+        // The decoders finish their queued telegrams before they stop.
+        for (auto &d : decoders_)
+        {
+            pthread_mutex_lock(&d->lock);
+            d->stopping = true;
+            pthread_cond_broadcast(&d->work);
+            pthread_mutex_unlock(&d->lock);
+        }
+        for (auto &d : decoders_)
+        {
+            pthread_join(d->thread, NULL);
+        }
+        decoders_.clear();
+    }
+
+    void onTelegram(function<bool(AboutTelegram &about, const vector<uchar>&)> cb)
     {
         telegram_listeners_.push_back(cb);
     }
@@ -299,13 +652,194 @@ public:
 
     void pollMeters(shared_ptr<BusManager> bus)
     {
+        vector<shared_ptr<Meter>> meters;
+        {
+            LOCK_METERS(pollMeters);
+            meters = meters_;
+        }
+
+        LOCK_POLL_BUSES(pollMeters);
+
+        for (auto &m : meters)
+        {
+            if (!m->usesPolling()) continue;
+
+            PollBus *b = findPollBus(m->bus());
+            if (b == NULL) continue;
+
+            // The poll thread checks if the meter is due for a poll.
+            pthread_mutex_lock(&b->lock);
+            b->bus_manager = bus;
+            if (b->queued.count(m.get()) == 0)
+            {
+                b->queued.insert(m.get());
+                b->queue.push_back(m);
+                pthread_cond_signal(&b->work);
+            }
+            pthread_mutex_unlock(&b->lock);
+        }
+    }
+
+    PollBus *findPollBus(string alias)
+    {
+        auto i = poll_buses_.find(alias);
+        if (i != poll_buses_.end()) return i->second.get();
+
+        poll_buses_[alias] = unique_ptr<PollBus>(new PollBus());
+        PollBus *b = poll_buses_[alias].get();
+        b->alias = alias;
+        b->metrics = lookupBusMetrics(alias);
+        auto *arg = new pair<MeterManagerImplementation*,PollBus*>(this, b);
+        if (pthread_create(&b->thread, NULL, pollBusEntryPoint, arg))
+        {
+            warning("(meter) could not start poll thread for bus %s!\n", alias.c_str());
+            delete arg;
+            poll_buses_.erase(alias);
+            return NULL;
+        }
+        debug("(meter) started poll thread for bus %s\n", alias.c_str());
+        return b;
+    }
+
+    void runPollBus(PollBus *b)
+    {
+        pthread_mutex_lock(&b->lock);
+        for (;;)
+        {
+            while (b->queue.size() == 0 && !b->stopping)
+            {
+                pthread_cond_wait(&b->work, &b->lock);
+            }
+            if (b->stopping) break;
+
+            auto start = chrono::steady_clock::now();
+            int polled = 0;
+            int timeouts = 0;
+
+            while (b->queue.size() > 0 && !b->stopping)
+            {
+                shared_ptr<Meter> m = b->queue.front();
+                b->queue.pop_front();
+                shared_ptr<BusManager> bus_manager = b->bus_manager;
+                pthread_mutex_unlock(&b->lock);
+
+                // Blocks until the meter has responded or timed out.
+                PollOutcome o = m->poll(bus_manager);
+
+                pthread_mutex_lock(&b->lock);
+                b->queued.erase(m.get());
+                if (!o.polled) continue;
+
+                polled++;
+                b->polls++;
+                if (b->metrics) countMetrics(b->metrics->polls);
+                if (!o.responded)
+                {
+                    timeouts++;
+                    b->timeouts++;
+                    if (b->metrics) countMetrics(b->metrics->poll_timeouts);
+                    continue;
+                }
+                if (b->metrics) recordStage(b->metrics->poll_response, (uint64_t)o.latency_ms*1000000);
+                b->latency_ms[m->name()] = o.latency_ms;
+                b->sum_latency_ms += o.latency_ms;
+                if (o.latency_ms > b->max_latency_ms) b->max_latency_ms = o.latency_ms;
+            }
+
+            if (polled == 0) continue;
+
+            std::chrono::duration<double> cycle_s = chrono::steady_clock::now()-start;
+            b->cycles++;
+            b->last_cycle_s = cycle_s.count();
+            if (b->metrics) recordStage(b->metrics->poll_cycle, (uint64_t)(b->last_cycle_s*1000000000.0));
+            if (b->last_cycle_s > b->max_cycle_s) b->max_cycle_s = b->last_cycle_s;
+            verbose("(meter) polled %d meters on bus %s in %.3f s, %d did not respond\n",
+                    polled, b->alias.c_str(), b->last_cycle_s, timeouts);
+        }
+        // Break the reference from the bus manager through the meter manager back to the bus manager.
+        b->bus_manager.reset();
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    static void *pollBusEntryPoint(void *a)
+    {
+        auto *arg = (pair<MeterManagerImplementation*,PollBus*>*)a;
+        MeterManagerImplementation *mm = arg->first;
+        PollBus *b = arg->second;
+        delete arg;
+        mm->runPollBus(b);
+        return NULL;
+    }
+
+    void stopPolling()
+    {
+        LOCK_POLL_BUSES(stopPolling);
+
+        // Meters still in the queues are not polled, but an ongoing poll is finished.
+        vector<PollBus*> running;
+        for (auto &p : poll_buses_)
+        {
+            PollBus *b = p.second.get();
+            pthread_mutex_lock(&b->lock);
+            if (!b->stopping) running.push_back(b);
+            b->stopping = true;
+            pthread_cond_broadcast(&b->work);
+            pthread_mutex_unlock(&b->lock);
+        }
+        for (PollBus *b : running)
+        {
+            pthread_join(b->thread, NULL);
+            b->queue.clear();
+            b->queued.clear();
+        }
+        // Keep the stopped buses for their metrics.
+    }
+
+    string pollMetrics()
+    {
+        LOCK_POLL_BUSES(pollMetrics);
+
+        string s;
+        for (auto &p : poll_buses_)
+        {
+            PollBus *b = p.second.get();
+            pthread_mutex_lock(&b->lock);
+            size_t responses = b->polls - b->timeouts;
+            s += tostrprintf("bus %s cycles %zu last %.3f s max %.3f s polls %zu timeouts %zu latency avg %.0f ms max %d ms\n",
+                             b->alias.c_str(),
+                             b->cycles,
+                             b->last_cycle_s,
+                             b->max_cycle_s,
+                             b->polls,
+                             b->timeouts,
+                             responses > 0 ? b->sum_latency_ms / responses : 0.0,
+                             b->max_latency_ms);
+            for (auto &l : b->latency_ms)
+            {
+                s += tostrprintf("bus %s meter %s latency %d ms\n", b->alias.c_str(), l.first.c_str(), l.second);
+            }
+            pthread_mutex_unlock(&b->lock);
+        }
+        return s;
+    }
+
+    string calculationMetrics()
+    {
+        LOCK_METERS(calculationMetrics);
+
+        string s;
         for (auto &m : meters_)
         {
-            m->poll(bus);
+            if (m->numCalculations() == 0 && m->numSkippedCalculations() == 0) continue;
+            s += tostrprintf("meter %s calculated %zu skipped %zu\n",
+                             m->name().c_str(),
+                             m->numCalculations(),
+                             m->numSkippedCalculations());
         }
+        return s;
     }
 
-    void analyzeEnabled(bool b, OutputFormat f, string force_driver, string key, bool verbose, int profile)
+    void analyzeEnabled(bool b, OutputFormat f, string force_driver, string key, bool verbose, bool batch, int profile)
     {
         should_analyze_ = b;
         should_profile_ = profile;
@@ -316,6 +850,35 @@ public:
         }
         analyze_key_ = key;
         analyze_verbose_ = verbose;
+        analyze_batch_ = batch;
+    }
+
+    void pickBestCandidate(AnalyzeCandidate &c, const string &only, int *best_length, int *best_understood, string *best_driver)
+    {
+        if (!c.match)
+        {
+            debug("no match!\n");
+        }
+        else if (!c.handled)
+        {
+            string aesc = AddressExpression::concat(c.meter->addressExpressions());
+            // Oups, we added a new meter object tailored for this telegram
+            // but it still did not handle it! This can happen if the wrong
+            // decryption key was used. But it is ok if analyzing....
+            debug("Newly created meter (%s %s %s) did not handle telegram!\n",
+                  c.meter->name().c_str(), aesc.c_str(), c.meter->driverName().str().c_str());
+        }
+        else
+        {
+            if (analyze_verbose_ && only == "") printf("(verbose) new %02d/%02d %s\n", c.understood, c.length, c.driver_name.c_str());
+            if (c.understood > *best_understood)
+            {
+                *best_understood = c.understood;
+                *best_length = c.length;
+                *best_driver = c.driver_name;
+                if (analyze_verbose_ && only == "") printf("(verbose) new best so far: %s %02d/%02d\n", best_driver->c_str(), c.understood, c.length);
+            }
+        }
     }
 
     string findBestNewStyleDriver(MeterInfo &mi,
@@ -323,7 +886,7 @@ public:
                                   int *best_understood,
                                   Telegram &t,
                                   AboutTelegram &about,
-                                  vector<uchar> &input_frame,
+                                  const vector<uchar> &input_frame,
                                   bool simulated,
                                   string only)
     {
@@ -339,6 +902,10 @@ public:
             only = di.name().str();
         }
 
+        // Debug output from the drivers is only readable when the drivers are tested one at a time.
+        int num_threads = isDebugEnabled() ? 1 : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        vector<AnalyzeCandidate> candidates;
+
         for (DriverInfo *ndr : allDrivers())
         {
             string driver_name = toString(*ndr);
@@ -360,44 +927,53 @@ public:
             mi.driver_name = driver_name;
             mi.poll_interval = 1000*1000*1000;  // Fake a high value to silence warning about poll inteval.
 
-            auto meter = createMeter(&mi);
-
-            bool match = false;
-            vector<Address> addresses;
-            bool h = meter->handleTelegram(about, input_frame, simulated, &addresses, &match, &t);
+            // The meters are created here, since creating a meter can update the shared driver info.
+            candidates.push_back(AnalyzeCandidate());
+            candidates.back().driver_name = ndr->name().str();
+            candidates.back().meter = createMeter(&mi);
 
-            if (!match)
+            if (num_threads <= 1)
             {
-                debug("no match!\n");
+                testCandidate(&candidates.back(), about, input_frame, simulated);
+                pickBestCandidate(candidates.back(), only, best_length, best_understood, &best_driver);
             }
-            else if (!h)
+        }
+
+        if (num_threads <= 1) return best_driver;
+
+        AnalyzeWork work;
+        work.candidates = &candidates;
+        work.about = &about;
+        work.frame = &input_frame;
+        work.simulated = simulated;
+
+        vector<pthread_t> threads;
+        for (int i = 1; i < num_threads && i < (int)candidates.size(); ++i)
+        {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, analyzeEntryPoint, &work))
             {
-                string aesc = AddressExpression::concat(meter->addressExpressions());
-                // Oups, we added a new meter object tailored for this telegram
-                // but it still did not handle it! This can happen if the wrong
-                // decryption key was used. But it is ok if analyzing....
-                debug("Newly created meter (%s %s %s) did not handle telegram!\n",
-                      meter->name().c_str(), aesc.c_str(), meter->driverName().str().c_str());
-            }
-            else
-            {
-                int l = 0;
-                int u = 0;
-                t.analyzeParse(OutputFormat::NONE, &l, &u);
-                if (analyze_verbose_ && only == "") printf("(verbose) new %02d/%02d %s\n", u, l, driver_name.c_str());
-                if (u > *best_understood)
-                {
-                    *best_understood = u;
-                    *best_length = l;
-                    best_driver = ndr->name().str();
-                    if (analyze_verbose_ && only == "") printf("(verbose) new best so far: %s %02d/%02d\n", best_driver.c_str(), u, l);
-                }
+                // Not fatal, the remaining candidates are tested by the other threads.
+                warning("(meter) could not start analyze thread!\n");
+                break;
             }
+            threads.push_back(thread);
+        }
+        analyzeEntryPoint(&work);
+        for (pthread_t &thread : threads)
+        {
+            pthread_join(thread, NULL);
+        }
+
+        // Pick the best in driver order, thus a tie is won by the same driver as when tested one at a time.
+        for (AnalyzeCandidate &c : candidates)
+        {
+            pickBestCandidate(c, only, best_length, best_understood, &best_driver);
         }
         return best_driver;
     }
 
-    void analyzeTelegram(AboutTelegram &about, vector<uchar> &input_frame, bool simulated)
+    void analyzeTelegram(AboutTelegram &about, const vector<uchar> &input_frame, bool simulated)
     {
         loadAllBuiltinDrivers();
         Telegram t;
@@ -449,8 +1025,8 @@ public:
         using_understood = best_understood;
 
         // Unless the existing mapping from mfct/media/version to driver overrides best.
-        DriverInfo auto_di = pickMeterDriver(&t);
-        string auto_driver = auto_di.name().str();
+        DriverInfo *auto_di = pickMeterDriver(&t);
+        string auto_driver = auto_di != NULL ? auto_di->name().str() : "";
 
         // Will be non-empty if an explicit driver has been selected.
         string force_driver = analyze_driver_;
@@ -471,6 +1047,19 @@ public:
             using_understood = force_understood;
         }
 
+        if (analyze_batch_)
+        {
+            // One line per telegram, useful when analyzing a file with many telegrams.
+            printf("{\"_\":\"analyze\",\"address\":\"%s\",\"auto_driver\":\"%s\","
+                   "\"similar_driver\":\"%s\",\"similar_understood\":%d,\"similar_length\":%d,"
+                   "\"using_driver\":\"%s\",\"using_understood\":%d,\"using_length\":%d}\n",
+                   t.addresses.back().str().c_str(),
+                   auto_driver.c_str(),
+                   best_driver.c_str(), best_understood, best_length,
+                   using_driver.c_str(), using_understood, using_length);
+            return;
+        }
+
         mi.driver_name = using_driver;
         mi.poll_interval = 1000*1000*1000;  // Fake a high value to silence warning about poll inteval.
         auto meter = createMeter(&mi);
@@ -516,6 +1105,35 @@ public:
                    speed_ms,
                    end_curr_rss,
                    end_peak_prss.c_str());
+
+            // Now profile the same telegram the way it is decoded when running as a daemon,
+            // ie without recording the explanations that are only used when analyzing.
+            notice("Profiling %d rounds without explanations\n", should_profile_);
+
+            start = chrono::duration_cast< chrono::milliseconds >(chrono::system_clock::now().time_since_epoch());
+
+            for (int k=0; k<should_profile_; ++k)
+            {
+                vector<Address> addresses;
+                meter->handleTelegram(about, input_frame, simulated, &addresses, &match);
+                string hr, fields, json;
+                vector<string> envs, more_json, selected_fields;
+
+                meter->printMeter(&t, &hr, &fields, '\t', &json,
+                                  &envs, &more_json, &selected_fields, true);
+                if (k % 100 == 0) fprintf(stderr, ".");
+            }
+
+            end = chrono::duration_cast< chrono::milliseconds >(chrono::system_clock::now().time_since_epoch());
+
+            std::chrono::duration<double> diff_no_explain_s(end-start);
+
+            double speed_no_explain_ms = 1000.0 * (diff_no_explain_s.count()) / should_profile_;
+
+            notice("\nDone profiling after %g s which gives %g ms/telegram saving %g ms/telegram\n",
+                   diff_no_explain_s.count(),
+                   speed_no_explain_ms,
+                   speed_ms-speed_no_explain_ms);
             return;
         }
 
@@ -548,7 +1166,7 @@ public:
     }
 
     MeterManagerImplementation(bool daemon) : is_daemon_(daemon) {}
-    ~MeterManagerImplementation() {}
+    ~MeterManagerImplementation() { stopPolling(); stopDecoders(); }
 };
 
 shared_ptr<MeterManager> createMeterManager(bool daemon)
@@ -21,20 +21,25 @@
 #include"driver_dynamic.h"
 #include"meters.h"
 #include"meters_common_implementation.h"
+#include"metrics.h"
 #include"units.h"
 #include"wmbus.h"
 #include"wmbus_utils.h"
 
 #include<algorithm>
+#include<chrono>
 #include<cmath>
 #include<limits>
 #include<memory.h>
 #include<numeric>
 #include<stdexcept>
 #include<time.h>
+#include<unordered_map>
 
 map<string, DriverInfo> *registered_drivers_ = NULL;
 vector<DriverInfo*> *registered_drivers_list_ = NULL;
+// The registered driver that auto detects a mfct/version/type, used to pick the driver for a telegram.
+unordered_map<uint32_t, DriverInfo*> *registered_drivers_by_mvt_ = NULL;
 map<string, string> removed_driver_explanation_;
 
 void verifyDriverLookupCreated()
@@ -47,6 +52,27 @@ void verifyDriverLookupCreated()
     {
         registered_drivers_list_ = new vector<DriverInfo*>;
     }
+    if (registered_drivers_by_mvt_ == NULL)
+    {
+        registered_drivers_by_mvt_ = new unordered_map<uint32_t, DriverInfo*>;
+    }
+}
+
+// Some weird meters (aptor08 and itronheat) send a mfct where the first character is lower case,
+// therefore restrict mfct to the correct range, the same way as DriverInfo::detect does.
+static uint32_t mvtKey(uint16_t mfct, uchar version, uchar type)
+{
+    return (mfct & 0x7fff) << 16 | version << 8 | type;
+}
+
+static void indexDriverMVTs(DriverInfo *di)
+{
+    for (auto &dd : di->mvts())
+    {
+        if (dd.mfct == 0 && dd.type == 0 && dd.version == 0) continue; // Ignore drivers with no detection.
+        // The first registered driver wins, as when searching the list of drivers.
+        registered_drivers_by_mvt_->insert({ mvtKey(dd.mfct, dd.version, dd.type), di });
+    }
 }
 
 // This function should return NULL if the name is not found.
@@ -82,11 +108,25 @@ vector<DriverInfo*> &allDrivers()
 
 void removeDriver(const string &name, string explanation)
 {
+    verifyDriverLookupCreated();
     for (auto i = registered_drivers_list_->begin(); i != registered_drivers_list_->end(); i++)
     {
         if ((*i)->name().str() == name)
         {
+            DriverInfo *removed = *i;
             registered_drivers_list_->erase(i);
+
+            // Drop the removed driver from the mvt index, then let any remaining
+            // driver with the same detection take its place.
+            for (auto j = registered_drivers_by_mvt_->begin(); j != registered_drivers_by_mvt_->end(); )
+            {
+                if (j->second == removed) j = registered_drivers_by_mvt_->erase(j);
+                else j++;
+            }
+            for (DriverInfo *di : *registered_drivers_list_)
+            {
+                indexDriverMVTs(di);
+            }
             break;
         }
     }
@@ -117,7 +157,9 @@ void addRegisteredDriver(DriverInfo di)
 
     (*registered_drivers_)[di.name().str()] = di;
     // The list elements points into the map.
-    (*registered_drivers_list_).push_back(lookupDriver(di.name().str()));
+    DriverInfo *registered = lookupDriver(di.name().str());
+    (*registered_drivers_list_).push_back(registered);
+    indexDriverMVTs(registered);
 }
 
 bool DriverInfo::detect(uint16_t mfct, uchar version, uchar type)
@@ -418,6 +460,7 @@ MeterCommonImplementation::MeterCommonImplementation(MeterInfo &mi,
 
     link_modes_.unionLinkModeSet(di.linkModes());
     force_mfct_index_ = di.forceMfctIndex();
+    driver_metrics_ = lookupDriverMetrics(driver_name_.str());
 }
 
 void MeterCommonImplementation::addShellMeterAdded(string cmdline)
@@ -526,6 +569,51 @@ void MeterCommonImplementation::markLastFieldAsLibrary()
     num_driver_fields_--;
 }
 
+void MeterCommonImplementation::addFieldInfo(const string &vname,
+                                             Quantity xuantity,
+                                             Unit display_unit,
+                                             VifScaling vif_scaling,
+                                             DifSignedness dif_signedness,
+                                             double scale,
+                                             const FieldMatcher &matcher,
+                                             const string &help,
+                                             PrintProperties print_properties,
+                                             const Translate::Lookup &lookup,
+                                             Formula *formula)
+{
+    // Meters using the same driver declare the same fields in the same order,
+    // so the prototype at this position can normally be shared. Extra calculated
+    // fields or failed formulas can shift the positions, then a private prototype is used.
+    DriverFields &df = driver_info_->fields();
+    WITH(df.lock, driver_fields_lock, addFieldInfo);
+
+    size_t pos = field_infos_.size();
+    shared_ptr<FieldPrototype> p;
+
+    if (pos < df.prototypes.size() &&
+        df.prototypes[pos]->sameAs(vname, xuantity, display_unit, vif_scaling, dif_signedness,
+                                   scale, matcher, help, print_properties, lookup))
+    {
+        p = df.prototypes[pos];
+    }
+    else
+    {
+        p = make_shared<FieldPrototype>(vname, xuantity, display_unit, vif_scaling, dif_signedness,
+                                        scale, matcher, help, print_properties, lookup);
+        if (p->plain_field_name)
+        {
+            if (p->xuantity == Quantity::Text) p->string_slot = stringSlot(p->vname, true);
+            else p->numeric_slot = numericSlot(p->vname, p->display_unit, true);
+        }
+        if (pos == df.prototypes.size()) df.prototypes.push_back(p);
+    }
+    // The driver's matcher table can be used for the leading fields that share the prototypes.
+    if (pos == num_shared_fields_ && p == df.prototypes[pos]) num_shared_fields_++;
+
+    size_t index = num_driver_fields_++;
+    field_infos_.emplace_back(FieldInfo(index, p, formula, this));
+}
+
 void MeterCommonImplementation::addNumericFieldWithExtractor(string vname,
                                                              string help,
                                                              PrintProperties print_properties,
@@ -536,26 +624,17 @@ void MeterCommonImplementation::addNumericFieldWithExtractor(string vname,
                                                              Unit display_unit,
                                                              double scale)
 {
-    size_t index = num_driver_fields_++;
-    field_infos_.emplace_back(
-        FieldInfo(index,
-                  vname,
-                  vquantity,
-                  display_unit == Unit::Unknown ? defaultUnitForQuantity(vquantity) : display_unit,
-                  vif_scaling,
-                  dif_signedness,
-                  scale,
-                  matcher,
-                  help,
-                  print_properties,
-                  NULL,
-                  NULL,
-                  NULL,
-                  NULL,
-                  NoLookup, /* Lookup table */
-                  NULL, /* Formula */
-                  this /* Meter */
-            ));
+    addFieldInfo(vname,
+                 vquantity,
+                 display_unit == Unit::Unknown ? defaultUnitForQuantity(vquantity) : display_unit,
+                 vif_scaling,
+                 dif_signedness,
+                 scale,
+                 matcher,
+                 help,
+                 print_properties,
+                 NoLookup,
+                 NULL);
 }
 
 void MeterCommonImplementation::addNumericFieldWithCalculator(string vname,
@@ -578,26 +657,20 @@ void MeterCommonImplementation::addNumericFieldWithCalculator(string vname,
     }
     assert(ok);
 
-    size_t index = num_driver_fields_++;
-    field_infos_.push_back(
-        FieldInfo(index,
-                  vname,
-                  vquantity,
-                  display_unit == Unit::Unknown ? defaultUnitForQuantity(vquantity) : display_unit,
-                  VifScaling::Auto,
-                  DifSignedness::Signed,
-                  1.0,
-                  FieldMatcher::noMatcher(),
-                  help,
-                  print_properties,
-                  NULL,
-                  NULL,
-                  NULL,
-                  NULL,
-                  NoLookup, /* Lookup table */
-                  f, /* Formula */
-                  this /* Meter */
-            ));
+    if (display_unit == Unit::Unknown) display_unit = defaultUnitForQuantity(vquantity);
+    f->compile(display_unit);
+
+    addFieldInfo(vname,
+                 vquantity,
+                 display_unit,
+                 VifScaling::Auto,
+                 DifSignedness::Signed,
+                 1.0,
+                 FieldMatcher::noMatcher(),
+                 help,
+                 print_properties,
+                 NoLookup,
+                 f);
 }
 
 void MeterCommonImplementation::addNumericFieldWithCalculatorAndMatcher(string vname,
@@ -621,26 +694,20 @@ void MeterCommonImplementation::addNumericFieldWithCalculatorAndMatcher(string v
     }
     assert(ok);
 
-    size_t index = num_driver_fields_++;
-    field_infos_.push_back(
-        FieldInfo(index,
-                  vname,
-                  vquantity,
-                  display_unit == Unit::Unknown ? defaultUnitForQuantity(vquantity) : display_unit,
-                  VifScaling::Auto,
-                  DifSignedness::Signed,
-                  1.0,
-                  matcher,
-                  help,
-                  print_properties,
-                  NULL,
-                  NULL,
-                  NULL,
-                  NULL,
-                  NoLookup, /* Lookup table */
-                  f, /* Formula */
-                  this /* Meter */
-            ));
+    if (display_unit == Unit::Unknown) display_unit = defaultUnitForQuantity(vquantity);
+    f->compile(display_unit);
+
+    addFieldInfo(vname,
+                 vquantity,
+                 display_unit,
+                 VifScaling::Auto,
+                 DifSignedness::Signed,
+                 1.0,
+                 matcher,
+                 help,
+                 print_properties,
+                 NoLookup,
+                 f);
 }
 
 
@@ -651,26 +718,17 @@ void MeterCommonImplementation::addNumericField(
     string help,
     Unit display_unit)
 {
-    size_t index = num_driver_fields_++;
-    field_infos_.emplace_back(
-        FieldInfo(index,
-                  vname,
-                  vquantity,
-                  display_unit == Unit::Unknown ? defaultUnitForQuantity(vquantity) : display_unit,
-                  VifScaling::None,
-                  DifSignedness::Signed,
-                  1.0,
-                  FieldMatcher::noMatcher(),
-                  help,
-                  print_properties,
-                  NULL, // getValueFunc,
-                  NULL,
-                  NULL, // setValueFunc
-                  NULL,
-                  NoLookup, /* Lookup table */
-                  NULL, /* Formula */
-                  this /* Meter */
-            ));
+    addFieldInfo(vname,
+                 vquantity,
+                 display_unit == Unit::Unknown ? defaultUnitForQuantity(vquantity) : display_unit,
+                 VifScaling::None,
+                 DifSignedness::Signed,
+                 1.0,
+                 FieldMatcher::noMatcher(),
+                 help,
+                 print_properties,
+                 NoLookup,
+                 NULL);
 }
 
 void MeterCommonImplementation::addStringFieldWithExtractor(string vname,
@@ -678,26 +736,17 @@ void MeterCommonImplementation::addStringFieldWithExtractor(string vname,
                                                             PrintProperties print_properties,
                                                             FieldMatcher matcher)
 {
-    size_t index = num_driver_fields_++;
-    field_infos_.emplace_back(
-        FieldInfo(index,
-                  vname,
-                  Quantity::Text,
-                  defaultUnitForQuantity(Quantity::Text),
-                  VifScaling::None,
-                  DifSignedness::Signed,
-                  1.0,
-                  matcher,
-                  help,
-                  print_properties,
-                  NULL,
-                  NULL,
-                  NULL,
-                  NULL,
-                  NoLookup, /* Lookup table */
-                  NULL, /* Formula */
-                  this /* Meter */
-            ));
+    addFieldInfo(vname,
+                 Quantity::Text,
+                 defaultUnitForQuantity(Quantity::Text),
+                 VifScaling::None,
+                 DifSignedness::Signed,
+                 1.0,
+                 matcher,
+                 help,
+                 print_properties,
+                 NoLookup,
+                 NULL);
 }
 
 void MeterCommonImplementation::addStringFieldWithExtractorAndLookup(string vname,
@@ -706,52 +755,34 @@ void MeterCommonImplementation::addStringFieldWithExtractorAndLookup(string vnam
                                                                      FieldMatcher matcher,
                                                                      Translate::Lookup lookup)
 {
-    size_t index = num_driver_fields_++;
-    field_infos_.emplace_back(
-        FieldInfo(index,
-                  vname,
-                  Quantity::Text,
-                  defaultUnitForQuantity(Quantity::Text),
-                  VifScaling::None,
-                  DifSignedness::Signed,
-                  1.0,
-                  matcher,
-                  help,
-                  print_properties,
-                  NULL,
-                  NULL,
-                  NULL,
-                  NULL,
-                  lookup,
-                  NULL, /* Formula */
-                  this /* Meter */
-            ));
+    addFieldInfo(vname,
+                 Quantity::Text,
+                 defaultUnitForQuantity(Quantity::Text),
+                 VifScaling::None,
+                 DifSignedness::Signed,
+                 1.0,
+                 matcher,
+                 help,
+                 print_properties,
+                 lookup,
+                 NULL);
 }
 
 void MeterCommonImplementation::addStringField(string vname,
                                                string help,
                                                PrintProperties print_properties)
 {
-    size_t index = num_driver_fields_++;
-    field_infos_.emplace_back(
-        FieldInfo(index,
-                  vname,
-                  Quantity::Text,
-                  defaultUnitForQuantity(Quantity::Text),
-                  VifScaling::None,
-                  DifSignedness::Signed,
-                  1.0,
-                  FieldMatcher(),
-                  help,
-                  print_properties,
-                  NULL,
-                  NULL,
-                  NULL,
-                  NULL,
-                  NoLookup, /* Lookup table */
-                  NULL, /* Formula */
-                  this /* Meter */
-            ));
+    addFieldInfo(vname,
+                 Quantity::Text,
+                 defaultUnitForQuantity(Quantity::Text),
+                 VifScaling::None,
+                 DifSignedness::Signed,
+                 1.0,
+                 FieldMatcher(),
+                 help,
+                 print_properties,
+                 NoLookup,
+                 NULL);
 }
 
 bool send_primary_poll(Meter *m, BusDevice *bus_device, AddressExpression *ae, bool next_telegram, uchar fcb)
@@ -865,19 +896,21 @@ bool send_secondary_poll(Meter *m, BusDevice *bus_device, AddressExpression *ae,
     return true;
 }
 
-void MeterCommonImplementation::poll(shared_ptr<BusManager> bus_manager)
+PollOutcome MeterCommonImplementation::poll(shared_ptr<BusManager> bus_manager)
 {
-    if (!usesPolling()) return;
+    PollOutcome outcome;
+
+    if (!usesPolling()) return outcome;
 
     // An valid poll interval must have been set!
-    if (pollInterval() <= 0) return;
+    if (pollInterval() <= 0) return outcome;
 
     time_t now = time(NULL);
     time_t next_poll_time = datetime_of_poll_+pollInterval();
     if (now < next_poll_time)
     {
         // Not yet time to poll this meter.
-        return;
+        return outcome;
     }
 
     BusDevice *bus_device = bus_manager->findBus(bus());
@@ -886,20 +919,20 @@ void MeterCommonImplementation::poll(shared_ptr<BusManager> bus_manager)
     {
         string aesc = AddressExpression::concat(addressExpressions());
         warning("(meter) warning! no bus specified for meter %s %s\n", name().c_str(), aesc.c_str());
-        return;
+        return outcome;
     }
 
     if (addressExpressions().size() == 0)
     {
         warning("(meter) not polling from \"%s\" since no valid id\n", name().c_str());
-        return;
+        return outcome;
     }
 
     AddressExpression &ae = addressExpressions().back();
     if (ae.has_wildcard)
     {
         warning("(meter) not polling from id \"%s\" since poll id must not have a wildcard\n", ae.id.c_str());
-        return;
+        return outcome;
     }
 
     // Reading the mbus spec:
@@ -915,20 +948,28 @@ void MeterCommonImplementation::poll(shared_ptr<BusManager> bus_manager)
         if (ae.mbus_primary)
         {
             bool ok = send_primary_poll(this, bus_device, &ae, next_telegram, fcb);
-            if (!ok) return;
+            if (!ok) return outcome;
         }
         else
         {
             bool ok = send_secondary_poll(this, bus_device, &ae, next_telegram, fcb);
-            if (!ok) return;
+            if (!ok) return outcome;
         }
+        outcome.polled = true;
 
+        auto sent = chrono::steady_clock::now();
         bool ok = waiting_for_poll_response_sem_.wait();
         if (!ok)
         {
             warning("(meter) %s %s did not send a response!\n", name().c_str(), ae.id.c_str());
+            outcome.responded = false;
             break;
         }
+        if (!next_telegram)
+        {
+            outcome.latency_ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now()-sent).count();
+        }
+        outcome.responded = true;
         if (!more_records_follow_) break;
         next_telegram = true;
         // Toggle fcb
@@ -947,6 +988,8 @@ void MeterCommonImplementation::poll(shared_ptr<BusManager> bus_manager)
         // Sleep 50ms before polling for the next telegram.
         usleep(1000*50);
     }
+
+    return outcome;
 }
 
 vector<AddressExpression>& MeterCommonImplementation::addressExpressions()
@@ -988,7 +1031,10 @@ string MeterCommonImplementation::datetimeOfUpdateHumanReadable()
 {
     char datetime[40];
     memset(datetime, 0, sizeof(datetime));
-    strftime(datetime, 20, "%Y-%m-%d %H:%M:%S", localtime(&datetime_of_update_));
+    time_t d = datetime_of_update_;
+    struct tm tm;
+    localtime_r(&d, &tm);
+    strftime(datetime, 20, "%Y-%m-%d %H:%M:%S", &tm);
     return string(datetime);
 }
 
@@ -1008,7 +1054,8 @@ string MeterCommonImplementation::unixTimestampOfUpdate()
 {
     char ut[40];
     memset(ut, 0, sizeof(ut));
-    snprintf(ut, sizeof(ut)-1, "%lu", datetime_of_update_);
+    time_t d = datetime_of_update_;
+    snprintf(ut, sizeof(ut)-1, "%lu", d);
     return string(ut);
 }
 
@@ -1076,7 +1123,7 @@ string toString(DriverInfo &di)
     return di.name().str();
 }
 
-bool MeterCommonImplementation::isTelegramForMeter(Telegram *t, Meter *meter, MeterInfo *mi)
+bool MeterCommonImplementation::isTelegramForMeter(const Telegram *t, Meter *meter, MeterInfo *mi)
 {
     string name;
     vector<AddressExpression> address_expressions;
@@ -1120,7 +1167,6 @@ bool MeterCommonImplementation::isTelegramForMeter(Telegram *t, Meter *meter, Me
     }
 
     debug("(meter) %s: yes for me\n", name.c_str());
-    t->meter = meter;
     return true;
 }
 
@@ -1338,25 +1384,45 @@ string concatFields(Meter *m, Telegram *t, char c, vector<FieldInfo> &prints, bo
     return buf;
 }
 
-bool MeterCommonImplementation::handleTelegram(AboutTelegram &about, vector<uchar> input_frame,
+bool MeterCommonImplementation::handleTelegram(AboutTelegram &about, const vector<uchar> &input_frame,
                                                bool simulated, vector<Address> *addresses,
                                                bool *id_match, Telegram *out_analyzed)
 {
-    Telegram t;
-    t.about = about;
-    bool ok = t.parseHeader(input_frame);
+    Telegram header;
+    header.about = about;
+    header.disableExplanations();
+    bool ok = header.parseHeader(input_frame);
 
-    if (simulated) t.markAsSimulated();
-    if (out_analyzed != NULL) t.markAsBeingAnalyzed();
+    *addresses = header.addresses;
+
+    if (!ok)
+    {
+        // This telegram is not intended for this meter.
+        return false;
+    }
 
-    *addresses = t.addresses;
+    return handleTelegramWithHeader(&header, input_frame, simulated, id_match, out_analyzed);
+}
 
-    if (!ok || !isTelegramForMeter(&t, this, NULL))
+bool MeterCommonImplementation::handleTelegramWithHeader(const Telegram *header, const vector<uchar> &input_frame,
+                                                         bool simulated, bool *id_match, Telegram *out_analyzed)
+{
+    if (!isTelegramForMeter(header, this, NULL))
     {
         // This telegram is not intended for this meter.
         return false;
     }
 
+    // The header is shared with other meters, the full parse is done into a telegram of our own.
+    Telegram t;
+    t.about = header->about;
+    t.meter = this;
+
+    if (simulated) t.markAsSimulated();
+    if (out_analyzed != NULL) t.markAsBeingAnalyzed();
+    // Nobody will look at the explanations unless we are analyzing or debugging.
+    if (out_analyzed == NULL && !isDebugEnabled()) t.disableExplanations();
+
     *id_match = true;
     if (isVerboseEnabled())
     {
@@ -1364,13 +1430,13 @@ bool MeterCommonImplementation::handleTelegram(AboutTelegram &about, vector<ucha
                 name().c_str(),
                 index(),
                 driverName().str().c_str(),
-                t.addresses.back().str().c_str());
+                header->addresses.back().str().c_str());
     }
 
     if (isDebugEnabled())
     {
         string msg = bin2hex(input_frame);
-        debug("(meter) %s %s \"%s\"\n", name().c_str(), t.addresses.back().str().c_str(), msg.c_str());
+        debug("(meter) %s %s \"%s\"\n", name().c_str(), header->addresses.back().str().c_str(), msg.c_str());
     }
 
     // For older meters with manufacturer specific data without a nice 0f dif marker.
@@ -1379,7 +1445,16 @@ bool MeterCommonImplementation::handleTelegram(AboutTelegram &about, vector<ucha
         t.force_mfct_index = force_mfct_index_;
     }
 
-    ok = t.parse(input_frame, &meter_keys_, true);
+    uint64_t start = metricsNow();
+    bool ok = t.parse(input_frame, &meter_keys_, true);
+    if (start && driver_metrics_)
+    {
+        // The parse and decrypt stages are recorded separately.
+        uint64_t ns = metricsNow()-start;
+        recordStage(driver_metrics_->parse, ns > t.decrypt_ns ? ns-t.decrypt_ns : 0);
+        if (t.decrypt_ns > 0) recordStage(driver_metrics_->decrypt, t.decrypt_ns);
+        if (!ok && t.decryption_failed) countMetrics(driver_metrics_->decrypt_failed);
+    }
     if (!ok)
     {
         if (out_analyzed != NULL) *out_analyzed = t;
@@ -1399,15 +1474,11 @@ bool MeterCommonImplementation::handleTelegram(AboutTelegram &about, vector<ucha
         waiting_for_poll_response_sem_.notify();
     }
 
-    // Invoke standardized field extractors!
-    processFieldExtractors(&t);
-    if (hasProcessContent())
-    {
-        // Invoke tailor made meter specific parsing!
-        processContent(&t);
-    }
+    start = metricsNow();
+    extractFields(&t);
     // Invoke any calculators working on the extracted fields.
     processFieldCalculators();
+    if (start && driver_metrics_) recordStage(driver_metrics_->extract, metricsNow()-start);
 
     // All done....
 
@@ -1424,11 +1495,46 @@ bool MeterCommonImplementation::handleTelegram(AboutTelegram &about, vector<ucha
     return true;
 }
 
-void MeterCommonImplementation::processFieldExtractors(Telegram *t)
+void MeterCommonImplementation::extractFields(Telegram *t)
 {
-    // Multiple dventries can be matched against a single wildcard FieldInfo.
-    map<FieldInfo*,set<DVEntry*>> founds;
+    // Invoke standardized field extractors!
+    processFieldExtractors(t);
+    if (hasProcessContent())
+    {
+        // Invoke tailor made meter specific parsing!
+        processContent(t);
+    }
+}
 
+void MeterCommonImplementation::fieldsMatching(DVEntry *dve, vector<size_t> *out)
+{
+    // Everything a field matcher tests is decoded from the difvif key, so the
+    // driver remembers which prototypes accept each key. Must hold the driver fields lock.
+    DriverFields &df = driver_info_->fields();
+    DriverFieldMatches &m = df.matches[dve->dif_vif_key.str()];
+    for (; m.num_prototypes < df.prototypes.size(); m.num_prototypes++)
+    {
+        FieldMatcher &fm = df.prototypes[m.num_prototypes]->matcher;
+        if (fm.active && fm.matches(*dve)) m.positions.push_back(m.num_prototypes);
+    }
+    for (size_t p : m.positions)
+    {
+        if (p >= num_shared_fields_) break;
+        out->push_back(p);
+    }
+
+    // The fields after the shared ones use their own prototypes.
+    for (size_t fi = num_shared_fields_; fi < field_infos_.size(); ++fi)
+    {
+        if (field_infos_[fi].hasMatcher() && field_infos_[fi].matches(dve))
+        {
+            out->push_back(fi);
+        }
+    }
+}
+
+void MeterCommonImplementation::processFieldExtractors(Telegram *t)
+{
     // Sort the dv_entries based on their offset in the telegram.
     // I.e. restore the ordering that was implicit in the telegram.
     vector<DVEntry*> sorted_entries;
@@ -1440,84 +1546,68 @@ void MeterCommonImplementation::processFieldExtractors(Telegram *t)
     sort(sorted_entries.begin(), sorted_entries.end(),
          [](const DVEntry* a, const DVEntry *b) -> bool { return a->offset < b->offset; });
 
-    // Now go through each field_info defined by the driver.
-    for (FieldInfo &fi : field_infos_)
+    // Pair each dv_entry with the field infos that match it.
+    vector<pair<size_t,DVEntry*>> matches;
+    vector<size_t> fis;
     {
-        int current_match_nr = 0;
+        WITH(driver_info_->fields().lock, driver_fields_lock, processFieldExtractors);
+        for (DVEntry *dve : sorted_entries)
+        {
+            fis.clear();
+            fieldsMatching(dve, &fis);
+            for (size_t fi : fis)
+            {
+                matches.push_back({ fi, dve });
+            }
+        }
+    }
+    // Go through each field_info in the order defined by the driver. Since the
+    // sort is stable the dv_entries of a field stay in telegram order.
+    stable_sort(matches.begin(), matches.end(),
+                [](const pair<size_t,DVEntry*> &a, const pair<size_t,DVEntry*> &b) -> bool { return a.first < b.first; });
 
-        if (!fi.hasMatcher())
+    // Multiple dventries can be matched against a single wildcard FieldInfo.
+    vector<bool> found(field_infos_.size());
+    int current_match_nr = 0;
+
+    for (size_t i = 0; i < matches.size(); ++i)
+    {
+        FieldInfo &fi = field_infos_[matches[i].first];
+        DVEntry *dve = matches[i].second;
+
+        if (i == 0 || matches[i-1].first != matches[i].first) current_match_nr = 0;
+        current_match_nr++;
+
+        if (fi.matcher().index_nr != IndexNr(current_match_nr) &&
+            !fi.matcher().expectedToMatchAgainstMultipleEntries())
         {
-            // This field_info has not been matched to a dv_entry before!
-            debug("(meters) skipping field without matcher %s(%s)[%d]...\n",
-                  fi.vname().c_str(),
-                  toString(fi.xuantity()),
-                  fi.index());
+            // This field info did match, but requires another index nr!
+            // Increment the current index nr and look for the next match.
             continue;
         }
 
-        debug("(meters) trying field info %s(%s)[%d]...\n",
+        debug("(meters) using field info %s(%s)[%d] to extract %s at offset %d\n",
               fi.vname().c_str(),
               toString(fi.xuantity()),
-              fi.index());
+              fi.index(),
+              dve->dif_vif_key.str().c_str(),
+              dve->offset);
 
-        // Iterate through dv_entries in the telegram in the same order the telegram presented them.
-        for (DVEntry *dve : sorted_entries)
-        {
-            if (fi.hasMatcher() && fi.matches(dve))
-            {
-                current_match_nr++;
-                if (fi.matcher().index_nr != IndexNr(current_match_nr) &&
-                    !fi.matcher().expectedToMatchAgainstMultipleEntries())
-                {
-                    // This field info did match, but requires another index nr!
-                    // Increment the current index nr and look for the next match.
-                }
-                else if (founds[&fi].count(dve) == 0 || fi.matcher().expectedToMatchAgainstMultipleEntries())
-                {
-                    debug("(meters) using field info %s(%s)[%d] to extract %s at offset %d\n",
-                          fi.vname().c_str(),
-                          toString(fi.xuantity()),
-                          fi.index(),
-                          dve->dif_vif_key.str().c_str(),
-                          dve->offset);
-
-                    dve->addFieldInfo(&fi);
-                    fi.performExtraction(this, t, dve);
-                    founds[&fi].insert(dve);
-                }
-                else
-                {
-                    if (isVerboseEnabled())
-                    {
-                        set<DVEntry*> old = founds[&fi];
-                        string olds;
-                        for (DVEntry *dve : old)
-                        {
-                            olds += to_string(dve->offset)+",";
-                        }
-                        olds.pop_back();
-
-                        verbose("(meter) while processing field extractors ignoring dventry %s at offset %d matching since "
-                                "field %s was already matched against offsets %s !\n",
-                                dve->dif_vif_key.str().c_str(),
-                                dve->offset,
-                                fi.vname().c_str(),
-                                olds.c_str());
-                    }
-                }
-            }
-        }
+        dve->addFieldInfo(&fi);
+        fi.performExtraction(this, t, dve);
+        found[matches[i].first] = true;
     }
 
     // Iterate over the fields that has no matcher rule. Ie the field
     // itself does the searching and matching.
-    for (FieldInfo &fi : field_infos_)
+    for (size_t i = 0; i < field_infos_.size(); ++i)
     {
+        FieldInfo &fi = field_infos_[i];
         if (!fi.hasMatcher())
         {
             fi.performExtraction(this, t, NULL);
         }
-        else if (founds.count(&fi) == 0 && fi.printProperties().hasINCLUDETPLSTATUS())
+        else if (!found[i] && fi.printProperties().hasINCLUDETPLSTATUS())
         {
             // This is a status field and it joins the tpl status but it also
             // has a potential dve match, which did not trigger. Now
@@ -1527,31 +1617,81 @@ void MeterCommonImplementation::processFieldExtractors(Telegram *t)
     }
 }
 
+void MeterCommonImplementation::buildFieldDependents()
+{
+    field_dependents_.assign(field_infos_.size(), vector<size_t>());
+    // Everything is calculated the first time.
+    field_needs_calculation_.assign(field_infos_.size(), true);
+
+    for (size_t i = 0; i < field_infos_.size(); ++i)
+    {
+        FieldInfo &fi = field_infos_[i];
+        if (!fi.hasFormula() || fi.hasMatcher()) continue;
+
+        for (size_t p : fi.formula()->fieldPositions())
+        {
+            if (p < field_dependents_.size()) field_dependents_[p].push_back(i);
+        }
+    }
+    field_dependents_num_fields_ = field_infos_.size();
+}
+
+void MeterCommonImplementation::markFieldSet(FieldInfo *fi)
+{
+    if (field_dependents_num_fields_ != field_infos_.size()) buildFieldDependents();
+    if (field_infos_.size() == 0) return;
+    if (fi < &field_infos_.front() || fi > &field_infos_.back()) return;
+
+    for (size_t d : field_dependents_[fi - &field_infos_.front()])
+    {
+        field_needs_calculation_[d] = true;
+    }
+}
+
 void MeterCommonImplementation::processFieldCalculators()
 {
-    // Iterate over the fields with formulas but no matcher.
-    for (FieldInfo &fi : field_infos_)
+    if (field_dependents_num_fields_ != field_infos_.size()) buildFieldDependents();
+
+    size_t calculations = num_calculations_;
+    size_t skipped = num_skipped_calculations_;
+
+    // Iterate over the fields with formulas but no matcher. A formula can only read
+    // fields declared before it, so a recalculated field marks its dependents in time.
+    for (size_t i = 0; i < field_infos_.size(); ++i)
     {
+        FieldInfo &fi = field_infos_[i];
         if (fi.hasFormula() && !fi.hasMatcher())
         {
+            if (!field_needs_calculation_[i])
+            {
+                num_skipped_calculations_++;
+                continue;
+            }
             debug("(meters) calculating field %s(%s)[%d]\n",
                   fi.vname().c_str(),
                   toString(fi.xuantity()),
                   fi.index());
+            field_needs_calculation_[i] = false;
             fi.performCalculation(this);
+            num_calculations_++;
         }
     }
+
+    if (driver_metrics_)
+    {
+        if (num_calculations_ > calculations) countMetrics(driver_metrics_->calculations, num_calculations_-calculations);
+        if (num_skipped_calculations_ > skipped) countMetrics(driver_metrics_->skipped_calculations, num_skipped_calculations_-skipped);
+    }
 }
 
 string MeterCommonImplementation::getStatusField(FieldInfo *fi)
 {
-    string field_name_no_unit = fi->vname();
-    if (string_values_.count(field_name_no_unit) == 0)
+    StringField *sf = stringField(stringSlot(fi, NULL, false));
+    if (sf == NULL)
     {
         return "null"; // This is translated to a real(non-string) null in the json.
     }
-    StringField &sf = string_values_[field_name_no_unit];
-    string value = sf.value;
+    string value = sf->value;
 
     // This is >THE< status field, only one is allowed.
     // Look for other fields with the JOIN_INTO_STATUS marker.
@@ -1586,19 +1726,83 @@ bool MeterCommonImplementation::hasProcessContent()
     return has_process_content_;
 }
 
+int MeterCommonImplementation::numericSlot(const string &vname, Unit u, bool create)
+{
+    DriverFields &df = driver_info_->fields();
+    WITH(df.lock, driver_fields_lock, numericSlot);
+
+    pair<string,Unit> key(vname, u);
+    auto i = df.numeric_slots.find(key);
+    if (i != df.numeric_slots.end()) return i->second;
+    if (!create) return -1;
+
+    size_t slot = df.numeric_slots.size();
+    df.numeric_slots[key] = slot;
+    return slot;
+}
+
+int MeterCommonImplementation::numericSlot(FieldInfo *fi, DVEntry *dve, bool create)
+{
+    if (dve == NULL || fi->hasPlainFieldName())
+    {
+        if (fi->numericSlot() != -1) return fi->numericSlot();
+        return numericSlot(fi->vname(), fi->displayUnit(), create);
+    }
+    return numericSlot(fi->generatedName(this, dve).no_unit, fi->displayUnit(), create);
+}
+
+int MeterCommonImplementation::stringSlot(const string &vname, bool create)
+{
+    DriverFields &df = driver_info_->fields();
+    WITH(df.lock, driver_fields_lock, stringSlot);
+
+    auto i = df.string_slots.find(vname);
+    if (i != df.string_slots.end()) return i->second;
+    if (!create) return -1;
+
+    size_t slot = df.string_slots.size();
+    df.string_slots[vname] = slot;
+    return slot;
+}
+
+int MeterCommonImplementation::stringSlot(FieldInfo *fi, DVEntry *dve, bool create)
+{
+    if (dve == NULL || fi->hasPlainFieldName())
+    {
+        if (fi->stringSlot() != -1) return fi->stringSlot();
+        return stringSlot(fi->vname(), create);
+    }
+    return stringSlot(fi->generatedName(this, dve).no_unit, create);
+}
+
+NumericField *MeterCommonImplementation::numericField(int slot)
+{
+    if (slot < 0 || (size_t)slot >= numeric_values_.size()) return NULL;
+    NumericField *nf = &numeric_values_[slot];
+    return nf->field_info != NULL ? nf : NULL;
+}
+
+StringField *MeterCommonImplementation::stringField(int slot)
+{
+    if (slot < 0 || (size_t)slot >= string_values_.size()) return NULL;
+    StringField *sf = &string_values_[slot];
+    return sf->field_info != NULL ? sf : NULL;
+}
+
 void MeterCommonImplementation::setNumericValue(FieldInfo *fi, DVEntry *dve, Unit u, double v)
 {
-    string field_name_no_unit;
+    markFieldSet(fi);
+
+    size_t slot = numericSlot(fi, dve, true);
+    if (slot >= numeric_values_.size()) numeric_values_.resize(slot+1);
 
     if (dve == NULL)
     {
-        string field_name_no_unit = fi->vname();
-        numeric_values_[pair<string,Unit>(field_name_no_unit, fi->displayUnit())] = NumericField(u, v, fi);
+        numeric_values_[slot] = NumericField(u, v, fi);
     }
     else
     {
-        field_name_no_unit = fi->generateFieldNameNoUnit(this, dve);
-        numeric_values_[pair<string,Unit>(field_name_no_unit, fi->displayUnit())] = NumericField(u, v, fi, *dve);
+        numeric_values_[slot] = NumericField(u, v, fi, *dve);
     }
 }
 
@@ -1622,53 +1826,44 @@ bool MeterCommonImplementation::hasValue(FieldInfo *fi)
 
 bool MeterCommonImplementation::hasNumericValue(FieldInfo *fi)
 {
-    pair<string,Unit> key(fi->vname(),fi->displayUnit());
-
-    return numeric_values_.count(key) != 0;
+    return numericField(numericSlot(fi, NULL, false)) != NULL;
 }
 
 bool MeterCommonImplementation::hasStringValue(FieldInfo *fi)
 {
-    return string_values_.count(fi->vname()) != 0;
+    return stringField(stringSlot(fi, NULL, false)) != NULL;
 }
 
 double MeterCommonImplementation::getNumericValue(FieldInfo *fi, Unit to)
 {
-    string field_name_no_unit = fi->vname();
-    pair<string,Unit> key(field_name_no_unit,fi->displayUnit());
-    if (numeric_values_.count(key) == 0)
+    return getNumericValue(fi, NULL, to);
+}
+
+double MeterCommonImplementation::getNumericValue(FieldInfo *fi, DVEntry *dve, Unit to)
+{
+    NumericField *nf = numericField(numericSlot(fi, dve, false));
+    if (nf == NULL)
     {
         return std::numeric_limits<double>::quiet_NaN(); // This is translated into a null in the json.
     }
-    NumericField &nf = numeric_values_[key];
-    return convert(nf.value, nf.unit, to);
+    return convert(nf->value, nf->unit, to);
 }
 
 double MeterCommonImplementation::getNumericValue(string vname, Unit to)
 {
-    pair<string,Unit> key(vname,to);
-    if (numeric_values_.count(key) == 0)
+    NumericField *nf = numericField(numericSlot(vname, to, false));
+    if (nf == NULL)
     {
         return std::numeric_limits<double>::quiet_NaN(); // This is translated into a null in the json.
     }
-    NumericField &nf = numeric_values_[key];
-    return convert(nf.value, nf.unit, to);
+    return convert(nf->value, nf->unit, to);
 }
 
 void MeterCommonImplementation::setStringValue(FieldInfo *fi, string v, DVEntry *dve)
 {
-    string field_name_no_unit;
-
-    if (dve == NULL)
-    {
-        string field_name_no_unit = fi->vname();
-        string_values_[field_name_no_unit] = StringField(v, fi);
-    }
-    else
-    {
-        field_name_no_unit = fi->generateFieldNameNoUnit(this, dve);
-        string_values_[field_name_no_unit] = StringField(v, fi);
-    }
+    size_t slot = stringSlot(fi, dve, true);
+    if (slot >= string_values_.size()) string_values_.resize(slot+1);
+    string_values_[slot] = StringField(v, fi);
 }
 
 void MeterCommonImplementation::setStringValue(string vname, string v, DVEntry *dve)
@@ -1685,13 +1880,12 @@ void MeterCommonImplementation::setStringValue(string vname, string v, DVEntry *
 
 string MeterCommonImplementation::getStringValue(FieldInfo *fi)
 {
-    string field_name_no_unit = fi->vname();
-    if (string_values_.count(field_name_no_unit) == 0)
+    StringField *sf = stringField(stringSlot(fi, NULL, false));
+    if (sf == NULL)
     {
         return "null"; // This is translated to a real(non-string) null in the json.
     }
-    StringField &sf = string_values_[field_name_no_unit];
-    string value = sf.value;
+    string value = sf->value;
 
     if (fi->printProperties().hasSTATUS())
     {
@@ -1751,71 +1945,115 @@ string MeterCommonImplementation::debugValues()
 {
     string s;
 
-    for (auto &p : numeric_values_)
+    DriverFields &df = driver_info_->fields();
+    WITH(df.lock, driver_fields_lock, debugValues);
+
+    for (auto &p : df.numeric_slots)
     {
+        NumericField *nf = numericField(p.second);
+        if (nf == NULL) continue;
         string vname = p.first.first;
         string us = unitToStringLowerCase(p.first.second);
-        NumericField& nf = p.second;
 
-        s += tostrprintf("%s_%s = %g\n", vname.c_str(), us.c_str(), nf.value);
+        s += tostrprintf("%s_%s = %g\n", vname.c_str(), us.c_str(), nf->value);
     }
 
-    for (auto &p : string_values_)
+    for (auto &p : df.string_slots)
     {
+        StringField *sf = stringField(p.second);
+        if (sf == NULL) continue;
         string vname = p.first;
-        StringField& nf = p.second;
 
-        s += tostrprintf("%s = \"%s\"\n", vname.c_str(), nf.value.c_str());
+        s += tostrprintf("%s = \"%s\"\n", vname.c_str(), sf->value.c_str());
     }
 
     return s;
 }
 
+FieldPrototype::FieldPrototype(const string &vname,
+                               Quantity xuantity,
+                               Unit display_unit,
+                               VifScaling vif_scaling,
+                               DifSignedness dif_signedness,
+                               double scale,
+                               const FieldMatcher &matcher,
+                               const string &help,
+                               PrintProperties print_properties,
+                               const Translate::Lookup &lookup) :
+    vname(vname),
+    xuantity(xuantity),
+    display_unit(display_unit),
+    vif_scaling(vif_scaling),
+    dif_signedness(dif_signedness),
+    scale(scale),
+    matcher(matcher),
+    help(help),
+    print_properties(print_properties),
+    lookup(lookup),
+    plain_field_name(vname.find('{') == string::npos)
+{
+    // Prepare the json key and env variable name once, instead of for every printed telegram.
+    string var = vname;
+    std::transform(var.begin(), var.end(), var.begin(), ::toupper);
+    if (xuantity == Quantity::Text)
+    {
+        json_key = "\""+vname+"\":";
+        env_name = "METER_"+var+"=";
+    }
+    else
+    {
+        json_key = "\""+vname+"_"+unitToStringLowerCase(display_unit)+"\":";
+        env_name = "METER_"+var+"_"+unitToStringUpperCase(display_unit)+"=";
+    }
+}
+
+bool FieldPrototype::sameAs(const string &vname,
+                            Quantity xuantity,
+                            Unit display_unit,
+                            VifScaling vif_scaling,
+                            DifSignedness dif_signedness,
+                            double scale,
+                            const FieldMatcher &matcher,
+                            const string &help,
+                            PrintProperties print_properties,
+                            const Translate::Lookup &lookup) const
+{
+    return this->vname == vname &&
+        this->xuantity == xuantity &&
+        this->display_unit == display_unit &&
+        this->vif_scaling == vif_scaling &&
+        this->dif_signedness == dif_signedness &&
+        this->scale == scale &&
+        this->matcher == matcher &&
+        this->help == help &&
+        this->print_properties.bits() == print_properties.bits() &&
+        this->lookup == lookup;
+}
+
 FieldInfo::~FieldInfo()
 {
 }
 
 FieldInfo::FieldInfo(int index,
-                     string vname,
-                     Quantity xuantity,
-                     Unit display_unit,
-                     VifScaling vif_scaling,
-                     DifSignedness dif_signedness,
-                     double scale,
-                     FieldMatcher matcher,
-                     string help,
-                     PrintProperties print_properties,
-                     function<double(Unit)> get_numeric_value_override,
-                     function<string()> get_string_value_override,
-                     function<void(Unit,double)> set_numeric_value_override,
-                     function<void(string)> set_string_value_override,
-                     Translate::Lookup lookup,
+                     shared_ptr<FieldPrototype> prototype,
                      Formula *formula,
                      Meter *m
         ) :
         index_(index),
-        vname_(vname),
-        xuantity_(xuantity),
-        display_unit_(display_unit),
-        vif_scaling_(vif_scaling),
-        dif_signedness_(dif_signedness),
-        scale_(scale),
-        matcher_(matcher),
-        help_(help),
-        print_properties_(print_properties),
-        get_numeric_value_override_(get_numeric_value_override),
-        get_string_value_override_(get_string_value_override),
-        set_numeric_value_override_(set_numeric_value_override),
-        set_string_value_override_(set_string_value_override),
-        lookup_(lookup),
+        prototype_(prototype),
         formula_(formula),
-        field_name_(newStringInterpolator()),
-        valid_field_name_(field_name_->parse(m, vname))
+        valid_field_name_(true)
 {
+    if (prototype_->plain_field_name) return;
+
+    // Only a templated field name needs an interpolator, and it refers to this meter.
+    field_name_ = shared_ptr<StringInterpolator>(newStringInterpolator());
+    valid_field_name_ = field_name_->parse(m, prototype_->vname);
     if (!valid_field_name_)
     {
-        warning("(meter) field template \"%s\" could not be parsed!\n", vname.c_str());
+        warning("(meter) field template \"%s\" could not be parsed!\n", prototype_->vname.c_str());
     }
+    cache_generated_names_ = valid_field_name_ && field_name_->onlyCounters();
 }
 
 string FieldInfo::renderJsonOnlyDefaultUnit(Meter *m)
@@ -1828,35 +2066,70 @@ string FieldInfo::renderJsonText(Meter *m, DVEntry *dve)
     return renderJson(m, dve);
 }
 
-string FieldInfo::generateFieldNameNoUnit(Meter *m, DVEntry *dve)
+GeneratedFieldName &FieldInfo::generatedName(Meter *m, DVEntry *dve)
 {
-    if (!valid_field_name_) return "bad_field_name";
+    GeneratedFieldName *n = &uncached_name_;
+
+    if (cache_generated_names_ && dve != NULL)
+    {
+        auto key = std::make_tuple(dve->storage_nr.intValue(), dve->tariff_nr.intValue(), dve->subunit_nr.intValue());
+        auto i = generated_names_.find(key);
+        if (i != generated_names_.end()) return i->second;
+        n = &generated_names_[key];
+    }
 
-    return field_name_->apply(m, dve);
+    *n = GeneratedFieldName();
+    if (!valid_field_name_)
+    {
+        n->no_unit = "bad_field_name";
+        n->with_unit = "bad_field_name";
+    }
+    else if (prototype_->plain_field_name)
+    {
+        n->no_unit = prototype_->vname;
+    }
+    else
+    {
+        n->no_unit = field_name_->apply(m, dve);
+    }
+    string unit_suffix;
+    if (xuantity() != Quantity::Text) unit_suffix = "_"+unitToStringLowerCase(displayUnit());
+    if (valid_field_name_) n->with_unit = n->no_unit+unit_suffix;
+    n->json_key = "\""+n->no_unit+unit_suffix+"\":";
+    return *n;
 }
 
-string FieldInfo::generateFieldNameWithUnit(Meter *m, DVEntry *dve)
+string FieldInfo::generateFieldNameNoUnit(Meter *m, DVEntry *dve)
 {
     if (!valid_field_name_) return "bad_field_name";
+    if (prototype_->plain_field_name) return prototype_->vname;
 
-    if (xuantity_ == Quantity::Text)
-    {
-        return field_name_->apply(m, dve);
-    }
-
-    string display_unit_s = unitToStringLowerCase(displayUnit());
-    string var = field_name_->apply(m, dve);
+    return generatedName(m, dve).no_unit;
+}
 
-    return var+"_"+display_unit_s;
+string FieldInfo::generateFieldNameWithUnit(Meter *m, DVEntry *dve)
+{
+    return generatedName(m, dve).with_unit;
 }
 
 
 string FieldInfo::renderJson(Meter *m, DVEntry *dve)
 {
     string s;
+    renderJson(m, dve, &s);
+    return s;
+}
 
-    string display_unit_s = unitToStringLowerCase(displayUnit());
-    string field_name = generateFieldNameNoUnit(m, dve);
+void FieldInfo::renderJson(Meter *m, DVEntry *dve, string *buf)
+{
+    if (prototype_->plain_field_name)
+    {
+        *buf += prototype_->json_key;
+    }
+    else
+    {
+        *buf += generatedName(m, dve).json_key;
+    }
 
     if (xuantity() == Quantity::Text)
     {
@@ -1867,37 +2140,35 @@ string FieldInfo::renderJson(Meter *m, DVEntry *dve)
             // be translated into "something":null in the json, indicating that there is no value.
             // This should not be a problem for now. Lets deal with it when a meter decides to send "null"
             // as its version string for example.
-            s += "\""+field_name+"\":null";
+            *buf += "null";
         }
         else
         {
-            // Normally the string values are quoted in json. TODO quote the value properly.
-            // A well crafted meter could send a version string with " and break the json format.
-            s += "\""+field_name+"\":\""+v+"\"";
+            appendJsonString(buf, v);
         }
     }
     else
     {
+        double v = m->getNumericValue(this, dve, displayUnit());
+
         if (displayUnit() == Unit::DateLT)
         {
-            s += "\""+field_name+"_"+display_unit_s+"\":\""+strdate(m->getNumericValue(field_name, Unit::DateLT))+"\"";
+            appendJsonString(buf, strdate(v));
         }
         else if (displayUnit() == Unit::DateTimeLT)
         {
-            s += "\""+field_name+"_"+display_unit_s+"\":\""+strdatetime(m->getNumericValue(field_name, Unit::DateTimeLT))+"\"";
+            appendJsonString(buf, strdatetime(v));
         }
         else if (displayUnit() == Unit::DateTimeUTC)
         {
-            s += "\""+field_name+"_"+display_unit_s+"\":\""+strTimestampUTC(m->getNumericValue(field_name, Unit::DateTimeUTC))+"\"";
+            appendJsonString(buf, strTimestampUTC(v));
         }
         else
         {
             // All numeric values.
-            s += "\""+field_name+"_"+display_unit_s+"\":"+valueToString(m->getNumericValue(field_name, displayUnit()), displayUnit());
+            appendValueToString(buf, v, displayUnit());
         }
     }
-
-    return s;
 }
 
 void MeterCommonImplementation::createMeterEnv(string id,
@@ -1932,8 +2203,17 @@ void MeterCommonImplementation::printMeter(Telegram *t,
 {
     bool first = !t->meter->hasReceivedFirstTelegram();
 
-    *human_readable = concatFields(this, t, '\t', field_infos_, true, selected_fields, extra_constant_fields);
-    *fields = concatFields(this, t, separator, field_infos_, false, selected_fields, extra_constant_fields);
+    if (human_readable != NULL)
+    {
+        *human_readable = concatFields(this, t, '\t', field_infos_, true, selected_fields, extra_constant_fields);
+    }
+    if (fields != NULL)
+    {
+        *fields = concatFields(this, t, separator, field_infos_, false, selected_fields, extra_constant_fields);
+    }
+
+    // The env variables include the json.
+    if (json == NULL && envs == NULL) return;
 
     string media;
     if (t->tpl_id_found)
@@ -1964,100 +2244,102 @@ void MeterCommonImplementation::printMeter(Telegram *t,
         newline ="\n";
     }
 
-    string s;
-    s += "{"+newline;
-    s += indent+"\"_\":\"telegram\","+newline;
-    s += indent+"\"media\":\""+media+"\","+newline;
-    s += indent+"\"meter\":\""+driverName().str()+"\","+newline;
-    s += indent+"\"name\":\""+name()+"\","+newline;
-    s += indent+"\"id\":\""+id+"\","+newline;
+    // Build the json straight into the caller's buffer, which keeps its capacity between telegrams.
+    string local;
+    string &s = json != NULL ? *json : local;
+    s.clear();
 
-    // Iterate over the meter field infos...
-    map<FieldInfo*,set<DVEntry*>> founds; // Multiple dventries can match to a single field info.
-    set<string> found_vnames;
+    s += '{'; s += newline;
+    s += indent; s += "\"_\":\"telegram\","; s += newline;
+    s += indent; s += "\"media\":"; appendJsonString(&s, media); s += ','; s += newline;
+    s += indent; s += "\"meter\":"; appendJsonString(&s, driverName().str()); s += ','; s += newline;
+    s += indent; s += "\"name\":"; appendJsonString(&s, name()); s += ','; s += newline;
+    s += indent; s += "\"id\":"; appendJsonString(&s, id); s += ','; s += newline;
 
-    for (auto &p : numeric_values_)
+    // The slots are listed in name order by the driver.
+    DriverFields &df = driver_info_->fields();
+    WITH(df.lock, driver_fields_lock, printMeter);
+
+    for (auto &p : df.numeric_slots)
     {
-        string vname = p.first.first;
-        NumericField& nf = p.second;
+        NumericField *nfp = numericField(p.second);
+        if (nfp == NULL) continue;
+        NumericField &nf = *nfp;
         if (nf.field_info->printProperties().hasHIDE()) continue;
 
-        string out = nf.field_info->renderJson(this, &nf.dv_entry);
-        s += indent+out+","+newline;
+        s += indent;
+        size_t start = s.size();
+        nf.field_info->renderJson(this, &nf.dv_entry, &s);
+        size_t end = s.size();
+        s += ','; s += newline;
 
         if (first && getDetailedFirst())
         {
-            size_t pos = out.find("\":");
-            if (pos != string::npos)
+            size_t pos = s.find("\":", start);
+            if (pos < end)
             {
-                string rule = out.substr(0, pos)+"_field\":"+to_string(nf.field_info->index());
-                s += indent+rule+","+newline;
+                string rule = s.substr(start, pos-start)+"_field\":"+to_string(nf.field_info->index());
+                s += indent; s += rule; s += ','; s += newline;
             }
         }
     }
 
-    for (auto &p : string_values_)
+    for (auto &p : df.string_slots)
     {
-        string vname = p.first;
-        StringField& sf = p.second;
-        string out;
+        const string &vname = p.first;
+        StringField *sfp = stringField(p.second);
+        if (sfp == NULL) continue;
+        StringField &sf = *sfp;
 
         if (sf.field_info->printProperties().hasHIDE()) continue;
+
+        s += indent; s += '"'; s += vname; s += "\":";
         if (sf.field_info->printProperties().hasSTATUS())
         {
-            string in = getStatusField(sf.field_info);
-            out = tostrprintf("\"%s\":\"%s\"", vname.c_str(), in.c_str());
-            s += indent+out+","+newline;
+            appendJsonString(&s, getStatusField(sf.field_info));
+        }
+        else if (sf.value == "null")
+        {
+            // The string "null" translates to actual json null.
+            s += "null";
         }
         else
         {
-            if (sf.value == "null")
-            {
-                // The string "null" translates to actual json null.
-                out = tostrprintf("\"%s\":null", vname.c_str());
-                s += indent+out+","+newline;
-            }
-            else
-            {
-                out = tostrprintf("\"%s\":\"%s\"", vname.c_str(), sf.value.c_str());
-                s += indent+out+","+newline;
-            }
+            appendJsonString(&s, sf.value);
         }
+        s += ','; s += newline;
+
         if (first && getDetailedFirst())
         {
-            size_t pos = out.find("\":");
-            if (pos != string::npos)
-            {
-                string rule = out.substr(0, pos)+"_field\":"+to_string(sf.field_info->index());
-                s += indent+rule+","+newline;
-            }
+            s += indent; s += '"'; s += vname; s += "_field\":"; s += to_string(sf.field_info->index()); s += ','; s += newline;
         }
     }
-    s += indent+"\"timestamp\":\""+datetimeOfUpdateRobot()+"\"";
+    s += indent; s += "\"timestamp\":"; appendJsonString(&s, datetimeOfUpdateRobot());
 
     if (t->about.device != "")
     {
-        s += ","+newline;
-        s += indent+"\"device\":\""+t->about.device+"\","+newline;
-        s += indent+"\"rssi_dbm\":"+to_string(t->about.rssi_dbm);
+        s += ','; s += newline;
+        s += indent; s += "\"device\":"; appendJsonString(&s, t->about.device); s += ','; s += newline;
+        s += indent; s += "\"rssi_dbm\":"; s += to_string(t->about.rssi_dbm);
     }
-    for (string extra_field : meterExtraConstantFields())
+    for (string &extra_field : meterExtraConstantFields())
     {
-        s += ","+newline;
-        s += indent+makeQuotedJson(extra_field);
+        s += ','; s += newline;
+        s += indent; s += makeQuotedJson(extra_field);
     }
-    for (string extra_field : *extra_constant_fields)
+    for (string &extra_field : *extra_constant_fields)
     {
-        s += ","+newline;
-        s += indent+makeQuotedJson(extra_field);
+        s += ','; s += newline;
+        s += indent; s += makeQuotedJson(extra_field);
     }
     s += newline;
-    s += "}";
-    *json = s;
+    s += '}';
+
+    if (envs == NULL) return;
 
     createMeterEnv(id, envs, extra_constant_fields);
 
-    envs->push_back(string("METER_JSON=")+*json);
+    envs->push_back(string("METER_JSON=")+s);
     envs->push_back(string("METER_MEDIA=")+media);
     envs->push_back(string("METER_TIMESTAMP=")+datetimeOfUpdateRobot());
     envs->push_back(string("METER_TIMESTAMP_UTC=")+datetimeOfUpdateRobot());
@@ -2068,18 +2350,13 @@ void MeterCommonImplementation::printMeter(Telegram *t,
     {
         if (fi.printProperties().hasHIDE()) continue;
 
-        string display_unit_s = unitToStringUpperCase(fi.displayUnit());
-        string var = fi.vname();
-        std::transform(var.begin(), var.end(), var.begin(), ::toupper);
         if (fi.xuantity() == Quantity::Text)
         {
-            string envvar = "METER_"+var+"="+getStringValue(&fi);
-            envs->push_back(envvar);
+            envs->push_back(fi.envName()+getStringValue(&fi));
         }
         else
         {
-            string envvar = "METER_"+var+"_"+display_unit_s+"="+valueToString(getNumericValue(&fi, fi.displayUnit()), fi.displayUnit());
-            envs->push_back(envvar);
+            envs->push_back(fi.envName()+valueToString(getNumericValue(&fi, fi.displayUnit()), fi.displayUnit()));
         }
     }
 
@@ -2144,9 +2421,7 @@ bool isMeterDriverReasonableForMedia(string driver_name, int media)
     return false;
 }
 
-DriverInfo driver_unknown_;
-
-DriverInfo pickMeterDriver(Telegram *t)
+DriverInfo *pickMeterDriver(Telegram *t)
 {
     int manufacturer = t->dll_mfct;
     int version = t->dll_version;
@@ -2159,15 +2434,11 @@ DriverInfo pickMeterDriver(Telegram *t)
         type = t->tpl_type;
     }
 
-    for (DriverInfo *p : allDrivers())
-    {
-        if (p->detect(manufacturer, version, type))
-        {
-            return *p;
-        }
-    }
+    verifyDriverLookupCreated();
+    auto i = registered_drivers_by_mvt_->find(mvtKey(manufacturer, version, type));
+    if (i == registered_drivers_by_mvt_->end()) return NULL;
 
-    return driver_unknown_;
+    return i->second;
 }
 
 shared_ptr<Meter> createMeter(MeterInfo *mi)
@@ -2372,7 +2643,7 @@ bool isValidKey(const string& key, MeterInfo &mi)
 
 void FieldInfo::performExtraction(Meter *m, Telegram *t, DVEntry *dve)
 {
-    if (xuantity_ == Quantity::Text)
+    if (xuantity() == Quantity::Text)
     {
         // Extract a string.
         extractString(m, t, dve);
@@ -2399,7 +2670,7 @@ void FieldInfo::performCalculation(Meter *m)
 
 bool FieldInfo::hasMatcher()
 {
-    return matcher_.active == true;
+    return matcher().active == true;
 }
 
 bool FieldInfo::hasFormula()
@@ -2409,19 +2680,19 @@ bool FieldInfo::hasFormula()
 
 bool FieldInfo::matches(DVEntry *dve)
 {
-    return matcher_.matches(*dve);
+    return matcher().matches(*dve);
 }
 
 string FieldInfo::str()
 {
     return tostrprintf("%d %s_%s (%s) %s [%s] \"%s\"",
                        index_,
-                       vname_.c_str(),
-                       unitToStringLowerCase(display_unit_).c_str(),
-                       toString(xuantity_),
-                       toString(vif_scaling_),
-                       matcher_.str().c_str(),
-                       help_.c_str());
+                       vname().c_str(),
+                       unitToStringLowerCase(displayUnit()).c_str(),
+                       toString(xuantity()),
+                       toString(vifScaling()),
+                       matcher().str().c_str(),
+                       help().c_str());
 }
 
 DriverName MeterInfo::driverName()
@@ -2432,18 +2703,18 @@ DriverName MeterInfo::driverName()
 bool FieldInfo::extractNumeric(Meter *m, Telegram *t, DVEntry *dve)
 {
     bool found = false;
-    string key = matcher_.dif_vif_key.str();
+    string key = matcher().dif_vif_key.str();
 
     if (dve == NULL)
     {
         if (key == "")
         {
             // Search for key.
-            bool ok = findKeyWithNr(matcher_.measurement_type,
-                                    matcher_.vif_range,
-                                    matcher_.storage_nr_from.intValue(),
-                                    matcher_.tariff_nr_from.intValue(),
-                                    matcher_.index_nr.intValue(),
+            bool ok = findKeyWithNr(matcher().measurement_type,
+                                    matcher().vif_range,
+                                    matcher().storage_nr_from.intValue(),
+                                    matcher().tariff_nr_from.intValue(),
+                                    matcher().index_nr.intValue(),
                                     &key,
                                     &t->dv_entries);
             // No entry was found.
@@ -2470,7 +2741,7 @@ bool FieldInfo::extractNumeric(Meter *m, Telegram *t, DVEntry *dve)
     if (dve->extractDouble(&extracted_double_value, auto_vif_scaling, force_unsigned))
     {
         Unit decoded_unit = displayUnit();
-        if (matcher_.vif_range == VIFRange::DateTime)
+        if (matcher().vif_range == VIFRange::DateTime)
         {
             struct tm datetime;
             dve->extractDate(&datetime);
@@ -2478,32 +2749,32 @@ bool FieldInfo::extractNumeric(Meter *m, Telegram *t, DVEntry *dve)
             string bbb = strdatetime(tmp);
             extracted_double_value = tmp;
         }
-        else if (matcher_.vif_range == VIFRange::Date)
+        else if (matcher().vif_range == VIFRange::Date)
         {
             struct tm date;
             dve->extractDate(&date);
             time_t tmp = mktime(&date);
             extracted_double_value = tmp;
         }
-        else if (matcher_.vif_range == VIFRange::AnyEnergyVIF ||
-                 matcher_.vif_range == VIFRange::AnyVolumeVIF ||
-                 matcher_.vif_range == VIFRange::AnyPowerVIF)
+        else if (matcher().vif_range == VIFRange::AnyEnergyVIF ||
+                 matcher().vif_range == VIFRange::AnyVolumeVIF ||
+                 matcher().vif_range == VIFRange::AnyPowerVIF)
         {
             // Find the actual unit used in the telegram.
             decoded_unit = toDefaultUnit(dve->vif);
         }
-        else if (matcher_.vif_range != VIFRange::Any &&
-                 matcher_.vif_range != VIFRange::None)
+        else if (matcher().vif_range != VIFRange::Any &&
+                 matcher().vif_range != VIFRange::None)
         {
             // Pick the default unit for this range.
-            decoded_unit = toDefaultUnit(matcher_.vif_range);
+            decoded_unit = toDefaultUnit(matcher().vif_range);
         }
 
         debug("(meter) %s %s decoded %s default %s value %g (scale %g)\n",
-              toString(matcher_.vif_range),
+              toString(matcher().vif_range),
               field_name.c_str(),
               unitToStringLowerCase(decoded_unit).c_str(),
-              unitToStringLowerCase(display_unit_).c_str(),
+              unitToStringLowerCase(displayUnit()).c_str(),
               extracted_double_value,
               scale());
 
@@ -2512,12 +2783,12 @@ bool FieldInfo::extractNumeric(Meter *m, Telegram *t, DVEntry *dve)
             // Hardcoded scale factor for this field used for manufacturer specific values without vif units.
             extracted_double_value *= scale();
         }
-        if (overrideConversion(decoded_unit, display_unit_))
+        if (overrideConversion(decoded_unit, displayUnit()))
         {
             // Special case! Transform the decoded unit into the display unit. I.e. kwh was replaced with kvarh.
-            decoded_unit = display_unit_;
+            decoded_unit = displayUnit();
         }
-        m->setNumericValue(this, dve, display_unit_, convert(extracted_double_value, decoded_unit, display_unit_));
+        m->setNumericValue(this, dve, displayUnit(), convert(extracted_double_value, decoded_unit, displayUnit()));
         t->addMoreExplanation(dve->offset, renderJson(m, dve));
         found = true;
     }
@@ -2556,7 +2827,7 @@ static string add_tpl_status(string existing_status, Meter *m, Telegram *t)
 bool FieldInfo::extractString(Meter *m, Telegram *t, DVEntry *dve)
 {
     bool found = false;
-    string key = matcher_.dif_vif_key.str();
+    string key = matcher().dif_vif_key.str();
 
     if (dve == NULL)
     {
@@ -2565,7 +2836,7 @@ bool FieldInfo::extractString(Meter *m, Telegram *t, DVEntry *dve)
             if (!hasMatcher())
             {
                 // There is no matcher, only use case is to capture JOIN_TPL_STATUS.
-                if (print_properties_.hasINCLUDETPLSTATUS())
+                if (printProperties().hasINCLUDETPLSTATUS())
                 {
                     string status = add_tpl_status("OK", m, t);
                     m->setStringValue(this, status, dve);
@@ -2575,17 +2846,17 @@ bool FieldInfo::extractString(Meter *m, Telegram *t, DVEntry *dve)
             else
             {
                 // Search for key.
-                bool ok = findKeyWithNr(matcher_.measurement_type,
-                                        matcher_.vif_range,
-                                        matcher_.storage_nr_from.intValue(),
-                                        matcher_.tariff_nr_from.intValue(),
-                                        matcher_.index_nr.intValue(),
+                bool ok = findKeyWithNr(matcher().measurement_type,
+                                        matcher().vif_range,
+                                        matcher().storage_nr_from.intValue(),
+                                        matcher().tariff_nr_from.intValue(),
+                                        matcher().index_nr.intValue(),
                                         &key,
                                         &t->dv_entries);
                 // No entry was found.
                 if (!ok) {
                     // Nothing found, however check if capturing JOIN_TPL_STATUS.
-                    if (print_properties_.hasINCLUDETPLSTATUS())
+                    if (printProperties().hasINCLUDETPLSTATUS())
                     {
                         string status = add_tpl_status("OK", m, t);
                         m->setStringValue(this, status, dve);
@@ -2599,7 +2870,7 @@ bool FieldInfo::extractString(Meter *m, Telegram *t, DVEntry *dve)
         if (t->dv_entries.count(key) == 0)
         {
             // Nothing found, however check if capturing JOIN_TPL_STATUS.
-            if (print_properties_.hasINCLUDETPLSTATUS())
+            if (printProperties().hasINCLUDETPLSTATUS())
             {
                 string status = add_tpl_status("OK", m, t);
                 m->setStringValue(this, status, dve);
@@ -2612,22 +2883,19 @@ bool FieldInfo::extractString(Meter *m, Telegram *t, DVEntry *dve)
     assert(dve != NULL);
     assert(key == "" || dve->dif_vif_key.str() == key);
 
-    // Generate the json field name:
-    string field_name = generateFieldNameNoUnit(m, dve);
-
     uint64_t extracted_bits {};
-    if (lookup_.hasLookups() || (print_properties_.hasINCLUDETPLSTATUS()))
+    if (lookup().hasLookups() || (printProperties().hasINCLUDETPLSTATUS()))
     {
         string translated_bits = "";
         // The field has lookups, or the print property JOIN_TPL_STATUS is set,
         // this means that we should create a string.
-        if (lookup_.hasLookups() && dve->extractLong(&extracted_bits))
+        if (lookup().hasLookups() && dve->extractLong(&extracted_bits))
         {
             translated_bits = lookup().translate(extracted_bits);
             found = true;
         }
 
-        if (print_properties_.hasINCLUDETPLSTATUS())
+        if (printProperties().hasINCLUDETPLSTATUS())
         {
             translated_bits = add_tpl_status(translated_bits, m, t);
         }
@@ -2638,13 +2906,13 @@ bool FieldInfo::extractString(Meter *m, Telegram *t, DVEntry *dve)
             t->addMoreExplanation(dve->offset, renderJsonText(m, dve));
         }
     }
-    else if (matcher_.vif_range == VIFRange::DateTime)
+    else if (matcher().vif_range == VIFRange::DateTime)
     {
         struct tm datetime;
         dve->extractDate(&datetime);
         string extracted_device_date_time;
 
-        if (dve->value.size() == 12)
+        if (dve->value_bytes.size() == 6)
         {
             // A long date time sec + timezone field. TODO add timezone data.
             extracted_device_date_time = strdatetimesec(&datetime);
@@ -2657,7 +2925,7 @@ bool FieldInfo::extractString(Meter *m, Telegram *t, DVEntry *dve)
         t->addMoreExplanation(dve->offset, renderJsonText(m, dve));
         found = true;
     }
-    else if (matcher_.vif_range == VIFRange::Date)
+    else if (matcher().vif_range == VIFRange::Date)
     {
         struct tm date;
         dve->extractDate(&date);
@@ -2666,19 +2934,19 @@ bool FieldInfo::extractString(Meter *m, Telegram *t, DVEntry *dve)
         t->addMoreExplanation(dve->offset, renderJsonText(m, dve));
         found = true;
     }
-    else if (matcher_.vif_range == VIFRange::Any ||
-             matcher_.vif_range == VIFRange::EnhancedIdentification ||
-             matcher_.vif_range == VIFRange::FabricationNo ||
-             matcher_.vif_range == VIFRange::HardwareVersion ||
-             matcher_.vif_range == VIFRange::FirmwareVersion ||
-             matcher_.vif_range == VIFRange::Medium ||
-             matcher_.vif_range == VIFRange::Manufacturer ||
-             matcher_.vif_range == VIFRange::ModelVersion ||
-             matcher_.vif_range == VIFRange::SoftwareVersion ||
-             matcher_.vif_range == VIFRange::Customer ||
-             matcher_.vif_range == VIFRange::Location ||
-             matcher_.vif_range == VIFRange::SpecialSupplierInformation ||
-             matcher_.vif_range == VIFRange::ParameterSet)
+    else if (matcher().vif_range == VIFRange::Any ||
+             matcher().vif_range == VIFRange::EnhancedIdentification ||
+             matcher().vif_range == VIFRange::FabricationNo ||
+             matcher().vif_range == VIFRange::HardwareVersion ||
+             matcher().vif_range == VIFRange::FirmwareVersion ||
+             matcher().vif_range == VIFRange::Medium ||
+             matcher().vif_range == VIFRange::Manufacturer ||
+             matcher().vif_range == VIFRange::ModelVersion ||
+             matcher().vif_range == VIFRange::SoftwareVersion ||
+             matcher().vif_range == VIFRange::Customer ||
+             matcher().vif_range == VIFRange::Location ||
+             matcher().vif_range == VIFRange::SpecialSupplierInformation ||
+             matcher().vif_range == VIFRange::ParameterSet)
     {
         string extracted_id;
         dve->extractReadableString(&extracted_id);
@@ -2689,7 +2957,7 @@ bool FieldInfo::extractString(Meter *m, Telegram *t, DVEntry *dve)
     else
     {
         error("Internal error: Cannot extract text string from vif %s in %s:%d\n",
-              toString(matcher_.vif_range),
+              toString(matcher().vif_range),
               __FILE__, __LINE__);
 
     }
@@ -21,6 +21,7 @@
 #include"address.h"
 #include"dvparser.h"
 #include"formula.h"
+#include"threads.h"
 #include"util.h"
 #include"units.h"
 #include"translatebits.h"
@@ -29,8 +30,10 @@
 
 #include<assert.h>
 #include<functional>
+#include<map>
 #include<numeric>
 #include<string>
+#include<tuple>
 #include<vector>
 
 
@@ -154,6 +157,33 @@ struct MVT
     uchar type;
 };
 
+struct DynamicDriverFields;
+struct FieldPrototype;
+
+// The positions of the field prototypes whose matchers accept a difvif key.
+struct DriverFieldMatches
+{
+    size_t num_prototypes {}; // The number of prototypes that have been tested.
+    vector<size_t> positions;
+};
+
+// The fields of a driver, shared by all meters using the driver. Meters append
+// prototypes while they are created and the decoder threads read the table,
+// so both are protected by the lock.
+struct DriverFields
+{
+    RecursiveMutex lock = { "driver_fields_lock" };
+    vector<shared_ptr<FieldPrototype>> prototypes;
+    // Map difvif key to the prototypes whose matchers accept it. Filled on demand and
+    // extended when prototypes have been appended since the key was first seen.
+    map<string,DriverFieldMatches> matches;
+    // Map field name+Unit to its numeric value slot, the slot is the same in every
+    // meter using the driver. Iterating gives the print order.
+    map<pair<string,Unit>,size_t> numeric_slots;
+    // Map field name (at_date) to its string value slot.
+    map<string,size_t> string_slots;
+};
+
 struct DriverInfo
 {
 private:
@@ -171,6 +201,8 @@ private:
     XMQDoc *dynamic_driver_ {}; // Configuration loaded from driver file.
     string dynamic_file_name_; // Name of actual loaded driver file.
     string dynamic_source_xmq_ {}; // A copy of the xmq used to create a dynamic driver.
+    shared_ptr<const DynamicDriverFields> dynamic_fields_; // The fields compiled from the dynamic driver.
+    shared_ptr<DriverFields> fields_ = make_shared<DriverFields>(); // The fields shared by all meters using this driver.
 
 public:
     ~DriverInfo();
@@ -187,12 +219,15 @@ public:
     void usesProcessContent() { has_process_content_ = true; }
     void setDynamic(const string &file_name, XMQDoc *driver) { dynamic_file_name_ = file_name; dynamic_driver_ = driver; }
     void setDynamicSource(const string &content) { dynamic_source_xmq_ = content; }
+    void setDynamicFields(shared_ptr<const DynamicDriverFields> dfs) { dynamic_fields_ = dfs; }
 
     XMQDoc *getDynamicDriver() { return dynamic_driver_; }
     const string &getDynamicFileName() { return dynamic_file_name_; }
     const string &getDynamicSource() { return dynamic_source_xmq_; }
+    const DynamicDriverFields *getDynamicFields() { return dynamic_fields_.get(); }
 
     vector<MVT> &mvts() { return mvts_; }
+    DriverFields &fields() { return *fields_; }
 
     DriverName name() { return name_; }
     vector<DriverName>& nameAliases() { return name_aliases_; }
@@ -218,8 +253,8 @@ bool staticRegisterDriver(function<void(DriverInfo&di)> setup);
 // Lookup (and load if necessary) driver from memory or disk.
 DriverInfo *lookupDriver(string name);
 bool lookupDriverInfo(const string& driver, DriverInfo *di = NULL);
-// Return the best driver match for a telegram.
-DriverInfo pickMeterDriver(Telegram *t);
+// Return the driver that auto detects the mfct/version/type of the telegram, or NULL.
+DriverInfo *pickMeterDriver(Telegram *t);
 // Return true for mbus and S2/C2/T2 drivers.
 bool driverNeedsPolling(DriverName& dn);
 
@@ -276,6 +311,7 @@ struct PrintProperties
     bool hasINJECTINTOSTATUS() { return props_ & PrintProperty::INJECT_INTO_STATUS; }
     bool hasHIDE() { return props_ & PrintProperty::HIDE; }
     bool hasUnknown() { return props_ & PrintProperty::Unknown; }
+    int bits() const { return props_; }
 
 private:
     int props_;
@@ -286,43 +322,91 @@ PrintProperties toPrintProperties(string s);
 
 #define DEFAULT_PRINT_PROPERTIES 0
 
+// The part of a field that is the same for all meters using the same driver.
+// It is created by the first meter and then shared by the following meters,
+// instead of every meter keeping its own copy of the matcher, lookup and names.
+// A prototype is never modified after it has been created.
+struct FieldPrototype
+{
+    FieldPrototype(const string &vname,
+                   Quantity xuantity,
+                   Unit display_unit,
+                   VifScaling vif_scaling,
+                   DifSignedness dif_signedness,
+                   double scale,
+                   const FieldMatcher &matcher,
+                   const string &help,
+                   PrintProperties print_properties,
+                   const Translate::Lookup &lookup);
+
+    // True if this prototype was created from an identical field declaration.
+    // Compared member by member, so that no temporary prototype has to be built.
+    bool sameAs(const string &vname,
+                Quantity xuantity,
+                Unit display_unit,
+                VifScaling vif_scaling,
+                DifSignedness dif_signedness,
+                double scale,
+                const FieldMatcher &matcher,
+                const string &help,
+                PrintProperties print_properties,
+                const Translate::Lookup &lookup) const;
+
+    string vname; // Value name, like: total current previous target, ie no unit suffix.
+    Quantity xuantity; // Quantity: Energy, Volume
+    Unit display_unit; // Selected display unit for above quantity: KWH, M3
+    VifScaling vif_scaling;
+    DifSignedness dif_signedness;
+    double scale; // A hardcoded scale factor. Used only for manufacturer specific values with unknown units for the vifs.
+    FieldMatcher matcher;
+    string help; // Helpful information on this meters use of this value.
+    PrintProperties print_properties;
+    Translate::Lookup lookup; // Lookup bits to strings.
+
+    // If the field name has no {} template parts.
+    bool plain_field_name {};
+    // The driver's value slot for a plain field name, -1 if not assigned.
+    int numeric_slot = -1;
+    int string_slot = -1;
+    // The json key "total_m3": used when the field name is plain.
+    string json_key;
+    // The env variable prefix METER_TOTAL_M3=
+    string env_name;
+};
+
+// A field name generated from a templated vname, like total_at_month_2 from total_at_month_{storage_counter}.
+struct GeneratedFieldName
+{
+    string no_unit;        // total_at_month_2
+    string with_unit;      // total_at_month_2_m3
+    string json_key;       // "total_at_month_2_m3":
+};
+
 struct FieldInfo
 {
     ~FieldInfo();
     FieldInfo(int index,
-              string vname,
-              Quantity quantity,
-              Unit display_unit,
-              VifScaling vif_scaling,
-              DifSignedness dif_signedness,
-              double scale,
-              FieldMatcher matcher,
-              string help,
-              PrintProperties print_properties,
-              function<double(Unit)> get_numeric_value_override,
-              function<string()> get_string_value_override,
-              function<void(Unit,double)> set_numeric_value_override,
-              function<void(string)> set_string_value_override,
-              Translate::Lookup lookup,
+              shared_ptr<FieldPrototype> prototype,
               Formula *formula,
               Meter *m
         );
 
     int index() { return index_; }
-    string vname() { return vname_; }
-    Quantity xuantity() { return xuantity_; }
-    Unit displayUnit() { return display_unit_; }
-    VifScaling vifScaling() { return vif_scaling_; }
-    DifSignedness difSignedness() { return dif_signedness_; }
-    double scale() { return scale_; }
-    FieldMatcher& matcher() { return matcher_; }
-    string help() { return help_; }
-    PrintProperties printProperties() { return print_properties_; }
+    string vname() { return prototype_->vname; }
+    Quantity xuantity() { return prototype_->xuantity; }
+    Unit displayUnit() { return prototype_->display_unit; }
+    VifScaling vifScaling() { return prototype_->vif_scaling; }
+    DifSignedness difSignedness() { return prototype_->dif_signedness; }
+    double scale() { return prototype_->scale; }
+    const FieldMatcher& matcher() { return prototype_->matcher; }
+    string help() { return prototype_->help; }
+    PrintProperties printProperties() { return prototype_->print_properties; }
 
     bool extractNumeric(Meter *m, Telegram *t, DVEntry *dve = NULL);
     bool extractString(Meter *m, Telegram *t, DVEntry *dve = NULL);
     bool hasMatcher();
     bool hasFormula();
+    Formula *formula() { return formula_.get(); }
     bool matches(DVEntry *dve);
     void performExtraction(Meter *m, Telegram *t, DVEntry *dve);
 
@@ -330,6 +414,8 @@ struct FieldInfo
 
     string renderJsonOnlyDefaultUnit(Meter *m);
     string renderJson(Meter *m, DVEntry *dve);
+    // Append the rendered json to buf.
+    void renderJson(Meter *m, DVEntry *dve, string *buf);
     string renderJsonText(Meter *m, DVEntry *dve);
     // Render the field name based on the actual field from the telegram.
     // A FieldInfo can be declared to handle any number of storage fields of a certain range.
@@ -337,10 +423,20 @@ struct FieldInfo
     // total_at_month_2 (for the dventry with storage nr 2.)
     string generateFieldNameWithUnit(Meter *m, DVEntry *dve);
     string generateFieldNameNoUnit(Meter *m, DVEntry *dve);
+    // Return the generated names for a templated field. The names are kept for each
+    // storage, tariff and subunit combination, unless the template reads meter fields.
+    GeneratedFieldName &generatedName(Meter *m, DVEntry *dve);
+    // True if the field name is not a template, ie it is always the vname.
+    bool hasPlainFieldName() { return prototype_->plain_field_name; }
+    // The driver's value slot for the plain field name, -1 if not assigned.
+    int numericSlot() { return prototype_->numeric_slot; }
+    int stringSlot() { return prototype_->string_slot; }
+    // The env variable prefix, like METER_TOTAL_M3=
+    const string &envName() { return prototype_->env_name; }
     // Check if the meter object stores a value for this field.
     bool hasValue(Meter *m);
 
-    Translate::Lookup& lookup() { return lookup_; }
+    const Translate::Lookup& lookup() { return prototype_->lookup; }
 
     string str();
 
@@ -349,35 +445,25 @@ struct FieldInfo
 private:
 
     int index_; // The field infos for a meter are ordered.
-    string vname_; // Value name, like: total current previous target, ie no unit suffix.
-    Quantity xuantity_; // Quantity: Energy, Volume
-    Unit display_unit_; // Selected display unit for above quantity: KWH, M3
-    VifScaling vif_scaling_;
-    DifSignedness dif_signedness_;
-    double scale_; // A hardcoded scale factor. Used only for manufacturer specific values with unknown units for the vifs.
-    FieldMatcher matcher_;
-    string help_; // Helpful information on this meters use of this value.
-    PrintProperties print_properties_;
-
-    // Normally the values are stored inside the meter object using its setNumeric/setString/getNumeric/getString
-    // But for special fields we can override this default location with these setters/getters.
-    function<double(Unit)> get_numeric_value_override_; // Callback to fetch the value from the meter.
-    function<string()> get_string_value_override_; // Callback to fetch the value from the meter.
-    function<void(Unit,double)> set_numeric_value_override_; // Call back to set the value in the c++ object
-    function<void(string)> set_string_value_override_; // Call back to set the value string in the c++ object
-
-    // Lookup bits to strings.
-    Translate::Lookup lookup_;
-
-    // For calculated fields.
+
+    // Shared with the other meters using the same driver.
+    shared_ptr<FieldPrototype> prototype_;
+
+    // For calculated fields. The formula refers to this meter and is not shared.
     shared_ptr<Formula> formula_;
 
-    // For the generated field name.
+    // For the generated field name, only created when the name is a template.
     shared_ptr<StringInterpolator> field_name_;
 
     // If the field name template could not be parsed.
     bool valid_field_name_ {};
 
+    // The generated names keyed on the storage, tariff and subunit counters.
+    std::map<std::tuple<int,int,int>,GeneratedFieldName> generated_names_;
+    // Used instead when the names cannot be kept.
+    GeneratedFieldName uncached_name_;
+    bool cache_generated_names_ {};
+
     // If true then this field was fetched from the library.
     bool from_library_ {};
 };
@@ -385,6 +471,14 @@ private:
 struct BusManager;
 struct MeterManager;
 
+// The outcome of polling a meter, used for the poll metrics.
+struct PollOutcome
+{
+    bool polled {}; // A request was sent, ie the meter was due and had a valid poll address.
+    bool responded {}; // The meter responded to all requests before the timeout.
+    int latency_ms {}; // Time from the first request until its response.
+};
+
 struct Meter
 {
     // Meters are instantiated on the fly from a template, when a telegram arrives
@@ -405,6 +499,8 @@ struct Meter
     virtual string name() = 0;
     virtual DriverName driverName() = 0;
     virtual DriverInfo *driverInfo() = 0;
+    // The metrics shared by the meters using the driver, NULL when the metrics are disabled.
+    virtual DriverMetrics *driverMetrics() = 0;
     virtual bool hasReceivedFirstTelegram() = 0;
     virtual void markFirstTelegramReceived() = 0;
 
@@ -420,6 +516,8 @@ struct Meter
     virtual void setNumericValue(FieldInfo *fi, DVEntry *dve, Unit u, double v) = 0;
     virtual double getNumericValue(string vname, Unit u) = 0;
     virtual double getNumericValue(FieldInfo *fi, Unit u) = 0;
+    // Get the value stored under the name generated for the dventry, dve can be NULL.
+    virtual double getNumericValue(FieldInfo *fi, DVEntry *dve, Unit u) = 0;
     virtual void setStringValue(FieldInfo *fi, std::string v, DVEntry *dve) = 0;
     virtual void setStringValue(string vname, std::string v, DVEntry *dve = NULL) = 0;
     virtual std::string getStringValue(FieldInfo *fi) = 0;
@@ -427,10 +525,14 @@ struct Meter
 
     virtual void onUpdate(std::function<void(Telegram*t,Meter*)> cb) = 0;
     virtual int numUpdates() = 0;
+    // The number of calculated fields evaluated, and skipped since no field they read was set by the telegram.
+    virtual size_t numCalculations() = 0;
+    virtual size_t numSkippedCalculations() = 0;
 
     virtual void createMeterEnv(string id,
                                 vector<string> *envs,
                                 vector<string> *more_json) = 0;
+    // Pass NULL for the outputs that are not needed, they will then not be rendered.
     virtual void printMeter(Telegram *t,
                             string *human_readable,
                             string *fields, char separator,
@@ -443,9 +545,14 @@ struct Meter
     // The handleTelegram expects an input_frame where the DLL crcs have been removed.
     // Returns true of this meter handled this telegram!
     // Sets id_match to true, if there was an id match, even though the telegram could not be properly handled.
-    virtual bool handleTelegram(AboutTelegram &about, vector<uchar> input_frame,
+    virtual bool handleTelegram(AboutTelegram &about, const vector<uchar> &input_frame,
                                 bool simulated, std::vector<Address> *addresses,
                                 bool *id_match, Telegram *out_t = NULL) = 0;
+    // Same as handleTelegram but the header has already been parsed, typically by the meter manager,
+    // which shares the same parsed header between all meters that are offered the telegram.
+    // The header is only read, the full telegram is parsed using the keys of this meter.
+    virtual bool handleTelegramWithHeader(const Telegram *header, const vector<uchar> &input_frame,
+                                          bool simulated, bool *id_match, Telegram *out_t = NULL) = 0;
     virtual MeterKeys *meterKeys() = 0;
     virtual void setMeterManager(MeterManager *mm) = 0;
     virtual MeterManager *meterManager() = 0;
@@ -455,7 +562,7 @@ struct Meter
     virtual void addShellMeterUpdated(std::string cmdline) = 0;
     virtual vector<string> &shellCmdlinesMeterAdded() = 0;
     virtual vector<string> &shellCmdlinesMeterUpdated() = 0;
-    virtual void poll(shared_ptr<BusManager> bus) = 0;
+    virtual PollOutcome poll(shared_ptr<BusManager> bus) = 0;
 
     virtual FieldInfo *findFieldInfo(string vname, Quantity xuantity) = 0;
     virtual string renderJsonOnlyDefaultUnit(string vname, Quantity xuantity) = 0;
@@ -472,14 +579,28 @@ struct MeterManager
     virtual Meter*lastAddedMeter() = 0;
     virtual void removeAllMeters() = 0;
     virtual void forEachMeter(std::function<void(Meter*)> cb) = 0;
-    virtual bool handleTelegram(AboutTelegram &about, vector<uchar> data, bool simulated) = 0;
+    // Returns true if a meter decoded the telegram. When decoding in decoder threads,
+    // it only promises that the telegram matched the address of a meter and was queued,
+    // a failure to decode is then reported by the decoder thread.
+    virtual bool handleTelegram(AboutTelegram &about, const vector<uchar> &data, bool simulated) = 0;
     virtual bool hasAllMetersReceivedATelegram() = 0;
     virtual bool hasMeters() = 0;
-    virtual void onTelegram(function<bool(AboutTelegram&,vector<uchar>)> cb) = 0;
+    virtual void onTelegram(function<bool(AboutTelegram&,const vector<uchar>&)> cb) = 0;
     virtual void whenMeterUpdated(std::function<void(Telegram*t,Meter*)> cb) = 0;
+    // Queue the meters for polling, each bus is polled by its own thread.
     virtual void pollMeters(shared_ptr<BusManager> bus) = 0;
-    virtual void analyzeEnabled(bool b, OutputFormat f, string force_driver, string key, bool verbose, int profile) = 0;
-    virtual void analyzeTelegram(AboutTelegram &about, vector<uchar> &input_frame, bool simulated) = 0;
+    // Wait for the ongoing polls and stop the poll threads.
+    virtual void stopPolling() = 0;
+    // The poll cycle durations and response latencies for each bus.
+    virtual string pollMetrics() = 0;
+    // The evaluated and skipped calculated fields for each meter.
+    virtual string calculationMetrics() = 0;
+    virtual void analyzeEnabled(bool b, OutputFormat f, string force_driver, string key, bool verbose, bool batch, int profile) = 0;
+    virtual void analyzeTelegram(AboutTelegram &about, const vector<uchar> &input_frame, bool simulated) = 0;
+    // Decode the telegrams in n threads instead of in the event loop thread.
+    virtual void startDecoders(int n) = 0;
+    // Wait for the queued telegrams to be decoded and stop the threads.
+    virtual void stopDecoders() = 0;
 
     virtual ~MeterManager() = default;
 };
@@ -23,6 +23,7 @@
 #include"threads.h"
 #include"units.h"
 
+#include<atomic>
 #include<map>
 #include<set>
 
@@ -66,6 +67,7 @@ struct MeterCommonImplementation : public virtual Meter
     string name();
     DriverName driverName();
     DriverInfo *driverInfo();
+    DriverMetrics *driverMetrics() { return driver_metrics_; }
     bool hasProcessContent();
 
     ELLSecurityMode expectedELLSecurityMode();
@@ -82,8 +84,14 @@ struct MeterCommonImplementation : public virtual Meter
 
     void onUpdate(function<void(Telegram*,Meter*)> cb);
     int numUpdates();
+    size_t numCalculations() { return num_calculations_; }
+    size_t numSkippedCalculations() { return num_skipped_calculations_; }
 
-    static bool isTelegramForMeter(Telegram *t, Meter *meter, MeterInfo *mi);
+    // The stages handleTelegram runs on a parsed telegram, the benchmark times them one by one.
+    void extractFields(Telegram *t);
+    void processFieldCalculators();
+
+    static bool isTelegramForMeter(const Telegram *t, Meter *meter, MeterInfo *mi);
     MeterKeys *meterKeys();
     void setMeterManager(MeterManager *mm);
     MeterManager *meterManager();
@@ -163,12 +171,27 @@ protected:
         string help,
         PrintProperties print_properties);
 
+    // Append a field, reusing the driver's identical prototype when another meter already created it.
+    void addFieldInfo(const string &vname,
+                      Quantity xuantity,
+                      Unit display_unit,
+                      VifScaling vif_scaling,
+                      DifSignedness dif_signedness,
+                      double scale,
+                      const FieldMatcher &matcher,
+                      const string &help,
+                      PrintProperties print_properties,
+                      const Translate::Lookup &lookup,
+                      Formula *formula);
+
     // The default implementation of poll does nothing.
     // Override for mbus meters that need to be queried and likewise for C2/T2 wmbus-meters.
-    void poll(shared_ptr<BusManager> bus);
-    bool handleTelegram(AboutTelegram &about, vector<uchar> frame,
+    PollOutcome poll(shared_ptr<BusManager> bus);
+    bool handleTelegram(AboutTelegram &about, const vector<uchar> &frame,
                         bool simulated, std::vector<Address> *addresses,
                         bool *id_match, Telegram *out_analyzed = NULL);
+    bool handleTelegramWithHeader(const Telegram *header, const vector<uchar> &frame,
+                                  bool simulated, bool *id_match, Telegram *out_analyzed = NULL);
     void createMeterEnv(string id,
                         vector<string> *envs,
                         vector<string> *more_json); // Add this json "key"="value" strings.
@@ -189,7 +212,16 @@ protected:
     string debugValues();
 
     void processFieldExtractors(Telegram *t);
-    void processFieldCalculators();
+    void fieldsMatching(DVEntry *dve, std::vector<size_t> *out);
+    int numericSlot(const std::string &vname, Unit u, bool create);
+    int numericSlot(FieldInfo *fi, DVEntry *dve, bool create);
+    int stringSlot(const std::string &vname, bool create);
+    int stringSlot(FieldInfo *fi, DVEntry *dve, bool create);
+    // Returns NULL if the meter has no value in the slot.
+    NumericField *numericField(int slot);
+    StringField *stringField(int slot);
+    void buildFieldDependents();
+    void markFieldSet(FieldInfo *fi);
     string getStatusField(FieldInfo *fi);
 
     virtual void processContent(Telegram *t);
@@ -198,6 +230,7 @@ protected:
     void setNumericValue(FieldInfo *fi, DVEntry *dve, Unit u, double v);
     double getNumericValue(string vname, Unit u);
     double getNumericValue(FieldInfo *fi, Unit u);
+    double getNumericValue(FieldInfo *fi, DVEntry *dve, Unit u);
     void setStringValue(string vname, std::string v, DVEntry *dve = NULL);
     void setStringValue(FieldInfo *fi, std::string v, DVEntry *dve);
     std::string getStringValue(FieldInfo *fi);
@@ -224,6 +257,7 @@ private:
     MeterType type_ {};
     DriverName driver_name_;
     DriverInfo *driver_info_ {};
+    DriverMetrics *driver_metrics_ {};
     string bus_ {};
     MeterKeys meter_keys_ {};
     ELLSecurityMode expected_ell_sec_mode_ {};
@@ -232,8 +266,9 @@ private:
     vector<AddressExpression> address_expressions_;
     IdentityMode identity_mode_;
     vector<function<void(Telegram*,Meter*)>> on_update_;
-    int num_updates_ {};
-    time_t datetime_of_update_ {};
+    // The update counters are read by the event loop while a decoder thread updates the meter.
+    std::atomic<int> num_updates_ {};
+    std::atomic<time_t> datetime_of_update_ {};
     time_t datetime_of_poll_ {};
     LinkModeSet link_modes_ {};
     vector<string> shell_cmdlines_added_;
@@ -243,12 +278,23 @@ private:
     Translate::Lookup mfct_tpl_status_bits_ = NoLookup;
     int force_mfct_index_ = -1;
     bool has_process_content_ = false;
-    bool has_received_first_telegram_ = false;
+    std::atomic<bool> has_received_first_telegram_ {};
     MeterManager *meter_manager_ {};
 
 protected:
 
     vector<FieldInfo> field_infos_;
+    // The number of leading field infos that use the driver's prototypes at the same
+    // positions, these are matched through the driver's table of difvif keys.
+    size_t num_shared_fields_ {};
+    // The calculated fields that read each field, indexed as field_infos_.
+    // Built on demand and dropped when the number of field infos changes.
+    std::vector<std::vector<size_t>> field_dependents_;
+    size_t field_dependents_num_fields_ {};
+    // Set for a calculated field when a field it reads has been set since it was last calculated.
+    std::vector<bool> field_needs_calculation_;
+    size_t num_calculations_ {};
+    size_t num_skipped_calculations_ {};
     // This is the number of fields in the driver, not counting the used library fields.
     size_t num_driver_fields_ {};
     vector<string> field_names_;
@@ -257,10 +303,10 @@ protected:
     vector<string> selected_fields_;
     // Map difvif key to hex values from telegrams.
     std::map<std::string,std::pair<int,std::string>> hex_values_;
-    // Map field name+Unit to Numeric field which includes the value.
-    std::map<pair<std::string,Unit>,NumericField> numeric_values_;
-    // Map field name (at_date) to string value.
-    std::map<std::string,StringField> string_values_;
+    // Field values are stored in dense vectors indexed by the slots assigned by the driver,
+    // see DriverFields. A value without a field info has not been set.
+    std::vector<NumericField> numeric_values_;
+    std::vector<StringField> string_values_;
     // Used to block next poll, until this poll has received a respones.
     Semaphore waiting_for_poll_response_sem_;
     // If the telegram ends with 0x1f then set this to true, and the poll
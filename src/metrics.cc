@@ -0,0 +1,420 @@
+/*
+ Copyright (C) 2024 Fredrik Öhrström (gpl-3.0-or-later)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"metrics.h"
+#include"util.h"
+
+#include<atomic>
+#include<chrono>
+#include<errno.h>
+#include<inttypes.h>
+#include<map>
+#include<memory>
+#include<pthread.h>
+#include<stdio.h>
+#include<string.h>
+#include<sys/socket.h>
+#include<sys/stat.h>
+#include<sys/un.h>
+#include<unistd.h>
+
+using namespace std;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// The upper bounds of the buckets are 1us, 2us, 4us ... 2^20us (about one second),
+// the last bucket counts the slower ones.
+#define NUM_FINITE_BUCKETS 21
+
+// The total count is the sum of the buckets, so that the +Inf bucket always equals the count.
+struct MetricsHistogram
+{
+    atomic<uint64_t> buckets[NUM_FINITE_BUCKETS+1] {};
+    atomic<uint64_t> sum_ns {};
+};
+
+struct MetricsCounter
+{
+    atomic<uint64_t> value {};
+};
+
+static const char *stage_names_[] =
+{
+#define X(name,label) #name,
+LIST_OF_METRICS_STAGES
+#undef X
+};
+
+static const char *stage_labels_[] =
+{
+#define X(name,label) #label,
+LIST_OF_METRICS_STAGES
+#undef X
+};
+
+static const char *drop_names_[] =
+{
+#define X(name,label) #name,
+LIST_OF_METRICS_DROPS
+#undef X
+};
+
+static const char *drop_labels_[] =
+{
+#define X(name,label) #label,
+LIST_OF_METRICS_DROPS
+#undef X
+};
+
+static const char *count_names_[] =
+{
+#define X(name,label,help) #name,
+LIST_OF_METRICS_COUNTS
+#undef X
+};
+
+static const char *count_labels_[] =
+{
+#define X(name,label,help) #label,
+LIST_OF_METRICS_COUNTS
+#undef X
+};
+
+static const char *count_helps_[] =
+{
+#define X(name,label,help) help,
+LIST_OF_METRICS_COUNTS
+#undef X
+};
+
+static const char *gauge_names_[] =
+{
+#define X(name,help) #name,
+LIST_OF_METRICS_GAUGES
+#undef X
+};
+
+static const char *gauge_helps_[] =
+{
+#define X(name,help) help,
+LIST_OF_METRICS_GAUGES
+#undef X
+};
+
+static bool metrics_enabled_ = false;
+// Protects the maps, not the values, which are atomics updated without the lock.
+// The entries are never removed, so the pointers handed out stay valid.
+static pthread_mutex_t metrics_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static map<pair<int,string>,unique_ptr<MetricsHistogram>> histograms_;
+static map<pair<int,string>,unique_ptr<MetricsCounter>> drops_;
+static map<pair<int,string>,unique_ptr<MetricsCounter>> counts_;
+static map<int,unique_ptr<MetricsCounter>> gauges_;
+// The driver and bus bundles are created under their own lock, since filling
+// in a bundle looks up its histograms and counters.
+static pthread_mutex_t metrics_bundles_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static map<string,unique_ptr<DriverMetrics>> driver_metrics_;
+static map<string,unique_ptr<BusMetrics>> bus_metrics_;
+
+void enableMetrics(bool b)
+{
+    metrics_enabled_ = b;
+}
+
+bool isMetricsEnabled()
+{
+    return metrics_enabled_;
+}
+
+uint64_t metricsNow()
+{
+    if (!metrics_enabled_) return 0;
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int bucketIndex(uint64_t ns)
+{
+    uint64_t us = (ns+999)/1000;
+    if (us <= 1) return 0;
+    // Round up to the next power of two.
+    int i = 64-__builtin_clzll(us-1);
+    return i < NUM_FINITE_BUCKETS ? i : NUM_FINITE_BUCKETS;
+}
+
+template<typename T, typename K>
+static T *lookupEntry(map<K,unique_ptr<T>> &entries, const K &key)
+{
+    if (!metrics_enabled_) return NULL;
+
+    pthread_mutex_lock(&metrics_lock_);
+    unique_ptr<T> &e = entries[key];
+    if (!e) e = unique_ptr<T>(new T());
+    T *t = e.get();
+    pthread_mutex_unlock(&metrics_lock_);
+    return t;
+}
+
+MetricsHistogram *lookupMetrics(MetricsStage stage, const string &key)
+{
+    return lookupEntry(histograms_, make_pair((int)stage, key));
+}
+
+MetricsCounter *lookupMetrics(MetricsDrop drop, const string &key)
+{
+    return lookupEntry(drops_, make_pair((int)drop, key));
+}
+
+MetricsCounter *lookupMetrics(MetricsCount count, const string &key)
+{
+    return lookupEntry(counts_, make_pair((int)count, key));
+}
+
+MetricsCounter *lookupMetrics(MetricsGauge gauge)
+{
+    return lookupEntry(gauges_, (int)gauge);
+}
+
+void recordStage(MetricsHistogram *h, uint64_t ns)
+{
+    if (h == NULL) return;
+
+    h->buckets[bucketIndex(ns)].fetch_add(1, memory_order_relaxed);
+    h->sum_ns.fetch_add(ns, memory_order_relaxed);
+}
+
+void countMetrics(MetricsCounter *c, uint64_t n)
+{
+    if (c == NULL) return;
+
+    c->value.fetch_add(n, memory_order_relaxed);
+}
+
+void setMetrics(MetricsCounter *c, uint64_t value)
+{
+    if (c == NULL) return;
+
+    c->value.store(value, memory_order_relaxed);
+}
+
+DriverMetrics *lookupDriverMetrics(const string &driver)
+{
+    if (!metrics_enabled_) return NULL;
+
+    pthread_mutex_lock(&metrics_bundles_lock_);
+    unique_ptr<DriverMetrics> &dm = driver_metrics_[driver];
+    if (!dm)
+    {
+        dm = unique_ptr<DriverMetrics>(new DriverMetrics());
+        dm->parse = lookupMetrics(MetricsStage::parse, driver);
+        dm->decrypt = lookupMetrics(MetricsStage::decrypt, driver);
+        dm->extract = lookupMetrics(MetricsStage::extract, driver);
+        dm->render = lookupMetrics(MetricsStage::render, driver);
+        dm->shell = lookupMetrics(MetricsStage::shell, driver);
+        dm->decrypt_failed = lookupMetrics(MetricsDrop::decrypt_failed, driver);
+        dm->shell_coalesced = lookupMetrics(MetricsDrop::shell_coalesced, driver);
+        dm->shell_invocations = lookupMetrics(MetricsCount::shell_invocations, driver);
+        dm->shell_late = lookupMetrics(MetricsCount::shell_late, driver);
+        dm->shell_blocked = lookupMetrics(MetricsCount::shell_blocked, driver);
+        dm->calculations = lookupMetrics(MetricsCount::calculations, driver);
+        dm->skipped_calculations = lookupMetrics(MetricsCount::skipped_calculations, driver);
+    }
+    DriverMetrics *r = dm.get();
+    pthread_mutex_unlock(&metrics_bundles_lock_);
+    return r;
+}
+
+BusMetrics *lookupBusMetrics(const string &bus)
+{
+    if (!metrics_enabled_) return NULL;
+
+    pthread_mutex_lock(&metrics_bundles_lock_);
+    unique_ptr<BusMetrics> &bm = bus_metrics_[bus];
+    if (!bm)
+    {
+        bm = unique_ptr<BusMetrics>(new BusMetrics());
+        bm->serial_data = lookupMetrics(MetricsStage::serial_data, bus);
+        bm->poll_cycle = lookupMetrics(MetricsStage::poll_cycle, bus);
+        bm->poll_response = lookupMetrics(MetricsStage::poll_response, bus);
+        bm->duplicate = lookupMetrics(MetricsDrop::duplicate, bus);
+        bm->unknown_meter = lookupMetrics(MetricsDrop::unknown_meter, bus);
+        bm->polls = lookupMetrics(MetricsCount::polls, bus);
+        bm->poll_timeouts = lookupMetrics(MetricsCount::poll_timeouts, bus);
+    }
+    BusMetrics *r = bm.get();
+    pthread_mutex_unlock(&metrics_bundles_lock_);
+    return r;
+}
+
+static string escapeLabel(const string &s)
+{
+    string r;
+    for (char c : s)
+    {
+        if (c == '\\') r += "\\\\";
+        else if (c == '"') r += "\\\"";
+        else if (c == '\n') r += "\\n";
+        else r += c;
+    }
+    return r;
+}
+
+string renderMetrics()
+{
+    string s;
+
+    pthread_mutex_lock(&metrics_lock_);
+
+    s += "# HELP wmbusmeters_stage_seconds Time spent in each processing stage.\n";
+    s += "# TYPE wmbusmeters_stage_seconds histogram\n";
+    for (auto &p : histograms_)
+    {
+        MetricsHistogram &h = *p.second;
+        uint64_t buckets[NUM_FINITE_BUCKETS+1];
+        uint64_t count = 0;
+        for (int i = 0; i <= NUM_FINITE_BUCKETS; ++i)
+        {
+            buckets[i] = h.buckets[i].load(memory_order_relaxed);
+            count += buckets[i];
+        }
+        // A histogram shows up with its first sample.
+        if (count == 0) continue;
+
+        string labels = tostrprintf("stage=\"%s\",%s=\"%s\"",
+                                    stage_names_[p.first.first],
+                                    stage_labels_[p.first.first],
+                                    escapeLabel(p.first.second).c_str());
+        uint64_t cumulative = 0;
+        for (int i = 0; i < NUM_FINITE_BUCKETS; ++i)
+        {
+            cumulative += buckets[i];
+            s += tostrprintf("wmbusmeters_stage_seconds_bucket{%s,le=\"%g\"} %" PRIu64 "\n",
+                             labels.c_str(), (double)(1 << i)/1000000.0, cumulative);
+        }
+        s += tostrprintf("wmbusmeters_stage_seconds_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n", labels.c_str(), count);
+        s += tostrprintf("wmbusmeters_stage_seconds_sum{%s} %.9f\n", labels.c_str(),
+                         (double)h.sum_ns.load(memory_order_relaxed)/1000000000.0);
+        s += tostrprintf("wmbusmeters_stage_seconds_count{%s} %" PRIu64 "\n", labels.c_str(), count);
+    }
+
+    s += "# HELP wmbusmeters_dropped_telegrams_total Telegrams that were dropped and never printed.\n";
+    s += "# TYPE wmbusmeters_dropped_telegrams_total counter\n";
+    for (auto &p : drops_)
+    {
+        s += tostrprintf("wmbusmeters_dropped_telegrams_total{reason=\"%s\",%s=\"%s\"} %" PRIu64 "\n",
+                         drop_names_[p.first.first],
+                         drop_labels_[p.first.first],
+                         escapeLabel(p.first.second).c_str(),
+                         p.second->value.load(memory_order_relaxed));
+    }
+
+    // The counters are ordered on the counter, then on the key, so each gets its help once.
+    int previous = -1;
+    for (auto &p : counts_)
+    {
+        const char *name = count_names_[p.first.first];
+        if (p.first.first != previous)
+        {
+            s += tostrprintf("# HELP wmbusmeters_%s_total %s\n", name, count_helps_[p.first.first]);
+            s += tostrprintf("# TYPE wmbusmeters_%s_total counter\n", name);
+            previous = p.first.first;
+        }
+        s += tostrprintf("wmbusmeters_%s_total{%s=\"%s\"} %" PRIu64 "\n",
+                         name,
+                         count_labels_[p.first.first],
+                         escapeLabel(p.first.second).c_str(),
+                         p.second->value.load(memory_order_relaxed));
+    }
+
+    for (auto &p : gauges_)
+    {
+        const char *name = gauge_names_[p.first];
+        s += tostrprintf("# HELP wmbusmeters_%s %s\n", name, gauge_helps_[p.first]);
+        s += tostrprintf("# TYPE wmbusmeters_%s gauge\n", name);
+        s += tostrprintf("wmbusmeters_%s %" PRIu64 "\n", name, p.second->value.load(memory_order_relaxed));
+    }
+
+    pthread_mutex_unlock(&metrics_lock_);
+
+    return s;
+}
+
+static bool sendMetricsToSocket(const string &path, const string &metrics)
+{
+    struct sockaddr_un addr {};
+    if (path.length() >= sizeof(addr.sun_path))
+    {
+        warning("(metrics) socket path too long \"%s\"\n", path.c_str());
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return false;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        warning("(metrics) could not connect to socket \"%s\" %s\n", path.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+    size_t written = 0;
+    while (written < metrics.length())
+    {
+        // A listener that has gone away must not raise SIGPIPE and terminate us.
+        ssize_t n = send(fd, metrics.c_str()+written, metrics.length()-written, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            if (n == -1 && errno == EINTR) continue;
+            warning("(metrics) could not write to socket \"%s\"\n", path.c_str());
+            close(fd);
+            return false;
+        }
+        written += n;
+    }
+    close(fd);
+    return true;
+}
+
+bool writeMetrics(const string &path)
+{
+    string metrics = renderMetrics();
+
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        return sendMetricsToSocket(path, metrics);
+    }
+
+    // Write into a temporary file and rename it, so that a reader never sees a partial file.
+    string tmp = path+".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (f == NULL)
+    {
+        warning("(metrics) could not write to \"%s\"\n", tmp.c_str());
+        return false;
+    }
+    size_t n = fwrite(metrics.c_str(), 1, metrics.length(), f);
+    fclose(f);
+    if (n != metrics.length() || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        warning("(metrics) could not write to \"%s\"\n", path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
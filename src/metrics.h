@@ -0,0 +1,149 @@
+/*
+ Copyright (C) 2024 Fredrik Öhrström (gpl-3.0-or-later)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include<stdint.h>
+#include<string>
+
+// The processing stages with a latency histogram, and the label used for their key.
+// The stages do not overlap, ie the parse time does not include the decrypt time.
+#define LIST_OF_METRICS_STAGES    \
+    X(serial_data,bus)            \
+    X(parse,driver)               \
+    X(decrypt,driver)             \
+    X(extract,driver)             \
+    X(render,driver)              \
+    X(shell,driver)               \
+    X(event_loop_callback,device) \
+    X(poll_cycle,bus)             \
+    X(poll_response,bus)
+
+// The reasons for dropping a telegram, and the label used for their key.
+// A coalesced shell invocation is replaced by a newer reading that was not yet sent.
+#define LIST_OF_METRICS_DROPS \
+    X(duplicate,bus)          \
+    X(unknown_meter,bus)      \
+    X(decrypt_failed,driver)  \
+    X(shell_coalesced,driver)
+
+// The counters, the label used for their key and their help text.
+#define LIST_OF_METRICS_COUNTS                                                                        \
+    X(shell_invocations,driver,"Shell commands started for telegrams.")                              \
+    X(shell_late,driver,"Shell commands that waited more than a second in the shell pool queue.")    \
+    X(shell_blocked,driver,"Telegrams that had to wait for a free slot in the full shell pool queue.") \
+    X(calculations,driver,"Calculated fields that were recalculated.")                              \
+    X(skipped_calculations,driver,"Calculated fields that were not recalculated, since no input changed.") \
+    X(polls,bus,"Meters polled.")                                                                     \
+    X(poll_timeouts,bus,"Polls that did not get a response.")
+
+// The gauges, they have no label, and their help text.
+#define LIST_OF_METRICS_GAUGES \
+    X(shell_queue_depth,"Shell commands waiting in the shell pool queue.")
+
+enum class MetricsStage
+{
+#define X(name,label) name,
+LIST_OF_METRICS_STAGES
+#undef X
+};
+
+enum class MetricsDrop
+{
+#define X(name,label) name,
+LIST_OF_METRICS_DROPS
+#undef X
+};
+
+enum class MetricsCount
+{
+#define X(name,label,help) name,
+LIST_OF_METRICS_COUNTS
+#undef X
+};
+
+enum class MetricsGauge
+{
+#define X(name,help) name,
+LIST_OF_METRICS_GAUGES
+#undef X
+};
+
+struct MetricsHistogram;
+struct MetricsCounter;
+
+void enableMetrics(bool b);
+bool isMetricsEnabled();
+
+// Returns a timestamp in nanoseconds, or 0 if the metrics are disabled.
+// Use: uint64_t start = metricsNow(); ... if (start) recordStage(histogram, metricsNow()-start);
+uint64_t metricsNow();
+
+// Look up the histogram or counter for the key, it is created the first time and then lives
+// until exit. Returns NULL if the metrics are disabled. The lookup takes a lock, the pointer
+// should be kept by the caller. Recording through the pointer is lock free.
+MetricsHistogram *lookupMetrics(MetricsStage stage, const std::string &key);
+MetricsCounter *lookupMetrics(MetricsDrop drop, const std::string &key);
+MetricsCounter *lookupMetrics(MetricsCount count, const std::string &key);
+MetricsCounter *lookupMetrics(MetricsGauge gauge);
+
+// Do nothing if the histogram or counter is NULL.
+void recordStage(MetricsHistogram *h, uint64_t ns);
+void countMetrics(MetricsCounter *c, uint64_t n = 1);
+void setMetrics(MetricsCounter *c, uint64_t value);
+
+// The metrics of a driver, shared by all meters using the driver.
+struct DriverMetrics
+{
+    MetricsHistogram *parse {};
+    MetricsHistogram *decrypt {};
+    MetricsHistogram *extract {};
+    MetricsHistogram *render {};
+    MetricsHistogram *shell {};
+    MetricsCounter *decrypt_failed {};
+    MetricsCounter *shell_coalesced {};
+    MetricsCounter *shell_invocations {};
+    MetricsCounter *shell_late {};
+    MetricsCounter *shell_blocked {};
+    MetricsCounter *calculations {};
+    MetricsCounter *skipped_calculations {};
+};
+
+// The metrics of a bus, keyed on the bus alias, or on the device if there is no alias.
+struct BusMetrics
+{
+    MetricsHistogram *serial_data {};
+    MetricsHistogram *poll_cycle {};
+    MetricsHistogram *poll_response {};
+    MetricsCounter *duplicate {};
+    MetricsCounter *unknown_meter {};
+    MetricsCounter *polls {};
+    MetricsCounter *poll_timeouts {};
+};
+
+// Returns NULL if the metrics are disabled, the same key always gives the same pointer.
+DriverMetrics *lookupDriverMetrics(const std::string &driver);
+BusMetrics *lookupBusMetrics(const std::string &bus);
+
+// Render the histograms and counters in the Prometheus text exposition format.
+std::string renderMetrics();
+// Write the metrics to the file, replacing it atomically. If the path is a unix socket,
+// then the metrics are instead sent to whoever listens on the socket.
+bool writeMetrics(const std::string &path);
+
+#endif
@@ -15,16 +15,21 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include"metrics.h"
 #include"printer.h"
 #include"shell.h"
 
+#include<algorithm>
+#include<unistd.h>
+
 using namespace std;
 
 Printer::Printer(bool json, bool pretty_print_json, bool fields, char separator,
                  bool use_meterfiles, string &meterfiles_dir,
                  bool use_logfile, string &logfile,
                  vector<string> new_meter_shell_cmdlines,
-                 vector<string> shell_cmdlines, bool overwrite,
+                 vector<string> shell_cmdlines,
+                 vector<string> stream_shell_cmdlines, bool overwrite,
                  MeterFileNaming naming,
                  MeterFileTimestamp timestamp)
 {
@@ -38,36 +43,95 @@ Printer::Printer(bool json, bool pretty_print_json, bool fields, char separator,
     logfile_ = logfile;
     new_meter_shell_cmdlines_ = new_meter_shell_cmdlines;
     shell_cmdlines_ = shell_cmdlines;
+    for (auto &cmdline : stream_shell_cmdlines)
+    {
+        StreamShell ss;
+        ss.cmdline = cmdline;
+        stream_shells_.push_back(ss);
+    }
     overwrite_ = overwrite;
     naming_ = naming;
     timestamp_ = timestamp;
+    json_buf_.reserve(4096);
+}
+
+Printer::~Printer()
+{
+    for (auto &ss : stream_shells_)
+    {
+        if (ss.dropped > 0)
+        {
+            verbose("(streamshell) dropped %zu readings for \"%s\"\n", ss.dropped, ss.cmdline.c_str());
+        }
+        if (ss.fd == -1) continue;
+        // Closing stdin tells the stream shell to finish, give it a moment
+        // to process the last readings before terminating it.
+        close(ss.fd);
+        ss.fd = -1;
+        for (int i = 0; i < 200 && stillRunning(ss.pid); ++i)
+        {
+            usleep(10*1000);
+        }
+        if (stillRunning(ss.pid))
+        {
+            stopBackgroundShell(ss.pid);
+        }
+        ss.pid = 0;
+    }
 }
 
 void Printer::print(Telegram *t, Meter *meter,
                     vector<string> *more_json,
                     vector<string> *selected_fields)
 {
-    string human_readable, fields, json;
+    WITH(printer_mutex_, printer_mutex, print);
+
+    string human_readable, fields;
+    string &json = json_buf_;
     vector<string> envs;
     bool printed = false;
 
-    meter->printMeter(t, &human_readable, &fields, separator_, &json, &envs, more_json, selected_fields, pretty_print_json_);
+    bool first = !meter->hasReceivedFirstTelegram();
+    bool new_meter_shells = first && (new_meter_shell_cmdlines_.size() > 0 || meter->shellCmdlinesMeterAdded().size() > 0);
+    bool shells = shell_cmdlines_.size() > 0 || meter->shellCmdlinesMeterUpdated().size() > 0;
+    bool streams = stream_shells_.size() > 0;
+    bool files = use_meterfiles_ || (!shells && !streams);
 
-    if (!meter->hasReceivedFirstTelegram())
+    // Only render the outputs that will actually be used.
+    // The json for files and for the METER_JSON env is rendered once into the same buffer.
+    DriverMetrics *metrics = meter->driverMetrics();
+    uint64_t start = metrics ? metricsNow() : 0;
+    meter->printMeter(t,
+                      files && !json_ && !fields_ ? &human_readable : NULL,
+                      files && !json_ && fields_ ? &fields : NULL,
+                      separator_,
+                      (files && json_) || new_meter_shells || shells || streams ? &json : NULL,
+                      new_meter_shells || shells ? &envs : NULL,
+                      more_json, selected_fields, pretty_print_json_);
+    if (start) recordStage(metrics->render, metricsNow()-start);
+
+    // The shell stage is recorded where the shells run, which can be in the shell pool.
+    if (first)
     {
         meter->markFirstTelegramReceived();
         envs.push_back("METER_FIRST_TELEGRAM=true");
-        if (new_meter_shell_cmdlines_.size() >  0 || meter->shellCmdlinesMeterAdded().size() > 0)
+        if (new_meter_shells)
         {
-            printNewMeterShells(meter, envs);
+            printNewMeterShells(meter, envs, metrics);
         }
     }
     else
     {
         envs.push_back("METER_FIRST_TELEGRAM=false");
     }
-    if (shell_cmdlines_.size() > 0 || meter->shellCmdlinesMeterUpdated().size() > 0) {
-        printShells(meter, envs);
+    if (shells) {
+        printShells(meter, envs, metrics);
+        printed = true;
+    }
+    if (streams) {
+        start = metrics ? metricsNow() : 0;
+        printStreamShells(json);
+        if (start) recordStage(metrics->shell, metricsNow()-start);
         printed = true;
     }
     if (use_meterfiles_) {
@@ -81,7 +145,7 @@ void Printer::print(Telegram *t, Meter *meter,
     }
 }
 
-void Printer::printNewMeterShells(Meter *meter, vector<string> &envs)
+void Printer::printNewMeterShells(Meter *meter, vector<string> &envs, DriverMetrics *metrics)
 {
     vector<string> *shells = &new_meter_shell_cmdlines_;
     if (meter->shellCmdlinesMeterAdded().size() > 0) {
@@ -91,11 +155,11 @@ void Printer::printNewMeterShells(Meter *meter, vector<string> &envs)
         vector<string> args;
         args.push_back("-c");
         args.push_back(s);
-        invokeShell("/bin/sh", args, envs);
+        invokeShellAsync("", "/bin/sh", args, envs, metrics);
     }
 }
 
-void Printer::printShells(Meter *meter, vector<string> &envs)
+void Printer::printShells(Meter *meter, vector<string> &envs, DriverMetrics *metrics)
 {
     vector<string> *shells = &shell_cmdlines_;
     if (meter->shellCmdlinesMeterUpdated().size() > 0) {
@@ -105,10 +169,93 @@ void Printer::printShells(Meter *meter, vector<string> &envs)
         vector<string> args;
         args.push_back("-c");
         args.push_back(s);
-        invokeShell("/bin/sh", args, envs);
+        // Coalesce per meter and shell command, when the shell pool is enabled.
+        string key = to_string(meter->index())+":"+s;
+        invokeShellAsync(key, "/bin/sh", args, envs, metrics);
     }
 }
 
+void Printer::printStreamShells(string &json)
+{
+    string line = json;
+    if (pretty_print_json_)
+    {
+        // One reading per line, the json is still valid without the newlines.
+        line.erase(remove(line.begin(), line.end(), '\n'), line.end());
+    }
+    line += '\n';
+
+    for (auto &ss : stream_shells_)
+    {
+        if (ss.fd == -1 || !stillRunning(ss.pid))
+        {
+            startStreamShell(&ss);
+        }
+        // Finish the line that did not fit in the pipe last time.
+        size_t n = 0;
+        if (ss.pending.size() > 0 && writeToBackgroundShell(ss.fd, ss.pending, &n))
+        {
+            ss.pending.erase(0, n);
+        }
+        if (ss.pending.size() > 0)
+        {
+            dropStreamShellReading(&ss);
+            continue;
+        }
+        if (!writeToBackgroundShell(ss.fd, line, &n))
+        {
+            // The stream shell exited after the check, restart and try once more.
+            startStreamShell(&ss);
+            if (!writeToBackgroundShell(ss.fd, line, &n))
+            {
+                warning("(streamshell) could not send reading to \"%s\"\n", ss.cmdline.c_str());
+                continue;
+            }
+        }
+        if (n == 0)
+        {
+            // The pipe is full, the stream shell is not reading fast enough.
+            dropStreamShellReading(&ss);
+        }
+        else if (n < line.size())
+        {
+            // Keep the rest of the line, a reader must never see half a reading.
+            ss.pending = line.substr(n);
+        }
+    }
+}
+
+void Printer::dropStreamShellReading(StreamShell *ss)
+{
+    if (ss->dropped == 0)
+    {
+        warning("(streamshell) \"%s\" is not reading fast enough, dropping readings.\n", ss->cmdline.c_str());
+    }
+    ss->dropped++;
+    debug("(streamshell) dropped reading %zu for \"%s\"\n", ss->dropped, ss->cmdline.c_str());
+}
+
+void Printer::startStreamShell(StreamShell *ss)
+{
+    if (ss->fd != -1)
+    {
+        close(ss->fd);
+        ss->fd = -1;
+    }
+    if (ss->pid != 0)
+    {
+        if (stillRunning(ss->pid)) stopBackgroundShell(ss->pid);
+        warning("(streamshell) \"%s\" exited, restarting it.\n", ss->cmdline.c_str());
+    }
+    ss->pending.clear();
+    vector<string> args;
+    args.push_back("-c");
+    args.push_back(ss->cmdline);
+    vector<string> envs;
+    invokeBackgroundShellWithInput("/bin/sh", args, envs, &ss->fd, &ss->pid);
+    verbose("(streamshell) started pid %d \"%s\"\n", ss->pid, ss->cmdline.c_str());
+}
+
 void Printer::printFiles(Meter *meter, Telegram *t, string &human_readable, string &fields, string &json)
 {
     FILE *output = stdout;
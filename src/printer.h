@@ -17,10 +17,23 @@
 
 #include"cmdline.h"
 #include"meters.h"
+#include"threads.h"
 #include"wmbus.h"
 
 using namespace std;
 
+// A stream shell is started once and then receives one json line
+// on its stdin for every meter update. The writes never block, when
+// the pipe is full the reading is dropped.
+struct StreamShell
+{
+    string cmdline;
+    int pid {};
+    int fd { -1 };
+    string pending; // The rest of a line that only partially fit in the pipe.
+    size_t dropped {}; // Readings dropped because the pipe was full.
+};
+
 struct Printer {
     Printer(bool json,
             bool pretty_print_json,
@@ -30,9 +43,11 @@ struct Printer {
             bool use_logfile, string &logfile,
             vector<string> new_meter_shell_cmdlines,
             vector<string> shell_cmdlines,
+            vector<string> stream_shell_cmdlines,
             bool overwrite,
             MeterFileNaming naming,
             MeterFileTimestamp timestamp);
+    ~Printer();
 
     void print(Telegram *t, Meter *meter, vector<string> *more_json, vector<string> *selected_fields);
 
@@ -46,12 +61,20 @@ struct Printer {
     char separator_;
     vector<string> new_meter_shell_cmdlines_;
     vector<string> shell_cmdlines_;
+    vector<StreamShell> stream_shells_;
     bool overwrite_;
     MeterFileNaming naming_;
     MeterFileTimestamp timestamp_;
+    // Reused for every telegram to avoid reallocating the json.
+    string json_buf_;
+    // Meters can be updated from several decoder threads.
+    RecursiveMutex printer_mutex_ = { "printer_mutex" };
 
-    void printNewMeterShells(Meter *meter, vector<string> &envs);
-    void printShells(Meter *meter, vector<string> &envs);
+    void printNewMeterShells(Meter *meter, vector<string> &envs, DriverMetrics *metrics);
+    void printShells(Meter *meter, vector<string> &envs, DriverMetrics *metrics);
+    void printStreamShells(string &json);
+    void startStreamShell(StreamShell *ss);
+    void dropStreamShellReading(StreamShell *ss);
     void printFiles(Meter *meter, Telegram *t, string &human_readable, string &fields, string &json);
 
 };
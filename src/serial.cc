@@ -16,6 +16,7 @@
 */
 
 #include"util.h"
+#include"metrics.h"
 #include"rtlsdr.h"
 #include"serial.h"
 #include"shell.h"
@@ -24,16 +25,19 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <chrono>
 #include <dirent.h>
 #include <fcntl.h>
 #include <functional>
 #include <libgen.h>
+#include <map>
 #include <memory.h>
 #include <pthread.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
 #include <errno.h>
+#include <set>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
@@ -42,6 +46,8 @@
 
 #if defined(__linux__)
 #include <linux/serial.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #endif
 
 // return a positive integer (file descriptor) on success.
@@ -68,6 +74,13 @@ struct Timer
     }
 };
 
+struct CallbackLatency
+{
+    size_t calls {};
+    double sum_ms {};
+    double max_ms {};
+};
+
 struct SerialCommunicationManagerImp : public SerialCommunicationManager
 {
     SerialCommunicationManagerImp(time_t exit_after_seconds, bool start_event_loop);
@@ -104,12 +117,27 @@ struct SerialCommunicationManagerImp : public SerialCommunicationManager
     vector<string> listSerialTTYs();
     shared_ptr<SerialDevice> lookup(std::string device);
     bool removeNonWorking(std::string device);
+    string eventLoopMetrics();
 
 private:
 
     void *eventLoop();
     void *timerLoop();
 
+    // Add and remove file descriptors from the event loop so that they match
+    // the devices that want callbacks. Only called from the event loop thread.
+    void syncWatchedDevices();
+    void watchFd(int fd);
+    void unwatchFd(int fd);
+    // Wait for data or a tickle. Returns the file descriptors with new data in ready.
+    int waitForEvents(int timeout_ms, vector<int> *ready, bool *tickled);
+    void drainTickles();
+    void invokeCallback(int fd);
+    // Returns false if all devices are expected to work but some do not.
+    bool allWorking();
+    // Close the devices that no longer work. Returns false if the event loop should stop.
+    bool closeNonWorking();
+
     void executeTimerCallbacks();
     time_t calculateTimeToNearestTimerCallback(time_t now);
 
@@ -125,6 +153,17 @@ private:
     RecursiveMutex event_loop_mutex_ = {"event_loop_mutex" };
 #define LOCK_EVENT_LOOP(where) WITH(event_loop_mutex_, event_loop_mutex, where)
 
+    // The event loop sleeps in epoll_wait (select where epoll is not available)
+    // and tickleEventLoop wakes it up by writing to an eventfd (a pipe elsewhere).
+    int tickle_read_fd_ = -1;
+    int tickle_write_fd_ = -1;
+    int epoll_fd_ = -1;
+    // The devices currently watched by the event loop, only used by the event loop thread.
+    map<int,weak_ptr<SerialDevice>> watched_;
+    // Regular files cannot be watched with epoll, they are always readable.
+    set<int> always_ready_;
+    map<string,CallbackLatency> callback_latencies_; // Protected by LOCK_SERIAL_DEVICES
+
     vector<Timer> timers_;  // Protected by LOCK_TIMERS
     RecursiveMutex timers_mutex_ = { "timers_mutex" };
 #define LOCK_TIMERS(where) WITH(timers_mutex_, timers_mutex, where)
@@ -142,12 +181,16 @@ SerialCommunicationManagerImp::~SerialCommunicationManagerImp()
     removeNonWorkingSerialDevices();
     // Now we can be sure the eventLoop has stopped and it is safe to
     // free this Manager object.
+    if (epoll_fd_ != -1) ::close(epoll_fd_);
+    if (tickle_write_fd_ != tickle_read_fd_) ::close(tickle_write_fd_);
+    ::close(tickle_read_fd_);
+    epoll_fd_ = tickle_read_fd_ = tickle_write_fd_ = -1;
 }
 
 struct SerialDeviceImp : public SerialDevice
 {
     void disableCallbacks() { no_callbacks_ = true; }
-    void enableCallbacks() { no_callbacks_ = false; }
+    void enableCallbacks() { no_callbacks_ = false; manager_->tickleEventLoop(); }
     bool skippingCallbacks() { return no_callbacks_; }
     void fill(vector<uchar> &data) {};
     int receive(vector<uchar> *data);
@@ -165,7 +208,7 @@ struct SerialDeviceImp : public SerialDevice
     int fd() { return fd_; }
     SerialCommunicationManager *manager() { return manager_; }
     void resetInitiated() { debug("(serial) initiate reset\n"); resetting_ = true; }
-    void resetCompleted() { debug("(serial) reset completed\n"); resetting_ = false; }
+    void resetCompleted() { debug("(serial) reset completed\n"); resetting_ = false; manager_->tickleEventLoop(); }
     bool checkIfDataIsPending()
     {
         if (!opened() || !working()) return false; // No data can be pending if device is not opened nor working.
@@ -203,6 +246,7 @@ protected:
     SerialCommunicationManagerImp *manager_;
     bool resetting_ {}; // Set to true while resetting.
     string purpose_; // Can be set to identify a serial device purose.
+    MetricsHistogram *callback_metrics_ {}; // Looked up by the event loop thread on the first callback.
 
     friend struct SerialCommunicationManagerImp;
 };
@@ -339,6 +383,7 @@ bool SerialDeviceTTY::open(bool fail_if_not_ok)
         return false;
     }
     verbose("(serialtty) opened %s fd %d (%s)\n", device_.c_str(), fd_, purpose_.c_str());
+    manager_->tickleEventLoop();
     return true;
 }
 
@@ -389,10 +434,7 @@ bool SerialDeviceTTY::send(vector<uchar> &data)
         debug("(serial %s) sent \"%s\"\n", device_.c_str(), msg.c_str());
     }
 
-    if (signalsInstalled())
-    {
-        if (getEventLoopThread()) pthread_kill(getEventLoopThread(), SIGUSR1);
-    }
+    manager_->tickleEventLoop();
 
     end:
     return rc;
@@ -467,6 +509,7 @@ bool SerialDeviceCommand::open(bool fail_if_not_ok)
     if (!ok) return false;
     setIsStdin();
     verbose("(serialcmd) opened %s pid %d fd %d (%s)\n", command_.c_str(), pid_, fd_, purpose_.c_str());
+    manager_->tickleEventLoop();
     return true;
 }
 
@@ -672,6 +715,31 @@ SerialCommunicationManagerImp::SerialCommunicationManagerImp(time_t exit_after_s
                                                              bool start_event_loop)
 {
     running_ = true;
+#if defined(__linux__)
+    tickle_read_fd_ = tickle_write_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (tickle_read_fd_ == -1 || epoll_fd_ == -1)
+    {
+        error("(serial) could not create the event loop! errno=%s\n", strerror(errno));
+    }
+    struct epoll_event ev {};
+    ev.events = EPOLLIN;
+    ev.data.fd = tickle_read_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, tickle_read_fd_, &ev);
+#else
+    int fds[2];
+    if (pipe(fds) == -1)
+    {
+        error("(serial) could not create the event loop! errno=%s\n", strerror(errno));
+    }
+    for (int fd : fds)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    tickle_read_fd_ = fds[0];
+    tickle_write_fd_ = fds[1];
+#endif
     // Block the event loop until everything is configured.
     if (start_event_loop)
     {
@@ -720,6 +788,7 @@ void SerialCommunicationManagerImp::listenTo(SerialDevice *sd, function<void()>
         error("Internal error: Invalid serial device passed to listenTo.\n");
     }
     si->on_data_ = cb;
+    tickleEventLoop();
 }
 
 void SerialCommunicationManagerImp::onDisappear(SerialDevice *sd, function<void()> cb)
@@ -751,10 +820,10 @@ void SerialCommunicationManagerImp::stop()
             if (signalsInstalled())
             {
                 if (getMainThread()) pthread_kill(getMainThread(), SIGUSR2);
-                if (getEventLoopThread()) pthread_kill(getEventLoopThread(), SIGUSR1);
                 if (getTimerLoopThread()) pthread_kill(getTimerLoopThread(), SIGUSR1);
             }
         }
+        tickleEventLoop();
     }
 }
 
@@ -785,9 +854,9 @@ void SerialCommunicationManagerImp::waitForStop()
 
     closeAllDoNotRemove();
 
+    tickleEventLoop();
     if (signalsInstalled())
     {
-        if (getEventLoopThread()) pthread_kill(getEventLoopThread(), SIGUSR1);
         if (getTimerLoopThread()) pthread_kill(getTimerLoopThread(), SIGUSR1);
     }
 
@@ -813,12 +882,13 @@ shared_ptr<SerialDevice> SerialCommunicationManagerImp::addSerialDeviceForManage
 
 void SerialCommunicationManagerImp::tickleEventLoop()
 {
-    LOCK_SERIAL_DEVICES(tickle);
-
-    if (signalsInstalled())
+    // Wake up the event loop so that it picks up new, closed or reset devices.
+    uint64_t one = 1;
+    if (tickle_write_fd_ == -1) return;
+    ssize_t n = write(tickle_write_fd_, &one, sizeof(one));
+    if (n == -1 && errno != EAGAIN)
     {
-        // Tickle the event loop to use the new file descriptor in the select.
-        if (getEventLoopThread()) pthread_kill(getEventLoopThread(), SIGUSR1);
+        debug("(serial) could not tickle event loop errno=%s\n", strerror(errno));
     }
 }
 
@@ -831,6 +901,7 @@ void SerialCommunicationManagerImp::removeNonWorkingSerialDevices()
         if ((*i)->opened() && !(*i)->working())
         {
             i = serial_devices_.erase(i);
+            tickleEventLoop();
         }
         else
         {
@@ -931,121 +1002,264 @@ void *SerialCommunicationManagerImp::timerLoop()
     return NULL;
 }
 
-void *SerialCommunicationManagerImp::eventLoop()
+void SerialCommunicationManagerImp::syncWatchedDevices()
 {
-    LOCK_EVENT_LOOP(eventLoop);
+    map<int,shared_ptr<SerialDevice>> wanted;
+    {
+        LOCK_SERIAL_DEVICES(sync_watched_devices);
 
-    fd_set readfds;
+        for (shared_ptr<SerialDevice> &sd : serial_devices_)
+        {
+            if (sd->opened() && sd->working() && !sd->skippingCallbacks() &&
+                !sd->resetting() && sd->fd() >= 0)
+            {
+                wanted[sd->fd()] = sd;
+            }
+        }
+    }
 
-    while (running_)
+    for (auto i = watched_.begin(); i != watched_.end(); )
+    {
+        auto w = wanted.find(i->first);
+        if (w == wanted.end() || w->second != i->second.lock())
+        {
+            // The device is gone, or the file descriptor has been reused by another device.
+            unwatchFd(i->first);
+            i = watched_.erase(i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    for (auto &p : wanted)
     {
-        FD_ZERO(&readfds);
+        if (watched_.count(p.first) == 0)
+        {
+            watchFd(p.first);
+            watched_[p.first] = p.second;
+        }
+    }
+}
 
-        bool all_working = true;
+void SerialCommunicationManagerImp::watchFd(int fd)
+{
+    trace("[SERIAL] watch fd %d\n", fd);
+#if defined(__linux__)
+    // Edge triggered, the callbacks read until there is no more data.
+    // Adding a file descriptor that already has data triggers an event.
+    struct epoll_event ev {};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = fd;
+    int rc = epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+    if (rc == -1 && errno == EEXIST)
+    {
+        rc = epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+    }
+    if (rc == -1 && errno == EPERM)
+    {
+        always_ready_.insert(fd);
+        return;
+    }
+    if (rc == -1)
+    {
+        warning("(serial) cannot watch fd %d errno=%s\n", fd, strerror(errno));
+    }
+#endif
+}
 
+void SerialCommunicationManagerImp::unwatchFd(int fd)
+{
+    trace("[SERIAL] unwatch fd %d\n", fd);
+    always_ready_.erase(fd);
+#if defined(__linux__)
+    // A closed file descriptor is already removed from the epoll set, so ignore any error.
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, NULL);
+#endif
+}
+
+int SerialCommunicationManagerImp::waitForEvents(int timeout_ms, vector<int> *ready, bool *tickled)
+{
+    ready->clear();
+    *tickled = false;
+
+#if defined(__linux__)
+    struct epoll_event events[16];
+    int n = epoll_wait(epoll_fd_, events, 16, timeout_ms);
+    for (int i = 0; i < n; ++i)
+    {
+        if (events[i].data.fd == tickle_read_fd_) *tickled = true;
+        else ready->push_back(events[i].data.fd);
+    }
+#else
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(tickle_read_fd_, &readfds);
+    int max_fd = tickle_read_fd_;
+    for (auto &p : watched_)
+    {
+        FD_SET(p.first, &readfds);
+        if (p.first > max_fd) max_fd = p.first;
+    }
+    struct timeval timeout { timeout_ms/1000, (timeout_ms%1000)*1000 };
+    int n = select(max_fd+1, &readfds, NULL, NULL, &timeout);
+    if (n > 0)
+    {
+        if (FD_ISSET(tickle_read_fd_, &readfds)) *tickled = true;
+        for (auto &p : watched_)
         {
-            LOCK_SERIAL_DEVICES(list_file_descriptiors_to_listen_to);
+            if (FD_ISSET(p.first, &readfds)) ready->push_back(p.first);
+        }
+    }
+#endif
+    if (*tickled) drainTickles();
+    return n;
+}
 
-            for (shared_ptr<SerialDevice> &sd : serial_devices_)
-            {
-                if (sd->opened() && sd->working() && !sd->skippingCallbacks())
-                {
-                    if (!sd->resetting() && sd->fd() >= 0)
-                    {
-                        trace("[SERIAL] select read on fd %d\n", sd->fd());
-                        FD_SET(sd->fd(), &readfds);
-                    }
-                }
-                if (sd->opened() && !sd->working()) all_working = false;
-            }
+void SerialCommunicationManagerImp::drainTickles()
+{
+    uchar buf[64];
+    while (read(tickle_read_fd_, buf, sizeof(buf)) > 0) {}
+}
+
+void SerialCommunicationManagerImp::invokeCallback(int fd)
+{
+    auto i = watched_.find(fd);
+    if (i == watched_.end()) return;
+    shared_ptr<SerialDevice> sd = i->second.lock();
+    if (!sd) return;
+    SerialDeviceImp *si = dynamic_cast<SerialDeviceImp*>(sd.get());
+    if (!si || si->fd() != fd || si->resetting() || si->skippingCallbacks() || !si->on_data_)
+    {
+        // The device was closed, reset or does not want callbacks right now. The event
+        // was edge triggered, so stop watching and let the next sync add it again,
+        // which triggers a new event if there is still data to read.
+        unwatchFd(fd);
+        watched_.erase(i);
+        return;
+    }
+
+    trace("[SERIAL] data available for reading on fd %d\n", fd);
+
+    auto start = chrono::steady_clock::now();
+    si->on_data_();
+    uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-start).count();
+    double ms = ns/1000000.0;
+
+    if (isMetricsEnabled())
+    {
+        if (si->callback_metrics_ == NULL) si->callback_metrics_ = lookupMetrics(MetricsStage::event_loop_callback, sd->device());
+        recordStage(si->callback_metrics_, ns);
+    }
+
+    LOCK_SERIAL_DEVICES(record_callback_latency);
+    CallbackLatency &cl = callback_latencies_[sd->device()];
+    cl.calls++;
+    cl.sum_ms += ms;
+    if (ms > cl.max_ms) cl.max_ms = ms;
+}
+
+bool SerialCommunicationManagerImp::allWorking()
+{
+    bool all_working = true;
+    {
+        LOCK_SERIAL_DEVICES(check_all_working);
+
+        for (shared_ptr<SerialDevice> &sd : serial_devices_)
+        {
+            if (sd->opened() && !sd->working()) all_working = false;
         }
+    }
 
-        if (!all_working && expect_devices_to_work_)
+    if (!all_working && expect_devices_to_work_)
+    {
+        debug("(serial) not all devices working, emergency exit!\n");
+        stop();
+        return false;
+    }
+    return true;
+}
+
+bool SerialCommunicationManagerImp::closeNonWorking()
+{
+    vector<shared_ptr<SerialDevice>> non_working;
+    {
+        LOCK_SERIAL_DEVICES(find_non_working_serial_devices);
+
+        for (shared_ptr<SerialDevice> &sd : serial_devices_)
         {
-            debug("(serial) not all devices working, emergency exit!\n");
-            stop();
-            break;
+            if (sd->opened() && !sd->working() && !sd->isClosed()) non_working.push_back(sd);
         }
+    }
+
+    for (shared_ptr<SerialDevice> &sd : non_working)
+    {
+        debug("(serial) closing non working fd=%d \"%s\"\n", sd->fd(), sd->device().c_str());
+        sd->close();
+    }
+
+    removeNonWorkingSerialDevices();
+
+    if (non_working.size() > 0 && expect_devices_to_work_)
+    {
+        debug("(serial) non working devices found, exiting.\n");
+        stop();
+        return false;
+    }
+    return true;
+}
 
-        // Perform a select call every second.
-        struct timeval timeout { 1, 0 };
+void *SerialCommunicationManagerImp::eventLoop()
+{
+    LOCK_EVENT_LOOP(eventLoop);
 
-        trace("[SERIAL] select timeout %d s\n", timeout.tv_sec);
+    // The devices are checked when the loop is tickled because a device was added,
+    // opened, closed or reset, and otherwise once every second.
+    bool check_devices = true;
+    time_t last_check = 0;
+    vector<int> ready;
 
-        int max_fd = 0;
-        for (shared_ptr<SerialDevice> &sp : serial_devices_)
+    while (running_)
+    {
+        if (check_devices)
         {
-            if (sp->fd() > max_fd)
-            {
-                max_fd = sp->fd();
-            }
+            if (!allWorking()) break;
+            syncWatchedDevices();
         }
 
-        int activity = select(max_fd+1 , &readfds, NULL , NULL, &timeout);
+        bool tickled = false;
+        // Regular files are always readable, do not sleep while reading them.
+        int timeout_ms = always_ready_.size() > 0 ? 0 : 1000;
+        int activity = waitForEvents(timeout_ms, &ready, &tickled);
 
         if (activity == -1 && errno == EINTR)
         {
             debug("(serial) EVENT thread interrupted\n");
+            tickled = true;
         }
         if (!running_) break;
         if (activity < 0 && errno!=EINTR)
         {
-            warning("(serial) internal error after select! errno=%s\n", strerror(errno));
+            warning("(serial) internal error after waiting for events! errno=%s\n", strerror(errno));
         }
 
-        if (activity > 0)
+        for (int fd : ready)
         {
-            // Something has happened that caused the sleeping select to wake up.
-            vector<shared_ptr<SerialDevice>> to_be_notified;
-            {
-                LOCK_SERIAL_DEVICES(find_triggering_file_descriptions);
-
-                for (shared_ptr<SerialDevice> &sd : serial_devices_)
-                {
-                    if (sd->opened() && sd->working() && !sd->resetting() && sd->fd() >= 0)
-                    {
-                        if (FD_ISSET(sd->fd(), &readfds))
-                        {
-                            trace("[SERIAL] select detected data available for reading on fd %d\n", sd->fd());
-                            to_be_notified.push_back(sd);
-                        }
-                    }
-                }
-            }
-
-            for (shared_ptr<SerialDevice> &sd : to_be_notified)
-            {
-                SerialDeviceImp *si = dynamic_cast<SerialDeviceImp*>(sd.get());
-                if (si->on_data_)
-                {
-                    si->on_data_();
-                }
-            }
+            invokeCallback(fd);
         }
-
-        vector<shared_ptr<SerialDevice>> non_working;
+        set<int> files = always_ready_;
+        for (int fd : files)
         {
-            LOCK_SERIAL_DEVICES(find_non_working_serial_devices);
-
-            for (shared_ptr<SerialDevice> &sd : serial_devices_)
-            {
-                if (sd->opened() && !sd->working() && !sd->isClosed()) non_working.push_back(sd);
-            }
+            invokeCallback(fd);
         }
 
-        for (shared_ptr<SerialDevice> &sd : non_working)
+        time_t now = time(NULL);
+        check_devices = tickled || now != last_check;
+        if (check_devices)
         {
-            debug("(serial) closing non working fd=%d \"%s\"\n", sd->fd(), sd->device().c_str());
-            sd->close();
-        }
-
-        removeNonWorkingSerialDevices();
-
-        if (non_working.size() > 0 && expect_devices_to_work_)
-        {
-            debug("(serial) non working devices found, exiting.\n");
-            stop();
-            break;
+            last_check = now;
+            if (!closeNonWorking()) break;
         }
     }
     verbose("(serial) event loop stopped!\n");
@@ -1053,6 +1267,23 @@ void *SerialCommunicationManagerImp::eventLoop()
     return NULL;
 }
 
+string SerialCommunicationManagerImp::eventLoopMetrics()
+{
+    LOCK_SERIAL_DEVICES(event_loop_metrics);
+
+    string s;
+    for (auto &p : callback_latencies_)
+    {
+        CallbackLatency &cl = p.second;
+        s += tostrprintf("device %s callbacks %zu latency avg %.3f ms max %.3f ms\n",
+                         p.first.c_str(),
+                         cl.calls,
+                         cl.calls > 0 ? cl.sum_ms / cl.calls : 0.0,
+                         cl.max_ms);
+    }
+    return s;
+}
+
 shared_ptr<SerialCommunicationManager> createSerialCommunicationManager(time_t exit_after_seconds,
                                                                         bool start_event_loop)
 {
@@ -1222,6 +1453,7 @@ bool SerialCommunicationManagerImp::removeNonWorking(string device)
         {
             i = serial_devices_.erase(i);
             found_and_removed = true;
+            tickleEventLoop();
         }
         else
         {
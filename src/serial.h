@@ -56,7 +56,7 @@ struct SerialDevice
     virtual bool resetting() = 0; // The serial device is working but can lack a valid file descriptor.
     // Used when connecting stdin to a tty driver for testing.
     virtual bool readonly() = 0;
-    // Mark this device so that it is ignored by the select/callback event loop.
+    // Mark this device so that it is ignored by the callback event loop.
     virtual void disableCallbacks() = 0;
     // Enable this device to trigger callbacks from the event loop.
     virtual void enableCallbacks() = 0;
@@ -117,6 +117,8 @@ struct SerialCommunicationManager
     virtual std::shared_ptr<SerialDevice> lookup(std::string device) = 0;
     // Remove a closed device, returns false and do not remove, if the device is still in use.
     virtual bool removeNonWorking(std::string device) = 0;
+    // Number of callbacks from the event loop and their latency, per device.
+    virtual std::string eventLoopMetrics() = 0;
     virtual ~SerialCommunicationManager();
 };
 
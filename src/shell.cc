@@ -15,13 +15,18 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "metrics.h"
 #include "shell.h"
 #include "util.h"
 
 #include <assert.h>
+#include <chrono>
+#include <deque>
+#include <errno.h>
 #include <fcntl.h>
 #include <memory.h>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -108,9 +113,13 @@ void invokeShell(string program, vector<string> args, vector<string> envs)
     delete[] p;
 }
 
-bool invokeBackgroundShell(string program, vector<string> args, vector<string> envs, int *fd_out, int *pid)
+// Start a background shell. If fd_out is non-NULL then the child's stdout and stderr are
+// piped to *fd_out, otherwise they are inherited. If fd_in is non-NULL then the child's
+// stdin is piped from *fd_in, otherwise it is closed.
+static bool startBackgroundShell(string program, vector<string> args, vector<string> envs, int *fd_in, int *fd_out, int *pid)
 {
     int link[2];
+    int input[2];
     vector<const char*> argv(args.size()+2);
     char *p = new char[program.length()+1];
     strcpy(p, program.c_str());
@@ -126,9 +135,22 @@ bool invokeBackgroundShell(string program, vector<string> args, vector<string> e
 
     vector<const char*> env = prepareEnv(envs);
 
-    if (pipe(link) == -1) {
+    if (fd_out && pipe(link) == -1) {
+        error("(bgshell) could not create pipe!\n");
+    }
+    // Do not leak the input pipe into other children, started meanwhile by other
+    // threads, then our child would never see end of file when we close it.
+#if defined(__APPLE__) && defined(__MACH__)
+    if (fd_in && (pipe(input) == -1 ||
+                  fcntl(input[0], F_SETFD, FD_CLOEXEC) == -1 ||
+                  fcntl(input[1], F_SETFD, FD_CLOEXEC) == -1)) {
+        error("(bgshell) could not create pipe!\n");
+    }
+#else
+    if (fd_in && pipe2(input, O_CLOEXEC) == -1) {
         error("(bgshell) could not create pipe!\n");
     }
+#endif
 
     *pid = fork();
     if (*pid == 0) {
@@ -140,14 +162,27 @@ bool invokeBackgroundShell(string program, vector<string> args, vector<string> e
         // so that we can easily terminate it and all its
         // subprocesses later one!
         setpgid(0, 0);
-        // Redirect stdout and stderr to pipe
-        dup2 (link[1], STDOUT_FILENO);
-        dup2 (link[1], STDERR_FILENO);
-        // Close return pipe, not duped.
-        close(link[0]);
-        // Close old forward fd pipe.
-        close(link[1]);
-        close(0); // Close stdin
+        if (fd_out)
+        {
+            // Redirect stdout and stderr to pipe
+            dup2 (link[1], STDOUT_FILENO);
+            dup2 (link[1], STDERR_FILENO);
+            // Close return pipe, not duped.
+            close(link[0]);
+            // Close old forward fd pipe.
+            close(link[1]);
+        }
+        if (fd_in)
+        {
+            // Read stdin from pipe.
+            dup2 (input[0], STDIN_FILENO);
+            close(input[0]);
+            close(input[1]);
+        }
+        else
+        {
+            close(0); // Close stdin
+        }
 
 #if (defined(__APPLE__) && defined(__MACH__)) || defined(__FreeBSD__)
         execve(program.c_str(), (char*const*)&argv[0], (char*const*)&env[0]);
@@ -160,16 +195,77 @@ bool invokeBackgroundShell(string program, vector<string> args, vector<string> e
         return false;
     }
 
-    // Make reads from the pipe non-blocking.
-    int flags = fcntl(link[0], F_GETFL);
-    flags |= O_NONBLOCK;
-    fcntl(link[0], F_SETFL, flags);
+    if (fd_out)
+    {
+        // Make reads from the pipe non-blocking.
+        int flags = fcntl(link[0], F_GETFL);
+        flags |= O_NONBLOCK;
+        fcntl(link[0], F_SETFL, flags);
 
-    *fd_out = link[0];
+        *fd_out = link[0];
+    }
+    if (fd_in)
+    {
+        close(input[0]);
+        // Make writes to the pipe non-blocking, a child that does not read
+        // its input must not stall us.
+        int flags = fcntl(input[1], F_GETFL);
+        flags |= O_NONBLOCK;
+        fcntl(input[1], F_SETFL, flags);
+
+        *fd_in = input[1];
+    }
     delete[] p;
     return true;
 }
 
+bool invokeBackgroundShell(string program, vector<string> args, vector<string> envs, int *fd_out, int *pid)
+{
+    return startBackgroundShell(program, args, envs, NULL, fd_out, pid);
+}
+
+bool invokeBackgroundShellWithInput(string program, vector<string> args, vector<string> envs, int *fd_in, int *pid)
+{
+    return startBackgroundShell(program, args, envs, fd_in, NULL, pid);
+}
+
+bool writeToBackgroundShell(int fd, const string &data, size_t *written)
+{
+    // A dead child would raise SIGPIPE and terminate us. Block the signal
+    // in this thread during the write and discard it if it was raised.
+    sigset_t sigpipe, old_mask;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+
+    bool ok = true;
+    bool broken_pipe = false;
+    *written = 0;
+    while (*written < data.size())
+    {
+        ssize_t n = write(fd, data.data()+*written, data.size()-*written);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            // The pipe is full, the child has not read its input yet.
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            broken_pipe = errno == EPIPE;
+            debug("(bgshell) write to fd %d failed: %s\n", fd, strerror(errno));
+            ok = false;
+            break;
+        }
+        *written += n;
+    }
+
+    if (broken_pipe)
+    {
+        struct timespec zero = { 0, 0 };
+        sigtimedwait(&sigpipe, NULL, &zero);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return ok;
+}
+
 bool stillRunning(int pid)
 {
     if (pid == 0) return false;
@@ -354,3 +450,178 @@ void detectProcesses(string cmd, vector<int> *pids)
         pch = strtok (NULL, " \n");
     }
 }
+
+struct ShellInvocation
+{
+    string key;
+    string program;
+    vector<string> args;
+    vector<string> envs;
+    DriverMetrics *metrics;
+    chrono::steady_clock::time_point queued;
+};
+
+static pthread_mutex_t shell_pool_lock_ = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when an invocation is queued, a key is released or the pool is stopping.
+static pthread_cond_t shell_pool_work_ = PTHREAD_COND_INITIALIZER;
+// Signalled when an invocation is taken from the queue or has finished.
+static pthread_cond_t shell_pool_space_ = PTHREAD_COND_INITIALIZER;
+static deque<ShellInvocation> shell_queue_;
+// Invocations with the same key are never run concurrently, this keeps them in order.
+static set<string> shell_running_keys_;
+static vector<pthread_t> shell_workers_;
+static size_t shell_max_queued_ {};
+static bool shell_coalesce_ {};
+static bool shell_stopping_ {};
+static int shell_running_ {};
+static ShellPoolCounters shell_counters_;
+static MetricsCounter *shell_queue_depth_ {};
+
+// Invoke the shell and record the time it took in the shell stage of the driver.
+static void invokeShellAndRecord(string program, vector<string> args, vector<string> envs, DriverMetrics *metrics)
+{
+    uint64_t start = metrics ? metricsNow() : 0;
+    invokeShell(program, args, envs);
+    if (start)
+    {
+        recordStage(metrics->shell, metricsNow()-start);
+        countMetrics(metrics->shell_invocations);
+    }
+}
+
+static void *shellWorker(void *)
+{
+    pthread_mutex_lock(&shell_pool_lock_);
+    for (;;)
+    {
+        auto i = shell_queue_.begin();
+        while (i != shell_queue_.end() && i->key != "" && shell_running_keys_.count(i->key) > 0) i++;
+
+        if (i == shell_queue_.end())
+        {
+            if (shell_stopping_ && shell_queue_.empty()) break;
+            pthread_cond_wait(&shell_pool_work_, &shell_pool_lock_);
+            continue;
+        }
+
+        ShellInvocation si = *i;
+        shell_queue_.erase(i);
+        setMetrics(shell_queue_depth_, shell_queue_.size());
+        if (si.key != "") shell_running_keys_.insert(si.key);
+        shell_running_++;
+        shell_counters_.invoked++;
+        if (chrono::steady_clock::now() - si.queued > chrono::seconds(1))
+        {
+            shell_counters_.late++;
+            if (si.metrics) countMetrics(si.metrics->shell_late);
+        }
+        pthread_cond_broadcast(&shell_pool_space_);
+        pthread_mutex_unlock(&shell_pool_lock_);
+
+        invokeShellAndRecord(si.program, si.args, si.envs, si.metrics);
+
+        pthread_mutex_lock(&shell_pool_lock_);
+        if (si.key != "") shell_running_keys_.erase(si.key);
+        shell_running_--;
+        pthread_cond_broadcast(&shell_pool_work_);
+        pthread_cond_broadcast(&shell_pool_space_);
+    }
+    pthread_mutex_unlock(&shell_pool_lock_);
+    return NULL;
+}
+
+void startShellPool(int workers, int max_queued, bool coalesce)
+{
+    assert(shell_workers_.size() == 0);
+    if (workers <= 0) return;
+
+    shell_max_queued_ = max_queued > 0 ? max_queued : 1;
+    shell_coalesce_ = coalesce;
+    shell_stopping_ = false;
+    shell_queue_depth_ = lookupMetrics(MetricsGauge::shell_queue_depth);
+    for (int i = 0; i < workers; ++i)
+    {
+        pthread_t t;
+        if (pthread_create(&t, NULL, shellWorker, NULL))
+        {
+            error("(shell) could not start shell worker thread!\n");
+        }
+        shell_workers_.push_back(t);
+    }
+    verbose("(shell) started %d shell workers with a queue of %zu invocations%s\n",
+            workers, shell_max_queued_, shell_coalesce_ ? ", coalescing" : "");
+}
+
+void invokeShellAsync(string key, string program, vector<string> args, vector<string> envs,
+                      DriverMetrics *metrics)
+{
+    if (shell_workers_.size() == 0)
+    {
+        invokeShellAndRecord(program, args, envs, metrics);
+        return;
+    }
+
+    pthread_mutex_lock(&shell_pool_lock_);
+    if (shell_coalesce_ && key != "")
+    {
+        for (auto &si : shell_queue_)
+        {
+            if (si.key == key)
+            {
+                // Keep the position in the queue, but send the latest values.
+                debug("(shell) coalescing invocation for %s\n", program.c_str());
+                si.args = args;
+                si.envs = envs;
+                shell_counters_.dropped++;
+                // The replaced reading is never sent, ie it is dropped.
+                if (metrics) countMetrics(metrics->shell_coalesced);
+                pthread_mutex_unlock(&shell_pool_lock_);
+                return;
+            }
+        }
+    }
+    if (shell_queue_.size() >= shell_max_queued_)
+    {
+        shell_counters_.blocked++;
+        if (metrics) countMetrics(metrics->shell_blocked);
+        debug("(shell) queue full, waiting for a shell worker\n");
+        while (shell_queue_.size() >= shell_max_queued_)
+        {
+            pthread_cond_wait(&shell_pool_space_, &shell_pool_lock_);
+        }
+    }
+    shell_queue_.push_back({ key, program, args, envs, metrics, chrono::steady_clock::now() });
+    setMetrics(shell_queue_depth_, shell_queue_.size());
+    if (shell_queue_.size() > shell_counters_.max_queue_depth) shell_counters_.max_queue_depth = shell_queue_.size();
+    pthread_cond_signal(&shell_pool_work_);
+    pthread_mutex_unlock(&shell_pool_lock_);
+}
+
+void stopShellPool()
+{
+    if (shell_workers_.size() == 0) return;
+
+    pthread_mutex_lock(&shell_pool_lock_);
+    shell_stopping_ = true;
+    pthread_cond_broadcast(&shell_pool_work_);
+    pthread_mutex_unlock(&shell_pool_lock_);
+
+    for (pthread_t t : shell_workers_)
+    {
+        pthread_join(t, NULL);
+    }
+    shell_workers_.clear();
+
+    ShellPoolCounters c = shellPoolCounters();
+    verbose("(shell) pool invoked %zu dropped %zu late %zu blocked %zu max queue depth %zu\n",
+            c.invoked, c.dropped, c.late, c.blocked, c.max_queue_depth);
+}
+
+ShellPoolCounters shellPoolCounters()
+{
+    pthread_mutex_lock(&shell_pool_lock_);
+    ShellPoolCounters c = shell_counters_;
+    c.queue_depth = shell_queue_.size();
+    pthread_mutex_unlock(&shell_pool_lock_);
+    return c;
+}
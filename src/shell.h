@@ -15,6 +15,8 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include"metrics.h"
+
 #include<string>
 #include<vector>
 
@@ -23,6 +25,37 @@ using namespace std;
 void invokeShell(string program, vector<string> args, vector<string> envs);
 int  invokeShellCaptureOutput(string program, vector<string> args, vector<string> envs, string *out, bool do_not_warn_if_fail);
 bool invokeBackgroundShell(string program, vector<string> args, vector<string> envs, int *out, int *pid);
+// Start a background shell that reads from *in, its stdout and stderr are inherited.
+bool invokeBackgroundShellWithInput(string program, vector<string> args, vector<string> envs, int *in, int *pid);
+// Write without blocking, *written is less than the size of data if the pipe is full.
+// Returns false if the background shell could not be written to, eg it has exited.
+bool writeToBackgroundShell(int fd, const string &data, size_t *written);
 bool stillRunning(int pid);
 void stopBackgroundShell(int pid);
 void detectProcesses(string cmd, vector<int> *pids);
+
+// Shells for telegrams can be invoked from a pool of worker threads, so that
+// a slow shell command does not stall the decoding of telegrams.
+// With zero workers (the default) the shells are invoked synchronously.
+// When the queue is full, the caller waits for a free slot (backpressure).
+// When coalescing is enabled, a queued invocation with the same key
+// is replaced by the newer one, ie only the latest reading of a meter is sent.
+void startShellPool(int workers, int max_queued, bool coalesce);
+// An empty key is never coalesced. The shell stage and the pool counters are recorded
+// in the driver metrics, which can be NULL.
+void invokeShellAsync(string key, string program, vector<string> args, vector<string> envs,
+                      DriverMetrics *metrics);
+// Wait for all queued invocations to finish and then stop the workers.
+void stopShellPool();
+
+struct ShellPoolCounters
+{
+    size_t queue_depth {}; // Currently queued invocations.
+    size_t max_queue_depth {}; // Highest number of queued invocations seen.
+    size_t invoked {}; // Invocations started by the workers.
+    size_t dropped {}; // Replaced by a newer invocation with the same key before it started.
+    size_t late {}; // Waited in the queue for more than a second before it started.
+    size_t blocked {}; // Times the caller had to wait for a slot in a full queue.
+};
+
+ShellPoolCounters shellPoolCounters();
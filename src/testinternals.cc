@@ -22,14 +22,19 @@
 #include"config.h"
 #include"formula_implementation.h"
 #include"meters.h"
+#include"metrics.h"
 #include"printer.h"
 #include"serial.h"
 #include"translatebits.h"
 #include"util.h"
 #include"wmbus.h"
+#include"wmbus_common_implementation.h"
 #include"dvparser.h"
 
 #include<string.h>
+#include<chrono>
+#include<cmath>
+#include<limits>
 #include<set>
 
 using namespace std;
@@ -41,6 +46,7 @@ bool verbose_ = false;
     X(addresses) \
     X(dynamic_loading)                        \
     X(crc)            \
+    X(duplicates)     \
     X(dvparser)       \
     X(devices)        \
     X(linkmodes)      \
@@ -51,16 +57,20 @@ bool verbose_ = false;
     X(meters)         \
     X(months)         \
     X(aes)            \
+    X(aes_backends)   \
     X(sbc)            \
     X(hex)            \
     X(translate)                                \
     X(slip)                                     \
+    X(receive_buffer)                           \
     X(dvs)                                      \
     X(ascii_detection)                          \
     X(status_join)                              \
     X(status_sort)                              \
     X(field_matcher)                            \
     X(units_extraction)                         \
+    X(value_to_string)                          \
+    X(json_string)                              \
     X(si_units_siexp)                           \
     X(si_units_basic)                           \
     X(si_units_conversion)                      \
@@ -75,11 +85,23 @@ bool verbose_ = false;
     X(formulas_errors)                          \
     X(formulas_dventries)                       \
     X(formulas_stringinterpolation)             \
+    X(formulas_compiled)                        \
+    X(calculations_skipped)                     \
+    X(generated_field_names)                    \
+    X(metrics_prometheus)                       \
 
 #define X(t) void test_##t();
 LIST_OF_TESTS
 #undef X
 
+// Benchmarks are only run when asked for, eg: testinternals bench_aes
+#define LIST_OF_BENCHMARKS \
+    X(aes)                 \
+
+#define X(t) void bench_##t();
+LIST_OF_BENCHMARKS
+#undef X
+
 // Test if we should run this test based on the command line pattern.
 bool test(const char *test_name, const char *pattern)
 {
@@ -127,6 +149,10 @@ int main(int argc, char **argv)
 
 #define X(x) if (test(#x, pattern)) test_##x();
 LIST_OF_TESTS
+#undef X
+
+#define X(x) if (pattern != NULL && !strncmp(pattern, "bench", 5) && strstr("bench_" #x, pattern)) bench_##x();
+LIST_OF_BENCHMARKS
 #undef X
 
     return 0;
@@ -186,6 +212,33 @@ void test_crc()
     }
 }
 
+void test_duplicates()
+{
+    vector<uchar> a, b, c;
+    hex2bin("2e44931578563412330333637a2a0020", &a);
+    hex2bin("2e44931578563412330333637a2b0020", &b);
+    hex2bin("2e44931511111111330333637a2a0020", &c);
+
+    // Remember at most two telegrams for at most 30 seconds.
+    DuplicateFilter df(2, 30);
+
+    if (df.seenBefore(a, 1000)) printf("ERROR! a should be new\n");
+    if (!df.seenBefore(a, 1010)) printf("ERROR! a should be a duplicate\n");
+    if (df.seenBefore(b, 1011)) printf("ERROR! b should be new\n");
+    if (df.seenBefore(c, 1012)) printf("ERROR! c should be new\n");
+    // a was pushed out by b and c, now a pushes out b.
+    if (df.seenBefore(a, 1013)) printf("ERROR! a should have been forgotten\n");
+    // c was first seen at 1012, it expires at 1042.
+    if (!df.seenBefore(c, 1041)) printf("ERROR! c should still be a duplicate\n");
+    if (df.seenBefore(c, 1042)) printf("ERROR! c should have expired\n");
+    if (!df.seenBefore(a, 1042)) printf("ERROR! a should still be a duplicate\n");
+
+    if (df.hits() != 3 || df.misses() != 5)
+    {
+        printf("ERROR! expected 3 hits and 5 misses but got %zu and %zu\n", df.hits(), df.misses());
+    }
+}
+
 bool tst_parse(const char *data, std::map<std::string,std::pair<int,DVEntry>> *dv_entries, int testnr)
 {
     debug("\n\nTest nr %d......\n\n", testnr);
@@ -270,6 +323,16 @@ void test_dvparser()
     dv_entries.clear();
     tst_parse("426C FE04", &dv_entries, testnr);
     tst_date(dv_entries, "426C", "2007-04-30 00:00:00", testnr); // 2010-dec-31
+
+    testnr++;
+    dv_entries.clear();
+    tst_parse("0A 13 23 F1 42 13 FE FF 8C 01 13 FF FF FF FF", &dv_entries, testnr);
+    tst_double(dv_entries, "0A13", -0.123, testnr);
+    // Extracting again must give the same negative bcd value.
+    tst_double(dv_entries, "0A13", -0.123, testnr);
+    tst_string(dv_entries, "0A13", "23F1", testnr);
+    tst_double(dv_entries, "4213", -0.002, testnr);
+    tst_string(dv_entries, "8C0113", "FFFFFFFF", testnr);
 }
 
 void test_devices()
@@ -1353,6 +1416,116 @@ void test_aes()
     }
 }
 
+void test_aes_backend(const char *backend)
+{
+    // ECB-AES128 from NIST SP 800-38A.
+    vector<uchar> key, plain, cipher;
+    hex2bin("2b7e151628aed2a6abf7158809cf4f3c", &key);
+    hex2bin("6bc1bee22e409f96e93d7e117393172a"
+            "ae2d8a571e03ac9c9eb76fac45af8e51", &plain);
+    hex2bin("3ad77bb40d7a3660a89ecaf32466ef97"
+            "f5d3d58503b9699de785895a96fdbaaf", &cipher);
+
+    AES_ctx ctx;
+    AES_init_ctx(&ctx, &key[0]);
+
+    uchar out[32], back[32];
+    AES_ctx_encrypt_block(&ctx, &plain[0], out);
+    AES_ctx_encrypt_block(&ctx, &plain[16], out+16);
+    if (memcmp(out, &cipher[0], 32))
+    {
+        printf("ERROR! aes %s encrypt expected %s but got %s\n", backend,
+               bin2hex(cipher).c_str(), bin2hex(vector<uchar>(out, out+32)).c_str());
+    }
+    AES_ctx_decrypt_block(&ctx, out, back);
+    AES_ctx_decrypt_block(&ctx, out+16, back+16);
+    if (memcmp(back, &plain[0], 32))
+    {
+        printf("ERROR! aes %s decrypt failed\n", backend);
+    }
+
+    // CBC-AES128 from NIST SP 800-38A.
+    vector<uchar> iv, cbc;
+    hex2bin("000102030405060708090a0b0c0d0e0f", &iv);
+    hex2bin("7649abac8119b246cee98e9b12e9197d"
+            "5086cb9b507219ee95db113a917678b2", &cbc);
+    AES_ctx_CBC_decrypt_buffer(&ctx, back, &cbc[0], 32, &iv[0]);
+    if (memcmp(back, &plain[0], 32))
+    {
+        printf("ERROR! aes %s cbc decrypt failed\n", backend);
+    }
+    // In place.
+    memcpy(back, &cbc[0], 32);
+    AES_ctx_CBC_decrypt_buffer(&ctx, back, back, 32, &iv[0]);
+    if (memcmp(back, &plain[0], 32))
+    {
+        printf("ERROR! aes %s cbc decrypt in place failed\n", backend);
+    }
+}
+
+void test_aes_backends()
+{
+    bool hw = AES_hw_enabled();
+
+    AES_enable_hw(false);
+    test_aes_backend("byte-wise");
+    if (AES_hw_available())
+    {
+        AES_enable_hw(true);
+        test_aes_backend("aes-ni");
+    }
+
+    AES_enable_hw(hw);
+}
+
+double benchAESCTR(const char *name, bool cached, int blocks)
+{
+    vector<uchar> key;
+    hex2bin("0123456789abcdef0123456789abcdef", &key);
+    uchar iv[16], xordata[16];
+    memset(iv, 0, sizeof(iv));
+
+    AES_ctx ctx;
+    AES_init_ctx(&ctx, &key[0]);
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < blocks; ++i)
+    {
+        if (cached)
+        {
+            AES_ctx_encrypt_block(&ctx, iv, xordata);
+        }
+        else
+        {
+            AES_ECB_encrypt(iv, &key[0], xordata, 16);
+        }
+        iv[i%16] ^= xordata[0];
+    }
+    auto end = chrono::steady_clock::now();
+    double ns = chrono::duration_cast<chrono::nanoseconds>(end-start).count() / (double)blocks;
+    printf("%-36s %8.1f ns/block\n", name, ns);
+    return ns;
+}
+
+void bench_aes()
+{
+    bool hw = AES_hw_enabled();
+    int blocks = 1000000;
+
+    AES_enable_hw(false);
+    double old_ns = benchAESCTR("key expansion every block", false, blocks);
+    double sw_ns = benchAESCTR("cached key schedule, byte-wise", true, blocks);
+    printf("%-36s %8.1fx\n", "speedup", old_ns/sw_ns);
+    if (AES_hw_available())
+    {
+        AES_enable_hw(true);
+        double hw_ns = benchAESCTR("cached key schedule, aes-ni", true, blocks);
+        printf("%-36s %8.1fx\n", "speedup", old_ns/hw_ns);
+    }
+
+    AES_enable_hw(hw);
+}
+
 void test_is_hex(const char *hex, bool expected_ok, bool expected_invalid, bool strict)
 {
     bool got_invalid;
@@ -1553,6 +1726,55 @@ void test_slip()
 
 }
 
+void test_receive_buffer()
+{
+    ReceiveBuffer rb;
+    vector<uchar> chunk = { 0xa5, 1, 2, 0x17, 0xa5, 3, 0xa5, 4 };
+
+    rb.append(chunk);
+    rb.consume(1);
+    if (rb.size() != 7 || rb.view()[0] != 1)
+    {
+        printf("ERROR receive buffer 1\n");
+    }
+
+    size_t n = rb.resync(0xa5);
+    if (n != 3 || rb.size() != 4 || rb.view()[0] != 0xa5)
+    {
+        printf("ERROR receive buffer 2 dropped %zu\n", n);
+    }
+
+    // The buffer starts with a5 but the frame is bad, skip to the next a5.
+    n = rb.resync(0xa5);
+    if (n != 2 || rb.size() != 2)
+    {
+        printf("ERROR receive buffer 3 dropped %zu\n", n);
+    }
+
+    vector<uchar> more = { 5, 6 };
+    rb.append(more);
+    FrameView v = rb.view();
+    vector<uchar> expected = { 0xa5, 4, 5, 6 };
+    if (vector<uchar>(v.begin(), v.end()) != expected)
+    {
+        printf("ERROR receive buffer 4 got %s\n", safeString(v).c_str());
+    }
+
+    // No start byte left, everything is dropped.
+    rb.consume(1);
+    n = rb.resync(0xa5);
+    if (n != 3 || rb.size() != 0 || rb.resync(0xa5) != 0)
+    {
+        printf("ERROR receive buffer 5 dropped %zu\n", n);
+    }
+
+    FrameView f = FrameView(chunk).from(0x17);
+    if (f.size() != 5 || f[1] != 0xa5 || FrameView(chunk).from(0x99).size() != 0)
+    {
+        printf("ERROR receive buffer 6\n");
+    }
+}
+
 void test_dvs()
 {
     DifVifKey dvk("0B2B");
@@ -1750,6 +1972,63 @@ void test_units_extraction()
     test_unit("current_power_consumption_phase1_kw", true, "current_power_consumption_phase1", Unit::KW);
 }
 
+void test_value(double v, string expected)
+{
+    string got = valueToString(v, Unit::M3);
+    if (got != expected)
+    {
+        printf("ERROR! valueToString(%.17g) expected \"%s\" but got \"%s\"\n", v, expected.c_str(), got.c_str());
+    }
+}
+
+void test_value_to_string()
+{
+    test_value(0, "0");
+    test_value(-0.0, "-0");
+    test_value(-0.0000001, "-0");
+    test_value(17, "17");
+    test_value(100, "100");
+    test_value(123.45, "123.45");
+    test_value(-3.5, "-3.5");
+    test_value(0.1, "0.1");
+    test_value(2.0/3.0, "0.666667");
+    test_value(0.0078125, "0.007812"); // A tie, rounded to even.
+    test_value(0.0234375, "0.023438"); // A tie, rounded to even.
+    test_value(1e20, "100000000000000000000");
+    test_value(std::numeric_limits<double>::quiet_NaN(), "null");
+
+    // Compare with the plain printf %f formatting for a spread of values.
+    double v = 0.000123;
+    for (int i = 0; i < 2000; ++i)
+    {
+        string s = tostrprintf("%f", v);
+        while (s.size() > 0 && s.back() == '0') s.pop_back();
+        if (s.back() == '.') s.pop_back();
+        test_value(v, s);
+        test_value(-v, "-"+s);
+        v = v*1.0173 + 0.0000371;
+    }
+}
+
+void test_json_string(string in, string expected)
+{
+    string got;
+    appendJsonString(&got, in);
+    if (got != expected)
+    {
+        printf("ERROR! appendJsonString(%s) expected %s but got %s\n", in.c_str(), expected.c_str(), got.c_str());
+    }
+}
+
+void test_json_string()
+{
+    test_json_string("", "\"\"");
+    test_json_string("OK", "\"OK\"");
+    test_json_string("say \"hi\"", "\"say \\\"hi\\\"\"");
+    test_json_string("a\\b", "\"a\\\\b\"");
+    test_json_string("1\n2\x01", "\"1\\n2\\u0001\"");
+}
+
 void test_expected_failed_si_convert(Unit from_unit,
                                      Unit to_unit,
                                      Quantity q)
@@ -2751,6 +3030,193 @@ void test_formulas_dventries()
 
 }
 
+void test_formula_compiled(FormulaImplementation *f, Meter *m, DVEntry *dve, string formula, Unit unit)
+{
+    f->clear();
+
+    bool ok = f->parse(m, formula);
+    assert(ok);
+
+    double v = f->calculate(unit, dve);
+    double t = f->topOp()->calculate(toSIUnit(unit));
+
+    if (memcmp(&v, &t, sizeof(v)) != 0 && !(std::isnan(v) && std::isnan(t)))
+    {
+        printf("ERROR when evaluating \"%s\"\nERROR program %s\nERROR calculated %.17g but tree calculated %.17g\n",
+               formula.c_str(), f->program().c_str(), v, t);
+    }
+}
+
+void test_formulas_compiled()
+{
+    MeterInfo mi;
+    mi.parse("testur", "ebzwmbe", "22992299", "");
+    shared_ptr<Meter> meter = createMeter(&mi);
+
+    vector<uchar> frame;
+    hex2bin("5B445a149922992202378c20f6900f002c25Bc9e0000BBBBBBBBBBBBBBBB72992299225a140102f6003007102f2f040330f92a0004a9ff01ff24000004a9ff026a29000004a9ff03460600000dfd11063132333435362f2f2f2f2f2f", &frame);
+
+    Telegram t;
+    MeterKeys mk;
+    t.parse(frame, &mk, true);
+
+    vector<Address> id;
+    bool match;
+    meter->handleTelegram(t.about, frame, true, &id, &match, &t);
+
+    DVEntry dve;
+    dve.storage_nr = 17;
+    dve.tariff_nr = 3;
+    dve.subunit_nr = 2;
+
+    unique_ptr<FormulaImplementation> f = unique_ptr<FormulaImplementation>(new FormulaImplementation());
+
+    test_formula_compiled(f.get(), meter.get(), NULL, "current_power_consumption_phase1_kw + current_power_consumption_phase2_kw", Unit::KW);
+    test_formula_compiled(f.get(), meter.get(), NULL, "current_power_consumption_phase1_kw * 3600 s", Unit::KWH);
+    test_formula_compiled(f.get(), meter.get(), NULL, "total_energy_consumption_kwh + 17 mj", Unit::GJ);
+    test_formula_compiled(f.get(), meter.get(), NULL, "sqrt(current_power_consumption_phase1_kw * current_power_consumption_phase1_kw)", Unit::W);
+    test_formula_compiled(f.get(), meter.get(), NULL, "12 c + 7 f - 3 k", Unit::F);
+    test_formula_compiled(f.get(), meter.get(), NULL, "'2022-02-28' + 1 month - 3 h", Unit::UnixTimestamp);
+    test_formula_compiled(f.get(), meter.get(), NULL, "2 month + '2022-01-31'", Unit::UnixTimestamp);
+    test_formula_compiled(f.get(), meter.get(), NULL, "30 min - '2022-01-31 10:00'", Unit::UnixTimestamp);
+    test_formula_compiled(f.get(), meter.get(), &dve, "(storage_counter - 12 counter) * tariff_counter - subunit_counter", Unit::COUNTER);
+
+    // Constant subtrees are calculated when compiling.
+    f->clear();
+    f->parse(meter.get(), "current_power_consumption_phase1_kw * (2 counter + 3 counter)");
+    f->calculate(Unit::KW);
+    string p = f->program();
+    if (p.find("CONSTANT(5)") == string::npos || p.find("ADD") != string::npos)
+    {
+        printf("ERROR expected the constant subtree to be folded, but got program %s\n", p.c_str());
+    }
+}
+
+void test_calculations_skipped()
+{
+    MeterInfo mi;
+    mi.parse("testur", "ebzwmbe", "22992299", "");
+    shared_ptr<Meter> meter = createMeter(&mi);
+    // The driver calculates current_power_consumption from the three phases.
+    meter->addExtraCalculatedField("fixed_counter=5 counter");
+    meter->addExtraCalculatedField("double_kw=current_power_consumption_kw * 2 counter");
+
+    vector<uchar> frame;
+    hex2bin("5B445a149922992202378c20f6900f002c25Bc9e0000BBBBBBBBBBBBBBBB72992299225a140102f6003007102f2f040330f92a0004a9ff01ff24000004a9ff026a29000004a9ff03460600000dfd11063132333435362f2f2f2f2f2f", &frame);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        Telegram t;
+        MeterKeys mk;
+        t.parse(frame, &mk, true);
+
+        vector<Address> id;
+        bool match;
+        meter->handleTelegram(t.about, frame, true, &id, &match, &t);
+    }
+
+    // The second telegram sets the phases again, but nothing that fixed reads.
+    if (meter->numCalculations() != 5 || meter->numSkippedCalculations() != 1)
+    {
+        printf("ERROR expected 5 calculations and 1 skipped but got %zu and %zu\n",
+               meter->numCalculations(), meter->numSkippedCalculations());
+    }
+
+    double fixed = meter->getNumericValue("fixed", Unit::COUNTER);
+    double twice = meter->getNumericValue("double", Unit::KW);
+    if (fixed != 5 || twice != 0.21679*2)
+    {
+        printf("ERROR expected fixed 5 and double 0.43358 but got %g and %.17g\n", fixed, twice);
+    }
+}
+
+void test_generated_field_names()
+{
+    MeterInfo mi;
+    mi.parse("testur", "eurisii", "88018801", "");
+    shared_ptr<Meter> meter = createMeter(&mi);
+    FieldInfo *fi = meter->findFieldInfo("consumption_at_set_date_{storage_counter}", Quantity::HCA);
+    assert(fi != NULL);
+
+    DVEntry dve;
+    dve.storage_nr = 3;
+
+    GeneratedFieldName *a = &fi->generatedName(meter.get(), &dve);
+    if (a->no_unit != "consumption_at_set_date_3" ||
+        a->with_unit != "consumption_at_set_date_3_hca" ||
+        a->json_key != "\"consumption_at_set_date_3_hca\":")
+    {
+        printf("ERROR in generated field name, got %s %s %s\n",
+               a->no_unit.c_str(), a->with_unit.c_str(), a->json_key.c_str());
+    }
+
+    // The same counters reuse the generated name.
+    GeneratedFieldName *b = &fi->generatedName(meter.get(), &dve);
+    if (a != b)
+    {
+        printf("ERROR expected the generated field name to be reused\n");
+    }
+
+    dve.storage_nr = 4;
+    string name = fi->generateFieldNameNoUnit(meter.get(), &dve);
+    if (name != "consumption_at_set_date_4")
+    {
+        printf("ERROR expected consumption_at_set_date_4 but got %s\n", name.c_str());
+    }
+}
+
+void test_metrics_prometheus()
+{
+    enableMetrics(true);
+    DriverMetrics *dm = lookupDriverMetrics("multical21");
+    if (dm == NULL || dm != lookupDriverMetrics("multical21") || dm->parse != lookupMetrics(MetricsStage::parse, "multical21"))
+    {
+        printf("ERROR expected the same driver metrics for the same driver\n");
+        enableMetrics(false);
+        return;
+    }
+    recordStage(dm->parse, 1500);
+    countMetrics(dm->calculations, 3);
+    BusMetrics *bm = lookupBusMetrics("main");
+    countMetrics(bm->duplicate);
+    countMetrics(bm->duplicate);
+    setMetrics(lookupMetrics(MetricsGauge::shell_queue_depth), 7);
+    string s = renderMetrics();
+    enableMetrics(false);
+
+    if (lookupDriverMetrics("multical21") != NULL || lookupMetrics(MetricsStage::parse, "multical21") != NULL)
+    {
+        printf("ERROR expected no metrics when disabled\n");
+    }
+
+    const char *expected[] =
+    {
+        "wmbusmeters_stage_seconds_bucket{stage=\"parse\",driver=\"multical21\",le=\"1e-06\"} 0\n",
+        "wmbusmeters_stage_seconds_bucket{stage=\"parse\",driver=\"multical21\",le=\"2e-06\"} 1\n",
+        "wmbusmeters_stage_seconds_bucket{stage=\"parse\",driver=\"multical21\",le=\"+Inf\"} 1\n",
+        "wmbusmeters_stage_seconds_sum{stage=\"parse\",driver=\"multical21\"} 0.000001500\n",
+        "wmbusmeters_stage_seconds_count{stage=\"parse\",driver=\"multical21\"} 1\n",
+        "wmbusmeters_dropped_telegrams_total{reason=\"duplicate\",bus=\"main\"} 2\n",
+        "wmbusmeters_dropped_telegrams_total{reason=\"unknown_meter\",bus=\"main\"} 0\n",
+        "# TYPE wmbusmeters_calculations_total counter\n",
+        "wmbusmeters_calculations_total{driver=\"multical21\"} 3\n",
+        "wmbusmeters_polls_total{bus=\"main\"} 0\n",
+        "# TYPE wmbusmeters_shell_queue_depth gauge\n",
+        "wmbusmeters_shell_queue_depth 7\n",
+    };
+    if (s.find("stage=\"decrypt\"") != string::npos)
+    {
+        printf("ERROR expected no decrypt histogram without samples\nGot:\n%s\n", s.c_str());
+    }
+    for (const char *e : expected)
+    {
+        if (s.find(e) == string::npos)
+        {
+            printf("ERROR expected metrics to contain: %s\nGot:\n%s\n", e, s.c_str());
+        }
+    }
+}
+
 void test_formulas_stringinterpolation()
 {
     DVEntry dve;
@@ -27,7 +27,7 @@ using namespace std;
 TriggerBits AlwaysTrigger(~(uint64_t)0);
 MaskBits AutoMask(0);
 
-void handleBitToString(Rule& rule, string &out_s, uint64_t bits)
+void handleBitToString(const Rule& rule, string &out_s, uint64_t bits)
 {
     string s;
 
@@ -42,7 +42,7 @@ void handleBitToString(Rule& rule, string &out_s, uint64_t bits)
     if (rule.mask == AutoMask)
     {
         mask = 0;
-        for (Map& m : rule.map)
+        for (const Map& m : rule.map)
         {
             // Collect all listed bits as the mask.
             mask |= m.from;
@@ -50,7 +50,7 @@ void handleBitToString(Rule& rule, string &out_s, uint64_t bits)
     }
 
     bits = bits & mask;
-    for (Map& m : rule.map)
+    for (const Map& m : rule.map)
     {
         if ((~mask & m.from) != 0)
         {
@@ -99,7 +99,7 @@ void handleBitToString(Rule& rule, string &out_s, uint64_t bits)
     out_s += s;
 }
 
-void handleIndexToString(Rule& rule, string &out_s, uint64_t bits)
+void handleIndexToString(const Rule& rule, string &out_s, uint64_t bits)
 {
     string s;
 
@@ -114,7 +114,7 @@ void handleIndexToString(Rule& rule, string &out_s, uint64_t bits)
     if (rule.mask == AutoMask)
     {
         mask = 0;
-        for (Map& m : rule.map)
+        for (const Map& m : rule.map)
         {
             // Collect all listed bits as the mask.
             mask |= m.from;
@@ -123,7 +123,7 @@ void handleIndexToString(Rule& rule, string &out_s, uint64_t bits)
 
     bits = bits & mask;
     bool found = false;
-    for (Map& m : rule.map)
+    for (const Map& m : rule.map)
     {
         assert(m.test == TestBit::Set);
 
@@ -151,7 +151,7 @@ void handleIndexToString(Rule& rule, string &out_s, uint64_t bits)
     out_s += s;
 }
 
-void handleDecimalsToString(Rule& rule, string &out_s, uint64_t bits)
+void handleDecimalsToString(const Rule& rule, string &out_s, uint64_t bits)
 {
     string s;
 
@@ -166,7 +166,7 @@ void handleDecimalsToString(Rule& rule, string &out_s, uint64_t bits)
     if (rule.mask == AutoMask)
     {
         mask = 0;
-        for (Map& m : rule.map)
+        for (const Map& m : rule.map)
         {
             // Collect all listed bits as the mask.
             mask |= m.from;
@@ -179,7 +179,7 @@ void handleDecimalsToString(Rule& rule, string &out_s, uint64_t bits)
     {
         s += rule.default_message.stringValue()+" ";
     }
-    for (Map& m : rule.map)
+    for (const Map& m : rule.map)
     {
         assert(m.test == TestBit::Set);
 
@@ -207,7 +207,7 @@ void handleDecimalsToString(Rule& rule, string &out_s, uint64_t bits)
     out_s += s;
 }
 
-void handleRule(Rule& rule, string &s, uint64_t bits)
+void handleRule(const Rule& rule, string &s, uint64_t bits)
 {
     switch (rule.type)
     {
@@ -228,11 +228,11 @@ void handleRule(Rule& rule, string &s, uint64_t bits)
     }
 }
 
-string Lookup::translate(uint64_t bits)
+string Lookup::translate(uint64_t bits) const
 {
     string total = "";
 
-    for (Rule& r : rules)
+    for (const Rule& r : rules)
     {
         string s;
         handleRule(r, s, bits);
@@ -244,11 +244,11 @@ string Lookup::translate(uint64_t bits)
     return sortStatusString(total);
 }
 
-string Lookup::str()
+string Lookup::str() const
 {
     string x = " Lookup {\n";
 
-    for (Rule& r : rules)
+    for (const Rule& r : rules)
     {
         x += "    Rulex {\n";
         x += "        name = "+r.name+"\n";
@@ -260,6 +260,26 @@ string Lookup::str()
     return x;
 }
 
+bool Map::operator==(const Map &m) const
+{
+    return from == m.from && to == m.to && test == m.test;
+}
+
+bool Rule::operator==(const Rule &r) const
+{
+    return name == r.name &&
+        type == r.type &&
+        trigger == r.trigger &&
+        mask == r.mask &&
+        default_message == r.default_message &&
+        map == r.map;
+}
+
+bool Lookup::operator==(const Lookup &l) const
+{
+    return rules == l.rules;
+}
+
 Translate::MapType toMapType(const char *s)
 {
     if (!strcmp(s, "BitToString")) return Translate::MapType::BitToString;
@@ -42,7 +42,7 @@ struct MaskBits
 {
     MaskBits() : bits_(0) {}
     MaskBits(uint64_t b) : bits_(b) {}
-    int intValue() { return bits_; }
+    int intValue() const { return bits_; }
     bool operator==(const MaskBits &tb) const { return bits_ == tb.bits_; }
     bool operator!=(const MaskBits &tb) const { return bits_ != tb.bits_; }
 
@@ -56,7 +56,7 @@ struct DefaultMessage
 {
     DefaultMessage() : message_("") {}
     DefaultMessage(std::string m) : message_(m) {}
-    const std::string &stringValue() { return message_; }
+    const std::string &stringValue() const { return message_; }
     bool operator==(const DefaultMessage &dm) const { return message_ == dm.message_; }
     bool operator!=(const DefaultMessage &dm) const { return message_ != dm.message_; }
 
@@ -82,6 +82,8 @@ namespace Translate
 
         Map(uint64_t f, std::string t, TestBit b) : from(f), to(t), test(b) {};
         Map(uint64_t f, std::string t) : from(f), to(t), test(TestBit::Set) {};
+
+        bool operator==(const Map &m) const;
     };
 
     struct Rule
@@ -102,18 +104,21 @@ namespace Translate
         Rule &set(MaskBits m) { mask = m; return *this; }
         Rule &set(DefaultMessage m) { default_message = m; return *this; }
         Rule &add(Map m) { map.push_back(m); return *this; }
+
+        bool operator==(const Rule &r) const;
     };
 
     struct Lookup
     {
         std::vector<Rule> rules;
 
-        std::string translate(uint64_t bits);
-        bool hasLookups() { return rules.size() > 0; }
+        std::string translate(uint64_t bits) const;
+        bool hasLookups() const { return rules.size() > 0; }
 
         Lookup &add(Rule r) { rules.push_back(r); return *this; }
 
-        std::string str();
+        std::string str() const;
+        bool operator==(const Lookup &l) const;
     };
 };
 
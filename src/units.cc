@@ -237,9 +237,21 @@ void getScaleOffset(const SIExp &e, double *scale, double *offset)
 
 bool SIUnit::convertTo(double left, const SIUnit &out_siunit, double *out) const
 {
+    SIConversion c;
+    bool ok = conversionTo(out_siunit, &c);
+    if (out != NULL) *out = c.apply(left);
+    return ok;
+}
+
+bool SIUnit::conversionTo(const SIUnit &out_siunit, SIConversion *c) const
+{
+    *c = SIConversion();
+
     if (exp() == out_siunit.exp())
     {
-        if (out != NULL) *out = (left*scale_)/out_siunit.scale_;
+        c->possible = true;
+        c->from_scale = scale_;
+        c->to_scale = out_siunit.scale_;
         return true;
     }
 
@@ -258,11 +270,15 @@ bool SIUnit::convertTo(double left, const SIUnit &out_siunit, double *out) const
         getScaleOffset(out_siunit.exp(), &to_scale, &to_offset);
         to_scale *= out_siunit.scale();
 
-        if (out != NULL) *out = ((left+from_offset)*from_scale)/to_scale-to_offset;
+        c->possible = true;
+        c->offset = true;
+        c->from_offset = from_offset;
+        c->from_scale = from_scale;
+        c->to_scale = to_scale;
+        c->to_offset = to_offset;
         return true;
     }
 
-    if (out != NULL) *out = std::numeric_limits<double>::quiet_NaN();
     return false;
 }
 
@@ -514,22 +530,60 @@ string strWithUnitLowerCase(double v, Unit u)
 }
 
 string valueToString(double v, Unit u)
+{
+    string s;
+    appendValueToString(&s, v, u);
+    return s;
+}
+
+void appendValueToString(string *buf, double v, Unit u)
 {
     if (::isnan(v))
     {
-        return "null";
+        *buf += "null";
+        return;
     }
     // This rounds the double value to 6 decimal digits.
     // TODO this should be changed to track all double digits available.
-    string s = to_string(v);
+
+    // Most values are formatted using integer arithmetic on the value scaled to
+    // millionths. The fma gives the exact rounding error of the scaling, if it is
+    // too close to a half we cannot know which way printf %f would have rounded.
+    double scaled = v * 1000000.0;
+    if (fabs(scaled) < 9.0e15)
+    {
+        double r = nearbyint(scaled);
+        double err = fma(v, 1000000.0, -r);
+        if (fabs(err) < 0.499999)
+        {
+            uint64_t n = (uint64_t)fabs(r);
+            uint64_t integer = n / 1000000;
+            int fraction = n % 1000000;
+
+            char tmp[32];
+            char *p = tmp+sizeof(tmp);
+            if (fraction != 0)
+            {
+                int digits = 6;
+                while (fraction % 10 == 0) { fraction /= 10; digits--; }
+                while (digits-- > 0) { *--p = '0' + fraction % 10; fraction /= 10; }
+                *--p = '.';
+            }
+            do { *--p = '0' + integer % 10; integer /= 10; } while (integer > 0);
+            if (signbit(v)) *--p = '-';
+            buf->append(p, tmp+sizeof(tmp)-p);
+            return;
+        }
+    }
+
+    string s = tostrprintf("%f", v);
     while (s.size() > 0 && s.back() == '0') s.pop_back();
     if (s.back() == '.') {
         s.pop_back();
-        if (s.length() == 0) return "0";
-        return s;
+        if (s.length() == 0) s = "0";
     }
-    if (s.length() == 0) return "0";
-    return s;
+    if (s.length() == 0) s = "0";
+    *buf += s;
 }
 
 bool extractUnit(const string &s, string *vname, Unit *u)
@@ -21,6 +21,7 @@
 #include<string>
 #include<vector>
 #include<cstdint>
+#include<limits>
 
 // A named quantity has a preferred unit,
 // ie Volume has m3 (cubic meters) Energy has kwh, Power has kw.
@@ -232,6 +233,28 @@ enum class MathOp
     ADD, SUB
 };
 
+// The constants of a unit conversion, looked up once by SIUnit::conversionTo
+// and then applied to any number of values.
+struct SIConversion
+{
+    bool possible = false;
+    bool offset = false; // Only conversions between K, C and F use the offsets.
+    double from_offset {};
+    double from_scale = 1.0;
+    double to_scale = 1.0;
+    double to_offset {};
+
+    double apply(double v) const
+    {
+        if (!possible) return std::numeric_limits<double>::quiet_NaN();
+        if (!offset) return (v*from_scale)/to_scale;
+        return ((v+from_offset)*from_scale)/to_scale-to_offset;
+    }
+
+    // A conversion between units with the same scale does not change the value.
+    bool identity() const { return possible && !offset && from_scale == 1.0 && to_scale == 1.0; }
+};
+
 struct SIUnit
 {
     // Transform a double,double,uint64_t into an SIUnit.
@@ -260,6 +283,8 @@ struct SIUnit
     bool sameExponents(SIUnit &to_siunit) const { return exponents_ == to_siunit.exponents_; }
     // Convert value from this unit to another unit and store it in out. Return false if conversion is impossible!
     bool convertTo(double left, const SIUnit &out_siunit, double *out) const;
+    // Prepare the conversion from this unit to another unit. Return false if conversion is impossible!
+    bool conversionTo(const SIUnit &out_siunit, SIConversion *c) const;
     // Do a math op. Store the resulting unit and value into the destination pointers.
     // Return false if the addion cannot be performed.
     bool mathOpTo(MathOp op, double left, double right, const SIUnit &right_siunit, SIUnit *out_siunit, double *out) const;
@@ -299,6 +324,8 @@ std::string unitToStringHR(Unit u);
 std::string unitToStringLowerCase(Unit u);
 std::string unitToStringUpperCase(Unit u);
 std::string valueToString(double v, Unit u);
+// Same as valueToString but appends to buf.
+void appendValueToString(std::string *buf, double v, Unit u);
 
 bool extractUnit(const std::string &s, std::string *vname, Unit *u);
 
@@ -285,7 +285,14 @@ string bin2hex(vector<uchar> &data, int offset, int len) {
     return str;
 }
 
-string safeString(vector<uchar> &target) {
+FrameView FrameView::from(uchar b)
+{
+    size_t i = 0;
+    while (i < len_ && data_[i] != b) i++;
+    return FrameView(data_+i, len_-i);
+}
+
+string safeString(FrameView target) {
     string str;
     for (size_t i = 0; i < target.size(); ++i) {
         const char ch = target[i];
@@ -408,7 +415,9 @@ bool enableLogfile(const string& logfile, bool daemon)
     if (output) {
         char buf[256];
         time_t now = time(NULL);
-        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
+        struct tm tm;
+        localtime_r(&now, &tm);
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
         int n = 0;
         if (daemon) {
             n = fprintf(output, "(wmbusmeters) logging started %s %s\n", buf, version_);
@@ -768,11 +777,11 @@ bool checkIfDirExists(const char *dir)
     return false;
 }
 
-void debugPayload(const string& intro, vector<uchar> &payload)
+void debugPayload(const string& intro, FrameView payload)
 {
     if (isDebugEnabled())
     {
-        string msg = bin2hex(payload);
+        string msg = bin2hex(vector<uchar>(payload.begin(), payload.end()));
         debug("%s \"%s\"\n", intro.c_str(), msg.c_str());
     }
 }
@@ -1343,6 +1352,34 @@ string makeQuotedJson(const string& s)
     return string("\"")+key+"\":\""+value+"\"";
 }
 
+void appendJsonString(string *buf, const string &s)
+{
+    *buf += '"';
+    size_t start = 0;
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+        unsigned char c = s[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        buf->append(s, start, i-start);
+        start = i+1;
+        switch (c)
+        {
+        case '"': *buf += "\\\""; break;
+        case '\\': *buf += "\\\\"; break;
+        case '\n': *buf += "\\n"; break;
+        case '\r': *buf += "\\r"; break;
+        case '\t': *buf += "\\t"; break;
+        default:
+            char tmp[8];
+            snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+            *buf += tmp;
+        }
+    }
+    buf->append(s, start, string::npos);
+    *buf += '"';
+}
+
 string currentYear()
 {
     char datetime[40];
@@ -1351,7 +1388,9 @@ string currentYear()
     struct timeval tv;
     gettimeofday(&tv, NULL);
 
-    strftime(datetime, 20, "%Y", localtime(&tv.tv_sec));
+    struct tm tm;
+    localtime_r(&tv.tv_sec, &tm);
+    strftime(datetime, 20, "%Y", &tm);
     return string(datetime);
 }
 
@@ -1363,7 +1402,9 @@ string currentYearMonth()
     struct timeval tv;
     gettimeofday(&tv, NULL);
 
-    strftime(datetime, 20, "%Y-%m", localtime(&tv.tv_sec));
+    struct tm tm;
+    localtime_r(&tv.tv_sec, &tm);
+    strftime(datetime, 20, "%Y-%m", &tm);
     return string(datetime);
 }
 
@@ -1375,7 +1416,9 @@ string currentYearMonthDay()
     struct timeval tv;
     gettimeofday(&tv, NULL);
 
-    strftime(datetime, 20, "%Y-%m-%d", localtime(&tv.tv_sec));
+    struct tm tm;
+    localtime_r(&tv.tv_sec, &tm);
+    strftime(datetime, 20, "%Y-%m-%d", &tm);
     return string(datetime);
 }
 
@@ -1387,7 +1430,9 @@ string currentHour()
     struct timeval tv;
     gettimeofday(&tv, NULL);
 
-    strftime(datetime, 20, "%Y-%m-%d_%H", localtime(&tv.tv_sec));
+    struct tm tm;
+    localtime_r(&tv.tv_sec, &tm);
+    strftime(datetime, 20, "%Y-%m-%d_%H", &tm);
     return string(datetime);
 }
 
@@ -1399,7 +1444,9 @@ string currentMinute()
     struct timeval tv;
     gettimeofday(&tv, NULL);
 
-    strftime(datetime, 20, "%Y-%m-%d_%H:%M", localtime(&tv.tv_sec));
+    struct tm tm;
+    localtime_r(&tv.tv_sec, &tm);
+    strftime(datetime, 20, "%Y-%m-%d_%H:%M", &tm);
     return string(datetime);
 }
 
@@ -1411,7 +1458,9 @@ string currentSeconds()
     struct timeval tv;
     gettimeofday(&tv, NULL);
 
-    strftime(datetime, 20, "%Y-%m-%d_%H:%M:%S", localtime(&tv.tv_sec));
+    struct tm tm;
+    localtime_r(&tv.tv_sec, &tm);
+    strftime(datetime, 20, "%Y-%m-%d_%H:%M:%S", &tm);
     return string(datetime);
 }
 
@@ -1423,7 +1472,9 @@ string currentMicros()
     struct timeval tv;
     gettimeofday(&tv, NULL);
 
-    strftime(datetime, 20, "%Y-%m-%d_%H:%M:%S", localtime(&tv.tv_sec));
+    struct tm tm;
+    localtime_r(&tv.tv_sec, &tm);
+    strftime(datetime, 20, "%Y-%m-%d_%H:%M:%S", &tm);
     return string(datetime)+"."+to_string(tv.tv_usec);
 }
 
@@ -1996,7 +2047,7 @@ void addSlipFraming(vector<uchar>& from, vector<uchar> &to)
     to.push_back(SLIP_END);
 }
 
-void removeSlipFraming(vector<uchar>& from, size_t *frame_length, vector<uchar> &to)
+void removeSlipFraming(FrameView from, size_t *frame_length, vector<uchar> &to)
 {
     *frame_length = 0;
     to.clear();
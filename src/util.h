@@ -66,13 +66,32 @@ bool isHexStringFlex(const std::string &txt, bool *invalid);
 bool isHexStringStrict(const char* txt, bool *invalid);
 bool isHexStringStrict(const std::string &txt, bool *invalid);
 int char2int(char input);
+// A window into bytes owned by someone else, for example the unconsumed
+// part of a receive buffer. A vector converts implicitly into a view.
+struct FrameView
+{
+    FrameView(uchar *data, size_t len) : data_(data), len_(len) {}
+    FrameView(std::vector<uchar> &v) : data_(v.data()), len_(v.size()) {}
+
+    size_t size() { return len_; }
+    uchar &operator[](size_t i) { return data_[i]; }
+    uchar *begin() { return data_; }
+    uchar *end() { return data_+len_; }
+    // The view starting at the first b, empty if there is no b.
+    FrameView from(uchar b);
+
+private:
+    uchar *data_;
+    size_t len_;
+};
+
 bool hex2bin(const char* src, std::vector<uchar> *target);
 bool hex2bin(const std::string &src, std::vector<uchar> *target);
 bool hex2bin(std::vector<uchar> &src, std::vector<uchar> *target);
 std::string bin2hex(const std::vector<uchar> &target);
 std::string bin2hex(std::vector<uchar>::iterator data, std::vector<uchar>::iterator end, int len);
 std::string bin2hex(std::vector<uchar> &data, int offset, int len);
-std::string safeString(std::vector<uchar> &target);
+std::string safeString(FrameView target);
 void strprintf(std::string *s, const char* fmt, ...);
 std::string tostrprintf(const char* fmt, ...);
 std::string tostrprintf(const std::string *fmt, ...);
@@ -138,7 +157,7 @@ bool isDebugEnabled();
 bool isTraceEnabled();
 bool isLogTelegramsEnabled();
 
-void debugPayload(const std::string& intro, std::vector<uchar> &payload);
+void debugPayload(const std::string& intro, FrameView payload);
 void debugPayload(const std::string& intro, std::vector<uchar> &payload, std::vector<uchar>::iterator &pos);
 void logTelegram(std::vector<uchar> &original, std::vector<uchar> &parsed, int header_size, int suffix_size);
 
@@ -201,7 +220,7 @@ bool     crc16_CCITT_check(uchar *data, uint16_t length);
 
 void addSlipFraming(std::vector<uchar>& from, std::vector<uchar> &to);
 // Frame length is set to zero if no frame was found.
-void removeSlipFraming(std::vector<uchar>& from, size_t *frame_length, std::vector<uchar> &to);
+void removeSlipFraming(FrameView from, size_t *frame_length, std::vector<uchar> &to);
 
 // Eat characters from the vector v, iterating using i, until the end char c is found.
 // If end char == -1, then do not expect any end char, get all until eof.
@@ -231,6 +250,8 @@ bool startsWith(const std::string &s, std::string &prefix);
 
 // Given alfa=beta it returns "alfa":"beta"
 std::string makeQuotedJson(const std::string &s);
+// Append s as a quoted json string, escaping quotes, backslashes and control characters.
+void appendJsonString(std::string *buf, const std::string &s);
 
 std::string currentYear();
 std::string currentYearMonth();
@@ -23,6 +23,7 @@
 #include"wmbus_utils.h"
 #include"dvparser.h"
 #include"manufacturer_specificities.h"
+#include"metrics.h"
 #include<assert.h>
 #include<cmath>
 #include<semaphore.h>
@@ -389,41 +390,103 @@ void Telegram::printTPL()
     verbose("\n");
 }
 
-// Store the hashes of the last 10 telegrams here.
-deque<SHA256_HASH> seen_telegrams;
+// FNV-1a, good enough to tell telegrams apart and much cheaper than sha256.
+static uint64_t hashFrame(const vector<uchar> &frame)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (uchar c : frame)
+    {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
 
-bool seen_this_telegram_before(vector<uchar> &frame)
+DuplicateFilter::DuplicateFilter(size_t capacity, int ttl) : capacity_(capacity), ttl_(ttl)
 {
-    SHA256_HASH hash;
-    Sha256Calculate(safeButUnsafeVectorPtr(frame), frame.size(), &hash);
+}
 
-    auto i = std::find(seen_telegrams.begin(), seen_telegrams.end(), hash);
+void DuplicateFilter::configure(size_t capacity, int ttl)
+{
+    pthread_mutex_lock(&lock_);
+    capacity_ = capacity;
+    ttl_ = ttl;
+    pthread_mutex_unlock(&lock_);
+}
 
-    if (i != seen_telegrams.end())
+void DuplicateFilter::forgetOld(time_t now)
+{
+    while (order_.size() > 0)
     {
-        // Found it!
-        return true;
+        pair<uint64_t,time_t> &oldest = order_.front();
+        bool expired = ttl_ > 0 && oldest.second + ttl_ <= now;
+        if (!expired && order_.size() <= capacity_) break;
+        auto i = seen_.find(oldest.first);
+        // The hash might have been remembered again after this entry expired.
+        if (i != seen_.end() && i->second == oldest.second) seen_.erase(i);
+        order_.pop_front();
     }
+}
 
-    if (seen_telegrams.size() >= 10)
+bool DuplicateFilter::seenBefore(const vector<uchar> &frame, time_t now)
+{
+    uint64_t hash = hashFrame(frame);
+
+    pthread_mutex_lock(&lock_);
+    forgetOld(now);
+    auto i = seen_.find(hash);
+    if (i != seen_.end())
     {
-        seen_telegrams.pop_front();
+        hits_++;
+        pthread_mutex_unlock(&lock_);
+        return true;
     }
-    seen_telegrams.push_back(hash);
+    misses_++;
+    seen_[hash] = now;
+    order_.push_back({ hash, now });
+    forgetOld(now);
+    pthread_mutex_unlock(&lock_);
 
     return false;
 }
 
+size_t DuplicateFilter::hits()
+{
+    pthread_mutex_lock(&lock_);
+    size_t n = hits_;
+    pthread_mutex_unlock(&lock_);
+    return n;
+}
+
+size_t DuplicateFilter::misses()
+{
+    pthread_mutex_lock(&lock_);
+    size_t n = misses_;
+    pthread_mutex_unlock(&lock_);
+    return n;
+}
+
+// Remember the last 10 telegrams, unless configured otherwise.
+static DuplicateFilter duplicate_filter_(10, 0);
+
+bool seen_this_telegram_before(const vector<uchar> &frame)
+{
+    return duplicate_filter_.seenBefore(frame, time(NULL));
+}
+
 // Store the dll_a (6 bytes composed of 4 id + 1 ver + 1 media )
 // for telegrams that has been warned about!
 deque<vector<uchar>> warning_printed_for_telegrams;
+static pthread_mutex_t warning_printed_lock_ = PTHREAD_MUTEX_INITIALIZER;
 
 bool warned_for_telegram_before(Telegram *t, vector<uchar> &dll_a)
 {
+    pthread_mutex_lock(&warning_printed_lock_);
     auto i = std::find(warning_printed_for_telegrams.begin(), warning_printed_for_telegrams.end(), dll_a);
 
     if (i != warning_printed_for_telegrams.end())
     {
+        pthread_mutex_unlock(&warning_printed_lock_);
         // Found it!
         if (t->triggered_warning)
         {
@@ -442,6 +505,7 @@ bool warned_for_telegram_before(Telegram *t, vector<uchar> &dll_a)
         warning_printed_for_telegrams.pop_front();
     }
     warning_printed_for_telegrams.push_back(dll_a);
+    pthread_mutex_unlock(&warning_printed_lock_);
     // Print all warnings for this telegram.
     t->triggered_warning = true;
     return false;
@@ -777,6 +841,13 @@ string ciType(int ci_field)
 
 void Telegram::addExplanationAndIncrementPos(vector<uchar>::iterator &pos, int len, KindOfData k, Understanding u, const char* fmt, ...)
 {
+    if (!explanations_enabled_)
+    {
+        parsed.insert(parsed.end(), pos, pos+len);
+        pos += len;
+        return;
+    }
+
     char buf[1024];
     buf[1023] = 0;
 
@@ -793,6 +864,8 @@ void Telegram::addExplanationAndIncrementPos(vector<uchar>::iterator &pos, int l
 
 void Telegram::setExplanation(vector<uchar>::iterator &pos, int len, KindOfData k, Understanding u, const char* fmt, ...)
 {
+    if (!explanations_enabled_) return;
+
     char buf[1024];
     buf[1023] = 0;
 
@@ -807,11 +880,15 @@ void Telegram::setExplanation(vector<uchar>::iterator &pos, int len, KindOfData
 
 void Telegram::addMoreExplanation(int pos, string json)
 {
+    if (!explanations_enabled_) return;
+
     addMoreExplanation(pos, " (%s)", json.c_str());
 }
 
 void Telegram::addMoreExplanation(int pos, const char* fmt, ...)
 {
+    if (!explanations_enabled_) return;
+
     char buf[1024];
 
     buf[1023] = 0;
@@ -840,6 +917,8 @@ void Telegram::addMoreExplanation(int pos, const char* fmt, ...)
 
 void Telegram::addSpecialExplanation(int offset, int len, KindOfData k, Understanding u, const char* fmt, ...)
 {
+    if (!explanations_enabled_) return;
+
     char buf[1024];
     buf[1023] = 0;
 
@@ -1083,7 +1162,11 @@ bool Telegram::parseELL(vector<uchar>::iterator &pos)
         {
             if (meter_keys)
             {
-                decrypt_ELL_AES_CTR(this, frame, pos, meter_keys->confidentiality_key);
+                // A NULL key schedule (no key or a bad key size) leaves the payload untouched.
+                // The decryption is only timed when the metrics are enabled, metricsNow is 0 otherwise.
+                uint64_t start = metricsNow();
+                decrypt_ELL_AES_CTR(this, frame, pos, meter_keys->confidentialityKeySchedule());
+                if (start) decrypt_ns += metricsNow()-start;
                 // Actually this ctr decryption always succeeds, if wrong key, it will decrypt to garbage.
             }
             // Now the frame from pos and onwards has been decrypted, perhaps.
@@ -1391,7 +1474,8 @@ bool Telegram::parseTPLConfig(std::vector<uchar>::iterator &pos)
 
             debugPayload("(wmbus) input to kdf for enc", input);
 
-            if (meter_keys == NULL || meter_keys->confidentiality_key.size() != 16)
+            const AES_ctx *key = meter_keys ? meter_keys->confidentialityKeySchedule() : NULL;
+            if (key == NULL)
             {
                 if (isSimulated())
                 {
@@ -1401,8 +1485,8 @@ bool Telegram::parseTPLConfig(std::vector<uchar>::iterator &pos)
                 debug("(wmbus) no key, thus cannot execute kdf.\n");
                 return false;
             }
-            AES_CMAC(safeButUnsafeVectorPtr(meter_keys->confidentiality_key),
-                     safeButUnsafeVectorPtr(input), 16,
+            AES_CMAC_ctx(key,
+                         safeButUnsafeVectorPtr(input), 16,
                      safeButUnsafeVectorPtr(mac));
             string s = bin2hex(mac);
             debug("(wmbus) ephemereal Kenc %s\n", s.c_str());
@@ -1413,8 +1497,8 @@ bool Telegram::parseTPLConfig(std::vector<uchar>::iterator &pos)
             mac.clear();
             mac.resize(16);
             debugPayload("(wmbus) input to kdf for mac", input);
-            AES_CMAC(safeButUnsafeVectorPtr(meter_keys->confidentiality_key),
-                     safeButUnsafeVectorPtr(input), 16,
+            AES_CMAC_ctx(key,
+                         safeButUnsafeVectorPtr(input), 16,
                      safeButUnsafeVectorPtr(mac));
             s = bin2hex(mac);
             debug("(wmbus) ephemereal Kmac %s\n", s.c_str());
@@ -1573,8 +1657,12 @@ bool Telegram::potentiallyDecrypt(vector<uchar>::iterator &pos)
         int num_encrypted_bytes = 0;
         int num_not_encrypted_at_end = 0;
 
-        bool ok = decrypt_TPL_AES_CBC_IV(this, frame, pos, meter_keys->confidentiality_key,
+        // Without a usable key the decryption fails below, after counting the encrypted bytes.
+        const AES_ctx *key = meter_keys->confidentialityKeySchedule();
+        uint64_t start = metricsNow();
+        bool ok = decrypt_TPL_AES_CBC_IV(this, frame, pos, key,
                                          &num_encrypted_bytes, &num_not_encrypted_at_end);
+        if (start) decrypt_ns += metricsNow()-start;
         if (!ok)
         {
             // No key supplied.
@@ -1692,9 +1780,18 @@ bool Telegram::potentiallyDecrypt(vector<uchar>::iterator &pos)
 
         int num_encrypted_bytes = 0;
         int num_not_encrypted_at_end = 0;
-        bool ok = decrypt_TPL_AES_CBC_NO_IV(this, frame, pos, tpl_generated_key,
+        AES_ctx generated_key;
+        const AES_ctx *aeskey = NULL;
+        if (tpl_generated_key.size() == 16)
+        {
+            AES_init_ctx(&generated_key, safeButUnsafeVectorPtr(tpl_generated_key));
+            aeskey = &generated_key;
+        }
+        uint64_t start = metricsNow();
+        bool ok = decrypt_TPL_AES_CBC_NO_IV(this, frame, pos, aeskey,
                                             &num_encrypted_bytes,
                                             &num_not_encrypted_at_end);
+        if (start) decrypt_ns += metricsNow()-start;
         if (!ok)
         {
             addExplanationAndIncrementPos(pos, num_encrypted_bytes, KindOfData::CONTENT, Understanding::FULL,
@@ -1941,7 +2038,7 @@ void Telegram::preProcess()
     }
 }
 
-bool Telegram::parse(vector<uchar> &input_frame, MeterKeys *mk, bool warn)
+bool Telegram::parse(const vector<uchar> &input_frame, MeterKeys *mk, bool warn)
 {
     switch (about.type)
     {
@@ -1953,7 +2050,7 @@ bool Telegram::parse(vector<uchar> &input_frame, MeterKeys *mk, bool warn)
     return false;
 }
 
-bool Telegram::parseHeader(vector<uchar> &input_frame)
+bool Telegram::parseHeader(const vector<uchar> &input_frame)
 {
     switch (about.type)
     {
@@ -1965,7 +2062,7 @@ bool Telegram::parseHeader(vector<uchar> &input_frame)
     return false;
 }
 
-bool Telegram::parseWMBUSHeader(vector<uchar> &input_frame)
+bool Telegram::parseWMBUSHeader(const vector<uchar> &input_frame)
 {
     assert(about.type == FrameType::WMBUS);
 
@@ -1975,6 +2072,7 @@ bool Telegram::parseWMBUSHeader(vector<uchar> &input_frame)
     // No need to warn.
     parser_warns_ = false;
     decryption_failed = false;
+    decrypt_ns = 0;
     explanations.clear();
     suffix_size = 0;
     frame = input_frame;
@@ -2005,12 +2103,13 @@ bool Telegram::parseWMBUSHeader(vector<uchar> &input_frame)
     return true;
 }
 
-bool Telegram::parseWMBUS(vector<uchar> &input_frame, MeterKeys *mk, bool warn)
+bool Telegram::parseWMBUS(const vector<uchar> &input_frame, MeterKeys *mk, bool warn)
 {
     assert(about.type == FrameType::WMBUS);
 
     parser_warns_ = warn;
     decryption_failed = false;
+    decrypt_ns = 0;
     explanations.clear();
     suffix_size = 0;
     meter_keys = mk;
@@ -2082,7 +2181,7 @@ bool Telegram::parseWMBUS(vector<uchar> &input_frame, MeterKeys *mk, bool warn)
     return true;
 }
 
-bool Telegram::parseMBUSHeader(vector<uchar> &input_frame)
+bool Telegram::parseMBUSHeader(const vector<uchar> &input_frame)
 {
     assert(about.type == FrameType::MBUS);
 
@@ -2092,6 +2191,7 @@ bool Telegram::parseMBUSHeader(vector<uchar> &input_frame)
     // No need to warn.
     parser_warns_ = false;
     decryption_failed = false;
+    decrypt_ns = 0;
     explanations.clear();
     suffix_size = 0;
     frame = input_frame;
@@ -2105,12 +2205,13 @@ bool Telegram::parseMBUSHeader(vector<uchar> &input_frame)
     return true;
 }
 
-bool Telegram::parseMBUS(vector<uchar> &input_frame, MeterKeys *mk, bool warn)
+bool Telegram::parseMBUS(const vector<uchar> &input_frame, MeterKeys *mk, bool warn)
 {
     assert(about.type == FrameType::MBUS);
 
     parser_warns_ = warn;
     decryption_failed = false;
+    decrypt_ns = 0;
     explanations.clear();
     suffix_size = 0;
     meter_keys = mk;
@@ -2133,14 +2234,14 @@ bool Telegram::parseMBUS(vector<uchar> &input_frame, MeterKeys *mk, bool warn)
     return true;
 }
 
-bool Telegram::parseHANHeader(vector<uchar> &input_frame)
+bool Telegram::parseHANHeader(const vector<uchar> &input_frame)
 {
     assert(about.type == FrameType::HAN);
 
     return false;
 }
 
-bool Telegram::parseHAN(vector<uchar> &input_frame, MeterKeys *mk, bool warn)
+bool Telegram::parseHAN(const vector<uchar> &input_frame, MeterKeys *mk, bool warn)
 {
     assert(about.type == FrameType::HAN);
 
@@ -4054,6 +4155,40 @@ bool Telegram::findFormatBytesFromKnownMeterSignatures(vector<uchar> *format_byt
     return ok;
 }
 
+void ReceiveBuffer::append(vector<uchar> &data)
+{
+    if (start_ > 0)
+    {
+        // Move the partial frame that is left down to the beginning.
+        buffer_.erase(buffer_.begin(), buffer_.begin()+start_);
+        start_ = 0;
+    }
+    buffer_.insert(buffer_.end(), data.begin(), data.end());
+}
+
+void ReceiveBuffer::consume(size_t n)
+{
+    assert(n <= size());
+    start_ += n;
+    if (start_ == buffer_.size()) clear();
+}
+
+size_t ReceiveBuffer::resync(uchar start_byte)
+{
+    if (size() == 0) return 0;
+
+    size_t n = 1;
+    while (n < size() && buffer_[start_+n] != start_byte) n++;
+    consume(n);
+    return n;
+}
+
+void ReceiveBuffer::clear()
+{
+    buffer_.clear();
+    start_ = 0;
+}
+
 BusDeviceCommonImplementation::~BusDeviceCommonImplementation()
 {
     manager_->listenTo(this->serial(), NULL);
@@ -4081,10 +4216,29 @@ BusDeviceCommonImplementation::BusDeviceCommonImplementation(string bus_alias,
     // Initialize timeout from now.
     last_received_ = time(NULL);
     last_reset_ = time(NULL);
-    manager_->listenTo(this->serial(),call(this,processSerialData));
+    manager_->listenTo(this->serial(),
+                       [this]()
+                       {
+                           uint64_t start = metricsNow();
+                           processSerialData();
+                           BusMetrics *bm = busMetrics();
+                           if (start && bm) recordStage(bm->serial_data, metricsNow()-start);
+                       });
     manager_->onDisappear(this->serial(),call(this,disconnectedFromDevice));
 }
 
+BusMetrics *BusDeviceCommonImplementation::busMetrics()
+{
+    BusMetrics *bm = bus_metrics_.load();
+    if (bm == NULL && isMetricsEnabled())
+    {
+        // The same key always gives the same pointer, so a concurrent lookup is harmless.
+        bm = lookupBusMetrics(metricsBus());
+        bus_metrics_.store(bm);
+    }
+    return bm;
+}
+
 string BusDeviceCommonImplementation::hr()
 {
     if (cached_hr_ == "")
@@ -4117,7 +4271,7 @@ string BusDeviceCommonImplementation::busAlias()
     return bus_alias_;
 }
 
-void BusDeviceCommonImplementation::onTelegram(function<bool(AboutTelegram&,vector<uchar>)> cb)
+void BusDeviceCommonImplementation::onTelegram(function<bool(AboutTelegram&,const vector<uchar>&)> cb)
 {
     telegram_listeners_.push_back(cb);
 }
@@ -4135,6 +4289,17 @@ void setIgnoreDuplicateTelegrams(bool idt)
     ignore_duplicate_telegrams_ = idt;
 }
 
+void setDuplicateTelegramsWindow(size_t capacity, int ttl)
+{
+    duplicate_filter_.configure(capacity, ttl);
+}
+
+void duplicateTelegramsCounters(size_t *hits, size_t *misses)
+{
+    *hits = duplicate_filter_.hits();
+    *misses = duplicate_filter_.misses();
+}
+
 static bool detailed_first_ = false;
 
 void setDetailedFirst(bool df)
@@ -4147,7 +4312,7 @@ bool getDetailedFirst()
     return detailed_first_;
 }
 
-bool BusDeviceCommonImplementation::handleTelegram(AboutTelegram &about, vector<uchar> frame)
+bool BusDeviceCommonImplementation::handleTelegram(AboutTelegram &about, const vector<uchar> &frame)
 {
     bool handled = false;
     last_received_ = time(NULL);
@@ -4165,9 +4330,12 @@ bool BusDeviceCommonImplementation::handleTelegram(AboutTelegram &about, vector<
         return false;
     }
 
+    about.bus_metrics = busMetrics();
+
     if (ignore_duplicate_telegrams_ && about.type == FrameType::WMBUS && seen_this_telegram_before(frame))
     {
         verbose("(wmbus) skipping already handled telegram leng=%zu.\n", frame.size());
+        if (about.bus_metrics) countMetrics(about.bus_metrics->duplicate);
         return true;
     }
 
@@ -4181,7 +4349,7 @@ bool BusDeviceCommonImplementation::handleTelegram(AboutTelegram &about, vector<
         }
     }
 
-    for (auto f : telegram_listeners_)
+    for (auto &f : telegram_listeners_)
     {
         if (f)
         {
@@ -5744,6 +5912,27 @@ LIST_OF_MBUS_DEVICES
     return false;
 }
 
+const AES_ctx *MeterKeys::confidentialityKeySchedule()
+{
+    if (confidentiality_key.size() != 16)
+    {
+        if (confidentiality_key.size() > 0 && !warned_key_size_)
+        {
+            warning("(wmbus) the key is %zu bytes, expected 16 bytes, cannot decrypt!\n", confidentiality_key.size());
+            warned_key_size_ = true;
+        }
+        return NULL;
+    }
+
+    if (!confidentiality_key_schedule_valid_ ||
+        memcmp(confidentiality_key_schedule_.Key, &confidentiality_key[0], 16))
+    {
+        AES_init_ctx(&confidentiality_key_schedule_, &confidentiality_key[0]);
+        confidentiality_key_schedule_valid_ = true;
+    }
+    return &confidentiality_key_schedule_;
+}
+
 const char *toString(FrameType ft)
 {
     switch (ft) {
@@ -19,15 +19,20 @@
 #define WMBUS_H
 
 #include"address.h"
+#include"aes.h"
 #include"dvparser.h"
 #include"manufacturers.h"
+#include"metrics.h"
 #include"serial.h"
 #include"translatebits.h"
 #include"util.h"
 
+#include<deque>
 #include<inttypes.h>
 #include<map>
+#include<pthread.h>
 #include<set>
+#include<unordered_map>
 
 // Check and remove the data link layer CRCs from a wmbus telegram.
 // If the CRCs do not pass the test, return false.
@@ -86,6 +91,36 @@ const char *toLowerCaseString(BusDeviceType t);
 BusDeviceType toBusDeviceType(string &t);
 
 void setIgnoreDuplicateTelegrams(bool idt);
+// Ignore a telegram if it is among the last capacity telegrams and was seen
+// less than ttl seconds ago. A ttl of 0 means no time limit.
+void setDuplicateTelegramsWindow(size_t capacity, int ttl);
+// Number of ignored duplicates and number of unique telegrams.
+void duplicateTelegramsCounters(size_t *hits, size_t *misses);
+
+// Remembers the hashes of recently received telegrams, to detect the same
+// telegram received through a repeater or another dongle.
+struct DuplicateFilter
+{
+    DuplicateFilter(size_t capacity, int ttl);
+    void configure(size_t capacity, int ttl);
+    // Return true if the frame has been seen before, otherwise remember it.
+    bool seenBefore(const std::vector<uchar> &frame, time_t now);
+    size_t hits();
+    size_t misses();
+
+private:
+    void forgetOld(time_t now);
+
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    size_t capacity_ {};
+    int ttl_ {};
+    size_t hits_ {};
+    size_t misses_ {};
+    // Hash to the time it was first seen.
+    std::unordered_map<uint64_t,time_t> seen_;
+    // The hashes in the order they were seen, the oldest is forgotten first.
+    std::deque<std::pair<uint64_t,time_t>> order_;
+};
 void setDetailedFirst(bool df);
 bool getDetailedFirst();
 
@@ -349,6 +384,14 @@ struct MeterKeys
 
     bool hasConfidentialityKey() { return confidentiality_key.size() > 0; }
     bool hasAuthenticationKey() { return authentication_key.size() > 0; }
+
+    // The expanded confidentiality key, only recalculated when the key changes.
+    // Returns NULL if there is no key, or with a warning if the key is not 16 bytes.
+    const AES_ctx *confidentialityKeySchedule();
+
+    AES_ctx confidentiality_key_schedule_ {};
+    bool confidentiality_key_schedule_valid_ {};
+    bool warned_key_size_ {};
 };
 
 enum class FrameType
@@ -372,6 +415,8 @@ struct AboutTelegram
     FrameType type {};
     // time the telegram was received
     time_t timestamp;
+    // The metrics of the bus that received the telegram, NULL when the metrics are disabled.
+    BusMetrics *bus_metrics {};
 
     AboutTelegram(string dv, int rs, FrameType t, time_t ts = 0) : device(dv), rssi_dbm(rs), type(t), timestamp(ts) {}
     AboutTelegram() {}
@@ -431,6 +476,9 @@ public:
     // If decryption failed, set this to true, to prevent further processing.
     bool decryption_failed {};
 
+    // Nanoseconds spent decrypting the payload during the last parse, only measured when the metrics are enabled.
+    uint64_t decrypt_ns {};
+
     // DLL
     int dll_len {}; // The length of the telegram, 1 byte.
     int dll_c {};   // 1 byte control code, SND_NR=0x44
@@ -532,17 +580,17 @@ public:
 
     bool handled {}; // Set to true, when a meter has accepted the telegram.
 
-    bool parseHeader(vector<uchar> &input_frame);
-    bool parse(vector<uchar> &input_frame, MeterKeys *mk, bool warn);
+    bool parseHeader(const vector<uchar> &input_frame);
+    bool parse(const vector<uchar> &input_frame, MeterKeys *mk, bool warn);
 
-    bool parseMBUSHeader(vector<uchar> &input_frame);
-    bool parseMBUS(vector<uchar> &input_frame, MeterKeys *mk, bool warn);
+    bool parseMBUSHeader(const vector<uchar> &input_frame);
+    bool parseMBUS(const vector<uchar> &input_frame, MeterKeys *mk, bool warn);
 
-    bool parseWMBUSHeader(vector<uchar> &input_frame);
-    bool parseWMBUS(vector<uchar> &input_frame, MeterKeys *mk, bool warn);
+    bool parseWMBUSHeader(const vector<uchar> &input_frame);
+    bool parseWMBUS(const vector<uchar> &input_frame, MeterKeys *mk, bool warn);
 
-    bool parseHANHeader(vector<uchar> &input_frame);
-    bool parseHAN(vector<uchar> &input_frame, MeterKeys *mk, bool warn);
+    bool parseHANHeader(const vector<uchar> &input_frame);
+    bool parseHAN(const vector<uchar> &input_frame, MeterKeys *mk, bool warn);
 
     void addAddressMfctFirst(const vector<uchar>::iterator &pos);
     void addAddressIdFirst(const vector<uchar>::iterator &pos);
@@ -562,6 +610,11 @@ public:
     void explainParse(string intro, int from);
     string analyzeParse(OutputFormat o, int *content_length, int *understood_content_length);
 
+    // Explanations are only read when analyzing or when debug is enabled. When disabled,
+    // the explanation calls only advance the parse position and skip all formatting.
+    void disableExplanations() { explanations_enabled_ = false; }
+    bool explanationsEnabled() { return explanations_enabled_; }
+
     bool parserWarns() { return parser_warns_; }
     bool isSimulated() { return is_simulated_; }
     bool beingAnalyzed() { return being_analyzed_; }
@@ -582,6 +635,7 @@ private:
     bool is_simulated_ {};
     bool being_analyzed_ {};
     bool parser_warns_ = true;
+    bool explanations_enabled_ = true;
     MeterKeys *meter_keys {};
 
     // Fixes quirks from non-compliant meters to make telegram compatible with the standard
@@ -668,7 +722,8 @@ struct BusDevice
     virtual bool canSetLinkModes(LinkModeSet lms) = 0;
     virtual void setLinkModes(LinkModeSet lms) = 0;
     virtual void setDeviceMode(DeviceMode mode) = 0;
-    virtual void onTelegram(function<bool(AboutTelegram&,vector<uchar>)> cb) = 0;
+    // The frame is passed by reference to all listeners, it must not be modified.
+    virtual void onTelegram(function<bool(AboutTelegram&,const vector<uchar>&)> cb) = 0;
     virtual bool sendTelegram(LinkMode link_mode, TelegramFormat format, vector<uchar> &content) = 0;
     virtual SerialDevice *serial() = 0;
     // Return true of the serial has been overridden, usually with stdin or a file.
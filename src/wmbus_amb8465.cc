@@ -31,7 +31,7 @@
 
 using namespace std;
 
-uchar xorChecksum(vector<uchar> &msg, size_t offset, size_t len);
+uchar xorChecksum(FrameView msg, size_t offset, size_t len);
 
 struct ConfigAMB8465AMB3665
 {
@@ -412,7 +412,7 @@ struct WMBusAmber : public virtual BusDeviceCommonImplementation
     }
 
 private:
-    vector<uchar> read_buffer_; // Must be protected by LOCK_WMBUS_RECEIVING_BUFFER(where)
+    ReceiveBuffer read_buffer_; // Must be protected by LOCK_WMBUS_RECEIVING_BUFFER(where)
     vector<uchar> request_;
     vector<uchar> response_;
 
@@ -423,7 +423,7 @@ private:
 
     ConfigAMB8465AMB3665 device_config_;
 
-    FrameStatus checkAMB8465Frame(vector<uchar> &data,
+    FrameStatus checkAMB8465Frame(FrameView data,
                                   size_t *frame_length,
                                   int *msgid_out,
                                   int *payload_len_out,
@@ -478,7 +478,7 @@ void WMBusAmber::deviceReset()
     timerclear(&timestamp_last_rx_);
 }
 
-uchar xorChecksum(vector<uchar> &msg, size_t offset, size_t len)
+uchar xorChecksum(FrameView msg, size_t offset, size_t len)
 {
     assert(msg.size() >= len+offset);
     uchar c = 0;
@@ -633,7 +633,7 @@ bool WMBusAmber::deviceSetLinkModes(LinkModeSet lms)
     return rc;
 }
 
-FrameStatus WMBusAmber::checkAMB8465Frame(vector<uchar> &data,
+FrameStatus WMBusAmber::checkAMB8465Frame(FrameView data,
                                           size_t *frame_length,
                                           int *msgid_out,
                                           int *payload_len_out,
@@ -698,10 +698,8 @@ FrameStatus WMBusAmber::checkAMB8465Frame(vector<uchar> &data,
             // No sensible telegram in the buffer. Flush it!
             // But not the last char, because the next char could be a valid c field.
             verbose("(amb8465) no sensible telegram found, clearing buffer.\n");
-            uchar last = data[data.size()-1];
-            data.clear();
-            data.insert(data.end(), &last, &last+1); // Re-insert the last byte.
-            return PartialFrame;
+            *frame_length = data.size()-1;
+            return TextAndNotFrame;
         }
     }
     *msgid_out = 0; // 0 is used to signal
@@ -762,7 +760,7 @@ void WMBusAmber::processSerialData()
         }
     }
 
-    read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    read_buffer_.append(data);
 
     size_t frame_length;
     int msgid;
@@ -771,11 +769,12 @@ void WMBusAmber::processSerialData()
 
     for (;;)
     {
-        FrameStatus status = checkAMB8465Frame(read_buffer_, &frame_length, &msgid, &payload_len, &payload_offset, &rssi_dbm);
+        FrameView frame = read_buffer_.view();
+        FrameStatus status = checkAMB8465Frame(frame, &frame_length, &msgid, &payload_len, &payload_offset, &rssi_dbm);
 
         if (status == PartialFrame)
         {
-            if (read_buffer_.size() > 0) {
+            if (frame.size() > 0) {
                 // Save timestamp of this chunk
                 timestamp_last_rx_ = timestamp;
             }
@@ -786,14 +785,19 @@ void WMBusAmber::processSerialData()
             }
             break;
         }
+        if (status == TextAndNotFrame)
+        {
+            read_buffer_.consume(frame_length);
+            continue;
+        }
         if (status == ErrorInFrame)
         {
             verbose("(amb8465) protocol error in message received!\n");
-            string msg = bin2hex(read_buffer_);
-            debug("(amb8465) protocol error \"%s\"\n", msg.c_str());
-            read_buffer_.clear();
+            debugPayload("(amb8465) protocol error", frame);
+            // Rescan from the next byte, a good frame might follow.
+            read_buffer_.consume(1);
             protocolErrorDetected();
-            break;
+            continue;
         }
         if (status == FullFrame)
         {
@@ -802,10 +806,10 @@ void WMBusAmber::processSerialData()
             {
                 uchar l = payload_len;
                 payload.insert(payload.end(), &l, &l+1); // Re-insert the len byte.
-                payload.insert(payload.end(), read_buffer_.begin()+payload_offset, read_buffer_.begin()+payload_offset+payload_len);
+                payload.insert(payload.end(), frame.begin()+payload_offset, frame.begin()+payload_offset+payload_len);
             }
 
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
 
             handleMessage(msgid, payload, rssi_dbm);
         }
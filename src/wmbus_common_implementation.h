@@ -22,6 +22,29 @@
 #include "threads.h"
 #include "wmbus.h"
 
+#include <atomic>
+
+// The bytes received from a dongle that are not yet consumed as frames.
+// Consuming a frame only advances the start, the remaining bytes are moved
+// down at most once per received chunk. A bad frame is skipped with resync,
+// which keeps any good frames that follow it in the buffer.
+struct ReceiveBuffer
+{
+    void append(vector<uchar> &data);
+    // The unconsumed bytes, the view is valid until the next append.
+    FrameView view() { return FrameView(buffer_.data()+start_, size()); }
+    size_t size() { return buffer_.size()-start_; }
+    void consume(size_t n);
+    // Drop the first byte and then everything before the next start byte.
+    // Returns the number of dropped bytes.
+    size_t resync(uchar start_byte);
+    void clear();
+
+private:
+    vector<uchar> buffer_;
+    size_t start_ {};
+};
+
 struct BusDeviceCommonImplementation : public virtual BusDevice
 {
     BusDeviceCommonImplementation(string bus_alias,
@@ -35,9 +58,9 @@ struct BusDeviceCommonImplementation : public virtual BusDevice
     string hr();
     bool isSerial();
     BusDeviceType type();
-    void onTelegram(function<bool(AboutTelegram&,vector<uchar>)> cb);
+    void onTelegram(function<bool(AboutTelegram&,const vector<uchar>&)> cb);
     bool sendTelegram(LinkMode link_mode, TelegramFormat format, vector<uchar> &content);
-    bool handleTelegram(AboutTelegram &about, vector<uchar> frame);
+    bool handleTelegram(AboutTelegram &about, const vector<uchar> &frame);
     void checkStatus();
     bool isWorking();
     string dongleId();
@@ -54,6 +77,11 @@ struct BusDeviceCommonImplementation : public virtual BusDevice
     void markSerialAsOverriden() { serial_override_ = true; }
 
     string device() { if (serial_) return serial_->device(); else return "?"; }
+    // The bus alias, or the device if no alias was given, used as the key for the metrics.
+    string metricsBus() { return bus_alias_ != "" ? bus_alias_ : device(); }
+    // Looked up on first use, since the serial device might not be known when the bus device
+    // is created. NULL when the metrics are disabled.
+    BusMetrics *busMetrics();
     // Wait for a response to arrive from the device.
     bool waitForResponse(int id);
     // Notify the waiter that the response has arrived.
@@ -87,7 +115,7 @@ struct BusDeviceCommonImplementation : public virtual BusDevice
     // Uses a serial tty?
     bool is_serial_ {};
     bool is_working_ {};
-    vector<function<bool(AboutTelegram&,vector<uchar>)>> telegram_listeners_;
+    vector<function<bool(AboutTelegram&,const vector<uchar>&)>> telegram_listeners_;
     BusDeviceType type_ {};
     int protocol_error_count_ {};
     time_t timeout_ {}; // If longer silence than timeout, then reset dongle! It might have hanged!
@@ -101,6 +129,7 @@ struct BusDeviceCommonImplementation : public virtual BusDevice
     Detected detected_ {}; // Used to remember how this device was setup.
 
     shared_ptr<SerialDevice> serial_;
+    std::atomic<BusMetrics*> bus_metrics_ {};
 
 protected:
 
@@ -69,12 +69,12 @@ struct WMBusCUL : public virtual BusDeviceCommonImplementation
 private:
 
     LinkModeSet link_modes_ {};
-    vector<uchar> read_buffer_;
+    ReceiveBuffer read_buffer_;
     vector<uchar> received_payload_;
     string sent_command_;
     string received_response_;
 
-    FrameStatus checkCULFrame(vector<uchar> &data,
+    FrameStatus checkCULFrame(FrameView data,
                               size_t *hex_frame_length,
                               vector<uchar> &payload,
                               int *rssi_dbm);
@@ -223,7 +223,7 @@ void WMBusCUL::simulate()
 {
 }
 
-string expectedResponses(vector<uchar> &data)
+string expectedResponses(FrameView data)
 {
     string safe = safeString(data);
     if (safe.find("CMODE") != string::npos) return "CMODE";
@@ -241,7 +241,7 @@ void WMBusCUL::processSerialData()
 
     LOCK_WMBUS_RECEIVING_BUFFER(processSerialData);
 
-    read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    read_buffer_.append(data);
 
     size_t frame_length;
     vector<uchar> payload;
@@ -249,7 +249,8 @@ void WMBusCUL::processSerialData()
 
     for (;;)
     {
-        FrameStatus status = checkCULFrame(read_buffer_, &frame_length, payload, &rssi_dbm);
+        FrameView frame = read_buffer_.view();
+        FrameStatus status = checkCULFrame(frame, &frame_length, payload, &rssi_dbm);
 
         if (status == PartialFrame)
         {
@@ -260,26 +261,25 @@ void WMBusCUL::processSerialData()
             // The buffer has already been printed by serial cmd.
             if (sent_command_ != "")
             {
-                string r = expectedResponses(read_buffer_);
+                string r = expectedResponses(FrameView(frame.begin(), frame_length));
                 if (r != "")
                 {
                     received_response_ = r;
                     notifyResponseIsHere(1);
                 }
             }
-            read_buffer_.clear();
-            break;
+            read_buffer_.consume(frame_length);
+            continue;
         }
         if (status == ErrorInFrame)
         {
             debug("(cul) error in received message.\n");
-            string msg = bin2hex(read_buffer_);
-            read_buffer_.clear();
-            break;
+            read_buffer_.consume(frame_length);
+            continue;
         }
         if (status == FullFrame)
         {
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
 
             AboutTelegram about("cul", rssi_dbm, FrameType::WMBUS);
             handleTelegram(about, payload);
@@ -287,7 +287,7 @@ void WMBusCUL::processSerialData()
     }
 }
 
-FrameStatus WMBusCUL::checkCULFrame(vector<uchar> &data,
+FrameStatus WMBusCUL::checkCULFrame(FrameView data,
                                     size_t *hex_frame_length,
                                     vector<uchar> &payload,
                                     int *rssi_dbm)
@@ -311,8 +311,10 @@ FrameStatus WMBusCUL::checkCULFrame(vector<uchar> &data,
         return PartialFrame;
     }
     eolp++; // Point to byte after CRLF.
+    // Export how long the current line is, so that it can be removed from the buffer.
+    *hex_frame_length = eolp;
     // Normally it is CRLF, but enable code to handle single LF as well.
-    int eof_len = data[eolp-2] == '\r' ? 2 : 1;
+    int eof_len = (eolp >= 2 && data[eolp-2] == '\r') ? 2 : 1;
     // If it was a CRLF then eof_len == 2, else it is 1.
     if (data[0] != 'b')
     {
@@ -320,6 +322,11 @@ FrameStatus WMBusCUL::checkCULFrame(vector<uchar> &data,
         debug("(cul) no leading 'b' so it is text and no frame\n");
         return TextAndNotFrame;
     }
+    if (eolp < (size_t)eof_len+6)
+    {
+        debug("(cul) too short line\n");
+        return ErrorInFrame;
+    }
 
     // Extract LQI and RSSI from message (appended 1 byte LQI and 1 byte RSSI at the end)
     vector<uchar> hex_buffer;
@@ -229,7 +229,7 @@ struct WMBusIM871aIM170A : public virtual BusDeviceCommonImplementation
     ~WMBusIM871aIM170A() {
     }
 
-    static FrameStatus checkIM871AFrame(vector<uchar> &data,
+    static FrameStatus checkIM871AFrame(FrameView data,
                                         size_t *frame_length, int *endpoint_out, int *msgid_out,
                                         int *payload_len_out, int *payload_offset,
                                         int *rssi_dbm);
@@ -241,7 +241,7 @@ private:
 
     uchar last_set_link_mode_ { 0x00 };
 
-    vector<uchar> read_buffer_;
+    ReceiveBuffer read_buffer_;
     vector<uchar> request_;
     vector<uchar> response_;
 
@@ -730,7 +730,7 @@ bool WMBusIM871aIM170A::deviceSetLinkModes(LinkModeSet lms)
     return rc;
 }
 
-FrameStatus WMBusIM871aIM170A::checkIM871AFrame(vector<uchar> &data,
+FrameStatus WMBusIM871aIM170A::checkIM871AFrame(FrameView data,
                                                 size_t *frame_length, int *endpoint_out, int *msgid_out,
                                                 int *payload_len_out, int *payload_offset,
                                                 int *rssi_dbm)
@@ -738,25 +738,10 @@ FrameStatus WMBusIM871aIM170A::checkIM871AFrame(vector<uchar> &data,
     if (data.size() == 0) return PartialFrame;
 
     debugPayload("(im871a) checkIM871AFrame", data);
-    if (data[0] != 0xa5)
+    if (data[0] != IM871A_SERIAL_SOF)
     {
-        debugPayload("(im871a) frame does not start with a5", data);
-        bool found_a5 = false;
-        for (size_t i = 0; i < data.size(); ++i)
-        {
-            if (data[i] == 0xa5)
-            {
-                debug("(im871a) found a5 at pos %d\n", i);
-                data.erase(data.begin(), data.begin()+i);
-                found_a5 = true;;
-                break;
-            }
-        }
-        if (!found_a5)
-        {
-            debug("(im871a) no a5 found at all, drop frame packet.\n");
-            return ErrorInFrame;
-        }
+        debug("(im871a) frame does not start with a5\n");
+        return ErrorInFrame;
     }
     if (data.size() < 4)
     {
@@ -865,7 +850,7 @@ void WMBusIM871aIM170A::processSerialData()
 
     LOCK_WMBUS_RECEIVING_BUFFER(processSerialData);
 
-    read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    read_buffer_.append(data);
 
     size_t frame_length;
     int endpoint;
@@ -875,21 +860,23 @@ void WMBusIM871aIM170A::processSerialData()
 
     for (;;)
     {
-        FrameStatus status = checkIM871AFrame(read_buffer_, &frame_length, &endpoint, &msgid, &payload_len, &payload_offset, &rssi_dbm);
+        FrameView frame = read_buffer_.view();
+        FrameStatus status = checkIM871AFrame(frame, &frame_length, &endpoint, &msgid, &payload_len, &payload_offset, &rssi_dbm);
 
         if (status == PartialFrame)
         {
-            if (read_buffer_.size() > 0)
+            if (frame.size() > 0)
             {
-                debugPayload("(im871a) partial frame, expecting more.", read_buffer_);
+                debugPayload("(im871a) partial frame, expecting more.", frame);
             }
             break;
         }
         if (status == ErrorInFrame)
         {
-            debugPayload("(im871a) bad frame, clearing.", read_buffer_);
-            read_buffer_.clear();
-            break;
+            debugPayload("(im871a) bad frame, skipping to next a5.", frame);
+            size_t n = read_buffer_.resync(IM871A_SERIAL_SOF);
+            debug("(im871a) dropped %zu bytes\n", n);
+            continue;
         }
         if (status == FullFrame)
         {
@@ -904,10 +891,10 @@ void WMBusIM871aIM170A::processSerialData()
                 }
                 // Insert the payload.
                 payload.insert(payload.end(),
-                               read_buffer_.begin()+payload_offset,
-                               read_buffer_.begin()+payload_offset+payload_len);
+                               frame.begin()+payload_offset,
+                               frame.begin()+payload_offset+payload_len);
             }
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
 
             // We now have a proper message in payload. Let us trigger actions based on it.
             // It can be wmbus receiver-dongle messages or wmbus remote meter messages received over the radio.
@@ -1218,7 +1205,8 @@ AccessCheck detectIM871AIM170A(Detected *detected, shared_ptr<SerialCommunicatio
 
     size_t frame_length;
     int endpoint, msgid, payload_len, payload_offset, rssi_dbm;
-    FrameStatus status = WMBusIM871aIM170A::checkIM871AFrame(response,
+    FrameView frame = FrameView(response).from(IM871A_SERIAL_SOF);
+    FrameStatus status = WMBusIM871aIM170A::checkIM871AFrame(frame,
                                                        &frame_length, &endpoint, &msgid,
                                                        &payload_len, &payload_offset, &rssi_dbm);
     if (status != FullFrame ||
@@ -1231,7 +1219,7 @@ AccessCheck detectIM871AIM170A(Detected *detected, shared_ptr<SerialCommunicatio
     }
 
     vector<uchar> payload;
-    payload.insert(payload.end(), response.begin()+payload_offset, response.begin()+payload_offset+payload_len);
+    payload.insert(payload.end(), frame.begin()+payload_offset, frame.begin()+payload_offset+payload_len);
 
     debugPayload("(device info bytes)", payload);
 
@@ -1265,7 +1253,8 @@ AccessCheck detectIM871AIM170A(Detected *detected, shared_ptr<SerialCommunicatio
     usleep(1000*100);
     serial->receive(&response);
 
-    status = WMBusIM871aIM170A::checkIM871AFrame(response,
+    frame = FrameView(response).from(IM871A_SERIAL_SOF);
+    status = WMBusIM871aIM170A::checkIM871AFrame(frame,
                                                  &frame_length, &endpoint, &msgid,
                                                  &payload_len, &payload_offset, &rssi_dbm);
     if (status != FullFrame ||
@@ -1280,7 +1269,7 @@ AccessCheck detectIM871AIM170A(Detected *detected, shared_ptr<SerialCommunicatio
     serial->close();
 
     payload.clear();
-    payload.insert(payload.end(), response.begin()+payload_offset, response.begin()+payload_offset+payload_len);
+    payload.insert(payload.end(), frame.begin()+payload_offset, frame.begin()+payload_offset+payload_len);
 
     debugPayload("(device config bytes)", payload);
 
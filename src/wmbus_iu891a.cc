@@ -279,7 +279,7 @@ struct WMBusIU891A : public virtual BusDeviceCommonImplementation
     ~WMBusIU891A() {
     }
 
-    static FrameStatus checkIU891AFrame(vector<uchar> &data,
+    static FrameStatus checkIU891AFrame(FrameView data,
                                         vector<uchar> &out,
                                         size_t *frame_length,
                                         int *endpoint_id_out,
@@ -295,7 +295,7 @@ private:
     WMBusAddressInfo_IU891A device_wmbus_address_ {};
     Config_IU891A device_config_ {};
 
-    vector<uchar> read_buffer_;
+    ReceiveBuffer read_buffer_;
     vector<uchar> request_;
     vector<uchar> response_;
 
@@ -511,7 +511,7 @@ void WMBusIU891A::extractFrame(vector<uchar> &payload, int *rssi_dbm, vector<uch
     frame->insert(frame->begin(), payload.begin()+8, payload.end());
 }
 
-FrameStatus WMBusIU891A::checkIU891AFrame(vector<uchar> &data,
+FrameStatus WMBusIU891A::checkIU891AFrame(FrameView data,
                                           vector<uchar> &out,
                                           size_t *frame_length_out,
                                           int *endpoint_id_out,
@@ -523,7 +523,12 @@ FrameStatus WMBusIU891A::checkIU891AFrame(vector<uchar> &data,
 
     removeSlipFraming(data, frame_length_out, msg);
 
-    if (msg.size() < 5) return PartialFrame;
+    if (*frame_length_out == 0) return PartialFrame;
+    if (msg.size() < 5)
+    {
+        debug("(iu891a) too short frame\n");
+        return ErrorInFrame;
+    }
 
     *endpoint_id_out = msg[0];
     *msg_id_out = msg[1];
@@ -565,7 +570,7 @@ void WMBusIU891A::processSerialData()
     // Receive and accumulated serial data until a full frame has been received.
     serial()->receive(&data);
 
-    read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    read_buffer_.append(data);
 
     size_t frame_length;
     int endpoint_id;
@@ -577,7 +582,8 @@ void WMBusIU891A::processSerialData()
 
     for (;;)
     {
-        FrameStatus status = checkIU891AFrame(read_buffer_,
+        FrameView frame = read_buffer_.view();
+        FrameStatus status = checkIU891AFrame(frame,
                                               payload,
                                               &frame_length,
                                               &endpoint_id,
@@ -587,21 +593,22 @@ void WMBusIU891A::processSerialData()
 
         if (status == PartialFrame)
         {
-            if (read_buffer_.size() > 0)
+            if (frame.size() > 0)
             {
-                debugPayload("(iu891a) partial frame, expecting more.", read_buffer_);
+                debugPayload("(iu891a) partial frame, expecting more.", frame);
             }
             break;
         }
         if (status == ErrorInFrame)
         {
-            debugPayload("(iu891a) bad frame, clearing.", read_buffer_);
-            read_buffer_.clear();
-            break;
+            // The slip framing found the end of the bad frame, skip just that frame.
+            debugPayload("(iu891a) bad frame, skipping.", frame);
+            read_buffer_.consume(frame_length);
+            continue;
         }
         if (status == FullFrame)
         {
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
 
             // We now have a proper message in payload. Let us trigger actions based on it.
             // It can be wmbus receiver-dongle messages or wmbus remote meter messages received over the radio.
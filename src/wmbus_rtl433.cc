@@ -64,11 +64,11 @@ private:
 
     string serialnr_;
     shared_ptr<SerialDevice> serial_;
-    vector<uchar> read_buffer_;
+    ReceiveBuffer read_buffer_;
     vector<uchar> received_payload_;
     bool warning_dll_len_printed_ {};
 
-    FrameStatus checkRTL433Frame(vector<uchar> &data,
+    FrameStatus checkRTL433Frame(FrameView data,
                                    size_t *hex_frame_length,
                                    int *hex_payload_len_out,
                                    int *hex_payload_offset);
@@ -197,14 +197,15 @@ void WMBusRTL433::processSerialData()
 
     // Receive and accumulated serial data until a full frame has been received.
     serial()->receive(&data);
-    read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    read_buffer_.append(data);
 
     size_t frame_length;
     int hex_payload_len, hex_payload_offset;
 
     for (;;)
     {
-        FrameStatus status = checkRTL433Frame(read_buffer_, &frame_length, &hex_payload_len, &hex_payload_offset);
+        FrameView frame = read_buffer_.view();
+        FrameStatus status = checkRTL433Frame(frame, &frame_length, &hex_payload_len, &hex_payload_offset);
 
         if (status == PartialFrame)
         {
@@ -213,7 +214,7 @@ void WMBusRTL433::processSerialData()
         if (status == TextAndNotFrame)
         {
             // The buffer has already been printed by serial cmd.
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
             if (read_buffer_.size() == 0)
             {
                 break;
@@ -227,7 +228,7 @@ void WMBusRTL433::processSerialData()
         if (status == ErrorInFrame)
         {
             debug("(rtl433) error in received message.\n");
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
             if (read_buffer_.size() == 0)
             {
                 break;
@@ -244,7 +245,7 @@ void WMBusRTL433::processSerialData()
             if (hex_payload_len > 0)
             {
                 vector<uchar> hex;
-                hex.insert(hex.end(), read_buffer_.begin()+hex_payload_offset, read_buffer_.begin()+hex_payload_offset+hex_payload_len);
+                hex.insert(hex.end(), frame.begin()+hex_payload_offset, frame.begin()+hex_payload_offset+hex_payload_len);
                 bool ok = hex2bin(hex, &payload);
                 if (!ok)
                 {
@@ -262,7 +263,7 @@ void WMBusRTL433::processSerialData()
                 }
             }
 
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
             if (payload.size() > 0)
             {
                 if (payload[0] != payload.size()-1)
@@ -282,7 +283,7 @@ void WMBusRTL433::processSerialData()
     }
 }
 
-FrameStatus WMBusRTL433::checkRTL433Frame(vector<uchar> &data,
+FrameStatus WMBusRTL433::checkRTL433Frame(FrameView data,
                                           size_t *hex_frame_length,
                                           int *hex_payload_len_out,
                                           int *hex_payload_offset)
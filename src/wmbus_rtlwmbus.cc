@@ -68,13 +68,13 @@ struct WMBusRTLWMBUS : public virtual BusDeviceCommonImplementation
 private:
 
     string serialnr_;
-    vector<uchar> read_buffer_;
+    ReceiveBuffer read_buffer_;
     vector<uchar> received_payload_;
     bool warning_dll_len_printed_ {};
 
     LinkModeSet device_link_modes_;
 
-    FrameStatus checkRTLWMBUSFrame(vector<uchar> &data,
+    FrameStatus checkRTLWMBUSFrame(FrameView data,
                                    size_t *hex_frame_length,
                                    int *hex_payload_len_out,
                                    int *hex_payload_offset,
@@ -256,7 +256,7 @@ void WMBusRTLWMBUS::processSerialData()
 
     // Receive and accumulated serial data until a full frame has been received.
     serial()->receive(&data);
-    read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    read_buffer_.append(data);
 
     size_t frame_length;
     int hex_payload_len, hex_payload_offset;
@@ -265,7 +265,8 @@ void WMBusRTLWMBUS::processSerialData()
     for (;;)
     {
         double rssi = 0;
-        FrameStatus status = checkRTLWMBUSFrame(read_buffer_, &frame_length, &hex_payload_len, &hex_payload_offset, &rssi, &timestamp);
+        FrameView frame = read_buffer_.view();
+        FrameStatus status = checkRTLWMBUSFrame(frame, &frame_length, &hex_payload_len, &hex_payload_offset, &rssi, &timestamp);
 
         if (status == PartialFrame)
         {
@@ -274,8 +275,8 @@ void WMBusRTLWMBUS::processSerialData()
         else if (status == TextAndNotFrame)
         {
             const char *exit_message = "rtl_wmbus: exiting";
-            auto end = read_buffer_.begin()+frame_length;
-            auto it = std::search(read_buffer_.begin(),
+            auto end = frame.begin()+frame_length;
+            auto it = std::search(frame.begin(),
                                   end,
                                   exit_message,
                                   exit_message + strlen(exit_message));
@@ -285,12 +286,12 @@ void WMBusRTLWMBUS::processSerialData()
                 reset();
             }
             // The buffer has already been printed by serial cmd.
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
         }
         else if (status == ErrorInFrame)
         {
             debug("(rtlwmbus) error in received message.\n");
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
         }
         else if (status == FullFrame)
         {
@@ -298,7 +299,7 @@ void WMBusRTLWMBUS::processSerialData()
             if (hex_payload_len > 0)
             {
                 vector<uchar> hex;
-                hex.insert(hex.end(), read_buffer_.begin()+hex_payload_offset, read_buffer_.begin()+hex_payload_offset+hex_payload_len);
+                hex.insert(hex.end(), frame.begin()+hex_payload_offset, frame.begin()+hex_payload_offset+hex_payload_len);
                 bool ok = hex2bin(hex, &payload);
                 if (!ok)
                 {
@@ -316,7 +317,7 @@ void WMBusRTLWMBUS::processSerialData()
                 }
             }
 
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
             if (payload.size() > 0)
             {
                 if (payload[0] != payload.size()-1)
@@ -341,7 +342,7 @@ void WMBusRTLWMBUS::processSerialData()
     }
 }
 
-FrameStatus WMBusRTLWMBUS::checkRTLWMBUSFrame(vector<uchar> &data,
+FrameStatus WMBusRTLWMBUS::checkRTLWMBUSFrame(FrameView data,
                                               size_t *hex_frame_length,
                                               int *hex_payload_len_out,
                                               int *hex_payload_offset,
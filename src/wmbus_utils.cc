@@ -23,9 +23,9 @@
 #include<assert.h>
 #include<memory.h>
 
-bool decrypt_ELL_AES_CTR(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey)
+bool decrypt_ELL_AES_CTR(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, const AES_ctx *aeskey)
 {
-    if (aeskey.size() == 0) return true;
+    if (aeskey == NULL) return true;
 
     vector<uchar> encrypted_bytes;
     vector<uchar> decrypted_bytes;
@@ -67,7 +67,7 @@ bool decrypt_ELL_AES_CTR(Telegram *t, vector<uchar> &frame, vector<uchar>::itera
 
         // Generate the pseudo-random bits from the IV and the key.
         uchar xordata[16];
-        AES_ECB_encrypt(iv, safeButUnsafeVectorPtr(aeskey), xordata, 16);
+        AES_ctx_encrypt_block(aeskey, iv, xordata);
 
         // Xor the data with the pseudo-random bits to decrypt into tmp.
         uchar tmp[block_size];
@@ -102,7 +102,7 @@ string frameTypeKamstrupC1(int ft) {
 bool decrypt_TPL_AES_CBC_IV(Telegram *t,
                             vector<uchar> &frame,
                             vector<uchar>::iterator &pos,
-                            vector<uchar> &aeskey,
+                            const AES_ctx *aeskey,
                             int *num_encrypted_bytes,
                             int *num_not_encrypted_at_end)
 {
@@ -136,7 +136,7 @@ bool decrypt_TPL_AES_CBC_IV(Telegram *t,
     debug("(TPL) num encrypted blocks %zu (%d bytes and remaining unencrypted %zu bytes)\n",
           t->tpl_num_encr_blocks, num_bytes_to_decrypt, buffer.size()-num_bytes_to_decrypt);
 
-    if (aeskey.size() == 0) return false;
+    if (aeskey == NULL) return false;
 
     debugPayload("(TPL) AES CBC IV decrypting", buffer);
 
@@ -184,7 +184,7 @@ bool decrypt_TPL_AES_CBC_IV(Telegram *t,
     memcpy(buffer_data, safeButUnsafeVectorPtr(buffer), num_bytes_to_decrypt);
     uchar decrypted_data[num_bytes_to_decrypt];
 
-    AES_CBC_decrypt_buffer(decrypted_data, buffer_data, num_bytes_to_decrypt, safeButUnsafeVectorPtr(aeskey), iv);
+    AES_ctx_CBC_decrypt_buffer(aeskey, decrypted_data, buffer_data, num_bytes_to_decrypt, iv);
 
     // Remove the encrypted bytes.
     frame.erase(pos, frame.end());
@@ -202,11 +202,11 @@ bool decrypt_TPL_AES_CBC_IV(Telegram *t,
     return true;
 }
 
-bool decrypt_TPL_AES_CBC_NO_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey,
+bool decrypt_TPL_AES_CBC_NO_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, const AES_ctx *aeskey,
                                int *num_encrypted_bytes,
                                int *num_not_encrypted_at_end)
 {
-    if (aeskey.size() == 0) return true;
+    if (aeskey == NULL) return true;
 
     vector<uchar> buffer;
     buffer.insert(buffer.end(), pos, frame.end());
@@ -233,7 +233,7 @@ bool decrypt_TPL_AES_CBC_NO_IV(Telegram *t, vector<uchar> &frame, vector<uchar>:
     debug("(TPL) num encrypted blocks %d (%d bytes and remaining unencrypted %d bytes)\n",
           t->tpl_num_encr_blocks, num_bytes_to_decrypt, buffer.size()-num_bytes_to_decrypt);
 
-    if (aeskey.size() == 0) return false;
+    if (aeskey == NULL) return false;
 
     // The content should be a multiple of 16 since we are using AES CBC mode.
     if (num_bytes_to_decrypt % 16 != 0)
@@ -256,7 +256,7 @@ bool decrypt_TPL_AES_CBC_NO_IV(Telegram *t, vector<uchar> &frame, vector<uchar>:
     memcpy(buffer_data, safeButUnsafeVectorPtr(buffer), num_bytes_to_decrypt);
     uchar decrypted_data[num_bytes_to_decrypt];
 
-    AES_CBC_decrypt_buffer(decrypted_data, buffer_data, num_bytes_to_decrypt, safeButUnsafeVectorPtr(aeskey), iv);
+    AES_ctx_CBC_decrypt_buffer(aeskey, decrypted_data, buffer_data, num_bytes_to_decrypt, iv);
 
     // Remove the encrypted bytes and any potentially not decryptes bytes after.
     frame.erase(pos, frame.end());
@@ -22,11 +22,12 @@
 #include "threads.h"
 #include "wmbus.h"
 
-bool decrypt_ELL_AES_CTR(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey);
-bool decrypt_TPL_AES_CBC_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey,
+// The aeskey is an expanded key schedule, or NULL if there is no key.
+bool decrypt_ELL_AES_CTR(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, const AES_ctx *aeskey);
+bool decrypt_TPL_AES_CBC_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, const AES_ctx *aeskey,
                             int *num_encrypted_bytes,
                             int *num_not_encrypted_at_end);
-bool decrypt_TPL_AES_CBC_NO_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey,
+bool decrypt_TPL_AES_CBC_NO_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, const AES_ctx *aeskey,
                                int *num_encrypted_bytes,
                                int *num_not_encrypted_at_end);
 
@@ -81,6 +81,15 @@ if [ "$?" != "0" ]; then RC="1"; fi
 tests/test_shell_env.sh $PROG
 if [ "$?" != "0" ]; then RC="1"; fi
 
+tests/test_shellpool.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_streamshell.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_metrics.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
 tests/test_meterfiles.sh $PROG
 if [ "$?" != "0" ]; then RC="1"; fi
 
@@ -220,3 +220,20 @@ EOF
 $PROG --analyze=28F64A24988064A079AA2C807D6102AE 23442D2C998734761B168D20983081B2227A6FA1F10E1B79B5EB4B17E81F930E937EE06C > $TEST/test_output.txt 2>&1
 
 performCheck
+
+TESTNAME="Test analyze batch of telegrams from a simulation file"
+TESTRESULT="ERROR"
+
+cat > $TEST/simulation_analyze_batch.txt <<EOF
+telegram=|A244EE4D785634123C067A8F000000_0C1348550000426CE1F14C130000000082046C21298C0413330000008D04931E3A3CFE3300000033000000330000003300000033000000330000003300000033000000330000003300000033000000330000004300000034180000046D0D0B5C2B03FD6C5E150082206C5C290BFD0F0200018C4079678885238310FD3100000082106C01018110FD610002FD66020002FD170000|
+telegram=|AF46EE4D2827282716087A80000000_046D040A9F2A036E000000426CE1F7436E000000525900008288016C61258388016E0000008D8801EE1E3533FE00000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000005FF2D0000803F8520FF2D0000803F0259AD0A0265D8041259AD0A8310FD3100000082106C01018110FD610082206C9F2A0BFD0F01030102FF2C000002FD66AC08|
+EOF
+
+cat > $TEST/test_expected.txt <<EOF
+{"_":"analyze","address":"12345678.M=SON.V=3c.T=06","auto_driver":"supercom587","similar_driver":"evo868","similar_understood":22,"similar_length":100,"using_driver":"supercom587","using_understood":0,"using_length":0}
+{"_":"analyze","address":"27282728.M=SON.V=16.T=08","auto_driver":"sontex868","similar_driver":"sontex868","similar_understood":20,"similar_length":101,"using_driver":"sontex868","using_understood":0,"using_length":0}
+EOF
+
+$PROG --analyze=batch $TEST/simulation_analyze_batch.txt > $TEST/test_output.txt 2>&1
+
+performCheck
@@ -11,7 +11,6 @@ cat > $TEST/test_expected.txt <<EOF
 (dvparser) warning: unexpected end of data
 (dvparser) found new format "046D036E51706CE1F14302FF2C0259D40902FD66A000" with hash 48a9, remembering!
 (dvparser) warning: unexpected end of data
-(dvparser) warning: unexpected end of data
 (dvparser) found new format "046D0406041301FD17426C4406840106840206840306840406840506840606840706840806840906C1337F47A64E0C062364" with hash b934, remembering!
 (dvparser) found new format "046D0406041301FD17426C4406840106840206840306840406840506840606840706840806840906585D65E6958F6B5E93DBA60CD99D06EB27D97106000000840F060003620501" with hash 6c76, remembering!
 EOF
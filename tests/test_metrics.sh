@@ -0,0 +1,31 @@
+#!/bin/sh
+
+PROG="$1"
+TEST=testoutput
+mkdir -p $TEST
+
+TESTNAME="Test metrics are written in Prometheus format"
+TESTRESULT="ERROR"
+
+rm -f $TEST/test_metrics.prom
+$PROG --metrics=$TEST/test_metrics.prom simulations/simulation_c1.txt MyTapWater multical21 76348799 "" > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+
+if [ "$?" = "0" ]
+then
+    INFO=$(grep -c 'wmbusmeters_stage_seconds_count{stage="\(parse\|decrypt\|extract\|render\)",driver="multical21"}' $TEST/test_metrics.prom)
+    EXPECTED="4"
+    if [ "$INFO" = "$EXPECTED" ]
+    then
+        echo OK: $TESTNAME
+        TESTRESULT="OK"
+    else
+        echo "Expected $EXPECTED stage counts for multical21"
+        cat $TEST/test_metrics.prom
+    fi
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
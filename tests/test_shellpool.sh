@@ -0,0 +1,116 @@
+#!/bin/sh
+
+PROG="$1"
+
+mkdir -p testoutput
+TEST=testoutput
+
+RC="0"
+
+# Five readings from the same meter, the duplicates are not ignored.
+TELEGRAM=$(grep telegram= simulations/simulation_shell.txt)
+rm -f $TEST/simulation_shellpool.txt
+for i in 1 2 3 4 5
+do
+    echo "$TELEGRAM" >> $TEST/simulation_shellpool.txt
+done
+
+TESTNAME="Test shell pool invokes the shell for every reading"
+TESTRESULT="ERROR"
+
+rm -f $TEST/test_shellpool.txt
+$PROG --verbose --ignoreduplicates=false --shellworkers=2 \
+      --shell='echo "$METER_ID $METER_TOTAL_M3" >> '$TEST/test_shellpool.txt \
+      $TEST/simulation_shellpool.txt MWW supercom587 12345678 "" \
+      > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+
+if [ "$?" = "0" ]
+then
+    INFO=$(cat $TEST/test_shellpool.txt | uniq -c | tr -s ' ')
+    EXPECTED=" 5 12345678 5.548"
+    if [ "$INFO" = "$EXPECTED" ] && grep -q "(shell) pool invoked 5 dropped 0" $TEST/test_stderr.txt
+    then
+        echo OK: $TESTNAME
+        TESTRESULT="OK"
+    else
+        echo "Expected: $EXPECTED"
+        echo "Got     : $INFO"
+        grep "(shell)" $TEST/test_stderr.txt
+    fi
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    RC="1"
+fi
+
+TESTNAME="Test shell pool coalesces the queued readings of a meter"
+TESTRESULT="ERROR"
+
+# The first reading keeps the only worker busy, the following readings are coalesced
+# while queued, but the latest reading is always sent.
+rm -f $TEST/test_shellpool.txt
+$PROG --verbose --ignoreduplicates=false --shellworkers=1 --shellcoalesce=true \
+      --shell='sleep 0.5; echo "$METER_ID $METER_TOTAL_M3" >> '$TEST/test_shellpool.txt \
+      $TEST/simulation_shellpool.txt MWW supercom587 12345678 "" \
+      > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+
+if [ "$?" = "0" ]
+then
+    INVOKED=$(grep -o "(shell) pool invoked [0-9]* dropped [0-9]*" $TEST/test_stderr.txt | cut -f 4 -d ' ')
+    DROPPED=$(grep -o "(shell) pool invoked [0-9]* dropped [0-9]*" $TEST/test_stderr.txt | cut -f 6 -d ' ')
+    LINES=$(cat $TEST/test_shellpool.txt | wc -l)
+    if [ -n "$INVOKED" ] && [ "$DROPPED" -gt "0" ] && [ "$((INVOKED+DROPPED))" = "5" ] && [ "$LINES" = "$INVOKED" ]
+    then
+        echo OK: $TESTNAME
+        TESTRESULT="OK"
+    else
+        echo "Expected 5 readings to be invoked or dropped, with at least one dropped"
+        grep "(shell)" $TEST/test_stderr.txt
+    fi
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    RC="1"
+fi
+
+TESTNAME="Test shell pool waits for a slot when the queue is full"
+TESTRESULT="ERROR"
+
+# A queue of one, without coalescing, the readings are delayed but never dropped.
+rm -f $TEST/test_shellpool.txt $TEST/test_shellpool.prom
+$PROG --verbose --ignoreduplicates=false --shellworkers=1 --shellqueue=1 \
+      --metrics=$TEST/test_shellpool.prom \
+      --shell='sleep 0.2; echo "$METER_ID $METER_TOTAL_M3" >> '$TEST/test_shellpool.txt \
+      $TEST/simulation_shellpool.txt MWW supercom587 12345678 "" \
+      > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+
+if [ "$?" = "0" ]
+then
+    INFO=$(cat $TEST/test_shellpool.txt | uniq -c | tr -s ' ')
+    EXPECTED=" 5 12345678 5.548"
+    BLOCKED=$(grep -o "(shell) pool invoked 5 dropped 0 late [0-9]* blocked [0-9]*" $TEST/test_stderr.txt | cut -f 10 -d ' ')
+    if [ "$INFO" = "$EXPECTED" ] && [ -n "$BLOCKED" ] && [ "$BLOCKED" -gt "0" ] \
+       && grep -q "wmbusmeters_shell_blocked_total{driver=\"supercom587\"} $BLOCKED" $TEST/test_shellpool.prom \
+       && grep -q "wmbusmeters_shell_invocations_total{driver=\"supercom587\"} 5" $TEST/test_shellpool.prom
+    then
+        echo OK: $TESTNAME
+        TESTRESULT="OK"
+    else
+        echo "Expected: $EXPECTED and blocked invocations"
+        echo "Got     : $INFO"
+        grep "(shell)" $TEST/test_stderr.txt
+        grep "shell" $TEST/test_shellpool.prom
+    fi
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    RC="1"
+fi
+
+exit $RC
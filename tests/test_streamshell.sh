@@ -0,0 +1,31 @@
+#!/bin/sh
+
+PROG="$1"
+TEST=testoutput
+mkdir -p $TEST
+
+TESTNAME="Test stream shell receives one json line per reading"
+TESTRESULT="ERROR"
+
+rm -f $TEST/test_streamshell.txt
+$PROG --streamshell="cat > $TEST/test_streamshell.txt" simulations/simulation_shell.txt MWW supercom587 12345678 "" > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+
+if [ "$?" = "0" ]
+then
+    INFO=$(cat $TEST/test_streamshell.txt | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/')
+    EXPECTED='{"_":"telegram","media":"warm water","meter":"supercom587","name":"MWW","id":"12345678","total_m3":5.548,"software_version":"010002","status":"OK","timestamp":"1111-11-11T11:11:11Z"}'
+    if [ "$INFO" = "$EXPECTED" ]
+    then
+        echo OK: $TESTNAME
+        TESTRESULT="OK"
+    else
+        echo "Expected: $EXPECTED"
+        echo "Got     : $INFO"
+    fi
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi